@@ -16,6 +16,9 @@
 #include "preload/preload_interface.h"
 
 #include "AutoRemoteSyscalls.h"
+#include "CompressedReader.h"
+#include "CompressedWriter.h"
+#include "EmuFs.h"
 #include "log.h"
 #include "RecordSession.h"
 #include "Session.h"
@@ -301,6 +304,198 @@ static vector<uint8_t> read_auxv(Task* t) {
 
 void AddressSpace::save_auxv(Task* t) { saved_auxv_ = read_auxv(t); }
 
+/**
+ * How a mapping is restored from a persistent checkpoint.
+ */
+enum CheckpointMappingKind : uint8_t {
+  // Present at the same address in every replay after the initial exec;
+  // restored by keeping the existing mapping.
+  CHECKPOINT_FIXED_MAPPING,
+  // Restored as an anonymous mapping holding the saved contents.
+  CHECKPOINT_SAVED_MAPPING,
+  // A shared mapping of an emufs file; the file contents are saved with the
+  // EmuFs.
+  CHECKPOINT_EMUFS_MAPPING
+};
+
+// Memory contents are saved in chunks of this size, and all-zero chunks
+// are saved as just a flag.
+static const size_t checkpoint_chunk_size = 1024 * 1024;
+
+static void write_checkpoint_mapping(CompressedWriter& out,
+                                     const KernelMapping& km) {
+  out << km.start() << km.end() << km.fsname() << km.device() << km.inode()
+      << km.prot() << km.flags() << km.file_offset_bytes();
+}
+
+static KernelMapping read_checkpoint_mapping(CompressedReader& in) {
+  remote_ptr<void> start, end;
+  string fsname;
+  dev_t device;
+  ino_t inode;
+  int prot, flags;
+  uint64_t offset;
+  in >> start >> end >> fsname >> device >> inode >> prot >> flags >> offset;
+  return KernelMapping(start, end, fsname, device, inode, prot, flags, offset);
+}
+
+static bool is_fixed_mapping(const KernelMapping& km) {
+  return km.start() == AddressSpace::rr_page_start() || km.is_vsyscall();
+}
+
+void AddressSpace::write_checkpoint(Task* t, EmuFs& emu_fs,
+                                    CompressedWriter& state,
+                                    CompressedWriter& memory) {
+  state << exe << leader_tid_ << leader_serial << exec_count << brk_start
+        << brk_end << is_clone << vdso_start_addr << traced_syscall_ip_
+        << privileged_traced_syscall_ip_ << syscallbuf_lib_start_
+        << syscallbuf_lib_end_ << saved_auxv_ << first_run_event_;
+  state << dont_fork.size();
+  for (auto& r : dont_fork) {
+    state << r.start() << r.end();
+  }
+
+  vector<Mapping> saved;
+  for (auto& it : mem) {
+    if (it.second.map.fsname().find(SYSCALLBUF_SHMEM_PATH_PREFIX) != 0) {
+      saved.push_back(it.second);
+    }
+  }
+  state << saved.size();
+  vector<uint8_t> buf(checkpoint_chunk_size);
+  for (auto& m : saved) {
+    CheckpointMappingKind kind = CHECKPOINT_SAVED_MAPPING;
+    if (is_fixed_mapping(m.map)) {
+      kind = CHECKPOINT_FIXED_MAPPING;
+    } else if ((m.recorded_map.flags() & MAP_SHARED) &&
+               emu_fs.has_file_for(m.recorded_map)) {
+      kind = CHECKPOINT_EMUFS_MAPPING;
+    }
+    state << kind;
+    write_checkpoint_mapping(state, m.map);
+    write_checkpoint_mapping(state, m.recorded_map);
+    if (kind != CHECKPOINT_SAVED_MAPPING) {
+      continue;
+    }
+
+    for (remote_ptr<void> p = m.map.start(); p < m.map.end();
+         p += checkpoint_chunk_size) {
+      size_t len = min<size_t>(checkpoint_chunk_size, m.map.end() - p);
+      ssize_t nread = t->read_bytes_fallible(p, len, buf.data());
+      // Pages we can't read are saved as zeroes.
+      memset(buf.data() + max<ssize_t>(0, nread), 0,
+             len - max<ssize_t>(0, nread));
+      replace_breakpoints_with_original_values(buf.data(), len, p.cast<uint8_t>());
+      bool nonzero = false;
+      for (size_t i = 0; i < len; ++i) {
+        if (buf[i]) {
+          nonzero = true;
+          break;
+        }
+      }
+      memory << nonzero;
+      if (nonzero) {
+        memory.write(buf.data(), len);
+      }
+    }
+  }
+}
+
+bool AddressSpace::read_checkpoint(Task* t, CompressedReader& state,
+                                   CompressedReader& memory) {
+  state >> exe >> leader_tid_ >> leader_serial >> exec_count >> brk_start >>
+      brk_end >> is_clone >> vdso_start_addr >> traced_syscall_ip_ >>
+      privileged_traced_syscall_ip_ >> syscallbuf_lib_start_ >>
+      syscallbuf_lib_end_ >> saved_auxv_ >> first_run_event_;
+  size_t count;
+  state >> count;
+  dont_fork.clear();
+  for (size_t i = 0; i < count; ++i) {
+    remote_ptr<void> start, end;
+    state >> start >> end;
+    dont_fork.insert(MemoryRange(start, end));
+  }
+
+  // Like replaying an exec, we don't need memory parameters, which is just as
+  // well since we're about to unmap the stack.
+  AutoRemoteSyscalls remote(t, AutoRemoteSyscalls::DISABLE_MEMORY_PARAMS);
+  vector<MemoryRange> unmaps;
+  for (auto& it : mem) {
+    if (!is_fixed_mapping(it.second.map)) {
+      unmaps.push_back(it.second.map);
+    }
+  }
+  for (auto& r : unmaps) {
+    remote.infallible_syscall(syscall_number_for_munmap(remote.arch()),
+                              r.start(), r.size());
+    unmap(r.start(), r.size());
+  }
+
+  // map() infers these from the mappings it's given, but what we saved is
+  // authoritative.
+  auto saved_vdso_start_addr = vdso_start_addr;
+  auto saved_syscallbuf_lib_start = syscallbuf_lib_start_;
+  auto saved_syscallbuf_lib_end = syscallbuf_lib_end_;
+
+  state >> count;
+  vector<uint8_t> buf(checkpoint_chunk_size);
+  for (size_t i = 0; i < count; ++i) {
+    CheckpointMappingKind kind;
+    state >> kind;
+    KernelMapping km = read_checkpoint_mapping(state);
+    KernelMapping recorded_km = read_checkpoint_mapping(state);
+    switch (kind) {
+      case CHECKPOINT_FIXED_MAPPING:
+        if (!has_mapping(km.start()) ||
+            mapping_of(km.start()).map.start() != km.start() ||
+            mapping_of(km.start()).map.end() != km.end()) {
+          LOG(warn) << "Fixed mapping " << km << " moved since checkpoint";
+          return false;
+        }
+        break;
+      case CHECKPOINT_EMUFS_MAPPING:
+        map(km.start(), km.size(), km.prot(), km.flags(),
+            km.file_offset_bytes(), km.fsname(), km.device(), km.inode(),
+            &recorded_km);
+        break;
+      case CHECKPOINT_SAVED_MAPPING: {
+        int flags = (km.flags() & ~MAP_GROWSDOWN) | MAP_ANONYMOUS;
+        remote.infallible_mmap_syscall(km.start(), km.size(),
+                                       PROT_READ | PROT_WRITE,
+                                       flags | MAP_FIXED, -1, 0);
+        for (remote_ptr<void> p = km.start(); p < km.end();
+             p += checkpoint_chunk_size) {
+          size_t len = min<size_t>(checkpoint_chunk_size, km.end() - p);
+          bool nonzero;
+          memory >> nonzero;
+          if (nonzero) {
+            memory.read(buf.data(), len);
+            t->write_bytes_helper(p, len, buf.data());
+          }
+        }
+        if (km.prot() != (PROT_READ | PROT_WRITE)) {
+          remote.infallible_syscall(syscall_number_for_mprotect(remote.arch()),
+                                    km.start(), km.size(), km.prot());
+        }
+        // Model the mapping exactly as it was, even though it's anonymous
+        // now, so this address space is indistinguishable from one that got
+        // here by replaying. (Only Flags::check_cached_mmaps notices.)
+        map(km.start(), km.size(), km.prot(), km.flags(),
+            km.file_offset_bytes(), km.fsname(), km.device(), km.inode(),
+            &recorded_km);
+        break;
+      }
+      default:
+        LOG(warn) << "Unknown checkpoint mapping kind " << kind;
+        return false;
+    }
+  }
+  vdso_start_addr = saved_vdso_start_addr;
+  syscallbuf_lib_start_ = saved_syscallbuf_lib_start;
+  syscallbuf_lib_end_ = saved_syscallbuf_lib_end;
+  return true;
+}
+
 void AddressSpace::post_exec_syscall(Task* t) {
   // First locate a syscall instruction we can use for remote syscalls.
   traced_syscall_ip_ = find_syscall_instruction(t);
@@ -554,6 +749,7 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
     }
   };
   for_each_in_range(addr, num_bytes, protector, ITERATE_CONTIGUOUS);
+  software_watch_pages_reset(addr, num_bytes);
   if (last_overlap.size()) {
     // All mappings that we altered which might need coalescing
     // are adjacent to |last_overlap|.
@@ -603,6 +799,8 @@ void AddressSpace::remap(remote_ptr<void> old_addr, size_t old_num_bytes,
     remove_range(dont_fork, MemoryRange(new_addr, new_num_bytes));
   }
 
+  page_checksums_reset(new_addr, new_num_bytes);
+
   remote_ptr<void> new_end = new_addr + new_num_bytes;
   map_and_coalesce(m.set_range(new_addr, new_end),
                    mr.recorded_map.set_range(new_addr, new_end));
@@ -815,6 +1013,8 @@ void AddressSpace::unmap_internal(remote_ptr<void> addr, ssize_t num_bytes) {
     }
   };
   for_each_in_range(addr, num_bytes, unmapper);
+  software_watch_pages_reset(addr, num_bytes);
+  page_checksums_reset(addr, num_bytes);
   update_watchpoint_values(addr, addr + num_bytes);
 }
 
@@ -831,6 +1031,12 @@ void AddressSpace::advise(remote_ptr<void> addr, ssize_t num_bytes,
     case MADV_DOFORK:
       remove_range(dont_fork, MemoryRange(addr, num_bytes));
       break;
+    case MADV_DONTNEED:
+    case MADV_REMOVE:
+      // The discarded pages read back as zeroes without becoming
+      // soft-dirty.
+      page_checksums_reset(addr, num_bytes);
+      break;
     default:
       break;
   }
@@ -1044,6 +1250,8 @@ AddressSpace::AddressSpace(Task* t, const string& exe, uint32_t exec_count)
       session_(&t->session()),
       monkeypatch_state(t->session().is_recording() ? new Monkeypatcher()
                                                     : nullptr),
+      software_watch_pages_dirty(false),
+      software_watch_pages_lifted(false),
       child_mem_fd(-1),
       first_run_event_(0) {
   // TODO: this is a workaround of
@@ -1085,6 +1293,9 @@ AddressSpace::AddressSpace(Session* session, const AddressSpace& o,
       monkeypatch_state(o.monkeypatch_state
                             ? new Monkeypatcher(*o.monkeypatch_state)
                             : nullptr),
+      software_watch_pages(o.software_watch_pages),
+      software_watch_pages_dirty(o.software_watch_pages_dirty),
+      software_watch_pages_lifted(false),
       traced_syscall_ip_(o.traced_syscall_ip_),
       privileged_traced_syscall_ip_(o.privileged_traced_syscall_ip_),
       syscallbuf_lib_start_(o.syscallbuf_lib_start_),
@@ -1175,6 +1386,9 @@ vector<WatchConfig> AddressSpace::get_watch_configs(
       kv.second.debug_regs_for_exec_read.clear();
       assigned_regs = &kv.second.debug_regs_for_exec_read;
     }
+    if (kv.second.software) {
+      continue;
+    }
     const MemoryRange& r = kv.first;
     int watching = kv.second.watched_bits();
     if (EXEC_BIT & watching) {
@@ -1241,30 +1455,172 @@ bool AddressSpace::has_exec_watchpoint_fired(remote_code_ptr addr) {
 }
 
 bool AddressSpace::allocate_watchpoints() {
-  Task::DebugRegs regs = get_watch_configs(SETTING_TASK_STATE);
-
-  if (regs.size() <= 0x7f) {
-    bool ok = true;
-    for (auto t : task_set()) {
-      if (!t->set_debug_regs(regs)) {
-        ok = false;
+  for (auto& kv : watchpoints) {
+    kv.second.software = false;
+  }
+  // Try the debug registers alone first. If they can't cover everything
+  // during replay, move the write watchpoints we can onto page protection
+  // and try again with what's left. Recording can't do this because it
+  // would change what the tracee observes.
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    if (attempt > 0) {
+      if (!session()->is_replaying()) {
+        break;
+      }
+      bool any_software = false;
+      for (auto& kv : watchpoints) {
+        if (kv.second.watched_bits() == WRITE_BIT &&
+            can_software_watch(kv.first)) {
+          kv.second.software = true;
+          any_software = true;
+        }
+      }
+      if (!any_software) {
+        break;
       }
     }
-    if (ok) {
-      return true;
+
+    Task::DebugRegs regs = get_watch_configs(SETTING_TASK_STATE);
+    if (regs.size() <= 0x7f) {
+      bool ok = true;
+      for (auto t : task_set()) {
+        if (!t->set_debug_regs(regs)) {
+          ok = false;
+        }
+      }
+      if (ok) {
+        software_watch_pages_dirty = true;
+        return true;
+      }
     }
   }
 
-  regs.clear();
+  Task::DebugRegs regs;
   for (auto t2 : task_set()) {
     t2->set_debug_regs(regs);
   }
-  for (auto kv : watchpoints) {
+  for (auto& kv : watchpoints) {
     kv.second.debug_regs_for_exec_read.clear();
+    kv.second.software = false;
   }
+  software_watch_pages_dirty = true;
   return false;
 }
 
+bool AddressSpace::can_software_watch(const MemoryRange& range) const {
+  for (remote_ptr<void> p = floor_page_size(range.start()); p < range.end();
+       p += page_size()) {
+    if (!has_mapping(p)) {
+      return false;
+    }
+    // Shared pages can be written by other processes, and the kernel
+    // writes signal frames to the stack, neither of which would fault.
+    const KernelMapping& m = mapping_of(p).map;
+    if ((m.flags() & MAP_SHARED) || !(m.prot() & PROT_WRITE) ||
+        m.is_stack()) {
+      return false;
+    }
+    // The kernel writes the tid of a new thread to its CLONE_CHILD_SETTID
+    // address when the thread first runs, which can be after the clone has
+    // returned. That write would just fail on a write-protected page.
+    for (Task* t : task_set()) {
+      if (!t->tid_addr().is_null() && floor_page_size(t->tid_addr()) == p) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+set<remote_ptr<void> > AddressSpace::wanted_software_watch_pages() const {
+  set<remote_ptr<void> > result;
+  if (software_watch_pages_lifted) {
+    return result;
+  }
+  for (auto& kv : watchpoints) {
+    if (!kv.second.software) {
+      continue;
+    }
+    for (remote_ptr<void> p = floor_page_size(kv.first.start());
+         p < kv.first.end(); p += page_size()) {
+      if (!suspended_software_watch_pages.count(p) &&
+          can_software_watch(MemoryRange(p, 1))) {
+        result.insert(p);
+      }
+    }
+  }
+  return result;
+}
+
+void AddressSpace::update_software_watch_pages(Task* t) {
+  software_watch_pages_dirty = false;
+  set<remote_ptr<void> > wanted = wanted_software_watch_pages();
+  if (wanted == software_watch_pages) {
+    return;
+  }
+
+  AutoRemoteSyscalls remote(t);
+  int mprotect_syscallno = syscall_number_for_mprotect(remote.arch());
+  for (auto p : software_watch_pages) {
+    if (!wanted.count(p)) {
+      remote.infallible_syscall(mprotect_syscallno, p, page_size(),
+                                mapping_of(p).map.prot());
+    }
+  }
+  for (auto p : wanted) {
+    if (!software_watch_pages.count(p)) {
+      remote.infallible_syscall(mprotect_syscallno, p, page_size(),
+                                mapping_of(p).map.prot() & ~PROT_WRITE);
+    }
+  }
+  LOG(debug) << "Write-protecting " << wanted.size()
+             << " pages for software watchpoints";
+  software_watch_pages = move(wanted);
+}
+
+void AddressSpace::lift_software_watch_pages(bool lifted) {
+  if (lifted != software_watch_pages_lifted) {
+    software_watch_pages_lifted = lifted;
+    software_watch_pages_dirty = true;
+  }
+}
+
+void AddressSpace::begin_software_watch_write(Task* t,
+                                              remote_ptr<void> addr) {
+  remote_ptr<void> page = floor_page_size(addr);
+  assert(software_watch_pages.count(page));
+  {
+    AutoRemoteSyscalls remote(t);
+    remote.infallible_syscall(syscall_number_for_mprotect(remote.arch()),
+                              page, page_size(), mapping_of(page).map.prot());
+  }
+  software_watch_pages.erase(page);
+  suspended_software_watch_pages.insert(page);
+}
+
+void AddressSpace::end_software_watch_write(remote_ptr<void> addr) {
+  suspended_software_watch_pages.erase(floor_page_size(addr));
+  software_watch_pages_dirty = true;
+}
+
+void AddressSpace::software_watch_pages_reset(remote_ptr<void> addr,
+                                              size_t num_bytes) {
+  MemoryRange range(floor_page_size(addr), ceil_page_size(addr + num_bytes));
+  for (auto it = software_watch_pages.lower_bound(range.start());
+       it != software_watch_pages.end() && *it < range.end();) {
+    it = software_watch_pages.erase(it);
+  }
+  if (!watchpoints.empty()) {
+    software_watch_pages_dirty = true;
+  }
+}
+
+void AddressSpace::page_checksums_reset(remote_ptr<void> addr,
+                                        size_t num_bytes) {
+  page_checksums_.erase(page_checksums_.lower_bound(addr),
+                        page_checksums_.lower_bound(addr + num_bytes));
+}
+
 void AddressSpace::coalesce_around(MemoryMap::iterator it) {
   auto first_kv = it;
   while (mem.begin() != first_kv) {
@@ -24,6 +24,9 @@
 #include "TraceStream.h"
 #include "util.h"
 
+class CompressedReader;
+class CompressedWriter;
+class EmuFs;
 class Session;
 class Task;
 
@@ -524,6 +527,43 @@ public:
    */
   std::vector<WatchConfig> consume_watchpoint_changes();
 
+  /**
+   * During replay, write watchpoints that don't fit in the debug registers
+   * are implemented by write-protecting the pages that contain them.
+   * Return true if the page containing |addr| is currently write-protected
+   * on behalf of such a "software" watchpoint.
+   */
+  bool is_software_watch_page(remote_ptr<void> addr) const {
+    return software_watch_pages.count(floor_page_size(addr)) > 0;
+  }
+  /**
+   * Return true if the protection of software-watched pages needs to be
+   * brought up to date before a task in this address space runs.
+   */
+  bool software_watch_pages_need_update() const {
+    return software_watch_pages_dirty;
+  }
+  /**
+   * Write-protect exactly the pages software watchpoints need, using
+   * remote syscalls in |t|. |t| must be stopped.
+   */
+  void update_software_watch_pages(Task* t);
+  /**
+   * Make the software-watched page containing |addr| writable again so |t|
+   * can complete the write that faulted on it. The page stays unprotected
+   * until end_software_watch_write() is called.
+   */
+  void begin_software_watch_write(Task* t, remote_ptr<void> addr);
+  void end_software_watch_write(remote_ptr<void> addr);
+  /**
+   * While |lifted|, no pages are write-protected for software watchpoints.
+   * Replay lifts the protection while the kernel executes a syscall for
+   * real, because the kernel's own writes to tracee memory (e.g.
+   * CLONE_PARENT_SETTID) fail on write-protected pages instead of faulting.
+   * Takes effect the next time a task in this address space resumes.
+   */
+  void lift_software_watch_pages(bool lifted);
+
   /**
    * Make [addr, addr + num_bytes) inaccesible within this
    * address space.
@@ -544,6 +584,15 @@ public:
    */
   void verify(Task* t) const;
 
+  /**
+   * Per-page memory checksums from the last incremental checksum point,
+   * keyed by page address. Only meaningful while the soft-dirty bits that
+   * were cleared right after computing them are still being tracked.
+   */
+  std::map<remote_ptr<void>, uint32_t>& page_checksums() {
+    return page_checksums_;
+  }
+
   bool has_breakpoints() { return !breakpoints.empty(); }
   bool has_watchpoints() { return !watchpoints.empty(); }
 
@@ -681,6 +730,24 @@ public:
   const std::vector<uint8_t>& saved_auxv() { return saved_auxv_; }
   void save_auxv(Task* t);
 
+  /**
+   * Save this address space, including the contents of its memory (read
+   * through |t|), in a persistent checkpoint. Shared mappings of |emu_fs|
+   * files are recorded without their contents, and syscallbufs are left
+   * out entirely since Task::copy_state() recreates them.
+   */
+  void write_checkpoint(Task* t, EmuFs& emu_fs, CompressedWriter& state,
+                        CompressedWriter& memory);
+  /**
+   * Replace the mappings of |t|, which must have just been forked into this
+   * address space, with those read from a persistent checkpoint. Mappings of
+   * emufs files are only added to the model; the caller must remap them.
+   * This changes our uid(), so the caller must re-index us.
+   * Returns false if the checkpoint doesn't fit this address space.
+   */
+  bool read_checkpoint(Task* t, CompressedReader& state,
+                       CompressedReader& memory);
+
   /**
    * Reads the /proc/<pid>/maps entry for a specific address. Does no caching.
    * If performed on a file in a btrfs file system, this may return the
@@ -728,6 +795,22 @@ private:
    * in this address space.
    */
   bool allocate_watchpoints();
+  /**
+   * Return true if every page of |range| could be write-protected for a
+   * software watchpoint.
+   */
+  bool can_software_watch(const MemoryRange& range) const;
+  std::set<remote_ptr<void> > wanted_software_watch_pages() const;
+  /**
+   * Forget about software-watched pages in [addr, addr + num_bytes), whose
+   * protection the kernel has just reset.
+   */
+  void software_watch_pages_reset(remote_ptr<void> addr, size_t num_bytes);
+  /**
+   * Forget the page_checksums() of [addr, addr + num_bytes), whose contents
+   * may have changed without the pages becoming soft-dirty.
+   */
+  void page_checksums_reset(remote_ptr<void> addr, size_t num_bytes);
 
   /**
    * Merge the mappings adjacent to |it| in memory that are
@@ -848,7 +931,8 @@ private:
           write_count(0),
           value_bytes(num_bytes),
           valid(false),
-          changed(false) {}
+          changed(false),
+          software(false) {}
     Watchpoint(const Watchpoint&) = default;
     ~Watchpoint() { assert_valid(); }
 
@@ -896,6 +980,9 @@ private:
     std::vector<uint8_t> value_bytes;
     bool valid;
     bool changed;
+    // Implemented by write-protecting the pages containing the range
+    // instead of by debug registers.
+    bool software;
   };
 
   // All breakpoints set in this VM.
@@ -930,6 +1017,16 @@ private:
   // behalf of debuggers that assume that model.
   std::map<MemoryRange, Watchpoint> watchpoints;
   std::vector<std::map<MemoryRange, Watchpoint> > saved_watchpoints;
+  // See page_checksums(). Not copied to clones.
+  std::map<remote_ptr<void>, uint32_t> page_checksums_;
+  // Pages we've write-protected for software watchpoints.
+  std::set<remote_ptr<void> > software_watch_pages;
+  // Software-watched pages made writable while a task completes a write.
+  std::set<remote_ptr<void> > suspended_software_watch_pages;
+  // True when software_watch_pages may not match what the watchpoints need.
+  bool software_watch_pages_dirty;
+  // See lift_software_watch_pages().
+  bool software_watch_pages_lifted;
   // Tracee memory is read and written through this fd, which is
   // opened for the tracee's magic /proc/[tid]/mem device.  The
   // advantage of this over ptrace is that we can access it even
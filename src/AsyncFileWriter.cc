@@ -0,0 +1,274 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "AsyncFileWriter"
+
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#endif
+
+#include "AsyncFileWriter.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef RR_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "log.h"
+
+using namespace std;
+
+AsyncFileWriter::AsyncFileWriter(int fd, uint32_t queue_depth)
+    : fd(fd),
+      ring_fd(-1),
+      sq_ring(MAP_FAILED),
+      sq_ring_size(0),
+      cq_ring(MAP_FAILED),
+      cq_ring_size(0),
+      sqes(MAP_FAILED),
+      sqes_size(0),
+      waiting_for_completions(false),
+      error(false) {
+  assert(queue_depth > 0);
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  in_flight.resize(queue_depth);
+  for (uint32_t i = 0; i < queue_depth; ++i) {
+    free_slots.push_back(queue_depth - 1 - i);
+  }
+  if (!setup_ring(queue_depth)) {
+    LOG(debug) << "io_uring unavailable; writing synchronously";
+  }
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+  drain();
+  if (sqes != MAP_FAILED) {
+    munmap(sqes, sqes_size);
+  }
+  if (cq_ring != MAP_FAILED) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (sq_ring != MAP_FAILED) {
+    munmap(sq_ring, sq_ring_size);
+  }
+  if (ring_fd >= 0) {
+    close(ring_fd);
+  }
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+#ifdef RR_HAVE_IO_URING
+static int io_uring_enter(int ring_fd, uint32_t to_submit,
+                          uint32_t min_complete, uint32_t flags) {
+  while (true) {
+    int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                      flags, nullptr, _NSIG / 8);
+    if (ret >= 0 || errno != EINTR) {
+      return ret;
+    }
+  }
+}
+#endif
+
+bool AsyncFileWriter::setup_ring(uint32_t entries) {
+#ifdef RR_HAVE_IO_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ret = syscall(__NR_io_uring_setup, entries, &params);
+  if (ret < 0) {
+    return false;
+  }
+  ring_fd = ret;
+  // IORING_OP_WRITE arrived in the same kernel release as this feature;
+  // without it every write would fail with EINVAL.
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(ring_fd);
+    ring_fd = -1;
+    return false;
+  }
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+    // The destructor unmaps whatever did get mapped.
+    close(ring_fd);
+    ring_fd = -1;
+    return false;
+  }
+
+  uint8_t* sq = static_cast<uint8_t*>(sq_ring);
+  sq_head = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+  sq_tail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+  sq_mask = reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+  sq_array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+  uint8_t* cq = static_cast<uint8_t*>(cq_ring);
+  cq_head = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+  cq_mask = reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+  cqes = cq + params.cq_off.cqes;
+  return true;
+#else
+  (void)entries;
+  return false;
+#endif
+}
+
+void AsyncFileWriter::write_synchronously(const void* data, size_t size,
+                                          uint64_t offset) {
+  while (size > 0) {
+    ssize_t ret = pwrite64(fd, data, size, offset);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      pthread_mutex_lock(&mutex);
+      error = true;
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    data = static_cast<const uint8_t*>(data) + ret;
+    size -= ret;
+    offset += ret;
+  }
+}
+
+void AsyncFileWriter::submit(const void* data, size_t size, uint64_t offset,
+                             uint64_t token) {
+  if (ring_fd < 0) {
+    write_synchronously(data, size, offset);
+    pthread_mutex_lock(&mutex);
+    completed.push_back(token);
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+
+#ifdef RR_HAVE_IO_URING
+  pthread_mutex_lock(&mutex);
+  assert(!free_slots.empty() && "Too many writes in flight");
+  uint32_t slot = free_slots.back();
+  free_slots.pop_back();
+  in_flight[slot] = { data, size, offset, token };
+
+  // We never have more writes in flight than submission queue entries, so
+  // there's always room.
+  uint32_t tail = *sq_tail;
+  uint32_t index = tail & *sq_mask;
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes) + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = reinterpret_cast<uintptr_t>(data);
+  sqe->len = size;
+  sqe->user_data = slot;
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  if (io_uring_enter(ring_fd, 1, 0, 0) != 1) {
+    // The kernel didn't take it; undo and write it ourselves.
+    LOG(debug) << "io_uring_enter failed; writing synchronously";
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    free_slots.push_back(slot);
+    pthread_mutex_unlock(&mutex);
+    write_synchronously(data, size, offset);
+    pthread_mutex_lock(&mutex);
+    completed.push_back(token);
+  }
+  pthread_mutex_unlock(&mutex);
+#endif
+}
+
+void AsyncFileWriter::harvest_completions() {
+#ifdef RR_HAVE_IO_URING
+  if (ring_fd < 0) {
+    return;
+  }
+  uint32_t head = *cq_head;
+  uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    struct io_uring_cqe* cqe =
+        static_cast<struct io_uring_cqe*>(cqes) + (head & *cq_mask);
+    uint32_t slot = cqe->user_data;
+    Pending p = in_flight[slot];
+    int res = cqe->res;
+    // Release the entry before doing anything slow.
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+    if (res < 0 || (size_t)res < p.size) {
+      // Short or failed write. Finish it the slow way; a real I/O error
+      // will fail again there and be reported.
+      size_t done = res < 0 ? 0 : res;
+      pthread_mutex_unlock(&mutex);
+      write_synchronously(static_cast<const uint8_t*>(p.data) + done,
+                          p.size - done, p.offset + done);
+      pthread_mutex_lock(&mutex);
+    }
+    free_slots.push_back(slot);
+    completed.push_back(p.token);
+    // The ring may have moved on while we didn't hold the lock.
+    head = *cq_head - 1;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  }
+#endif
+}
+
+void AsyncFileWriter::reap(vector<uint64_t>* done, bool wait) {
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    harvest_completions();
+    if (!completed.empty() || !wait ||
+        free_slots.size() == in_flight.size()) {
+      break;
+    }
+    if (waiting_for_completions) {
+      pthread_cond_wait(&cond, &mutex);
+      continue;
+    }
+#ifdef RR_HAVE_IO_URING
+    waiting_for_completions = true;
+    pthread_mutex_unlock(&mutex);
+    io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+    pthread_mutex_lock(&mutex);
+    waiting_for_completions = false;
+    pthread_cond_broadcast(&cond);
+#endif
+  }
+  done->insert(done->end(), completed.begin(), completed.end());
+  completed.clear();
+  pthread_mutex_unlock(&mutex);
+}
+
+void AsyncFileWriter::drain() {
+  vector<uint64_t> done;
+  while (true) {
+    pthread_mutex_lock(&mutex);
+    bool idle = free_slots.size() == in_flight.size();
+    pthread_mutex_unlock(&mutex);
+    if (idle) {
+      break;
+    }
+    reap(&done, true);
+  }
+}
+
+bool AsyncFileWriter::failed() const {
+  pthread_mutex_lock(&mutex);
+  bool ret = error;
+  pthread_mutex_unlock(&mutex);
+  return ret;
+}
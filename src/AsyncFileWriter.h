@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_ASYNC_FILE_WRITER_H_
+#define RR_ASYNC_FILE_WRITER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+/**
+ * AsyncFileWriter writes buffers to given offsets of a file without making
+ * the submitting thread wait for the disk. It uses io_uring when rr was
+ * built with it and the kernel supports it; otherwise submit() simply
+ * pwrite()s on the calling thread, which still lets several threads write
+ * different parts of the file concurrently.
+ *
+ * Each write is identified by a caller-chosen token, which is returned by
+ * reap() once the write has completed and its buffer may be reused. Writes
+ * complete in any order. All methods may be called from any thread.
+ */
+class AsyncFileWriter {
+public:
+  /**
+   * |queue_depth| is the maximum number of writes in flight at once; the
+   * caller must not exceed it.
+   */
+  AsyncFileWriter(int fd, uint32_t queue_depth);
+  ~AsyncFileWriter();
+
+  /** True if writes are really asynchronous. */
+  bool is_async() const { return ring_fd >= 0; }
+
+  /**
+   * Queue a write of |size| bytes from |data| to file offset |offset|.
+   * |data| must remain valid until |token| has been returned by reap().
+   */
+  void submit(const void* data, size_t size, uint64_t offset,
+              uint64_t token);
+  /**
+   * Append the tokens of completed writes to |done|. If |wait| and no
+   * writes have completed, wait for one (unless none are in flight).
+   */
+  void reap(std::vector<uint64_t>* done, bool wait);
+  /** Wait until all writes have completed. */
+  void drain();
+  /**
+   * True if any write failed. Failed writes are still returned by reap().
+   */
+  bool failed() const;
+
+  /**
+   * Buffers passed to submit() should be aligned to this, so that a file
+   * opened with O_DIRECT could be written from them.
+   */
+  static const size_t BUFFER_ALIGNMENT = 4096;
+
+private:
+  bool setup_ring(uint32_t entries);
+  void write_synchronously(const void* data, size_t size, uint64_t offset);
+  /** Move completion-queue entries to 'completed'. Call with 'mutex' held. */
+  void harvest_completions();
+
+  int fd;
+  int ring_fd;
+
+  // The io_uring rings, mapped from ring_fd.
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  void* sqes;
+  size_t sqes_size;
+  uint32_t* sq_head;
+  uint32_t* sq_tail;
+  uint32_t* sq_mask;
+  uint32_t* sq_array;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t* cq_mask;
+  void* cqes;
+
+  struct Pending {
+    const void* data;
+    size_t size;
+    uint64_t offset;
+    uint64_t token;
+  };
+
+  mutable pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  // BEGIN protected by 'mutex'
+  // Writes submitted to the ring and not yet completed, indexed by the
+  // user_data of their submission.
+  std::vector<Pending> in_flight;
+  std::vector<uint32_t> free_slots;
+  // Tokens of completed writes not yet returned by reap().
+  std::vector<uint64_t> completed;
+  // True while some thread is blocked in io_uring_enter waiting for
+  // completions; other reapers wait on 'cond' for it instead.
+  bool waiting_for_completions;
+  bool error;
+  // END protected by 'mutex'
+};
+
+#endif /* RR_ASYNC_FILE_WRITER_H_ */
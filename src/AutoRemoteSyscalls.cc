@@ -66,6 +66,7 @@ AutoRemoteSyscalls::AutoRemoteSyscalls(Task* t,
   // need privileges because tracee seccomp filters are modified to only
   // produce PTRACE_SECCOMP_EVENTs that we ignore. And before the rr page is
   // loaded, the privileged_traced_syscall_ip is not available.
+  ++t->remote_syscalls_depth;
   initial_regs.set_ip(t->vm()->traced_syscall_ip());
   if (enable_mem_params == ENABLE_MEMORY_PARAMS) {
     maybe_fix_stack_pointer();
@@ -106,7 +107,10 @@ void AutoRemoteSyscalls::maybe_fix_stack_pointer() {
   initial_regs.set_sp(found_stack.end());
 }
 
-AutoRemoteSyscalls::~AutoRemoteSyscalls() { restore_state_to(t); }
+AutoRemoteSyscalls::~AutoRemoteSyscalls() {
+  restore_state_to(t);
+  --t->remote_syscalls_depth;
+}
 
 void AutoRemoteSyscalls::restore_state_to(Task* t) {
   initial_regs.set_ip(initial_ip);
@@ -0,0 +1,180 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "CheckpointCommand"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "Command.h"
+#include "log.h"
+#include "main.h"
+#include "ReplaySession.h"
+
+using namespace std;
+
+class CheckpointCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  CheckpointCommand(const char* name, const char* help)
+      : Command(name, help) {}
+
+  static CheckpointCommand singleton;
+};
+
+CheckpointCommand CheckpointCommand::singleton(
+    "checkpoint",
+    " rr checkpoint create [OPTION]... [<trace_dir>]\n"
+    "  Replay a trace, saving checkpoints in the trace directory so that\n"
+    "  `rr replay -g' and friends can start close to their target event\n"
+    "  instead of at the start of the trace. Runs at low priority so it\n"
+    "  can be left running in the background. Resumes from the latest\n"
+    "  existing checkpoint.\n"
+    "  -i, --interval=<EVENTS>    save a checkpoint every <EVENTS> events\n"
+    "                             (default 100000)\n"
+    "  -r, --range=<FIRST>-<LAST> save a single checkpoint at the first\n"
+    "                             event from FIRST to LAST where one can be\n"
+    "                             saved, resuming from the latest checkpoint\n"
+    "                             before FIRST, then stop\n"
+    " rr checkpoint list [<trace_dir>]\n"
+    "  List the events at which a trace has checkpoints.\n");
+
+struct CheckpointFlags {
+  TraceFrame::Time interval;
+  // When nonzero, the range of events passed to --range.
+  TraceFrame::Time first;
+  TraceFrame::Time last;
+
+  CheckpointFlags() : interval(100000), first(0), last(0) {}
+};
+
+static bool parse_checkpoint_arg(std::vector<std::string>& args,
+                                 CheckpointFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'i', "interval", HAS_PARAMETER },
+                                        { 'r', "range", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'i':
+      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+        return false;
+      }
+      flags.interval = opt.int_value;
+      break;
+    case 'r': {
+      long long first, last;
+      char dash;
+      istringstream in(opt.value);
+      if (!(in >> first >> dash >> last) || dash != '-' || first < 1 ||
+          last < first || !in.eof()) {
+        fprintf(stderr, "Invalid event range `%s'\n", opt.value.c_str());
+        return false;
+      }
+      flags.first = first;
+      flags.last = last;
+      break;
+    }
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+static int create_checkpoints(const string& trace_dir,
+                              const CheckpointFlags& flags) {
+  // Don't compete with interactive work.
+  setpriority(PRIO_PROCESS, 0, 10);
+
+  ReplaySession::shr_ptr session;
+  auto times = ReplaySession::persistent_checkpoints(trace_dir);
+  if (flags.first) {
+    times.erase(upper_bound(times.begin(), times.end(), flags.first),
+                times.end());
+  }
+  if (!times.empty()) {
+    session = ReplaySession::create_from_checkpoint(trace_dir, times.back());
+    if (!session) {
+      LOG(warn) << "Couldn't restore the checkpoint at event " << times.back()
+                << "; starting from the start of the trace";
+    }
+  }
+  if (!session) {
+    session = ReplaySession::create(trace_dir);
+  }
+  session->set_visible_execution(false);
+  session->set_flags(ReplaySession::Flags());
+
+  TraceFrame::Time next = session->current_trace_frame().time() + 1;
+  next = ((next + flags.interval - 1) / flags.interval) * flags.interval;
+  if (flags.first) {
+    next = flags.first;
+  }
+  int written = 0;
+  while (true) {
+    TraceFrame::Time now = session->current_trace_frame().time();
+    if (flags.last && now > flags.last) {
+      // The events after |last| may not have been written yet.
+      break;
+    }
+    if (now >= next && !session->current_step_key().in_execution() &&
+        session->write_checkpoint()) {
+      fprintf(stdout, "rr: Saved checkpoint at event %" PRId64 "\n",
+              (int64_t)now);
+      fflush(stdout);
+      ++written;
+      if (flags.first) {
+        break;
+      }
+      next = (now / flags.interval + 1) * flags.interval;
+    }
+    if (session->replay_step(RUN_CONTINUE).status == REPLAY_EXITED) {
+      break;
+    }
+  }
+
+  fprintf(stdout, "rr: Saved %d checkpoints in `%s'\n", written,
+          session->trace_reader().dir().c_str());
+  return 0;
+}
+
+static int list_checkpoints(const string& trace_dir) {
+  for (TraceFrame::Time time :
+       ReplaySession::persistent_checkpoints(trace_dir)) {
+    fprintf(stdout, "%" PRId64 "\n", (int64_t)time);
+  }
+  return 0;
+}
+
+int CheckpointCommand::run(std::vector<std::string>& args) {
+  if (args.empty() || (args[0] != "create" && args[0] != "list")) {
+    print_help(stderr);
+    return 1;
+  }
+  bool create = args[0] == "create";
+  args.erase(args.begin());
+
+  CheckpointFlags flags;
+  while (parse_checkpoint_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return create ? create_checkpoints(trace_dir, flags)
+                : list_checkpoints(trace_dir);
+}
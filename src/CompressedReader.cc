@@ -14,25 +14,85 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef RR_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef RR_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
-#include "CompressedWriter.h"
+#include <algorithm>
 
-CompressedReader::CompressedReader(const std::string& filename)
-    : fd(new ScopedFd(filename.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE)) {
+#include "Flags.h"
+#include "log.h"
+
+using namespace std;
+
+// Read-ahead blocks are independent, so more threads than this mostly
+// compete with the replayer and tracees for CPU.
+static const size_t MAX_READ_AHEAD_THREADS = 4;
+
+/**
+ * A block queued for decompression by the read-ahead pool. Once queued,
+ * 'state' and 'data' are protected by read_ahead_mutex.
+ */
+struct CompressedReader::ReadAheadBlock {
+  enum State { QUEUED, CANCELLED, IN_PROGRESS, DONE, FAILED };
+
+  shared_ptr<ScopedFd> fd;
+  CompressedWriter::BlockHeader header;
+  // File offset of the block header.
+  uint64_t offset;
+  // File offset of the compressed data.
+  uint64_t data_offset;
+  // File offset of the next block's header.
+  uint64_t next_offset;
+  State state;
+  vector<uint8_t> data;
+};
+
+static pthread_mutex_t read_ahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a block is queued.
+static pthread_cond_t read_ahead_queued_cond = PTHREAD_COND_INITIALIZER;
+// Signalled when a block is DONE or FAILED.
+static pthread_cond_t read_ahead_done_cond = PTHREAD_COND_INITIALIZER;
+static bool read_ahead_threads_started;
+
+deque<shared_ptr<CompressedReader::ReadAheadBlock> >*
+    CompressedReader::read_ahead_queue;
+
+CompressedReader::CompressedReader(const string& filename,
+                                   bool legacy_zlib_format)
+    : fd(new ScopedFd(filename.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE)),
+      legacy_zlib_format(legacy_zlib_format) {
   fd_offset = 0;
   error = !fd->is_open();
   eof = false;
   buffer_read_pos = 0;
+  buffer_block_offset = 0;
+  read_ahead_blocks = Flags::get().read_ahead_blocks;
+  read_ahead_offset = 0;
   have_saved_state = false;
+  if (read_ahead_blocks > 0) {
+    // Start the pool now, while we're (typically) not yet bound to the
+    // tracees' CPU; see Task::spawn.
+    start_read_ahead_threads(min(read_ahead_blocks, MAX_READ_AHEAD_THREADS));
+  }
 }
 
 CompressedReader::CompressedReader(const CompressedReader& other) {
   fd = other.fd;
   fd_offset = other.fd_offset;
+  legacy_zlib_format = other.legacy_zlib_format;
   error = other.error;
   eof = other.eof;
   buffer_read_pos = other.buffer_read_pos;
   buffer = other.buffer;
+  buffer_block_offset = other.buffer_block_offset;
+  // Blocks are identified by file offset, so the copy can simply start its
+  // own read-ahead when it next needs a block.
+  read_ahead_blocks = other.read_ahead_blocks;
+  read_ahead_offset = 0;
   have_saved_state = false;
   assert(!other.have_saved_state);
 }
@@ -53,8 +113,23 @@ static bool read_all(const ScopedFd& fd, size_t size, void* data,
   return true;
 }
 
-static bool do_decompress(std::vector<uint8_t>& compressed,
-                          std::vector<uint8_t>& uncompressed) {
+bool CompressedReader::read_block_header(
+    uint64_t* offset, CompressedWriter::BlockHeader* header) const {
+  if (legacy_zlib_format) {
+    CompressedWriter::LegacyBlockHeader legacy;
+    if (!read_all(*fd, sizeof(legacy), &legacy, offset)) {
+      return false;
+    }
+    header->compressed_length = legacy.compressed_length;
+    header->uncompressed_length = legacy.uncompressed_length;
+    header->codec = CompressedWriter::CODEC_ZLIB;
+    return true;
+  }
+  return read_all(*fd, sizeof(*header), header, offset);
+}
+
+static bool zlib_decompress(std::vector<uint8_t>& compressed,
+                            std::vector<uint8_t>& uncompressed) {
   z_stream stream;
   memset(&stream, 0, sizeof(stream));
   int result = inflateInit(&stream);
@@ -82,6 +157,208 @@ static bool do_decompress(std::vector<uint8_t>& compressed,
   return true;
 }
 
+static bool do_decompress(CompressedWriter::Codec codec,
+                          std::vector<uint8_t>& compressed,
+                          std::vector<uint8_t>& uncompressed) {
+  switch (codec) {
+    case CompressedWriter::CODEC_STORE:
+      if (compressed.size() != uncompressed.size()) {
+        return false;
+      }
+      memcpy(uncompressed.data(), compressed.data(), compressed.size());
+      return true;
+    case CompressedWriter::CODEC_ZLIB:
+      return zlib_decompress(compressed, uncompressed);
+#ifdef RR_HAVE_LZ4
+    case CompressedWriter::CODEC_LZ4: {
+      int result = LZ4_decompress_safe(
+          reinterpret_cast<const char*>(compressed.data()),
+          reinterpret_cast<char*>(uncompressed.data()), compressed.size(),
+          uncompressed.size());
+      return result >= 0 && (size_t)result == uncompressed.size();
+    }
+#endif
+#ifdef RR_HAVE_ZSTD
+    case CompressedWriter::CODEC_ZSTD: {
+      size_t result =
+          ZSTD_decompress(uncompressed.data(), uncompressed.size(),
+                          compressed.data(), compressed.size());
+      return !ZSTD_isError(result) && result == uncompressed.size();
+    }
+#endif
+    default:
+      // This can run on a read-ahead thread, so just report the block as
+      // bad and let good() catch it.
+      LOG(error) << "Trace block uses codec " << (int)codec << " ("
+                 << CompressedWriter::codec_name(codec)
+                 << "), which this rr was built without or doesn't know";
+      return false;
+  }
+}
+
+static bool read_and_decompress(const ScopedFd& fd,
+                                const CompressedWriter::BlockHeader& header,
+                                uint64_t data_offset,
+                                std::vector<uint8_t>& uncompressed) {
+  std::vector<uint8_t> compressed_buf;
+  compressed_buf.resize(header.compressed_length);
+  if (!read_all(fd, compressed_buf.size(), &compressed_buf[0], &data_offset)) {
+    return false;
+  }
+
+  uncompressed.resize(header.uncompressed_length);
+  return do_decompress((CompressedWriter::Codec)header.codec, compressed_buf,
+                       uncompressed);
+}
+
+/*static*/ void CompressedReader::start_read_ahead_threads(size_t count) {
+  pthread_mutex_lock(&read_ahead_mutex);
+  if (!read_ahead_threads_started) {
+    read_ahead_threads_started = true;
+    read_ahead_queue = new deque<shared_ptr<ReadAheadBlock> >();
+    for (size_t i = 0; i < count; ++i) {
+      pthread_t thread;
+      pthread_create(&thread, nullptr, read_ahead_thread, nullptr);
+      pthread_setname_np(thread, "decompress");
+      pthread_detach(thread);
+    }
+  }
+  pthread_mutex_unlock(&read_ahead_mutex);
+}
+
+/*static*/ void* CompressedReader::read_ahead_thread(void*) {
+  pthread_mutex_lock(&read_ahead_mutex);
+  while (true) {
+    if (read_ahead_queue->empty()) {
+      pthread_cond_wait(&read_ahead_queued_cond, &read_ahead_mutex);
+      continue;
+    }
+    shared_ptr<ReadAheadBlock> block = read_ahead_queue->front();
+    read_ahead_queue->pop_front();
+    if (block->state != ReadAheadBlock::QUEUED) {
+      // Cancelled, or the reader got impatient and took it.
+      continue;
+    }
+    block->state = ReadAheadBlock::IN_PROGRESS;
+    pthread_mutex_unlock(&read_ahead_mutex);
+
+    vector<uint8_t> data;
+    bool ok = read_and_decompress(*block->fd, block->header,
+                                  block->data_offset, data);
+
+    pthread_mutex_lock(&read_ahead_mutex);
+    block->data.swap(data);
+    block->state = ok ? ReadAheadBlock::DONE : ReadAheadBlock::FAILED;
+    pthread_cond_broadcast(&read_ahead_done_cond);
+  }
+  return nullptr;
+}
+
+bool CompressedReader::load_block() {
+  if (read_ahead_blocks > 0) {
+    return load_block_read_ahead();
+  }
+
+  uint64_t offset = fd_offset;
+  CompressedWriter::BlockHeader header;
+  if (!read_block_header(&fd_offset, &header)) {
+    return false;
+  }
+  buffer_block_offset = offset;
+  buffer_read_pos = 0;
+  if (!read_and_decompress(*fd, header, fd_offset, buffer)) {
+    return false;
+  }
+  fd_offset += header.compressed_length;
+  return true;
+}
+
+bool CompressedReader::load_block_read_ahead() {
+  if (!read_ahead.empty() && read_ahead.front()->offset != fd_offset) {
+    // We've been rewound or restored to an earlier position.
+    cancel_read_ahead();
+  }
+  if (read_ahead.empty()) {
+    read_ahead_offset = fd_offset;
+  }
+  fill_read_ahead();
+  if (read_ahead.empty()) {
+    return false;
+  }
+
+  shared_ptr<ReadAheadBlock> block = read_ahead.front();
+  read_ahead.pop_front();
+
+  pthread_mutex_lock(&read_ahead_mutex);
+  bool decompress_here = block->state == ReadAheadBlock::QUEUED;
+  if (decompress_here) {
+    // The workers haven't got to it yet (maybe they're busy with other
+    // readers' blocks). Don't wait for them.
+    block->state = ReadAheadBlock::IN_PROGRESS;
+  } else {
+    while (block->state == ReadAheadBlock::IN_PROGRESS) {
+      pthread_cond_wait(&read_ahead_done_cond, &read_ahead_mutex);
+    }
+  }
+  pthread_mutex_unlock(&read_ahead_mutex);
+
+  bool ok;
+  if (decompress_here) {
+    ok = read_and_decompress(*fd, block->header, block->data_offset, buffer);
+  } else {
+    ok = block->state == ReadAheadBlock::DONE;
+    buffer.swap(block->data);
+  }
+  if (!ok) {
+    return false;
+  }
+  buffer_block_offset = block->offset;
+  buffer_read_pos = 0;
+  fd_offset = block->next_offset;
+
+  fill_read_ahead();
+  return true;
+}
+
+void CompressedReader::fill_read_ahead() {
+  while (read_ahead.size() < read_ahead_blocks) {
+    uint64_t offset = read_ahead_offset;
+    CompressedWriter::BlockHeader header;
+    if (!read_block_header(&offset, &header)) {
+      // End of file.
+      break;
+    }
+    shared_ptr<ReadAheadBlock> block(new ReadAheadBlock());
+    block->fd = fd;
+    block->header = header;
+    block->offset = read_ahead_offset;
+    block->data_offset = offset;
+    block->next_offset = offset + header.compressed_length;
+    block->state = ReadAheadBlock::QUEUED;
+    read_ahead_offset = block->next_offset;
+    read_ahead.push_back(block);
+
+    pthread_mutex_lock(&read_ahead_mutex);
+    read_ahead_queue->push_back(block);
+    pthread_cond_signal(&read_ahead_queued_cond);
+    pthread_mutex_unlock(&read_ahead_mutex);
+  }
+}
+
+void CompressedReader::cancel_read_ahead() {
+  if (read_ahead.empty()) {
+    return;
+  }
+  pthread_mutex_lock(&read_ahead_mutex);
+  for (auto& block : read_ahead) {
+    if (block->state == ReadAheadBlock::QUEUED) {
+      block->state = ReadAheadBlock::CANCELLED;
+    }
+  }
+  pthread_mutex_unlock(&read_ahead_mutex);
+  read_ahead.clear();
+}
+
 bool CompressedReader::read(void* data, size_t size) {
   while (size > 0) {
     if (error) {
@@ -102,15 +379,7 @@ bool CompressedReader::read(void* data, size_t size) {
       have_saved_buffer = true;
     }
 
-    CompressedWriter::BlockHeader header;
-    if (!read_all(*fd, sizeof(header), &header, &fd_offset)) {
-      error = true;
-      return false;
-    }
-
-    std::vector<uint8_t> compressed_buf;
-    compressed_buf.resize(header.compressed_length);
-    if (!read_all(*fd, compressed_buf.size(), &compressed_buf[0], &fd_offset)) {
+    if (!load_block()) {
       error = true;
       return false;
     }
@@ -119,26 +388,133 @@ bool CompressedReader::read(void* data, size_t size) {
     if (pread(*fd, &ch, 1, fd_offset) == 0) {
       eof = true;
     }
-
-    buffer.resize(header.uncompressed_length);
-    buffer_read_pos = 0;
-    if (!do_decompress(compressed_buf, buffer)) {
-      error = true;
-      return false;
-    }
   }
   return true;
 }
 
 void CompressedReader::rewind() {
   assert(!have_saved_state);
+  cancel_read_ahead();
   fd_offset = 0;
   buffer_read_pos = 0;
   buffer.clear();
   eof = false;
 }
 
-void CompressedReader::close() { fd = nullptr; }
+bool CompressedReader::seek(uint64_t block_offset,
+                            uint64_t intra_block_offset) {
+  assert(!have_saved_state);
+  fd_offset = block_offset;
+  buffer.clear();
+  buffer_read_pos = 0;
+  eof = false;
+  error = false;
+
+  char ch;
+  if (pread(*fd, &ch, 1, fd_offset) == 0) {
+    // Seeking to the end of the stream.
+    eof = true;
+    if (intra_block_offset > 0) {
+      error = true;
+    }
+    return !error;
+  }
+  if (!load_block() || intra_block_offset > buffer.size()) {
+    error = true;
+    return false;
+  }
+  buffer_read_pos = intra_block_offset;
+  if (pread(*fd, &ch, 1, fd_offset) == 0) {
+    eof = true;
+  }
+  return true;
+}
+
+void CompressedReader::build_block_index() {
+  uint64_t offset = 0;
+  uint64_t uncompressed_offset = 0;
+  while (true) {
+    BlockIndexEntry entry = { uncompressed_offset, offset };
+    CompressedWriter::BlockHeader header;
+    if (!read_block_header(&offset, &header)) {
+      break;
+    }
+    block_index.push_back(entry);
+    uncompressed_offset += header.uncompressed_length;
+    offset += header.compressed_length;
+  }
+}
+
+bool CompressedReader::seek_uncompressed(uint64_t position) {
+  if (block_index.empty()) {
+    build_block_index();
+  }
+  // Find the last block starting at or before |position|.
+  auto it = upper_bound(block_index.begin(), block_index.end(), position,
+                        [](uint64_t p, const BlockIndexEntry& e) {
+    return p < e.uncompressed_offset;
+  });
+  if (it == block_index.begin()) {
+    error = true;
+    return false;
+  }
+  --it;
+  uint64_t intra_block_offset = position - it->uncompressed_offset;
+  if (!buffer.empty() && buffer_block_offset == it->block_offset) {
+    assert(!have_saved_state);
+    if (intra_block_offset > buffer.size()) {
+      error = true;
+      return false;
+    }
+    buffer_read_pos = intra_block_offset;
+    return true;
+  }
+  return seek(it->block_offset, intra_block_offset);
+}
+
+bool CompressedReader::uncompressed_position(uint64_t block_offset,
+                                             uint64_t intra_block_offset,
+                                             uint64_t* position) {
+  if (block_index.empty()) {
+    build_block_index();
+  }
+  auto it = lower_bound(block_index.begin(), block_index.end(), block_offset,
+                        [](const BlockIndexEntry& e, uint64_t offset) {
+    return e.block_offset < offset;
+  });
+  if (it == block_index.end() || it->block_offset != block_offset) {
+    if (intra_block_offset == 0 && block_offset == compressed_bytes()) {
+      // The end of the stream.
+      *position = uncompressed_bytes();
+      return true;
+    }
+    return false;
+  }
+  *position = it->uncompressed_offset + intra_block_offset;
+  return true;
+}
+
+void CompressedReader::disable_read_ahead() {
+  cancel_read_ahead();
+  read_ahead_blocks = 0;
+}
+
+bool CompressedReader::skip(size_t size) {
+  uint8_t scratch[4096];
+  while (size > 0) {
+    size_t amount = std::min(size, sizeof(scratch));
+    if (!read(scratch, amount)) {
+      return false;
+    }
+    size -= amount;
+  }
+  return true;
+}
+
+void CompressedReader::close() {
+  cancel_read_ahead();
+  fd = nullptr;
+}
 
 void CompressedReader::save_state() {
   assert(!have_saved_state);
@@ -146,6 +522,7 @@ void CompressedReader::save_state() {
   have_saved_buffer = false;
   saved_fd_offset = fd_offset;
   saved_buffer_read_pos = buffer_read_pos;
+  saved_buffer_block_offset = buffer_block_offset;
 }
 
 void CompressedReader::restore_state() {
@@ -154,10 +531,26 @@ void CompressedReader::restore_state() {
   if (saved_fd_offset < fd_offset) {
     eof = false;
   }
+  if (have_saved_buffer && read_ahead_blocks > 0 &&
+      buffer_block_offset == saved_fd_offset &&
+      (read_ahead.empty() || read_ahead.front()->offset == fd_offset)) {
+    // We peeked into exactly one new block. Put it back at the front of the
+    // read-ahead queue so we don't decompress it again.
+    shared_ptr<ReadAheadBlock> block(new ReadAheadBlock());
+    block->offset = buffer_block_offset;
+    block->next_offset = fd_offset;
+    block->state = ReadAheadBlock::DONE;
+    block->data.swap(buffer);
+    if (read_ahead.empty()) {
+      read_ahead_offset = fd_offset;
+    }
+    read_ahead.push_front(block);
+  }
   fd_offset = saved_fd_offset;
   if (have_saved_buffer) {
     std::swap(buffer, saved_buffer);
     saved_buffer.clear();
+    buffer_block_offset = saved_buffer_block_offset;
   }
   buffer_read_pos = saved_buffer_read_pos;
 }
@@ -166,7 +559,7 @@ uint64_t CompressedReader::uncompressed_bytes() const {
   uint64_t offset = 0;
   uint64_t uncompressed_bytes = 0;
   CompressedWriter::BlockHeader header;
-  while (read_all(*fd, sizeof(header), &header, &offset)) {
+  while (read_block_header(&offset, &header)) {
     uncompressed_bytes += header.uncompressed_length;
     offset += header.compressed_length;
   }
@@ -6,20 +6,30 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include <deque>
 #include <memory>
 #include <vector>
 #include <string>
 
+#include "CompressedWriter.h"
 #include "ScopedFd.h"
 
 /**
  * CompressedReader opens an input file written by CompressedWriter
- * and reads data from it. Currently data is decompressed by the thread that
- * calls read().
+ * and reads data from it. By default data is decompressed by the thread that
+ * calls read(). When read-ahead is enabled (see Flags::read_ahead_blocks),
+ * a shared pool of worker threads decompresses the blocks following the
+ * current one in the background, so read() only waits if the workers have
+ * fallen behind.
  */
 class CompressedReader {
 public:
-  CompressedReader(const std::string& filename);
+  /**
+   * When |legacy_zlib_format| is true, the file was written by an rr that
+   * only supported zlib and its block headers carry no codec.
+   */
+  CompressedReader(const std::string& filename,
+                   bool legacy_zlib_format = false);
   CompressedReader(const CompressedReader& aOther);
   ~CompressedReader();
   bool good() const { return !error; }
@@ -28,6 +38,36 @@ public:
   // will be false.
   bool read(void* data, size_t size);
   void rewind();
+  /**
+   * Position the reader at 'intra_block_offset' bytes into the uncompressed
+   * data of the block whose header is at file offset 'block_offset' (see
+   * CompressedWriter::block_position). Returns false if there's no such
+   * block, in which case good() will be false.
+   */
+  bool seek(uint64_t block_offset, uint64_t intra_block_offset);
+  /**
+   * Position the reader at offset 'position' in the uncompressed data, i.e.
+   * where it would be after reading 'position' bytes from the start.
+   * Cheap if 'position' is in the current block. Returns false if the
+   * stream is shorter than that, in which case good() will be false.
+   */
+  bool seek_uncompressed(uint64_t position);
+  /**
+   * Translate a position as passed to seek() into an offset in the
+   * uncompressed data. Returns false if there's no block at
+   * 'block_offset'.
+   */
+  bool uncompressed_position(uint64_t block_offset,
+                             uint64_t intra_block_offset, uint64_t* position);
+  /**
+   * Stop decompressing ahead of the reader. Useful for readers that mostly
+   * seek around rather than read sequentially.
+   */
+  void disable_read_ahead();
+  /**
+   * Discard the next 'size' bytes. Returns true if successful.
+   */
+  bool skip(size_t size);
   void close();
 
   /**
@@ -77,21 +117,77 @@ public:
   }
 
 protected:
+  struct ReadAheadBlock;
+
+  /**
+   * Decompress the block at fd_offset into 'buffer' and advance fd_offset
+   * past it. Returns false on error or at end of file.
+   */
+  bool load_block();
+  bool load_block_read_ahead();
+  /**
+   * Queue decompression of blocks following the last queued block until
+   * the read-ahead window is full.
+   */
+  void fill_read_ahead();
+  /**
+   * Drop all queued blocks. Workers skip blocks that haven't started yet.
+   */
+  void cancel_read_ahead();
+
+  static void start_read_ahead_threads(size_t count);
+  static void* read_ahead_thread(void*);
+  /* Blocks waiting for a read-ahead thread, from all readers. Protected by
+     a mutex in CompressedReader.cc. */
+  static std::deque<std::shared_ptr<ReadAheadBlock> >* read_ahead_queue;
+
+  /**
+   * Read the block header at *offset and advance *offset past it. Returns
+   * false at end of file or on error.
+   */
+  bool read_block_header(uint64_t* offset,
+                         CompressedWriter::BlockHeader* header) const;
+
+  struct BlockIndexEntry {
+    /* Offset of the block's data in the uncompressed stream. */
+    uint64_t uncompressed_offset;
+    /* File offset of the block header. */
+    uint64_t block_offset;
+  };
+  /* Fill 'block_index' by scanning all the block headers. */
+  void build_block_index();
+
   /* Our fd might be the dup of another fd, so we can't rely on its current file
      position.
      Instead track the current position in fd_offset and use pread. */
   uint64_t fd_offset;
   std::shared_ptr<ScopedFd> fd;
+  bool legacy_zlib_format;
   bool error;
   bool eof;
   std::vector<uint8_t> buffer;
   size_t buffer_read_pos;
+  /* File offset of the header of the block in 'buffer'. */
+  uint64_t buffer_block_offset;
+
+  /* Maximum number of blocks to decompress ahead of fd_offset; zero disables
+     read-ahead. */
+  size_t read_ahead_blocks;
+  /* Blocks queued for decompression, in file order. The first starts at
+     fd_offset unless we've been repositioned since they were queued. */
+  std::deque<std::shared_ptr<ReadAheadBlock> > read_ahead;
+  /* File offset of the first block not yet in 'read_ahead'. */
+  uint64_t read_ahead_offset;
+
+  /* Every block in file order. Built on the first seek_uncompressed(). */
+  std::vector<BlockIndexEntry> block_index;
 
   bool have_saved_state;
   bool have_saved_buffer;
   uint64_t saved_fd_offset;
   std::vector<uint8_t> saved_buffer;
   size_t saved_buffer_read_pos;
+  uint64_t saved_buffer_block_offset;
 };
 
 #endif /* RR_COMPRESSED_READER_H_ */
@@ -9,24 +9,151 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef RR_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef RR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "AsyncFileWriter.h"
+#include "util.h"
 
 using namespace std;
 
+// Compressed blocks buffered per compression thread: one being compressed
+// and one being written.
+static const int OUTPUT_BUFFERS_PER_THREAD = 2;
+
+// zstd's default level (3) compresses no better than zlib on our data;
+// substreams that ask for zstd want ratio, so trade some speed for it.
+static const int ZSTD_LEVEL = 9;
+static const int ZLIB_LEVEL = 6;
+// LZ4 level L compresses with acceleration 2^(LZ4_LEVEL - L). Its default
+// is already its best ratio.
+static const int LZ4_LEVEL = 4;
+
+// Consider raising the level after compressing this many blocks at the
+// current one.
+static const uint64_t RAISE_LEVEL_AFTER_BLOCKS = 8;
+
+static const char* const codec_names[CompressedWriter::CODEC_COUNT] = {
+  "store", "zlib", "lz4", "zstd"
+};
+
+bool CompressedWriter::codec_available(Codec codec) {
+  switch (codec) {
+    case CODEC_STORE:
+    case CODEC_ZLIB:
+      return true;
+    case CODEC_LZ4:
+#ifdef RR_HAVE_LZ4
+      return true;
+#else
+      return false;
+#endif
+    case CODEC_ZSTD:
+#ifdef RR_HAVE_ZSTD
+      return true;
+#else
+      return false;
+#endif
+    default:
+      return false;
+  }
+}
+
+const char* CompressedWriter::codec_name(Codec codec) {
+  if (codec < 0 || codec >= CODEC_COUNT) {
+    return "???";
+  }
+  return codec_names[codec];
+}
+
+bool CompressedWriter::parse_codec(const string& name, Codec* codec) {
+  for (int i = 0; i < CODEC_COUNT; ++i) {
+    if (name == codec_names[i]) {
+      *codec = (Codec)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+int CompressedWriter::min_level(Codec codec) {
+  switch (codec) {
+    case CODEC_ZLIB:
+    case CODEC_LZ4:
+    case CODEC_ZSTD:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+int CompressedWriter::default_level(Codec codec) {
+  switch (codec) {
+    case CODEC_ZLIB:
+      return ZLIB_LEVEL;
+    case CODEC_LZ4:
+      return LZ4_LEVEL;
+    case CODEC_ZSTD:
+      return ZSTD_LEVEL;
+    default:
+      return 0;
+  }
+}
+
+int CompressedWriter::max_level(Codec codec) {
+  switch (codec) {
+    case CODEC_ZLIB:
+      return 9;
+    case CODEC_LZ4:
+      return LZ4_LEVEL;
+    case CODEC_ZSTD:
+      // Higher zstd levels are too slow to ever keep up with a recording.
+      return MAX_LEVEL;
+    default:
+      return 0;
+  }
+}
+
+static size_t max_compressed_length(CompressedWriter::Codec codec,
+                                    size_t length) {
+  switch (codec) {
+    case CompressedWriter::CODEC_ZLIB:
+      return compressBound(length);
+#ifdef RR_HAVE_LZ4
+    case CompressedWriter::CODEC_LZ4:
+      return LZ4_compressBound(length);
+#endif
+#ifdef RR_HAVE_ZSTD
+    case CompressedWriter::CODEC_ZSTD:
+      return ZSTD_compressBound(length);
+#endif
+    default:
+      return length;
+  }
+}
+
 void* CompressedWriter::compression_thread_callback(void* p) {
   static_cast<CompressedWriter*>(p)->compression_thread();
   return nullptr;
 }
 
 CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
-                                   uint32_t num_threads)
+                                   uint32_t num_threads, Codec codec)
     : fd(filename.c_str(),
          O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0400) {
+  assert(codec_available(codec));
   this->block_size = block_size;
+  this->codec = codec;
   threads.resize(num_threads);
   thread_pos.resize(num_threads);
   buffer.resize(block_size * (num_threads + 2));
@@ -40,16 +167,43 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
   next_thread_end_pos = 0;
   closing = false;
   write_error = false;
+  next_block_offset = 0;
+  level = default_level(codec);
+  adaptive_level = true;
+  stalls_seen = 0;
+  level_start_time = monotonic_now_sec();
+  level_blocks = 0;
+  level_compress_time = 0;
+  memset(levels, 0, sizeof(levels));
 
   producer_reserved_pos = 0;
   producer_reserved_write_pos = 0;
   producer_reserved_upto_pos = 0;
+  producer_stalls = 0;
+  producer_stall_time = 0;
   error = false;
+  output_buffer_size = 0;
   if (fd < 0) {
     error = true;
     return;
   }
 
+  uint32_t num_output_buffers = num_threads * OUTPUT_BUFFERS_PER_THREAD;
+  output.reset(new AsyncFileWriter(fd, num_output_buffers));
+  output_buffer_size =
+      max(max_compressed_length(codec, block_size), (size_t)block_size) +
+      sizeof(BlockHeader);
+  for (uint32_t i = 0; i < num_output_buffers; ++i) {
+    void* p;
+    if (posix_memalign(&p, AsyncFileWriter::BUFFER_ALIGNMENT,
+                       output_buffer_size)) {
+      error = true;
+      return;
+    }
+    output_buffers.push_back(static_cast<uint8_t*>(p));
+    free_output_buffers.push_back(i);
+  }
+
   // Hold the lock so threads don't inspect the 'threads' array
   // until we've finished initializing it.
   pthread_mutex_lock(&mutex);
@@ -67,12 +221,30 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
 
 CompressedWriter::~CompressedWriter() {
   close();
+  for (uint8_t* p : output_buffers) {
+    free(p);
+  }
   pthread_mutex_destroy(&mutex);
   pthread_cond_destroy(&cond);
 }
 
 void CompressedWriter::write(const void* data, size_t size) {
-  while (!error && size > 0) {
+  while (size > 0) {
+    size_t amount = size;
+    uint8_t* p = reserve(&amount);
+    if (!p) {
+      return;
+    }
+    memcpy(p, data, amount);
+    commit(amount);
+    data = static_cast<const char*>(data) + amount;
+    size -= amount;
+  }
+}
+
+uint8_t* CompressedWriter::reserve(size_t* size) {
+  assert(*size > 0);
+  while (!error) {
     uint64_t reservation_size =
         producer_reserved_upto_pos - producer_reserved_write_pos;
     if (reservation_size == 0) {
@@ -80,13 +252,16 @@ void CompressedWriter::write(const void* data, size_t size) {
       continue;
     }
     size_t buf_offset = (size_t)(producer_reserved_write_pos % buffer.size());
-    size_t amount = min(buffer.size() - buf_offset,
-                        (size_t)min<uint64_t>(reservation_size, size));
-    memcpy(&buffer[buf_offset], data, amount);
-    producer_reserved_write_pos += amount;
-    data = static_cast<const char*>(data) + amount;
-    size -= amount;
+    *size = min(buffer.size() - buf_offset,
+                (size_t)min<uint64_t>(reservation_size, *size));
+    return &buffer[buf_offset];
   }
+  return nullptr;
+}
+
+void CompressedWriter::commit(size_t size) {
+  assert(producer_reserved_write_pos + size <= producer_reserved_upto_pos);
+  producer_reserved_write_pos += size;
 
   if (!error &&
       producer_reserved_write_pos - producer_reserved_pos >=
@@ -104,6 +279,7 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
   // Wake up threads that might be waiting to consume data.
   pthread_cond_broadcast(&cond);
 
+  double stall_start = 0;
   while (!error) {
     if (write_error) {
       error = true;
@@ -120,12 +296,86 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
       break;
     }
 
+    if (!stall_start) {
+      ++producer_stalls;
+      stall_start = monotonic_now_sec();
+    }
     pthread_cond_wait(&cond, &mutex);
   }
+  if (stall_start) {
+    producer_stall_time += monotonic_now_sec() - stall_start;
+  }
+
+  pthread_mutex_unlock(&mutex);
+}
 
+void CompressedWriter::set_adaptive_level(bool adaptive) {
+  pthread_mutex_lock(&mutex);
+  adaptive_level = adaptive;
+  if (!adaptive) {
+    level = default_level(codec);
+  }
   pthread_mutex_unlock(&mutex);
 }
 
+int CompressedWriter::choose_level() {
+  if (!adaptive_level) {
+    return level;
+  }
+  int new_level = level;
+  double now = monotonic_now_sec();
+  if (producer_stalls != stalls_seen) {
+    // The producer had to wait for us since the last block, so speed up.
+    // Leave an expensive level at once: a burst of data after a quiet
+    // spell shouldn't have to stall its way down one level at a time.
+    stalls_seen = producer_stalls;
+    new_level = level > default_level(codec)
+                    ? default_level(codec)
+                    : max(min_level(codec), level - 1);
+  } else if (level_blocks >= RAISE_LEVEL_AFTER_BLOCKS &&
+             level < max_level(codec) &&
+             level_compress_time * 2 <
+                 (now - level_start_time) * threads.size()) {
+    // The threads were busy less than half the time, so the producer
+    // isn't close to waiting for us; spend some of that time on ratio.
+    new_level = level + 1;
+  }
+  if (new_level != level) {
+    level = new_level;
+    level_start_time = now;
+    level_blocks = 0;
+    level_compress_time = 0;
+  }
+  return level;
+}
+
+void CompressedWriter::release_output_buffers(const vector<uint64_t>& indices) {
+  for (uint64_t i : indices) {
+    free_output_buffers.push_back(i);
+  }
+  if (output->failed()) {
+    write_error = true;
+  }
+}
+
+uint32_t CompressedWriter::acquire_output_buffer() {
+  vector<uint64_t> done;
+  // Recycle the buffers of finished writes even if we have a free one, so
+  // their completions don't pile up.
+  output->reap(&done, false);
+  release_output_buffers(done);
+  while (free_output_buffers.empty()) {
+    done.clear();
+    pthread_mutex_unlock(&mutex);
+    output->reap(&done, true);
+    pthread_mutex_lock(&mutex);
+    release_output_buffers(done);
+  }
+  uint32_t index = free_output_buffers.back();
+  free_output_buffers.pop_back();
+  return index;
+}
+
 void CompressedWriter::compression_thread() {
   pthread_mutex_lock(&mutex);
 
@@ -134,28 +384,46 @@ void CompressedWriter::compression_thread() {
   for (thread_index = 0; threads[thread_index] != self; ++thread_index) {
   }
 
-  // Add slop for incompressible data
-  vector<uint8_t> outputbuf;
-  outputbuf.resize((size_t)(block_size * 1.1) + sizeof(BlockHeader));
-  BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
+  // Holds a block's input when it wraps around the end of 'buffer'.
+  vector<uint8_t> scratch;
 
   while (true) {
     if (!write_error && next_thread_pos < next_thread_end_pos &&
         (closing || next_thread_pos + block_size <= next_thread_end_pos)) {
       thread_pos[thread_index] = next_thread_pos;
       next_thread_pos = min(next_thread_end_pos, next_thread_pos + block_size);
+      int block_level = choose_level();
       // header->uncompressed_length must be <= block_size,
       // therefore fits in a size_t.
-      header->uncompressed_length =
+      size_t uncompressed_length =
           (size_t)(next_thread_pos - thread_pos[thread_index]);
+      // Taking a buffer may wait for earlier writes. Our thread_pos is
+      // already set, so the producer won't overwrite our input meanwhile.
+      uint32_t buffer_index = acquire_output_buffer();
+      uint8_t* outputbuf = output_buffers[buffer_index];
+      BlockHeader* header = reinterpret_cast<BlockHeader*>(outputbuf);
+      header->uncompressed_length = uncompressed_length;
 
       pthread_mutex_unlock(&mutex);
-      header->compressed_length =
-          do_compress(thread_pos[thread_index], header->uncompressed_length,
-                      &outputbuf[sizeof(BlockHeader)],
-                      outputbuf.size() - sizeof(BlockHeader));
+      double compress_start = monotonic_now_sec();
+      size_t compressed_length;
+      header->codec = do_compress(
+          thread_pos[thread_index], header->uncompressed_length, block_level,
+          scratch, outputbuf + sizeof(BlockHeader),
+          output_buffer_size - sizeof(BlockHeader), &compressed_length);
+      header->compressed_length = compressed_length;
+      double compress_time = monotonic_now_sec() - compress_start;
       pthread_mutex_lock(&mutex);
 
+      LevelStats& stats = levels[block_level];
+      ++stats.blocks;
+      stats.uncompressed_bytes += uncompressed_length;
+      stats.compress_seconds += compress_time;
+      if (block_level == level) {
+        ++level_blocks;
+        level_compress_time += compress_time;
+      }
+
       if (header->compressed_length == 0) {
         write_error = true;
       }
@@ -174,18 +442,27 @@ void CompressedWriter::compression_thread() {
         pthread_cond_wait(&cond, &mutex);
       }
 
-      if (!write_error) {
-        pthread_mutex_unlock(&mutex);
-        ::write(fd, &outputbuf[0],
-                sizeof(BlockHeader) + header->compressed_length);
-        pthread_mutex_lock(&mutex);
+      if (write_error) {
+        free_output_buffers.push_back(buffer_index);
+        thread_pos[thread_index] = UINT64_MAX;
+        pthread_cond_broadcast(&cond);
+        continue;
       }
 
+      size_t block_length = sizeof(BlockHeader) + header->compressed_length;
+      uint64_t block_offset = next_block_offset;
+      block_offsets.push_back(block_offset);
+      next_block_offset += block_length;
+      // Our place in the file is settled, so let the next block claim its
+      // place and the producer reuse our input while our write proceeds.
       thread_pos[thread_index] = UINT64_MAX;
       // do a broadcast because we might need to unblock
       // the producer thread or a compressor thread waiting
-      // for us to write.
+      // for its turn.
       pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&mutex);
+      output->submit(outputbuf, block_length, block_offset, buffer_index);
+      pthread_mutex_lock(&mutex);
       continue;
     }
 
@@ -215,47 +492,124 @@ void CompressedWriter::close() {
     pthread_join(*i, nullptr);
   }
 
+  if (output) {
+    output->drain();
+    if (output->failed()) {
+      error = true;
+    }
+    output.reset();
+  }
   fd.close();
 }
 
-size_t CompressedWriter::do_compress(uint64_t offset, size_t length,
-                                     uint8_t* outputbuf, size_t outputbuf_len) {
-  z_stream stream;
-  memset(&stream, 0, sizeof(stream));
-  int result = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+void CompressedWriter::block_position(uint64_t position,
+                                      uint64_t* block_offset,
+                                      uint64_t* intra_block_offset) const {
+  assert(fd < 0 && "Call block_position() only after close()");
+  size_t block = position / block_size;
+  if (block < block_offsets.size()) {
+    *block_offset = block_offsets[block];
+    *intra_block_offset = position % block_size;
+  } else {
+    // At the end of the stream.
+    *block_offset = next_block_offset;
+    *intra_block_offset = 0;
+  }
+}
+
+static size_t zlib_compress(const uint8_t* input, size_t length, int level,
+                            uint8_t* outputbuf, size_t outputbuf_len) {
+  uLongf out_len = outputbuf_len;
+  int result = compress2(outputbuf, &out_len, input, length, level);
   if (result != Z_OK) {
-    assert(0 && "deflateInit failed!");
+    assert(0 && "compress2 failed!");
     return 0;
   }
+  return out_len;
+}
 
-  stream.next_out = outputbuf;
-  stream.avail_out = outputbuf_len;
-
-  while (length > 0 || stream.avail_in > 0) {
-    if (stream.avail_in == 0) {
-      size_t buf_offset = (size_t)(offset % buffer.size());
-      size_t amount = min(length, buffer.size() - buf_offset);
-      stream.next_in = &buffer[buf_offset];
-      stream.avail_in = amount;
-      length -= amount;
-      offset += amount;
-    }
-    if (stream.avail_out == 0) {
-      assert(0 && "outputbuf exhausted!");
-      return 0;
-    }
-    result = deflate(&stream, length == 0 ? Z_FINISH : Z_NO_FLUSH);
-    if (result != (length == 0 ? Z_STREAM_END : Z_OK)) {
-      assert(0 && "deflate failed!");
-      return 0;
-    }
+#ifdef RR_HAVE_LZ4
+static size_t lz4_compress(const uint8_t* input, size_t length, int level,
+                           uint8_t* outputbuf, size_t outputbuf_len) {
+  int result = LZ4_compress_fast(reinterpret_cast<const char*>(input),
+                                 reinterpret_cast<char*>(outputbuf), length,
+                                 outputbuf_len, 1 << (LZ4_LEVEL - level));
+  if (result <= 0) {
+    assert(0 && "LZ4_compress_fast failed!");
+    return 0;
   }
-
-  result = deflateEnd(&stream);
-  if (result != Z_OK) {
-    assert(0 && "deflateEnd failed!");
+  return result;
+}
+#endif
+
+#ifdef RR_HAVE_ZSTD
+static size_t zstd_compress(const uint8_t* input, size_t length, int level,
+                            uint8_t* outputbuf, size_t outputbuf_len) {
+  size_t result = ZSTD_compress(outputbuf, outputbuf_len, input, length, level);
+  if (ZSTD_isError(result)) {
+    assert(0 && "ZSTD_compress failed!");
     return 0;
   }
+  return result;
+}
+#endif
+
+/**
+ * Compress the block at 'offset' in the output stream into 'outputbuf' at
+ * 'level'.
+ * Returns the codec actually used and sets *compressed_length; a
+ * *compressed_length of zero indicates failure.
+ */
+CompressedWriter::Codec CompressedWriter::do_compress(
+    uint64_t offset, size_t length, int level, vector<uint8_t>& scratch,
+    uint8_t* outputbuf, size_t outputbuf_len, size_t* compressed_length) {
+  // Codecs need contiguous input, so copy out blocks that wrap around the
+  // end of the ring buffer. Full blocks never wrap, so this is rare.
+  const uint8_t* input;
+  size_t buf_offset = (size_t)(offset % buffer.size());
+  if (buf_offset + length <= buffer.size()) {
+    input = &buffer[buf_offset];
+  } else {
+    size_t first = buffer.size() - buf_offset;
+    scratch.resize(length);
+    memcpy(scratch.data(), &buffer[buf_offset], first);
+    memcpy(scratch.data() + first, &buffer[0], length - first);
+    input = scratch.data();
+  }
 
-  return stream.total_out;
+  size_t result = 0;
+  switch (codec) {
+    case CODEC_STORE:
+      break;
+    case CODEC_ZLIB:
+      result = zlib_compress(input, length, level, outputbuf, outputbuf_len);
+      break;
+#ifdef RR_HAVE_LZ4
+    case CODEC_LZ4:
+      result = lz4_compress(input, length, level, outputbuf, outputbuf_len);
+      break;
+#endif
+#ifdef RR_HAVE_ZSTD
+    case CODEC_ZSTD:
+      result = zstd_compress(input, length, level, outputbuf, outputbuf_len);
+      break;
+#endif
+    default:
+      assert(0 && "Unsupported codec");
+      break;
+  }
+
+  if (result > 0 && result < length) {
+    *compressed_length = result;
+    return codec;
+  }
+  // Compression didn't help (or we're not compressing); store the block.
+  if (length > outputbuf_len) {
+    assert(0 && "outputbuf exhausted!");
+    *compressed_length = 0;
+    return codec;
+  }
+  memcpy(outputbuf, input, length);
+  *compressed_length = length;
+  return CODEC_STORE;
 }
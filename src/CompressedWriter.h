@@ -12,12 +12,15 @@
 
 #include "ScopedFd.h"
 
+class AsyncFileWriter;
+
 /**
  * CompressedWriter opens an output file and writes compressed blocks to it.
  * Blocks of a fixed but unspecified size (currently 1MB) are compressed.
- * Each block of compressed data is written to the file preceded by two
- * 32-bit words: the size of the compressed data (excluding block header)
- * and the size of the uncompressed data, in that order. See BlockHeader below.
+ * Each block of compressed data is written to the file preceded by three
+ * 32-bit words: the size of the compressed data (excluding block header),
+ * the size of the uncompressed data and the codec used to compress the block,
+ * in that order. See BlockHeader below.
  *
  * We use multiple threads to perform compression. The threads are
  * responsible for the actual data writes. The thread that creates the
@@ -25,23 +28,129 @@
  * 'write'. The producer thread may block in 'write' if 'buffer_size' bytes are
  * being compressed.
  *
- * Each data block is compressed independently using zlib.
+ * Blocks are assigned file offsets in stream order, but a compression thread
+ * doesn't wait for earlier blocks to reach the disk before handing its own
+ * to the AsyncFileWriter, so writes complete out of order (and with io_uring,
+ * without blocking the thread at all).
+ *
+ * Each data block is compressed independently. The codec is chosen per
+ * writer; a block that doesn't shrink is stored uncompressed instead.
+ *
+ * The compression level adapts to the producer: when it has to wait for the
+ * compression threads we drop to faster levels, and when the threads have
+ * time to spare we climb to higher-ratio ones. See choose_level().
  */
 class CompressedWriter {
 public:
+  /**
+   * How the payload of a block is encoded. Stored in every BlockHeader, so
+   * a reader needs no out-of-band information to decode a block.
+   * Update codec_name() when you update this list, and never renumber
+   * existing entries: they're part of the trace format.
+   */
+  enum Codec {
+    // Payload stored verbatim.
+    CODEC_STORE = 0,
+    CODEC_ZLIB = 1,
+    // Fast, moderate-ratio compression. Requires rr to be built with liblz4.
+    CODEC_LZ4 = 2,
+    // Slower, high-ratio compression. Requires rr to be built with libzstd.
+    CODEC_ZSTD = 3,
+    CODEC_COUNT
+  };
+  static bool codec_available(Codec codec);
+  static const char* codec_name(Codec codec);
+  /**
+   * Parse a codec name as printed by codec_name(). Returns false if |name|
+   * isn't a known codec.
+   */
+  static bool parse_codec(const std::string& name, Codec* codec);
+  /**
+   * Range of compression levels for a codec; higher levels compress better
+   * and more slowly. CODEC_STORE only has level 0.
+   */
+  static int min_level(Codec codec);
+  static int default_level(Codec codec);
+  static int max_level(Codec codec);
+  static const int MAX_LEVEL = 15;
+
   CompressedWriter(const std::string& filename, size_t buffer_size,
-                   uint32_t num_threads);
+                   uint32_t num_threads, Codec codec = CODEC_ZLIB);
   ~CompressedWriter();
   // Call only on producer thread
   bool good() const { return !error; }
   // Call only on producer thread.
   void write(const void* data, size_t size);
+  /**
+   * Reserve contiguous space in the buffer so the caller can produce data
+   * in place instead of handing write() a copy. On entry *size is the
+   * number of bytes wanted; on return it's the number of bytes available
+   * at the returned pointer, which is at least one but may be fewer than
+   * requested (the buffer wraps around). Returns null on error.
+   * Call commit() with the number of bytes actually produced before any
+   * other call on this writer; uncommitted bytes are discarded.
+   * Call only on producer thread.
+   */
+  uint8_t* reserve(size_t* size);
+  // Call only on producer thread.
+  void commit(size_t size);
   // Call only on producer thread
   void close();
+  // Call only on producer thread
+  bool is_open() const { return fd >= 0; }
+
+  /**
+   * Number of uncompressed bytes written so far. Call only on producer
+   * thread.
+   */
+  uint64_t position() const { return producer_reserved_write_pos; }
+  /**
+   * Number of times the producer had to wait for compression threads to
+   * free buffer space, and the total time it spent waiting. Nonzero values
+   * mean compression or the disk can't keep up. Call only on producer
+   * thread.
+   */
+  uint64_t producer_stall_count() const { return producer_stalls; }
+  double producer_stall_seconds() const { return producer_stall_time; }
+  /**
+   * Whether to adapt the compression level to the producer (the default).
+   * Otherwise every block is compressed at default_level(). Call only on
+   * producer thread.
+   */
+  void set_adaptive_level(bool adaptive);
+
+  struct LevelStats {
+    uint64_t blocks;
+    uint64_t uncompressed_bytes;
+    double compress_seconds;
+  };
+  /**
+   * What the compression threads did at each level, indexed by level.
+   * Call only after close().
+   */
+  const LevelStats* level_stats() const { return levels; }
+  /**
+   * Translate an uncompressed stream position into the file offset of the
+   * header of the block containing it and the offset within that block's
+   * uncompressed data. Every block but the last holds exactly
+   * 'block_size' bytes, which makes this a lookup. Call only after close().
+   */
+  void block_position(uint64_t position, uint64_t* block_offset,
+                      uint64_t* intra_block_offset) const;
 
   struct BlockHeader {
     uint32_t compressed_length;
     uint32_t uncompressed_length;
+    // A Codec.
+    uint32_t codec;
+  };
+  /**
+   * Block header written by rr versions that only supported zlib (trace
+   * versions before 42). Such blocks are always CODEC_ZLIB.
+   */
+  struct LegacyBlockHeader {
+    uint32_t compressed_length;
+    uint32_t uncompressed_length;
   };
 
   template <typename T> CompressedWriter& operator<<(const T& value) {
@@ -69,16 +178,32 @@ protected:
 
   static void* compression_thread_callback(void* p);
   void compression_thread();
-  size_t do_compress(uint64_t offset, size_t length, uint8_t* outputbuf,
-                     size_t outputbuf_len);
+  Codec do_compress(uint64_t offset, size_t length, int level,
+                    std::vector<uint8_t>& scratch, uint8_t* outputbuf,
+                    size_t outputbuf_len, size_t* compressed_length);
+  /** Pick the level for the next block. Call with 'mutex' held. */
+  int choose_level();
+  /** Call with 'mutex' held. May release it temporarily. */
+  uint32_t acquire_output_buffer();
+  void release_output_buffers(const std::vector<uint64_t>& indices);
 
   // Immutable while threads are running
   ScopedFd fd;
   int block_size;
+  Codec codec;
   pthread_mutex_t mutex;
   pthread_cond_t cond;
   std::vector<pthread_t> threads;
 
+  std::unique_ptr<AsyncFileWriter> output;
+  /* AsyncFileWriter::BUFFER_ALIGNMENT-aligned buffers for compressed
+   * blocks, each big enough for a block header plus a block compressed with
+   * 'codec'. There are
+   * more buffers than threads so threads can carry on compressing while
+   * their previous blocks are being written. */
+  std::vector<uint8_t*> output_buffers;
+  size_t output_buffer_size;
+
   // Carefully shared...
   std::vector<uint8_t> buffer;
 
@@ -92,6 +217,25 @@ protected:
   uint64_t next_thread_end_pos;
   bool closing;
   bool write_error;
+  /* file offset of each block written so far, in stream order */
+  std::vector<uint64_t> block_offsets;
+  /* file offset at which the next block will be written */
+  uint64_t next_block_offset;
+  /* indices into 'output_buffers' of buffers not in use */
+  std::vector<uint32_t> free_output_buffers;
+  /* level at which to compress the next block */
+  int level;
+  bool adaptive_level;
+  /* value of 'producer_stalls' when we last lowered the level */
+  uint64_t stalls_seen;
+  /* when 'level' last changed, and the number of blocks compressed and
+   * time spent compressing them since */
+  double level_start_time;
+  uint64_t level_blocks;
+  double level_compress_time;
+  LevelStats levels[MAX_LEVEL + 1];
+  /* written by the producer, read by compression threads */
+  uint64_t producer_stalls;
   // END protected by 'mutex'
 
   /* producer thread only */
@@ -99,6 +243,7 @@ protected:
   uint64_t producer_reserved_pos;
   uint64_t producer_reserved_write_pos;
   uint64_t producer_reserved_upto_pos;
+  double producer_stall_time;
   bool error;
 };
 
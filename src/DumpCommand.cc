@@ -145,6 +145,11 @@ static void dump_events_matching(TraceReader& trace, const DumpFlags& flags,
     start = end = atoi(spec->c_str());
   }
 
+  // Jump over the events before |start| rather than decoding them all.
+  if (start > trace.time() + 1 && !trace.seek_to_time(start)) {
+    return;
+  }
+
   bool process_raw_data =
       flags.dump_syscallbuf || flags.dump_recorded_data_metadata;
   while (!trace.at_end()) {
@@ -222,6 +227,33 @@ static void dump_statistics(const TraceReader& trace, FILE* out) {
   fprintf(out, "// Uncompressed bytes %" PRIu64 ", compressed bytes %" PRIu64
                ", ratio %.2fx\n",
           uncompressed, compressed, double(uncompressed) / compressed);
+  fprintf(out, "// Raw data bytes saved by deduplication %" PRIu64 "\n",
+          trace.deduplicated_bytes());
+
+  TraceReader::CompressionStats stats[TraceReader::SUBSTREAM_COUNT];
+  if (!trace.read_compression_stats(stats)) {
+    return;
+  }
+  for (int s = TraceReader::SUBSTREAM_FIRST; s < TraceReader::SUBSTREAM_COUNT;
+       ++s) {
+    const TraceReader::CompressionStats& st = stats[s];
+    fprintf(out, "// %s: %s, recorder stalled %" PRIu64 " times for %.3fs\n",
+            TraceReader::substream_name((TraceReader::Substream)s),
+            CompressedWriter::codec_name((CompressedWriter::Codec)st.codec),
+            st.producer_stalls, st.producer_stall_seconds);
+    for (int i = 0; i <= CompressedWriter::MAX_LEVEL; ++i) {
+      const CompressedWriter::LevelStats& level = st.levels[i];
+      if (!level.blocks) {
+        continue;
+      }
+      fprintf(out, "//   level %d: %" PRIu64 " blocks, %" PRIu64
+                   " bytes, %.1f MB/s\n",
+              i, level.blocks, level.uncompressed_bytes,
+              level.compress_seconds > 0
+                  ? level.uncompressed_bytes / level.compress_seconds / 1e6
+                  : 0.0);
+    }
+  }
 }
 
 static void dump(const string& trace_dir, const DumpFlags& flags,
@@ -183,6 +183,14 @@ EmuFile::shr_ptr EmuFs::get_or_create(const KernelMapping& recorded_km,
   return vf;
 }
 
+vector<EmuFile::shr_ptr> EmuFs::all_files() const {
+  vector<EmuFile::shr_ptr> result;
+  for (auto& kv : files) {
+    result.push_back(kv.second);
+  }
+  return result;
+}
+
 void EmuFs::log() const {
   LOG(error) << "EmuFs " << this << " with " << files.size() << " files:";
   for (auto& kv : files) {
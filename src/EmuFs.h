@@ -82,6 +82,7 @@ public:
 
   dev_t device() const { return device_; }
   ino_t inode() const { return inode_; }
+  uint64_t size() const { return size_; }
 
 private:
   friend class EmuFs;
@@ -163,6 +164,9 @@ public:
 
   size_t size() const { return files.size(); }
 
+  /** Return all the files of this emufs. */
+  std::vector<EmuFile::shr_ptr> all_files() const;
+
   /** Create and return a new emufs. */
   static shr_ptr create();
 
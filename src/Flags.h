@@ -21,6 +21,9 @@ struct Flags {
    * event time at which to start checksumming.
    */
   int checksum;
+  /* Only recompute checksums for pages that have been written since the
+   * last checksum point, and store per-page checksums. */
+  bool incremental_checksums;
 
   enum { DUMP_ON_ALL = 10000, DUMP_ON_NONE = -DUMP_ON_ALL };
   /* event(s) to create memory dumps for */
@@ -53,19 +56,30 @@ struct Flags {
   // Any warning or error that would be printed is treated as fatal
   bool fatal_errors_and_warnings;
 
+  // Number of trace blocks per substream to decompress in the background
+  // ahead of the reader. Zero means decompress synchronously in read().
+  size_t read_ahead_blocks;
+
+  // Bytes of memory that reverse-execution checkpoints may pin during
+  // replay. Zero means a quarter of physical memory.
+  uint64_t checkpoint_memory_budget;
+
   // User override for architecture detection, e.g. when running
   // under valgrind.
   std::string forced_uarch;
 
   Flags()
       : checksum(CHECKSUM_NONE),
+        incremental_checksums(false),
         dump_on(DUMP_ON_NONE),
         dump_at(DUMP_AT_NONE),
         verbose(false),
         force_things(false),
         mark_stdio(false),
         check_cached_mmaps(false),
-        suppress_environment_warnings(false) {}
+        suppress_environment_warnings(false),
+        read_ahead_blocks(0),
+        checkpoint_memory_budget(0) {}
 
   static const Flags& get() { return singleton; }
 
@@ -21,6 +21,15 @@ static SimpleGdbCommand when_tid("when-tid", [](GdbServer&, Task* t,
   return string("Current tid: ") + to_string(t->tid);
 });
 
+static SimpleGdbCommand info_loop_fast_forward(
+    "info loop-fast-forward",
+    [](GdbServer&, Task* t, const vector<string>&) {
+      Session::Statistics stats = t->session().statistics();
+      return to_string(stats.loop_iterations_fast_forwarded) +
+             " loop iterations fast-forwarded, " +
+             to_string(stats.singlesteps_avoided) + " singlesteps avoided.";
+    });
+
 static int gNextCheckpointId = 0;
 
 string invoke_checkpoint(GdbServer& gdb_server, Task*,
@@ -71,6 +80,27 @@ string invoke_info_checkpoints(GdbServer& gdb_server, Task*,
 static SimpleGdbCommand info_checkpoints("info checkpoints",
                                          invoke_info_checkpoints);
 
+string invoke_info_checkpoint_memory(GdbServer& gdb_server, Task*,
+                                     const vector<string>&) {
+  auto costs = gdb_server.timeline.reverse_exec_checkpoint_costs();
+  uint64_t total = 0;
+  string out = "When\tPrivate dirty KB";
+  for (auto& c : costs) {
+    out += string("\n") + to_string(c.mark.time()) + "\t" +
+           to_string(c.bytes / 1024);
+    total += c.bytes;
+  }
+  return out + "\n" + to_string(costs.size()) +
+         " reverse-exec checkpoints use " + to_string(total / 1024) +
+         " KB of a " +
+         to_string(gdb_server.timeline.checkpoint_memory_budget() / 1024) +
+         " KB budget; " +
+         to_string(gdb_server.timeline.checkpoints_discarded_over_budget()) +
+         " discarded to stay within it.";
+}
+static SimpleGdbCommand info_checkpoint_memory("info checkpoint-memory",
+                                               invoke_info_checkpoint_memory);
+
 /*static*/ void GdbCommand::init_auto_args() {
   checkpoint.add_auto_arg("rr-where");
 }
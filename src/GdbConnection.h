@@ -486,6 +486,12 @@ public:
    */
   bool sniff_packet();
 
+  /**
+   * Return true if we're waiting for the debugger: it hasn't asked us to
+   * do anything we haven't done, and hasn't sent anything new.
+   */
+  bool is_idle() { return req.type == DREQ_NONE && !sniff_packet(); }
+
   const Features& features() { return features_; }
 
 private:
@@ -737,6 +737,11 @@ GdbRequest GdbServer::divert(ReplaySession& replay) {
  */
 GdbRequest GdbServer::process_debugger_requests(ReportState state) {
   while (true) {
+    // Use the time the user spends at the debugger prompt to prepare for
+    // reverse execution, stopping as soon as the debugger sends something.
+    while (timeline.is_running() && dbg->is_idle() &&
+           timeline.prewarm_reverse_exec_checkpoints()) {
+    }
     GdbRequest req = dbg->get_request();
     req.suppress_debugger_stop = false;
     try_lazy_reverse_singlesteps(req);
@@ -22,6 +22,8 @@ class GdbServer {
                                               const std::vector<std::string>&);
   friend std::string invoke_info_checkpoints(GdbServer&, Task*,
                                              const std::vector<std::string>&);
+  friend std::string invoke_info_checkpoint_memory(
+      GdbServer&, Task*, const std::vector<std::string>&);
 
 public:
   struct Target {
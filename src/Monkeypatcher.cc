@@ -10,6 +10,8 @@
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
 #include "log.h"
+#include "PatchSiteCache.h"
+#include "RecordSession.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
 #include "task.h"
@@ -119,7 +121,8 @@ void Monkeypatcher::init_dynamic_syscall_patching(
 
 template <typename Arch>
 static bool patch_syscall_with_hook_arch(Monkeypatcher& patcher, Task* t,
-                                         const syscall_patch_hook& hook);
+                                         const syscall_patch_hook& hook,
+                                         remote_ptr<uint8_t> jump_patch_start);
 
 remote_ptr<uint8_t> Monkeypatcher::allocate_stub(Task* t, size_t bytes) {
   if (!stub_buffer) {
@@ -282,12 +285,14 @@ static remote_ptr<uint8_t> allocate_extended_jump(
  * too for consistency.
  *
  * trampoline_call_end is the offset within the StubPatch where the call to
- * the trampoline ends.
+ * the trampoline ends. jump_patch_start is the address of the syscall
+ * instruction being patched.
  */
 template <typename JumpPatch, typename ExtendedJumpPatch, typename StubPatch,
           uint32_t trampoline_call_end>
-static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher, Task* t,
-                                           const syscall_patch_hook& hook) {
+static bool patch_syscall_with_hook_x86ish(
+    Monkeypatcher& patcher, Task* t, const syscall_patch_hook& hook,
+    remote_ptr<uint8_t> jump_patch_start) {
   uint8_t stub_patch[StubPatch::size];
   auto stub_patch_start = patcher.allocate_stub(t, sizeof(stub_patch));
   if (!stub_patch_start) {
@@ -300,7 +305,6 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher, Task* t,
   uint8_t jump_patch[JumpPatch::size];
   // We're patching in a relative jump, so we need to compute the offset from
   // the end of the jump to our actual destination.
-  auto jump_patch_start = t->regs().ip().to_data_ptr<uint8_t>();
   auto jump_patch_end = jump_patch_start + sizeof(jump_patch);
 
   remote_ptr<uint8_t> extended_jump_start =
@@ -341,26 +345,32 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher, Task* t,
 }
 
 template <>
-bool patch_syscall_with_hook_arch<X86Arch>(Monkeypatcher& patcher, Task* t,
-                                           const syscall_patch_hook& hook) {
-  return patch_syscall_with_hook_x86ish<X86SysenterVsyscallSyscallHook,
-                                        X86SyscallStubExtendedJump,
-                                        X86SyscallStubMonkeypatch, 30>(patcher,
-                                                                       t, hook);
+bool patch_syscall_with_hook_arch<X86Arch>(
+    Monkeypatcher& patcher, Task* t, const syscall_patch_hook& hook,
+    remote_ptr<uint8_t> jump_patch_start) {
+  return patch_syscall_with_hook_x86ish<
+      X86SysenterVsyscallSyscallHook, X86SyscallStubExtendedJump,
+      X86SyscallStubMonkeypatch, 30>(patcher, t, hook, jump_patch_start);
 }
 
 template <>
-bool patch_syscall_with_hook_arch<X64Arch>(Monkeypatcher& patcher, Task* t,
-                                           const syscall_patch_hook& hook) {
-  return patch_syscall_with_hook_x86ish<X64JumpMonkeypatch,
-                                        X64SyscallStubExtendedJump,
-                                        X64SyscallStubMonkeypatch, 43>(patcher,
-                                                                       t, hook);
+bool patch_syscall_with_hook_arch<X64Arch>(
+    Monkeypatcher& patcher, Task* t, const syscall_patch_hook& hook,
+    remote_ptr<uint8_t> jump_patch_start) {
+  return patch_syscall_with_hook_x86ish<
+      X64JumpMonkeypatch, X64SyscallStubExtendedJump,
+      X64SyscallStubMonkeypatch, 43>(patcher, t, hook, jump_patch_start);
 }
 
+/**
+ * Patch the syscall instruction at |jump_patch_start|, which must be
+ * followed by the instruction |hook| matches.
+ */
 static bool patch_syscall_with_hook(Monkeypatcher& patcher, Task* t,
-                                    const syscall_patch_hook& hook) {
-  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), patcher, t, hook);
+                                    const syscall_patch_hook& hook,
+                                    remote_ptr<uint8_t> jump_patch_start) {
+  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), patcher, t, hook,
+                   jump_patch_start);
 }
 
 bool Monkeypatcher::try_patch_syscall(Task* t) {
@@ -401,7 +411,10 @@ bool Monkeypatcher::try_patch_syscall(Task* t) {
       // Get out of executing the current syscall before we patch it.
       t->exit_syscall_and_prepare_restart();
 
-      patch_syscall_with_hook(*this, t, hook);
+      remote_ptr<uint8_t> site = t->regs().ip().to_data_ptr<uint8_t>();
+      if (patch_syscall_with_hook(*this, t, hook, site)) {
+        note_patched_site(t, site);
+      }
 
       LOG(debug) << "Patched syscall at " << r.ip() << " syscall "
                  << syscall_name(syscallno, t->arch()) << " tid " << t->tid
@@ -455,6 +468,12 @@ public:
   SymbolTable read_symbols_arch(const char* symtab, const char* strtab);
   SymbolTable read_symbols(SupportedArch arch, const char* symtab,
                            const char* strtab);
+  template <typename Arch> string read_build_id_arch();
+  /**
+   * Return the contents of the file's NT_GNU_BUILD_ID note as a hex string,
+   * or the empty string if there isn't one.
+   */
+  string read_build_id(SupportedArch arch);
 };
 
 template <typename Arch>
@@ -560,6 +579,64 @@ SymbolTable ElfReader::read_symbols(SupportedArch arch, const char* symtab,
   RR_ARCH_FUNCTION(read_symbols_arch, arch, symtab, strtab);
 }
 
+template <typename Arch> string ElfReader::read_build_id_arch() {
+  typename Arch::ElfEhdr elfheader;
+  if (!read(0, elfheader) || memcmp(&elfheader, ELFMAG, SELFMAG) != 0 ||
+      elfheader.e_ident[EI_CLASS] != Arch::elfclass ||
+      elfheader.e_ident[EI_DATA] != Arch::elfendian ||
+      elfheader.e_machine != Arch::elfmachine ||
+      elfheader.e_shentsize != sizeof(typename Arch::ElfShdr)) {
+    LOG(debug) << "Invalid ELF file: invalid header";
+    return string();
+  }
+
+  auto sections =
+      read<typename Arch::ElfShdr>(elfheader.e_shoff, elfheader.e_shnum);
+  for (auto& s : sections) {
+    // Notes are tiny; anything big is bogus.
+    if (s.sh_type != SHT_NOTE || s.sh_size > 65536) {
+      continue;
+    }
+    auto notes = read<uint8_t>(s.sh_offset, s.sh_size);
+    // Elf32_Nhdr and Elf64_Nhdr are the same. Most notes are 4-byte
+    // aligned, but some sections use 8-byte alignment.
+    size_t align = s.sh_addralign == 8 ? 8 : 4;
+    size_t pos = 0;
+    while (pos + sizeof(Elf32_Nhdr) <= notes.size()) {
+      Elf32_Nhdr nhdr;
+      memcpy(&nhdr, notes.data() + pos, sizeof(nhdr));
+      if (nhdr.n_namesz > notes.size() || nhdr.n_descsz > notes.size()) {
+        break;
+      }
+      size_t name_pos = pos + sizeof(nhdr);
+      size_t desc_pos = name_pos + ((nhdr.n_namesz + align - 1) & ~(align - 1));
+      size_t next = desc_pos + ((nhdr.n_descsz + align - 1) & ~(align - 1));
+      if (desc_pos + nhdr.n_descsz > notes.size()) {
+        break;
+      }
+      if (nhdr.n_type == NT_GNU_BUILD_ID &&
+          nhdr.n_namesz == sizeof(ELF_NOTE_GNU) &&
+          memcmp(notes.data() + name_pos, ELF_NOTE_GNU,
+                 sizeof(ELF_NOTE_GNU)) == 0 &&
+          nhdr.n_descsz > 0) {
+        string result;
+        for (size_t i = 0; i < nhdr.n_descsz; ++i) {
+          char buf[3];
+          sprintf(buf, "%02x", notes[desc_pos + i]);
+          result += buf;
+        }
+        return result;
+      }
+      pos = next;
+    }
+  }
+  return string();
+}
+
+string ElfReader::read_build_id(SupportedArch arch) {
+  RR_ARCH_FUNCTION(read_build_id_arch, arch);
+}
+
 class VdsoReader : public ElfReader {
 public:
   VdsoReader(Task* t) : t(t) {}
@@ -826,6 +903,19 @@ void Monkeypatcher::patch_after_exec(Task* t) {
   RR_ARCH_FUNCTION(patch_after_exec_arch, t->arch(), t, *this);
 }
 
+static bool use_patch_site_cache(Task* t) {
+  return t->session().as_record()->use_patch_site_cache();
+}
+
+/**
+ * Return true if |km| is an executable mapping of a regular file, whose
+ * syscall sites PatchSiteCache can describe.
+ */
+static bool is_cacheable_mapping(const KernelMapping& km) {
+  return (km.prot() & PROT_EXEC) && km.is_real_device() &&
+         !km.fsname().empty() && km.fsname()[0] == '/';
+}
+
 void Monkeypatcher::patch_at_preload_init(Task* t) {
   ASSERT(t, 1 == t->vm()->task_set().size())
       << "TODO: monkeypatch multithreaded process";
@@ -834,6 +924,23 @@ void Monkeypatcher::patch_at_preload_init(Task* t) {
   // we're processing the rrcall, because it's masked off all
   // signals.
   RR_ARCH_FUNCTION(patch_at_preload_init_arch, t->arch(), t, *this);
+
+  if (syscall_hooks.empty() || !use_patch_site_cache(t)) {
+    return;
+  }
+  // The executable, the dynamic loader and the libraries it loaded before
+  // us were mapped before we could patch anything. The only thread is in
+  // this rrcall, so it's not in the middle of any of their syscalls.
+  // Patching can add mappings, so collect the candidates first.
+  vector<KernelMapping> mappings;
+  for (auto m : t->vm()->maps()) {
+    if (is_cacheable_mapping(m.map)) {
+      mappings.push_back(m.map);
+    }
+  }
+  for (auto& km : mappings) {
+    patch_cached_sites(t, km, nullptr);
+  }
 }
 
 class FileReader : public ElfReader {
@@ -896,4 +1003,104 @@ void Monkeypatcher::patch_after_mmap(Task* t, remote_ptr<void> start,
       }
     }
   }
+
+  // Before the preload library is initialized we can't patch anything;
+  // patch_at_preload_init catches up on what was mapped until then.
+  if (!syscall_hooks.empty() && use_patch_site_cache(t) &&
+      is_cacheable_mapping(map.map)) {
+    // Only look at what was just mapped: no thread can be in the middle of
+    // a syscall there. Copy the mapping, since patching can add mappings.
+    remote_ptr<void> end = min(start + ceil_page_size(size), map.map.end());
+    KernelMapping km = map.map.subrange(start, end);
+    ScopedFd open_fd = t->open_fd(child_fd, O_RDONLY);
+    patch_cached_sites(t, km, &open_fd);
+  }
+}
+
+/**
+ * Return the build-id of the file mapped by |km|, or the empty string if it
+ * has none or we can't read it. |fd|, if it's open, refers to the file;
+ * otherwise we open it by name.
+ */
+static string build_id_of_mapping(Task* t, const KernelMapping& km,
+                                  ScopedFd* fd) {
+  PatchSiteCache& cache = PatchSiteCache::get();
+  string build_id;
+  if (cache.cached_build_id(km.device(), km.inode(), &build_id)) {
+    return build_id;
+  }
+  ScopedFd opened;
+  if (!fd || !fd->is_open()) {
+    opened = ScopedFd(km.fsname().c_str(), O_RDONLY);
+    struct stat st;
+    // Make sure the file at that path is still the one that's mapped.
+    if (!opened.is_open() || fstat(opened, &st) || st.st_ino != km.inode()) {
+      return string();
+    }
+    fd = &opened;
+  }
+  build_id = FileReader(*fd).read_build_id(t->arch());
+  cache.set_build_id(km.device(), km.inode(), build_id);
+  return build_id;
+}
+
+void Monkeypatcher::patch_cached_sites(Task* t, const KernelMapping& km,
+                                       ScopedFd* fd) {
+  string build_id = build_id_of_mapping(t, km, fd);
+  if (build_id.empty()) {
+    return;
+  }
+  const set<uint64_t>& sites = PatchSiteCache::get().sites(build_id, t->arch());
+  vector<uint8_t> syscall_insn = syscall_instruction(t->arch());
+  syscall_patch_hook dummy;
+  uint8_t code[syscall_instruction_length(x86_64) +
+               sizeof(dummy.next_instruction_bytes)];
+  assert(syscall_insn.size() == (size_t)syscall_instruction_length(x86_64));
+
+  uint64_t map_offset = km.file_offset_bytes();
+  for (auto it = sites.lower_bound(map_offset);
+       it != sites.end() && *it < map_offset + km.size(); ++it) {
+    remote_ptr<uint8_t> addr = km.start().cast<uint8_t>() + (*it - map_offset);
+    remote_code_ptr after_syscall = (addr + syscall_insn.size()).as_int();
+    if (tried_to_patch_syscall_addresses.count(after_syscall)) {
+      continue;
+    }
+    // The cache is only a hint. Make sure the site still holds a syscall
+    // followed by an instruction we have a hook for.
+    bool ok = true;
+    t->read_bytes_helper(addr, sizeof(code), code, &ok);
+    if (!ok || memcmp(code, syscall_insn.data(), syscall_insn.size()) != 0) {
+      LOG(debug) << "Cached patch site " << addr << " isn't a syscall";
+      continue;
+    }
+    for (auto& hook : syscall_hooks) {
+      if (memcmp(code + syscall_insn.size(), hook.next_instruction_bytes,
+                 hook.next_instruction_length) == 0) {
+        tried_to_patch_syscall_addresses.insert(after_syscall);
+        if (patch_syscall_with_hook(*this, t, hook, addr)) {
+          t->session().accumulate_syscall_site_patched(true);
+          LOG(debug) << "Patched cached syscall site at " << addr << " in "
+                     << km.fsname();
+        }
+        break;
+      }
+    }
+  }
+}
+
+void Monkeypatcher::note_patched_site(Task* t, remote_ptr<uint8_t> addr) {
+  t->session().accumulate_syscall_site_patched(false);
+  if (!use_patch_site_cache(t)) {
+    return;
+  }
+  KernelMapping km = t->vm()->mapping_of(addr).map;
+  if (!is_cacheable_mapping(km)) {
+    return;
+  }
+  string build_id = build_id_of_mapping(t, km, nullptr);
+  if (!build_id.empty()) {
+    PatchSiteCache::get().add_site(build_id, t->arch(),
+                                   km.file_offset_bytes() +
+                                       (addr - km.start().cast<uint8_t>()));
+  }
 }
@@ -11,6 +11,7 @@
 #include "remote_ptr.h"
 #include "remote_code_ptr.h"
 
+class KernelMapping;
 class ScopedFd;
 class Task;
 
@@ -27,7 +28,9 @@ class Task;
  * our syscall hook in the preload library (x86 only).
  *
  * 3) Patch syscall instructions whose following instructions match a known
- * pattern to call the syscall hook.
+ * pattern to call the syscall hook. Sites we've patched before, in this or
+ * an earlier recording, are patched as soon as their library is mapped;
+ * see PatchSiteCache.
  *
  * Monkeypatcher only runs during recording, never replay.
  */
@@ -74,7 +77,8 @@ public:
 
   /**
    * Apply any necessary patching immediately after an mmap. We use this to
-   * patch libpthread.so.
+   * patch libpthread.so, and to patch known syscall sites in executable
+   * mappings.
    */
   void patch_after_mmap(Task* t, remote_ptr<void> start, size_t size,
                         size_t offset_pages, int child_fd);
@@ -100,6 +104,16 @@ public:
   }
 
 private:
+  /**
+   * Patch the syscall sites PatchSiteCache knows about in the part of the
+   * file mapped by |km|. |fd|, if open, refers to that file.
+   */
+  void patch_cached_sites(Task* t, const KernelMapping& km, ScopedFd* fd);
+  /**
+   * Add the just-patched syscall instruction at |addr| to PatchSiteCache.
+   */
+  void note_patched_site(Task* t, remote_ptr<uint8_t> addr);
+
   /**
    * The list of supported syscall patches obtained from the preload
    * library. Each one matches a specific byte signature for the instruction(s)
@@ -0,0 +1,204 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "AddressSpace.h"
+#include "Command.h"
+#include "Flags.h"
+#include "log.h"
+#include "main.h"
+#include "TraceStream.h"
+#include "TraceTaskEvent.h"
+
+using namespace std;
+
+class PackCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  PackCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static PackCommand singleton;
+};
+
+PackCommand PackCommand::singleton(
+    "pack",
+    " rr pack [<trace_dir>]\n"
+    "  Rewrite a trace for archiving: recompress it with the strongest\n"
+    "  available codec, deduplicate its recorded data and copy the files it\n"
+    "  maps into the trace directory, so the trace no longer depends on\n"
+    "  them and can be moved to another machine.\n");
+
+/**
+ * Deduplicate raw-data records at least this big. Smaller records aren't
+ * worth the header overhead.
+ */
+static const size_t PACK_DEDUP_THRESHOLD = 4096;
+/** Compression threads per substream. */
+static const int PACK_MAX_THREADS = 8;
+
+static void copy_task_events_until(TraceReader& tasks, TraceWriter& packed,
+                                   uint64_t position) {
+  while (packed.substream_position(TraceStream::TASKS) < position) {
+    TraceTaskEvent e = tasks.read_task_event();
+    if (e.type() == TraceTaskEvent::NONE) {
+      return;
+    }
+    packed.write_task_event(e);
+  }
+}
+
+static void copy_trace(TraceReader& trace, TraceWriter& packed) {
+  // Task events aren't tagged with times, so position them relative to the
+  // frames using the original seek index. Rewritten task events are
+  // byte-identical to the originals, so the substream positions match.
+  TraceReader tasks(trace);
+  bool have_seek_index = trace.has_seek_index();
+  if (!have_seek_index) {
+    packed.discard_seek_index();
+  }
+
+  while (!trace.at_end()) {
+    TraceFrame frame = trace.read_frame();
+
+    TraceReader::RawData data;
+    while (trace.read_raw_data_for_frame(frame, data)) {
+      packed.write_raw(data.data.data(), data.data.size(), data.addr);
+    }
+    while (true) {
+      TraceReader::MappedData mapped_data;
+      bool found;
+      KernelMapping km = trace.read_mapped_region(&mapped_data, &found,
+                                                  TraceReader::DONT_VALIDATE);
+      if (!found) {
+        break;
+      }
+      packed.write_mapped_region_copy(km, mapped_data);
+    }
+
+    // Writing this frame may add a seek index entry for the next one.
+    uint64_t tasks_position;
+    if (have_seek_index &&
+        tasks.seek_index_position(frame.time() + 1, TraceStream::TASKS,
+                                  &tasks_position)) {
+      copy_task_events_until(tasks, packed, tasks_position);
+    }
+    packed.write_frame(frame);
+  }
+  copy_task_events_until(tasks, packed, UINT64_MAX);
+}
+
+/**
+ * Hardlink files rr pack doesn't rewrite, i.e. memory checksums and dumps,
+ * whose names start with a digit, from |dir| into |packed_dir|.
+ */
+static void carry_over_files(const string& dir, const string& packed_dir) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return;
+  }
+  while (struct dirent* ent = readdir(d)) {
+    string name = ent->d_name;
+    if (!isdigit(name[0])) {
+      continue;
+    }
+    if (link((dir + "/" + name).c_str(), (packed_dir + "/" + name).c_str())) {
+      LOG(warn) << "Failed to carry " << name << " over to the packed trace";
+    }
+  }
+  closedir(d);
+}
+
+static bool remove_trace_dir(const string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return false;
+  }
+  while (struct dirent* ent = readdir(d)) {
+    string name = ent->d_name;
+    if (name != "." && name != "..") {
+      unlink((dir + "/" + name).c_str());
+    }
+  }
+  closedir(d);
+  return rmdir(dir.c_str()) == 0;
+}
+
+static int pack(const string& trace_dir) {
+  TraceReader trace(trace_dir);
+  if (trace.segment_count() > 1) {
+    fprintf(stderr, "Can't pack `%s': packing flight-recorder traces that "
+                    "have been split into segments isn't supported\n",
+            trace.dir().c_str());
+    return 1;
+  }
+  // Resolve the latest-trace symlink; we replace the directory it points to.
+  char resolved[PATH_MAX];
+  if (!realpath(trace.dir().c_str(), resolved)) {
+    fprintf(stderr, "Can't find trace directory `%s'\n", trace.dir().c_str());
+    return 1;
+  }
+  string dir = resolved;
+  string packed_dir = dir + ".pack-tmp";
+  string old_dir = dir + ".pack-old";
+
+  CompressedWriter::Codec codec =
+      CompressedWriter::codec_available(CompressedWriter::CODEC_ZSTD)
+          ? CompressedWriter::CODEC_ZSTD
+          : CompressedWriter::CODEC_ZLIB;
+  int threads =
+      min<int>(max<long>(sysconf(_SC_NPROCESSORS_ONLN), 1), PACK_MAX_THREADS);
+  {
+    TraceWriter packed(packed_dir, trace, codec, threads);
+    packed.set_raw_data_dedup_threshold(PACK_DEDUP_THRESHOLD);
+    packed.set_delta_encode_registers(true);
+    // Nobody is waiting on us, so don't trade ratio for speed.
+    packed.set_adaptive_compression(false);
+    copy_trace(trace, packed);
+    packed.close();
+  }
+  carry_over_files(dir, packed_dir);
+  // Packing doesn't change events, so persistent checkpoints stay valid.
+  rename((dir + "/checkpoints").c_str(),
+         (packed_dir + "/checkpoints").c_str());
+
+  uint64_t old_bytes = trace.compressed_bytes();
+  uint64_t new_bytes = TraceReader(packed_dir).compressed_bytes();
+
+  if (rename(dir.c_str(), old_dir.c_str()) ||
+      rename(packed_dir.c_str(), dir.c_str())) {
+    FATAL() << "Failed to replace " << dir << " with " << packed_dir;
+  }
+  if (!remove_trace_dir(old_dir)) {
+    LOG(warn) << "Failed to remove " << old_dir;
+  }
+
+  fprintf(stdout, "rr: Packed `%s': %" PRIu64 " -> %" PRIu64 " bytes\n",
+          dir.c_str(), old_bytes, new_bytes);
+  return 0;
+}
+
+int PackCommand::run(std::vector<std::string>& args) {
+  while (parse_global_option(args)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  // Decompress the input on background threads while we recompress it.
+  if (Flags::get().read_ahead_blocks == 0) {
+    Flags::get_for_init().read_ahead_blocks = 2;
+  }
+
+  return pack(trace_dir);
+}
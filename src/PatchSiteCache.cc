@@ -0,0 +1,157 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "PatchSiteCache"
+
+#include "PatchSiteCache.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+
+#include "kernel_metadata.h"
+#include "log.h"
+
+using namespace rr;
+using namespace std;
+
+/* Bump this if the format of the site files changes. Files with another
+ * version are ignored and eventually overwritten. */
+static const char CACHE_FILE_MAGIC[] = "rr-syscall-patch-sites-1";
+
+static string cache_dir() {
+  static string cached_dir;
+
+  if (!cached_dir.empty()) {
+    return cached_dir;
+  }
+
+  const char* xdg_cache_home = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (xdg_cache_home) {
+    cached_dir = string(xdg_cache_home) + "/rr";
+  } else if (home) {
+    cached_dir = string(home) + "/.cache/rr";
+  } else {
+    cached_dir = "/tmp/rr-cache";
+  }
+  cached_dir += "/syscall-patch-sites";
+  return cached_dir;
+}
+
+/**
+ * Create |dir| and any missing parents. Returns false on failure.
+ */
+static bool make_dirs(const string& dir) {
+  size_t pos = 0;
+  while (pos != string::npos) {
+    pos = dir.find('/', pos + 1);
+    string d = dir.substr(0, pos);
+    if (mkdir(d.c_str(), 0700) && errno != EEXIST) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void read_sites(const string& path, set<uint64_t>* offsets) {
+  ifstream in(path);
+  string magic;
+  if (!(in >> magic) || magic != CACHE_FILE_MAGIC) {
+    return;
+  }
+  uint64_t offset;
+  while (in >> hex >> offset) {
+    offsets->insert(offset);
+  }
+}
+
+PatchSiteCache& PatchSiteCache::get() {
+  static PatchSiteCache singleton;
+  return singleton;
+}
+
+string PatchSiteCache::file_name(const Key& key) {
+  return cache_dir() + "/" + key.first + (key.second == x86 ? "-x86" : "-x64");
+}
+
+const set<uint64_t>& PatchSiteCache::sites(const string& build_id,
+                                           SupportedArch arch) {
+  Key key(build_id, arch);
+  auto it = site_lists.find(key);
+  if (it == site_lists.end()) {
+    it = site_lists.insert(make_pair(key, SiteList())).first;
+    read_sites(file_name(key), &it->second.offsets);
+    LOG(debug) << "Loaded " << it->second.offsets.size()
+               << " patch sites for build-id " << build_id;
+  }
+  return it->second.offsets;
+}
+
+void PatchSiteCache::add_site(const string& build_id, SupportedArch arch,
+                              uint64_t offset) {
+  sites(build_id, arch);
+  SiteList& list = site_lists[Key(build_id, arch)];
+  if (list.offsets.insert(offset).second) {
+    list.dirty = true;
+  }
+}
+
+void PatchSiteCache::save() {
+  bool made_dir = false;
+  for (auto& it : site_lists) {
+    SiteList& list = it.second;
+    if (!list.dirty) {
+      continue;
+    }
+    list.dirty = false;
+    if (!made_dir) {
+      if (!make_dirs(cache_dir())) {
+        LOG(warn) << "Unable to create " << cache_dir() << ": "
+                  << errno_name(errno);
+        return;
+      }
+      made_dir = true;
+    }
+
+    // Another rr may have added sites since we loaded the file. Merge
+    // them in and replace the file atomically, so concurrent writers can
+    // only lose each other's additions, never corrupt the file.
+    string path = file_name(it.first);
+    read_sites(path, &list.offsets);
+    string tmp_path = path + ".tmp." + to_string(getpid());
+    {
+      ofstream out(tmp_path);
+      out << CACHE_FILE_MAGIC << "\n" << hex;
+      for (uint64_t offset : list.offsets) {
+        out << offset << "\n";
+      }
+      if (!out.good()) {
+        LOG(warn) << "Unable to write " << tmp_path;
+        unlink(tmp_path.c_str());
+        continue;
+      }
+    }
+    if (rename(tmp_path.c_str(), path.c_str())) {
+      LOG(warn) << "Unable to replace " << path << ": " << errno_name(errno);
+      unlink(tmp_path.c_str());
+    }
+  }
+}
+
+bool PatchSiteCache::cached_build_id(dev_t device, ino_t inode,
+                                     string* build_id) {
+  auto it = build_ids.find(make_pair(device, inode));
+  if (it == build_ids.end()) {
+    return false;
+  }
+  *build_id = it->second;
+  return true;
+}
+
+void PatchSiteCache::set_build_id(dev_t device, ino_t inode,
+                                  const string& build_id) {
+  build_ids[make_pair(device, inode)] = build_id;
+}
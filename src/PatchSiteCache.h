@@ -0,0 +1,76 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PATCH_SITE_CACHE_H_
+#define RR_PATCH_SITE_CACHE_H_
+
+#include <sys/types.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "kernel_abi.h"
+
+/**
+ * Remembers, across recordings, which syscall instructions Monkeypatcher
+ * has managed to patch. Sites are keyed by the build-id of the ELF file
+ * containing them and stored as the file offset of the syscall
+ * instruction, so they apply wherever the file gets mapped. That lets
+ * Monkeypatcher patch known sites as soon as a library is mapped, instead
+ * of taking a ptrace trap at each of them the first time they run in each
+ * process.
+ *
+ * The cache lives under $XDG_CACHE_HOME/rr/syscall-patch-sites (or
+ * ~/.cache/rr/syscall-patch-sites), with one file per build-id and
+ * architecture. Its contents are only hints: Monkeypatcher checks the code
+ * at each site before patching it.
+ */
+class PatchSiteCache {
+public:
+  static PatchSiteCache& get();
+
+  /**
+   * Return the file offsets of the sites known for the file with
+   * |build_id|, loading them from disk the first time.
+   */
+  const std::set<uint64_t>& sites(const std::string& build_id,
+                                  SupportedArch arch);
+
+  /**
+   * Note that the syscall instruction at |offset| in the file with
+   * |build_id| has been patched.
+   */
+  void add_site(const std::string& build_id, SupportedArch arch,
+                uint64_t offset);
+
+  /**
+   * Write out the site lists that have grown, merging them with whatever
+   * other rr processes have written in the meantime.
+   */
+  void save();
+
+  /**
+   * Build-ids are looked up once per file. Return true and set |build_id|
+   * (possibly to the empty string, if the file has none) if the file with
+   * this device and inode has been looked up already.
+   */
+  bool cached_build_id(dev_t device, ino_t inode, std::string* build_id);
+  void set_build_id(dev_t device, ino_t inode, const std::string& build_id);
+
+private:
+  PatchSiteCache() {}
+
+  struct SiteList {
+    SiteList() : dirty(false) {}
+    std::set<uint64_t> offsets;
+    bool dirty;
+  };
+  typedef std::pair<std::string, SupportedArch> Key;
+
+  std::string file_name(const Key& key);
+
+  std::map<Key, SiteList> site_lists;
+  std::map<std::pair<dev_t, ino_t>, std::string> build_ids;
+};
+
+#endif /* RR_PATCH_SITE_CACHE_H_ */
@@ -6,6 +6,7 @@
 #include <err.h>
 #include <fcntl.h>
 #include <linux/perf_event.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -203,10 +204,53 @@ static ScopedFd start_counter(pid_t tid, int group_fd,
   return fd;
 }
 
+/**
+ * Some kernels don't apply a PERF_EVENT_IOC_PERIOD change until the old
+ * period has elapsed, so we can't reprogram counters with it there.
+ * Detect that by counting our own ticks with a huge period, shrinking the
+ * period to 1 and checking whether the counter overflows.
+ */
+static bool has_ioc_period_bug() {
+  static bool checked = false;
+  static bool has_bug = false;
+  if (checked) {
+    return has_bug;
+  }
+  checked = true;
+
+  struct perf_event_attr attr = ticks_attr;
+  attr.sample_period = 0xffffffff;
+  ScopedFd fd = start_counter(0, -1, &attr);
+  uint64_t new_period = 1;
+  if (ioctl(fd, PERF_EVENT_IOC_PERIOD, &new_period)) {
+    has_bug = true;
+  } else {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    poll(&pfd, 1, 0);
+    has_bug = pfd.revents == 0;
+  }
+  LOG(debug) << "PERF_EVENT_IOC_PERIOD " << (has_bug ? "is" : "isn't")
+             << " buggy";
+  return has_bug;
+}
+
 void PerfCounters::reset(Ticks ticks_period) {
   assert(ticks_period >= 0);
 
-  stop();
+  if (fd_ticks.is_open() && !has_ioc_period_bug()) {
+    // Reprogramming the counters we already have takes three ioctls,
+    // instead of opening, configuring and enabling new ones.
+    uint64_t period = ticks_period;
+    if (ioctl(fd_ticks, PERF_EVENT_IOC_PERIOD, &period) ||
+        ioctl(fd_ticks, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) ||
+        ioctl(fd_ticks, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)) {
+      FATAL() << "Failed to reprogram ticks counter";
+    }
+    started = true;
+    return;
+  }
+
+  close_counters();
 
   struct perf_event_attr attr = ticks_attr;
   attr.sample_period = ticks_period;
@@ -241,6 +285,15 @@ void PerfCounters::stop() {
   }
   started = false;
 
+  // Keep the counters open so reset() can reuse them.
+  if (ioctl(fd_ticks, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP)) {
+    FATAL() << "Failed to stop ticks counter";
+  }
+}
+
+void PerfCounters::close_counters() {
+  started = false;
+
   fd_ticks.close();
   fd_page_faults.close();
   fd_hw_interrupts.close();
@@ -32,7 +32,7 @@ public:
    * Create performance counters monitoring the given task.
    */
   PerfCounters(pid_t tid);
-  ~PerfCounters() { stop(); }
+  ~PerfCounters() { close_counters(); }
 
   // Change this to 'true' to enable perf counters that may be interesting
   // for experimentation, but aren't necessary for core functionality.
@@ -48,8 +48,8 @@ public:
   void reset(Ticks ticks_period);
 
   /**
-   * Close the perfcounter fds. They will be automatically reopened if/when
-   * reset is called again.
+   * Stop counting. The counters stay open, and reset() reprograms them
+   * rather than opening new ones where the kernel allows.
    */
   void stop();
 
@@ -67,6 +67,44 @@ public:
    * hope that tracees don't either. */
   enum { TIME_SLICE_SIGNAL = SIGSTKFLT };
 
+  /* Why a skid region?  Interrupts generated by perf counters don't
+   * fire at exactly the programmed point (as of 2013 kernel/HW);
+   * there's a variable slack region, which is technically unbounded.
+   * This means that an interrupt programmed for retired branch k might
+   * fire at |k + 50|, for example.  To counteract the slack, we program
+   * interrupts just short of our target, by the |SKID_SIZE| region
+   * below, and then more slowly advance to the real target.
+   *
+   * How was this magic number determined?  Trial and error: we want it
+   * to be as small as possible for efficiency, but not so small that
+   * overshoots are observed.  If all other possible causes of overshoot
+   * have been ruled out, like memory divergence, then you'll know that
+   * this magic number needs to be increased if the following symptom is
+   * observed during replay.  Running with DEBUGLOG enabled in
+   * ReplaySession.cc, a sequence of log messages like the following will
+   * appear
+   *
+   * 1. programming interrupt for [target - SKID_SIZE] ticks
+   * 2. Error: Replay diverged.  Dumping register comparison.
+   * 3. Error: [list of divergent registers; arbitrary]
+   * 4. Error: overshot target ticks=[target] by [i]
+   *
+   * The key is that no other replayer log messages occur between (1)
+   * and (2).  This spew means that the replayer programmed an interrupt
+   * for ticks=[target-SKID_SIZE], but the tracee was actually interrupted
+   * at ticks=[target+i].  And that in turn means that the kernel/HW
+   * skidded too far past the programmed target for rr to handle it.
+   *
+   * If that occurs, the SKID_SIZE needs to be increased by at least
+   * [i].
+   *
+   * NB: there are probably deeper reasons for the target slack that
+   * could perhaps let it be deduced instead of arrived at empirically;
+   * perhaps pipeline depth and things of that nature are involved.  But
+   * those reasons if they exit are currently not understood.
+   */
+  enum { SKID_SIZE = 70 };
+
   struct Extra {
     Extra() : page_faults(0), hw_interrupts(0), instructions_retired(0) {}
 
@@ -77,6 +115,8 @@ public:
   Extra read_extra();
 
 private:
+  void close_counters();
+
   pid_t tid;
   ScopedFd fd_ticks;
   ScopedFd fd_page_faults;
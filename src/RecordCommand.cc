@@ -25,13 +25,28 @@ RecordCommand RecordCommand::singleton(
     "  -c, --num-cpu-ticks=<NUM>  maximum number of 'CPU ticks' (currently \n"
     "                             retired conditional branches) to allow a \n"
     "                             task to run before interrupting it\n"
+    "  -d, --dedup-raw-data=<MIN_BYTES>\n"
+    "                             store repeated recorded data blocks of at\n"
+    "                             least MIN_BYTES bytes only once\n"
+    "  -e, --delta-registers      store each task's registers as a delta\n"
+    "                             against its previous event, making the\n"
+    "                             trace smaller\n"
     "  -h, --chaos                randomize scheduling decisions to try to \n"
     "                             reproduce bugs\n"
     "  -i, --ignore-signal=<SIG>  block <SIG> from being delivered to \n"
     "                             tracees. Probably only useful for unit \n"
     "                             tests.\n"
+    "  -k, --keep-last=<SECONDS>  flight-recorder mode: keep only about the\n"
+    "                             last SECONDS seconds of the trace,\n"
+    "                             discarding older events as recording goes\n"
+    "                             on. Replay starts from a checkpoint saved\n"
+    "                             after the discarded events\n"
+    "  -m, --max-trace-size=<MB>  flight-recorder mode: keep the trace below\n"
+    "                             about MB megabytes (see -k)\n"
     "  -n, --no-syscall-buffer    disable the syscall buffer preload \n"
     "                             library even if it would otherwise be used\n"
+    "  -p, --no-patch-cache       don't use or update the cache of syscall\n"
+    "                             sites that are known to be patchable\n"
     "  -s, --always-switch        tryto context switch at every rr event\n"
     "  -u, --cpu-unbound          allow tracees to run on any virtual CPU.\n"
     "                             Default is to bind to CPU 0.  This option\n"
@@ -40,7 +55,10 @@ RecordCommand RecordCommand::singleton(
     "  -v, --env=NAME=VALUE       value to add to the environment of the\n"
     "                             tracee. There can be any number of these.\n"
     "  -w, --wait                 Wait for all child processes to exit, not\n"
-    "                             just the initial process\n");
+    "                             just the initial process\n"
+    "  -z, --compression=<CODEC>  compress all trace data with <CODEC>\n"
+    "                             (store, zlib, lz4 or zstd) instead of\n"
+    "                             each substream's default codec\n");
 
 struct RecordFlags {
   vector<string> extra_env;
@@ -69,6 +87,24 @@ struct RecordFlags {
    * recording. */
   bool wait_for_all;
 
+  /* Codec for all trace substreams, or CODEC_COUNT to use the defaults. */
+  CompressedWriter::Codec codec;
+
+  /* Minimum size of raw-data records to deduplicate, or zero to store them
+   * all. */
+  size_t dedup_threshold;
+
+  /* Whether to delta-encode registers in the trace. */
+  bool delta_registers;
+
+  /* Whether to apply and update the persistent syscall patch-site cache. */
+  bool use_patch_site_cache;
+
+  /* Flight-recorder limits on the trace size in bytes and the time span
+   * kept, or zero for no limit. */
+  uint64_t max_trace_size;
+  int keep_last_secs;
+
   RecordFlags()
       : max_ticks(Scheduler::DEFAULT_MAX_TICKS),
         ignore_sig(0),
@@ -76,7 +112,13 @@ struct RecordFlags {
         bind_cpu(RecordSession::BIND_CPU),
         always_switch(false),
         chaos(RecordSession::DISABLE_CHAOS),
-        wait_for_all(false) {}
+        wait_for_all(false),
+        codec(CompressedWriter::CODEC_COUNT),
+        dedup_threshold(0),
+        delta_registers(false),
+        use_patch_site_cache(true),
+        max_trace_size(0),
+        keep_last_secs(0) {}
 };
 
 static bool parse_record_arg(std::vector<std::string>& args,
@@ -88,13 +130,19 @@ static bool parse_record_arg(std::vector<std::string>& args,
   static const OptionSpec options[] = {
     { 'b', "force-syscall-buffer", NO_PARAMETER },
     { 'c', "num-cpu-ticks", HAS_PARAMETER },
+    { 'd', "dedup-raw-data", HAS_PARAMETER },
+    { 'e', "delta-registers", NO_PARAMETER },
     { 'h', "chaos", NO_PARAMETER },
     { 'i', "ignore-signal", HAS_PARAMETER },
+    { 'k', "keep-last", HAS_PARAMETER },
+    { 'm', "max-trace-size", HAS_PARAMETER },
     { 'n', "no-syscall-buffer", NO_PARAMETER },
+    { 'p', "no-patch-cache", NO_PARAMETER },
     { 's', "always-switch", NO_PARAMETER },
     { 'u', "cpu-unbound", NO_PARAMETER },
     { 'v', "env", HAS_PARAMETER },
-    { 'w', "wait", NO_PARAMETER }
+    { 'w', "wait", NO_PARAMETER },
+    { 'z', "compression", HAS_PARAMETER }
   };
   ParsedOption opt;
   auto args_copy = args;
@@ -112,6 +160,15 @@ static bool parse_record_arg(std::vector<std::string>& args,
       }
       flags.max_ticks = opt.int_value;
       break;
+    case 'd':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.dedup_threshold = opt.int_value;
+      break;
+    case 'e':
+      flags.delta_registers = true;
+      break;
     case 'h':
       LOG(info) << "Enabled chaos mode";
       flags.chaos = RecordSession::ENABLE_CHAOS;
@@ -122,9 +179,24 @@ static bool parse_record_arg(std::vector<std::string>& args,
       }
       flags.ignore_sig = opt.int_value;
       break;
+    case 'k':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.keep_last_secs = opt.int_value;
+      break;
+    case 'm':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.max_trace_size = uint64_t(opt.int_value) * 1024 * 1024;
+      break;
     case 'n':
       flags.use_syscall_buffer = RecordSession::DISABLE_SYSCALL_BUF;
       break;
+    case 'p':
+      flags.use_patch_site_cache = false;
+      break;
     case 's':
       flags.always_switch = true;
       break;
@@ -137,6 +209,17 @@ static bool parse_record_arg(std::vector<std::string>& args,
     case 'w':
       flags.wait_for_all = true;
       break;
+    case 'z':
+      if (!CompressedWriter::parse_codec(opt.value, &flags.codec)) {
+        fprintf(stderr, "Unknown codec %s\n", opt.value.c_str());
+        return false;
+      }
+      if (!CompressedWriter::codec_available(flags.codec)) {
+        fprintf(stderr, "rr was built without support for codec %s\n",
+                opt.value.c_str());
+        return false;
+      }
+      break;
     default:
       assert(0 && "Unknown option");
   }
@@ -180,6 +263,13 @@ static void setup_session_from_flags(RecordSession& session,
   session.scheduler().set_always_switch(flags.always_switch);
   session.set_ignore_sig(flags.ignore_sig);
   session.set_wait_for_all(flags.wait_for_all);
+  session.set_use_patch_site_cache(flags.use_patch_site_cache);
+  session.trace_writer().set_raw_data_dedup_threshold(flags.dedup_threshold);
+  session.trace_writer().set_delta_encode_registers(flags.delta_registers);
+  if (flags.max_trace_size > 0 || flags.keep_last_secs > 0) {
+    session.trace_writer().set_flight_recorder(flags.max_trace_size,
+                                               flags.keep_last_secs);
+  }
 }
 
 static int record(const vector<string>& args, const RecordFlags& flags) {
@@ -187,7 +277,7 @@ static int record(const vector<string>& args, const RecordFlags& flags) {
 
   auto session =
       RecordSession::create(args, flags.extra_env, flags.use_syscall_buffer,
-                            flags.bind_cpu, flags.chaos);
+                            flags.bind_cpu, flags.chaos, flags.codec);
   setup_session_from_flags(*session, flags);
 
   // Install signal handlers after creating the session, to ensure they're not
@@ -200,10 +290,22 @@ static int record(const vector<string>& args, const RecordFlags& flags) {
     step_result = session->record_step();
     if (!done_initial_exec && session->done_initial_exec()) {
       session->trace_writer().make_latest_trace();
+      session->trace_writer().end_first_segment();
     }
   } while (step_result.status == RecordSession::STEP_CONTINUE && !term_request);
 
   session->terminate_recording();
+  Session::Statistics stats = session->statistics();
+  LOG(info) << "Register fetches " << stats.register_fetches << ", writebacks "
+            << stats.register_writebacks << "; extra register fetches "
+            << stats.extra_register_fetches << ", writebacks "
+            << stats.extra_register_writebacks;
+  LOG(info) << "Syscallbuf flushes " << stats.syscallbuf_flushes
+            << ", resizes " << stats.syscallbuf_resizes;
+  LOG(info) << "Syscall sites patched on first use "
+            << stats.syscall_sites_patched << ", from the patch-site cache "
+            << stats.syscall_sites_patched_from_cache
+            << " (traps avoided)";
 
   switch (step_result.status) {
     case RecordSession::STEP_CONTINUE:
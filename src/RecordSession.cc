@@ -12,6 +12,7 @@
 #include "AutoRemoteSyscalls.h"
 #include "kernel_metadata.h"
 #include "log.h"
+#include "PatchSiteCache.h"
 #include "record_signal.h"
 #include "record_syscall.h"
 #include "seccomp-bpf.h"
@@ -1341,7 +1342,8 @@ static string find_syscall_buffer_library() {
 
 /*static*/ RecordSession::shr_ptr RecordSession::create(
     const vector<string>& argv, const vector<string>& extra_env,
-    SyscallBuffering syscallbuf, BindCPU bind_cpu, Chaos chaos) {
+    SyscallBuffering syscallbuf, BindCPU bind_cpu, Chaos chaos,
+    CompressedWriter::Codec codec) {
   // The syscallbuf library interposes some critical
   // external symbols like XShmQueryExtension(), so we
   // preload it whether or not syscallbuf is enabled. Indicate here whether
@@ -1415,21 +1417,23 @@ static string find_syscall_buffer_library() {
   env.push_back("MOZ_GDB_SLEEP=0");
 
   shr_ptr session(
-      new RecordSession(argv, env, cwd, syscallbuf, bind_cpu, chaos));
+      new RecordSession(argv, env, cwd, syscallbuf, bind_cpu, chaos, codec));
   return session;
 }
 
 RecordSession::RecordSession(const std::vector<std::string>& argv,
                              const std::vector<std::string>& envp,
                              const string& cwd, SyscallBuffering syscallbuf,
-                             BindCPU bind_cpu, Chaos chaos)
-    : trace_out(argv, envp, cwd, choose_cpu(bind_cpu)),
+                             BindCPU bind_cpu, Chaos chaos,
+                             CompressedWriter::Codec codec)
+    : trace_out(argv, envp, cwd, choose_cpu(bind_cpu), codec),
       scheduler_(*this),
       ignore_sig(0),
       last_task_switchable(PREVENT_SWITCH),
       use_syscall_buffer_(syscallbuf == ENABLE_SYSCALL_BUF),
       enable_chaos_(false),
-      wait_for_all_(false) {
+      wait_for_all_(false),
+      use_patch_site_cache_(true) {
   scheduler().set_enable_chaos(chaos == ENABLE_CHAOS);
   set_enable_chaos(chaos == ENABLE_CHAOS);
   Task* t = Task::spawn(*this, trace_out);
@@ -1565,6 +1569,8 @@ void RecordSession::terminate_recording() {
                    t ? t->tick_count() : 0);
   trace_out.write_frame(frame);
   trace_out.close();
+
+  PatchSiteCache::get().save();
 }
 
 void RecordSession::on_create(Task* t) {
@@ -27,7 +27,8 @@ public:
       const std::vector<std::string>& argv,
       const std::vector<std::string>& extra_env = std::vector<std::string>(),
       SyscallBuffering syscallbuf = ENABLE_SYSCALL_BUF,
-      BindCPU bind_cpu = BIND_CPU, Chaos chaos = DISABLE_CHAOS);
+      BindCPU bind_cpu = BIND_CPU, Chaos chaos = DISABLE_CHAOS,
+      CompressedWriter::Codec codec = CompressedWriter::CODEC_COUNT);
 
   bool use_syscall_buffer() const { return use_syscall_buffer_; }
   void set_ignore_sig(int ignore_sig) { this->ignore_sig = ignore_sig; }
@@ -96,10 +97,16 @@ public:
     this->wait_for_all_ = wait_for_all;
   }
 
+  void set_use_patch_site_cache(bool use_patch_site_cache) {
+    this->use_patch_site_cache_ = use_patch_site_cache;
+  }
+  bool use_patch_site_cache() const { return use_patch_site_cache_; }
+
 private:
   RecordSession(const std::vector<std::string>& argv,
                 const std::vector<std::string>& envp, const std::string& cwd,
-                SyscallBuffering syscallbuf, BindCPU bind_cpu, Chaos chaos);
+                SyscallBuffering syscallbuf, BindCPU bind_cpu, Chaos chaos,
+                CompressedWriter::Codec codec);
 
   virtual void on_create(Task* t);
 
@@ -132,6 +139,12 @@ private:
    * When true, wait for all tracees to exit before finishing recording.
    */
   bool wait_for_all_;
+  /**
+   * When true, Monkeypatcher patches the syscall sites it already knows
+   * about as soon as their libraries are mapped, and remembers new ones.
+   * See PatchSiteCache.
+   */
+  bool use_patch_site_cache_;
 };
 
 #endif // RR_RECORD_SESSION_H_
@@ -6,7 +6,9 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
+#include <map>
 
 #include "Command.h"
 #include "Flags.h"
@@ -49,6 +51,18 @@ ReplayCommand ReplayCommand::singleton(
     "been\n"
     "                             reached.\n"
     "  -d, --debugger=<FILE>      use <FILE> as the gdb command\n"
+    "  -m, --checkpoint-memory=<MB>\n"
+    "                             let checkpoints made to speed up reverse\n"
+    "                             execution use up to <MB> megabytes of\n"
+    "                             memory (default a quarter of RAM)\n"
+    "  -n, --no-checkpoints       always replay from the start of the trace,\n"
+    "                             ignoring checkpoints made by\n"
+    "                             `rr checkpoint create'\n"
+    "  -P, --parallel-verify=<N>  don't debug; instead check the trace\n"
+    "                             replays correctly by replaying the\n"
+    "                             segments between its checkpoints in up to\n"
+    "                             <N> processes at once, checking each one\n"
+    "                             ends in the state its checkpoint recorded\n"
     "  -q, --no-redirect-output   don't replay writes to stdout/stderr\n"
     "  -s, --dbgport=<PORT>       only start a debug server on <PORT>;\n"
     "                             don't automatically launch the debugger\n"
@@ -94,6 +108,13 @@ struct ReplayFlags {
   /* When true, echo tracee stdout/stderr writes to console. */
   bool redirect;
 
+  /* When true, start from the latest persistent checkpoint before the
+   * target event. */
+  bool use_checkpoints;
+
+  /* When nonzero, verify the trace using up to this many processes. */
+  int parallel_verify;
+
   ReplayFlags()
       : goto_event(0),
         singlestep_to_event(0),
@@ -102,7 +123,9 @@ struct ReplayFlags {
         dont_launch_debugger(false),
         dbg_port(-1),
         gdb_binary_file_path("gdb"),
-        redirect(true) {}
+        redirect(true),
+        use_checkpoints(true),
+        parallel_verify(0) {}
 };
 
 static bool parse_replay_arg(std::vector<std::string>& args,
@@ -117,6 +140,9 @@ static bool parse_replay_arg(std::vector<std::string>& args,
     { 's', "dbgport", HAS_PARAMETER },
     { 'g', "goto", HAS_PARAMETER },
     { 't', "trace", HAS_PARAMETER },
+    { 'm', "checkpoint-memory", HAS_PARAMETER },
+    { 'n', "no-checkpoints", NO_PARAMETER },
+    { 'P', "parallel-verify", HAS_PARAMETER },
     { 'q', "no-redirect-output", NO_PARAMETER },
     { 'f', "onfork", HAS_PARAMETER },
     { 'p', "onprocess", HAS_PARAMETER },
@@ -159,6 +185,22 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       }
       flags.process_created_how = ReplayFlags::CREATED_EXEC;
       break;
+    case 'm':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      Flags::get_for_init().checkpoint_memory_budget =
+          (uint64_t)opt.int_value * 1024 * 1024;
+      break;
+    case 'n':
+      flags.use_checkpoints = false;
+      break;
+    case 'P':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.parallel_verify = opt.int_value;
+      break;
     case 'q':
       flags.redirect = false;
       break;
@@ -242,6 +284,29 @@ static ReplaySession::Flags session_flags(ReplayFlags flags) {
   return result;
 }
 
+/**
+ * Create the session to replay to |target| in, starting at the latest
+ * persistent checkpoint before the target event if there is one.
+ */
+static ReplaySession::shr_ptr create_session(const string& trace_dir,
+                                             const ReplayFlags& flags,
+                                             const GdbServer::Target& target) {
+  if (flags.use_checkpoints && target.event > 0) {
+    auto times = ReplaySession::persistent_checkpoints(trace_dir);
+    auto it = upper_bound(times.begin(), times.end(), target.event);
+    if (it != times.begin()) {
+      --it;
+      auto session = ReplaySession::create_from_checkpoint(trace_dir, *it);
+      if (session) {
+        return session;
+      }
+      LOG(warn) << "Couldn't restore the checkpoint at event " << *it
+                << "; replaying from the start of the trace";
+    }
+  }
+  return ReplaySession::create(trace_dir);
+}
+
 static uint64_t to_microseconds(const struct timeval& tv) {
   return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
@@ -254,6 +319,8 @@ static void serve_replay_no_debugger(const string& trace_dir,
   struct timeval last_dump_time;
   Session::Statistics last_stats;
   gettimeofday(&last_dump_time, NULL);
+  struct timeval start_time = last_dump_time;
+  TraceFrame::Time start_event = replay_session->trace_reader().time();
 
   while (true) {
     RunCommand cmd = RUN_CONTINUE;
@@ -296,7 +363,117 @@ static void serve_replay_no_debugger(const string& trace_dir,
     assert(cmd == RUN_SINGLESTEP || !result.break_status.singlestep_complete);
   }
 
-  LOG(info) << ("Replayer successfully finished.");
+  struct timeval end_time;
+  gettimeofday(&end_time, NULL);
+  double seconds =
+      (to_microseconds(end_time) - to_microseconds(start_time)) / 1000000.0;
+  TraceFrame::Time events = replay_session->trace_reader().time() - start_event;
+  LOG(info) << "Replayer successfully finished: " << events << " events in "
+            << seconds << "s (" << (seconds > 0 ? events / seconds : 0)
+            << " events/s)";
+  Session::Statistics stats = replay_session->statistics();
+  LOG(info) << "Register fetches " << stats.register_fetches << ", writebacks "
+            << stats.register_writebacks << "; extra register fetches "
+            << stats.extra_register_fetches << ", writebacks "
+            << stats.extra_register_writebacks;
+  LOG(info) << "Loop iterations fast-forwarded "
+            << stats.loop_iterations_fast_forwarded << ", singlesteps avoided "
+            << stats.singlesteps_avoided;
+}
+
+/**
+ * Replay the trace from the checkpoint at |start| (or the start of the trace
+ * if |start| is 0) to the checkpoint at |end| (or the end of the trace if
+ * |end| is 0) and check we got there in the state the checkpoint recorded.
+ * Returns the exit status for the worker process.
+ */
+static int verify_segment(const string& trace_dir, TraceFrame::Time start,
+                          TraceFrame::Time end) {
+  auto session = start ? ReplaySession::create_from_checkpoint(trace_dir, start)
+                       : ReplaySession::create(trace_dir);
+  if (!session) {
+    fprintf(stderr, "rr: Couldn't restore the checkpoint at event %lld\n",
+            (long long)start);
+    return 1;
+  }
+  session->set_flags(ReplaySession::Flags());
+
+  while (!end || session->current_trace_frame().time() < end ||
+         session->current_step_key().in_execution()) {
+    if (session->replay_step(RUN_CONTINUE).status == REPLAY_EXITED) {
+      if (end) {
+        fprintf(stderr, "rr: Trace ended before event %lld\n",
+                (long long)end);
+        return 1;
+      }
+      return 0;
+    }
+  }
+  return session->matches_checkpoint() ? 0 : 1;
+}
+
+/**
+ * Verify the segments of the trace between its persistent checkpoints,
+ * replaying up to |jobs| of them at once, each in its own process. Every
+ * segment is replayed with the usual divergence checks, and every one
+ * except the last is also checked against the checkpoint it ends at.
+ */
+static int parallel_verify(const string& trace_dir, int jobs) {
+  vector<TraceFrame::Time> bounds =
+      ReplaySession::persistent_checkpoints(trace_dir);
+  if (bounds.empty()) {
+    fprintf(stderr, "rr: Trace has no checkpoints, so it can't be split. "
+                    "Run `rr checkpoint create' first.\n");
+    return 1;
+  }
+  // Segment i runs from bounds[i] to bounds[i + 1]; 0 means the start or end
+  // of the trace.
+  bounds.insert(bounds.begin(), 0);
+  bounds.push_back(0);
+  size_t segments = bounds.size() - 1;
+
+  map<pid_t, size_t> running;
+  size_t next = 0;
+  size_t failed = 0;
+  while (next < segments || !running.empty()) {
+    if (next < segments && running.size() < (size_t)jobs) {
+      pid_t child = fork();
+      if (child < 0) {
+        FATAL() << "Can't fork verification process";
+      }
+      if (!child) {
+        _exit(verify_segment(trace_dir, bounds[next], bounds[next + 1]));
+      }
+      running[child] = next++;
+      continue;
+    }
+
+    int status;
+    pid_t child = waitpid(-1, &status, 0);
+    if (child < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      FATAL() << "waitpid failed";
+    }
+    auto it = running.find(child);
+    if (it == running.end()) {
+      continue;
+    }
+    size_t i = it->second;
+    running.erase(it);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    failed += !ok;
+    string from = i ? to_string(bounds[i]) : string("start");
+    string to = bounds[i + 1] ? to_string(bounds[i + 1]) : string("end");
+    fprintf(stdout, "rr: Segment %s-%s %s\n", from.c_str(), to.c_str(),
+            ok ? "verified" : "FAILED");
+    fflush(stdout);
+  }
+
+  fprintf(stdout, "rr: %zu of %zu segments verified\n", segments - failed,
+          segments);
+  return failed ? 1 : 0;
 }
 
 /* Handling ctrl-C during replay:
@@ -349,7 +526,7 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
     if (target.event == numeric_limits<decltype(target.event)>::max()) {
       serve_replay_no_debugger(trace_dir, flags);
     } else {
-      auto session = ReplaySession::create(trace_dir);
+      auto session = create_session(trace_dir, flags, target);
       GdbServer::ConnectionFlags conn_flags;
       conn_flags.dbg_port = flags.dbg_port;
       GdbServer(session, session_flags(flags), target).serve_replay(conn_flags);
@@ -367,7 +544,7 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
     close(debugger_params_pipe[0]);
 
     ScopedFd debugger_params_write_pipe(debugger_params_pipe[1]);
-    auto session = ReplaySession::create(trace_dir);
+    auto session = create_session(trace_dir, flags, target);
     GdbServer::ConnectionFlags conn_flags;
     conn_flags.dbg_port = flags.dbg_port;
     conn_flags.debugger_params_write_pipe = &debugger_params_write_pipe;
@@ -476,5 +653,8 @@ int ReplayCommand::run(std::vector<std::string>& args) {
   assert_prerequisites();
   check_performance_settings();
 
+  if (flags.parallel_verify) {
+    return parallel_verify(trace_dir, flags.parallel_verify);
+  }
   return replay(trace_dir, flags);
 }
@@ -8,10 +8,13 @@
 
 #include <syscall.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
 
 #include <algorithm>
 
 #include "AutoRemoteSyscalls.h"
+#include "CompressedReader.h"
+#include "CompressedWriter.h"
 #include "fast_forward.h"
 #include "kernel_metadata.h"
 #include "log.h"
@@ -22,43 +25,6 @@
 using namespace rr;
 using namespace std;
 
-/* Why a skid region?  Interrupts generated by perf counters don't
- * fire at exactly the programmed point (as of 2013 kernel/HW);
- * there's a variable slack region, which is technically unbounded.
- * This means that an interrupt programmed for retired branch k might
- * fire at |k + 50|, for example.  To counteract the slack, we program
- * interrupts just short of our target, by the |SKID_SIZE| region
- * below, and then more slowly advance to the real target.
- *
- * How was this magic number determined?  Trial and error: we want it
- * to be as small as possible for efficiency, but not so small that
- * overshoots are observed.  If all other possible causes of overshoot
- * have been ruled out, like memory divergence, then you'll know that
- * this magic number needs to be increased if the following symptom is
- * observed during replay.  Running with DEBUGLOG enabled (see above),
- * a sequence of log messages like the following will appear
- *
- * 1. programming interrupt for [target - SKID_SIZE] ticks
- * 2. Error: Replay diverged.  Dumping register comparison.
- * 3. Error: [list of divergent registers; arbitrary]
- * 4. Error: overshot target ticks=[target] by [i]
- *
- * The key is that no other replayer log messages occur between (1)
- * and (2).  This spew means that the replayer programmed an interrupt
- * for ticks=[target-SKID_SIZE], but the tracee was actually interrupted
- * at ticks=[target+i].  And that in turn means that the kernel/HW
- * skidded too far past the programmed target for rr to handle it.
- *
- * If that occurs, the SKID_SIZE needs to be increased by at least
- * [i].
- *
- * NB: there are probably deeper reasons for the target slack that
- * could perhaps let it be deduced instead of arrived at empirically;
- * perhaps pipeline depth and things of that nature are involved.  But
- * those reasons if they exit are currently not understood.
- */
-static const int SKID_SIZE = 70;
-
 static void debug_memory(Task* t) {
   if (should_dump_memory(t->current_trace_frame())) {
     dump_process_memory(t, t->current_trace_frame().time(), "rep");
@@ -153,6 +119,32 @@ void ReplaySession::maybe_gc_emufs(SupportedArch arch, int syscallno) {
 }
 
 /*static*/ ReplaySession::shr_ptr ReplaySession::create(const string& dir) {
+  TraceReader trace(dir);
+  TraceFrame::Time gap_end = trace.first_time_after_gap();
+  if (!gap_end) {
+    return create_at_start(trace.dir());
+  }
+
+  // A flight-recorder trace that lost its older events. Start from the
+  // first checkpoint after them.
+  for (TraceFrame::Time time : trace.checkpoint_times()) {
+    if (time >= gap_end) {
+      auto session = create_from_checkpoint(trace.dir(), time);
+      if (session) {
+        return session;
+      }
+      break;
+    }
+  }
+  FATAL() << "Trace `" << trace.dir() << "' was recorded in flight-recorder "
+          << "mode and lost events before event " << gap_end
+          << ", and has no usable checkpoint to start replaying from after "
+             "them. Inspect it with `rr dump'.";
+  return nullptr;
+}
+
+/*static*/ ReplaySession::shr_ptr ReplaySession::create_at_start(
+    const string& dir) {
   shr_ptr session(new ReplaySession(dir));
 
   // Because we execvpe() the tracee, we must ensure that $PATH
@@ -177,6 +169,367 @@ void ReplaySession::maybe_gc_emufs(SupportedArch arch, int syscallno) {
   return session;
 }
 
+/**
+ * Bump this when the layout of persistent checkpoints changes. Checkpoints
+ * also record the sizes of the structures they store verbatim, so ones
+ * written by an incompatible rr build are rejected too.
+ */
+static const uint32_t CHECKPOINT_VERSION = 6;
+
+struct CheckpointHeader {
+  uint32_t version;
+  uint32_t registers_size;
+  uint32_t event_size;
+  uint32_t cpuid_bug_detector_size;
+};
+
+static CheckpointHeader checkpoint_header() {
+  return { CHECKPOINT_VERSION, sizeof(Registers), sizeof(Event),
+           sizeof(CPUIDBugDetector) };
+}
+
+/**
+ * Return the task groups of |session| ordered so that each one's parent
+ * (if it has one) comes before it. Each is restored by forking its parent.
+ */
+static vector<TaskGroup*> task_groups_parents_first(
+    const Session::TaskGroupMap& groups) {
+  vector<TaskGroup*> result;
+  set<TaskGroup*> done;
+  while (result.size() < groups.size()) {
+    size_t before = result.size();
+    for (auto& it : groups) {
+      TaskGroup* tg = it.second;
+      if (!done.count(tg) &&
+          (!tg->parent() || done.count(tg->parent()) ||
+           !groups.count(tg->parent()->tguid()))) {
+        result.push_back(tg);
+        done.insert(tg);
+      }
+    }
+    assert(result.size() > before);
+  }
+  return result;
+}
+
+bool ReplaySession::write_checkpoint() {
+  finish_initializing();
+
+  if (!can_clone() || current_step.action != TSTEP_NONE) {
+    LOG(debug) << "Can't write a checkpoint at " << trace_frame.time();
+    return false;
+  }
+  // Only files still mapped somewhere need saving.
+  gc_emufs();
+
+  vector<TaskGroup*> groups = task_groups_parents_first(task_group_map);
+  pid_t max_rec_tid = 0;
+  for (TaskGroup* tg : groups) {
+    Task* leader = find_task(tg->tgid);
+    if (!leader || leader->task_group().get() != tg ||
+        leader->tuid().serial() != tg->tguid().serial()) {
+      LOG(debug) << "Task group " << tg->tgid << " has lost its leader";
+      return false;
+    }
+    if (leader->vm()->task_set() != tg->task_set()) {
+      LOG(debug) << "Task group " << tg->tgid << " shares its address space";
+      return false;
+    }
+    for (Task* t : tg->task_set()) {
+      max_rec_tid = max(max_rec_tid, t->rec_tid);
+      if (t->unstable || t->emulated_ptracer ||
+          !t->emulated_ptrace_tracees.empty()) {
+        LOG(debug) << "Task " << t->rec_tid << " can't be checkpointed";
+        return false;
+      }
+      for (auto& ev : t->pending_events) {
+        // These point into the syscallbuf as mapped in rr.
+        if (ev.type() == EV_DESCHED ||
+            (ev.is_syscall_event() && ev.Syscall().desched_rec)) {
+          LOG(debug) << "Task " << t->rec_tid << " is in a desched event";
+          return false;
+        }
+      }
+    }
+  }
+  if (vm_map.size() > 1) {
+    // Other shared memory would have to be shared again when restoring.
+    for (auto& vm : vm_map) {
+      for (auto m : vm.second->maps()) {
+        if ((m.map.flags() & MAP_SHARED) &&
+            !emu_fs->has_file_for(m.recorded_map) &&
+            m.map.fsname().find(SYSCALLBUF_SHMEM_PATH_PREFIX) != 0) {
+          LOG(debug) << "Can't checkpoint shared mapping " << m.map;
+          return false;
+        }
+      }
+    }
+  }
+
+  string checkpoints_dir = trace_in.checkpoints_dir();
+  string dir = trace_in.checkpoint_dir(trace_frame.time());
+  char suffix[32];
+  sprintf(suffix, ".tmp.%d", getpid());
+  string tmp_dir = dir + suffix;
+  if ((mkdir(checkpoints_dir.c_str(), S_IRWXU | S_IRWXG) && errno != EEXIST) ||
+      mkdir(tmp_dir.c_str(), S_IRWXU | S_IRWXG)) {
+    LOG(warn) << "Can't create " << tmp_dir;
+    return false;
+  }
+
+  CompressedWriter::Codec codec =
+      CompressedWriter::codec_available(CompressedWriter::CODEC_LZ4)
+          ? CompressedWriter::CODEC_LZ4
+          : CompressedWriter::CODEC_ZLIB;
+  CompressedWriter state(tmp_dir + "/state", 64 * 1024, 1, codec);
+  CompressedWriter memory(tmp_dir + "/memory", 8 * 1024 * 1024, 3, codec);
+  // What replaying up to this event must produce; see matches_checkpoint().
+  CompressedWriter registers(tmp_dir + "/registers", 64 * 1024, 1, codec);
+
+  state << checkpoint_header() << trace_frame.time()
+        << trace_in.task_events_read() << ticks_at_start_of_event
+        << cpuid_bug_detector << statistics_ << next_task_serial_
+        << max_rec_tid;
+
+  vector<EmuFile::shr_ptr> files = emu_fs->all_files();
+  state << files.size();
+  vector<uint8_t> buf(1024 * 1024);
+  for (auto& f : files) {
+    state << f->emu_path() << f->device() << f->inode() << f->size();
+    for (uint64_t offset = 0; offset < f->size(); offset += buf.size()) {
+      size_t len = min<uint64_t>(buf.size(), f->size() - offset);
+      ssize_t nread = pread64(f->fd(), buf.data(), len, offset);
+      memset(buf.data() + max<ssize_t>(0, nread), 0,
+             len - max<ssize_t>(0, nread));
+      memory.write(buf.data(), len);
+    }
+  }
+
+  state << groups.size();
+  for (TaskGroup* tg : groups) {
+    Task* leader = find_task(tg->tgid);
+    TaskGroupUid parent = tg->parent() ? tg->parent()->tguid() : TaskGroupUid();
+    state << tg->tgid << tg->tguid().serial() << parent.tid()
+          << parent.serial() << tg->exit_code << tg->dumpable;
+    leader->write_sighandlers(state);
+    leader->vm()->write_checkpoint(leader, *emu_fs, state, memory);
+    state << tg->task_set().size();
+    Task::write_captured_state(state, leader->capture_state());
+    for (Task* t : tg->task_set()) {
+      if (t != leader) {
+        Task::write_captured_state(state, t->capture_state());
+      }
+    }
+    checksum_process_memory(leader, trace_frame.time(), tmp_dir);
+  }
+
+  registers << task_map.size();
+  for (auto& it : task_map) {
+    registers << it.first << it.second->regs();
+  }
+
+  state.close();
+  memory.close();
+  registers.close();
+  if (!state.good() || !memory.good() || !registers.good() ||
+      rename(tmp_dir.c_str(), dir.c_str())) {
+    // Most likely another rr wrote this checkpoint first.
+    LOG(warn) << "Failed to write checkpoint " << dir;
+    TraceStream::remove_checkpoint_dir(tmp_dir);
+    return false;
+  }
+  LOG(debug) << "Wrote checkpoint " << dir;
+  return true;
+}
+
+/*static*/ ReplaySession::shr_ptr ReplaySession::create_from_checkpoint(
+    const string& dir, TraceFrame::Time time) {
+  shr_ptr session = create_at_start(dir);
+  string path = session->trace_in.checkpoint_dir(time);
+  CompressedReader state(path + "/state");
+  CompressedReader memory(path + "/memory");
+  CheckpointHeader header;
+  state >> header;
+  CheckpointHeader expected = checkpoint_header();
+  if (!state.good() || !memory.good() ||
+      memcmp(&header, &expected, sizeof(header))) {
+    LOG(warn) << "Checkpoint " << path << " is unreadable or was written by "
+                                        "a different rr build";
+    return nullptr;
+  }
+
+  // Get the initial exec out of the way. After it, every replay has the
+  // same fixed mappings (see AddressSpace::read_checkpoint()).
+  while (!session->done_initial_exec() ||
+         session->current_step_key().in_execution()) {
+    if (session->replay_step(RUN_CONTINUE).status == REPLAY_EXITED) {
+      return nullptr;
+    }
+  }
+
+  TraceFrame::Time checkpoint_time;
+  uint64_t task_events;
+  Statistics statistics;
+  uint32_t next_serial;
+  pid_t max_rec_tid;
+  state >> checkpoint_time >> task_events >>
+      session->ticks_at_start_of_event >> session->cpuid_bug_detector >>
+      statistics >> next_serial >> max_rec_tid;
+  if (checkpoint_time != time) {
+    LOG(warn) << "Checkpoint " << path << " is for event " << checkpoint_time;
+    return nullptr;
+  }
+
+  // Task groups are restored by forking their parents. Groups without one
+  // are forked from a template process, which mustn't use any tid or
+  // serial that a restored task needs. The initial task might, so we
+  // get rid of it.
+  Task* t0 = session->current_task();
+  Task* tmpl = t0->os_fork_into(session.get(), max_rec_tid + 1,
+                                session->next_task_serial());
+  session->on_create(tmpl);
+  session->kill_task(t0);
+
+  EmuFs& emu_fs = session->emufs();
+  size_t count;
+  state >> count;
+  vector<uint8_t> buf(1024 * 1024);
+  for (size_t i = 0; i < count; ++i) {
+    string emu_path;
+    dev_t device;
+    ino_t inode;
+    uint64_t size;
+    state >> emu_path >> device >> inode >> size;
+    auto f = emu_fs.get_or_create(
+        KernelMapping(remote_ptr<void>(), page_size(), emu_path, device, inode,
+                      PROT_READ, MAP_SHARED),
+        size);
+    for (uint64_t offset = 0; offset < size; offset += buf.size()) {
+      size_t len = min<uint64_t>(buf.size(), size - offset);
+      memory.read(buf.data(), len);
+      if (pwrite64(f->fd(), buf.data(), len, offset) != ssize_t(len)) {
+        FATAL() << "Can't restore " << f->real_path();
+      }
+    }
+  }
+
+  state >> count;
+  for (size_t i = 0; i < count; ++i) {
+    pid_t tgid, parent_tgid;
+    uint32_t serial, parent_serial;
+    int exit_code;
+    bool dumpable;
+    state >> tgid >> serial >> parent_tgid >> parent_serial >> exit_code >>
+        dumpable;
+    TaskGroup* parent =
+        session->find_task_group(TaskGroupUid(parent_tgid, parent_serial));
+    Task* source = parent ? session->find_task(parent->tgid) : tmpl;
+
+    Task* leader = source->os_fork_into(session.get(), tgid, serial);
+    session->on_create(leader);
+    leader->read_sighandlers(state);
+    AddressSpace* vm = leader->vm().get();
+    session->vm_map.erase(vm->uid());
+    bool ok = vm->read_checkpoint(leader, state, memory);
+    session->vm_map[vm->uid()] = vm;
+    if (!ok) {
+      return nullptr;
+    }
+
+    size_t num_tasks;
+    state >> num_tasks;
+    Task::CapturedState leader_state = Task::read_captured_state(state);
+    if (leader_state.regs.arch() != leader->arch()) {
+      LOG(warn) << "Can't restore " << tgid << " from a process of a different "
+                                                "architecture";
+      return nullptr;
+    }
+    {
+      AutoRemoteSyscalls remote(leader);
+      for (auto m : vm->maps()) {
+        if ((m.recorded_map.flags() & MAP_SHARED) &&
+            emu_fs.has_file_for(m.recorded_map)) {
+          remap_shared_mmap(remote, emu_fs, m);
+        }
+      }
+      for (size_t j = 1; j < num_tasks; ++j) {
+        Task::CapturedState member_state = Task::read_captured_state(state);
+        Task* t = Task::os_clone_into(member_state, leader, remote);
+        session->on_create(t);
+        t->copy_state(member_state);
+      }
+    }
+    leader->copy_state(leader_state);
+    leader->task_group()->exit_code = exit_code;
+    leader->task_group()->dumpable = dumpable;
+  }
+  session->kill_task(tmpl);
+  if (!state.good() || !memory.good()) {
+    LOG(warn) << "Checkpoint " << path << " is truncated";
+    return nullptr;
+  }
+
+  session->statistics_ = statistics;
+  session->next_task_serial_ = next_serial;
+  TraceReader& trace = session->trace_in;
+  if (!trace.seek_to_time(time)) {
+    return nullptr;
+  }
+  trace.skip_task_events(task_events);
+  session->trace_frame = trace.read_frame();
+  session->current_step.action = TSTEP_NONE;
+  return session;
+}
+
+bool ReplaySession::matches_checkpoint() {
+  assert(current_step.action == TSTEP_NONE);
+
+  string dir = trace_in.checkpoint_dir(trace_frame.time());
+  CompressedReader registers(dir + "/registers");
+  size_t count;
+  registers >> count;
+  if (!registers.good()) {
+    LOG(error) << "Checkpoint " << dir << " has no registers";
+    return false;
+  }
+  bool ok = true;
+  if (count != task_map.size()) {
+    LOG(error) << "Checkpoint " << dir << " has " << count << " tasks but "
+               << task_map.size() << " are live";
+    ok = false;
+  }
+  for (size_t i = 0; i < count && registers.good(); ++i) {
+    pid_t rec_tid;
+    Registers regs;
+    registers >> rec_tid >> regs;
+    Task* t = find_task(rec_tid);
+    if (!t) {
+      LOG(error) << "Task " << rec_tid << " of checkpoint " << dir
+                 << " isn't live";
+      ok = false;
+    } else if (!Registers::compare_register_files(t, "checkpoint", regs,
+                                                  "replay", t->regs(),
+                                                  LOG_MISMATCHES)) {
+      ok = false;
+    }
+  }
+  if (!ok || !registers.good()) {
+    return false;
+  }
+
+  for (auto& it : task_group_map) {
+    // Memory divergence is fatal, as it is with the trace's own checksums.
+    validate_process_memory(find_task(it.second->tgid), trace_frame.time(),
+                            dir);
+  }
+  return true;
+}
+
+/*static*/ vector<TraceFrame::Time> ReplaySession::persistent_checkpoints(
+    const string& dir) {
+  return TraceReader(dir).checkpoint_times();
+}
+
 void ReplaySession::advance_to_next_trace_frame() {
   if (trace_in.at_end()) {
     return;
@@ -201,7 +554,8 @@ static bool compute_ticks_request(
     TicksRequest* ticks_request) {
   *ticks_request = RESUME_UNLIMITED_TICKS;
   if (constraints.ticks_target > 0) {
-    Ticks ticks_period = constraints.ticks_target - SKID_SIZE - t->tick_count();
+    Ticks ticks_period =
+        constraints.ticks_target - PerfCounters::SKID_SIZE - t->tick_count();
     if (ticks_period <= 0) {
       // Behave as if we actually executed something. Callers assume we did.
       t->clear_wait_status();
@@ -230,10 +584,11 @@ Completion ReplaySession::cont_syscall_boundary(
   }
 
   if (constraints.command == RUN_SINGLESTEP_FAST_FORWARD) {
-    // ignore ticks_period. We can't add more than one tick during a
-    // fast_forward so it doesn't matter.
+    // ignore ticks_period. A fast_forward doesn't add more than one tick
+    // beyond what fast_forward_ticks_limit allows, so it doesn't matter.
     did_fast_forward |= fast_forward_through_instruction(
-        t, RESUME_SYSEMU_SINGLESTEP, constraints.stop_before_states);
+        t, RESUME_SYSEMU_SINGLESTEP, constraints.stop_before_states,
+        fast_forward_ticks_limit(constraints));
   } else {
     ResumeRequest resume_how =
         constraints.is_singlestep() ? RESUME_SYSEMU_SINGLESTEP : RESUME_SYSEMU;
@@ -339,6 +694,21 @@ Completion ReplaySession::exit_syscall(Task* t) {
   return COMPLETE;
 }
 
+/**
+ * The tick count below which a RUN_SINGLESTEP_FAST_FORWARD may run loop
+ * iterations, or 0 if it mustn't. The current event happens at the
+ * frame's tick count, so we mustn't reach that either, and we can't trust
+ * it at all for events with ticks slop.
+ */
+Ticks ReplaySession::fast_forward_ticks_limit(
+    const StepConstraints& constraints) {
+  if (constraints.fast_forward_ticks_limit == 0 ||
+      trace_frame.event().has_ticks_slop()) {
+    return 0;
+  }
+  return min(trace_frame.ticks(), constraints.fast_forward_ticks_limit);
+}
+
 void ReplaySession::check_pending_sig(Task* t) {
   ASSERT(t, 0 < t->pending_sig())
       << "Replaying `" << trace_frame.event()
@@ -370,7 +740,8 @@ void ReplaySession::continue_or_step(Task* t,
     t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT, tick_request);
   } else if (constraints.command == RUN_SINGLESTEP_FAST_FORWARD) {
     did_fast_forward |= fast_forward_through_instruction(
-        t, RESUME_SINGLESTEP, constraints.stop_before_states);
+        t, RESUME_SINGLESTEP, constraints.stop_before_states,
+        fast_forward_ticks_limit(constraints));
   } else {
     t->resume_execution(resume_how, RESUME_WAIT, tick_request);
   }
@@ -477,11 +848,12 @@ Completion ReplaySession::emulate_async_signal(
              << ip;
 
   /* XXX should we only do this if (ticks > 10000)? */
-  while (ticks_left - SKID_SIZE > SKID_SIZE) {
-    LOG(debug) << "  programming interrupt for " << (ticks_left - SKID_SIZE)
-               << " ticks";
+  while (ticks_left - PerfCounters::SKID_SIZE > PerfCounters::SKID_SIZE) {
+    LOG(debug) << "  programming interrupt for "
+               << (ticks_left - PerfCounters::SKID_SIZE) << " ticks";
 
-    continue_or_step(t, constraints, (TicksRequest)(ticks_left - SKID_SIZE));
+    continue_or_step(t, constraints,
+                     (TicksRequest)(ticks_left - PerfCounters::SKID_SIZE));
     guard_unexpected_signal(t);
 
     ticks_left = ticks - t->tick_count();
@@ -655,8 +1027,16 @@ Completion ReplaySession::emulate_async_signal(
         // This state may not be relevant if we don't have the correct tick
         // count yet. But it doesn't hurt to push it on anyway.
         states.push_back(&regs);
-        did_fast_forward |=
-            fast_forward_through_instruction(t, RESUME_SINGLESTEP, states);
+        // |regs| can't be reached before |ticks|. When we're only stepping
+        // internally, nothing else needs to be seen on the way.
+        Ticks ticks_limit = 0;
+        if (!constraints.is_singlestep()) {
+          ticks_limit = ticks;
+        } else if (constraints.stop_before_states.empty()) {
+          ticks_limit = fast_forward_ticks_limit(constraints);
+        }
+        did_fast_forward |= fast_forward_through_instruction(
+            t, RESUME_SINGLESTEP, states, ticks_limit);
         SIGTRAP_run_command = RUN_SINGLESTEP_FAST_FORWARD;
         check_pending_sig(t);
       }
@@ -807,7 +1187,7 @@ void ReplaySession::prepare_syscallbuf_records(Task* t) {
   // region.
   auto buf = t->trace_reader().read_raw_data();
   ASSERT(t, buf.data.size() >= sizeof(struct syscallbuf_hdr));
-  ASSERT(t, buf.data.size() <= SYSCALLBUF_BUFFER_SIZE);
+  ASSERT(t, buf.data.size() <= t->syscallbuf_size);
   ASSERT(t, buf.addr == t->syscallbuf_child.cast<void>());
 
   struct syscallbuf_hdr recorded_hdr;
@@ -818,7 +1198,7 @@ void ReplaySession::prepare_syscallbuf_records(Task* t) {
          buf.data.size() - sizeof(struct syscallbuf_hdr));
 
   ASSERT(t, recorded_hdr.num_rec_bytes + sizeof(struct syscallbuf_hdr) <=
-                SYSCALLBUF_BUFFER_SIZE);
+                t->syscallbuf_size);
 
   current_step.flush.stop_breakpoint_addr =
       t->stopping_breakpoint_table.to_data_ptr<void>().as_int() +
@@ -898,20 +1278,7 @@ Completion ReplaySession::patch_next_syscall(
   // All patching effects have been recorded to the trace.
   // First, replay any memory mapping done by Monkeypatcher. There should be
   // at most one but we might as well be general.
-  while (true) {
-    TraceReader::MappedData data;
-    bool found;
-    KernelMapping km = t->trace_reader().read_mapped_region(&data, &found);
-    if (!found) {
-      break;
-    }
-    AutoRemoteSyscalls remote(t);
-    ASSERT(t, km.flags() & MAP_ANONYMOUS);
-    remote.infallible_mmap_syscall(km.start(), km.size(), km.prot(),
-                                   km.flags() | MAP_FIXED, -1, 0);
-    t->vm()->map(km.start(), km.size(), km.prot(), km.flags(), 0, string(),
-                 KernelMapping::NO_DEVICE, KernelMapping::NO_INODE, &km);
-  }
+  process_patch_mappings(t);
 
   // Now replay all data records.
   t->apply_all_data_records_from_trace();
@@ -939,7 +1306,7 @@ void ReplaySession::check_approaching_ticks_target(
     Task* t, const StepConstraints& constraints, BreakStatus& break_status) {
   if (constraints.ticks_target > 0) {
     Ticks ticks_left = constraints.ticks_target - t->tick_count();
-    if (ticks_left <= SKID_SIZE) {
+    if (ticks_left <= PerfCounters::SKID_SIZE) {
       break_status.approaching_ticks_target = true;
     }
   }
@@ -1101,6 +1468,18 @@ void ReplaySession::setup_replay_one_trace_frame(Task* t) {
       // the recorded data area. This is important because stray reads such
       // as those performed by return_addresses should be consistent.
       t->reset_syscallbuf();
+      {
+        // If the buffer was resized at this point during recording, the
+        // new size was recorded with the reset.
+        TraceReader::RawData data;
+        if (t->trace_reader().read_raw_data_for_frame(trace_frame, data)) {
+          uint32_t size;
+          ASSERT(t, data.addr == t->syscallbuf_size_child.cast<void>() &&
+                        data.data.size() == sizeof(size));
+          memcpy(&size, data.data.data(), sizeof(size));
+          t->set_syscallbuf_size(size);
+        }
+      }
       current_step.action = TSTEP_RETIRE;
       break;
     case EV_PATCH_SYSCALL:
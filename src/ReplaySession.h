@@ -208,13 +208,48 @@ public:
 
   /**
    * Create a replay session that will use the trace directory specified
-   * by 'dir', or the latest trace if 'dir' is not supplied.
+   * by 'dir', or the latest trace if 'dir' is not supplied. If the trace
+   * lost events in flight-recorder mode, the session starts at the first
+   * checkpoint after them.
    */
   static shr_ptr create(const std::string& dir);
 
+  /**
+   * Save the state of this session in a persistent checkpoint in the trace
+   * directory, so later replays of the trace can start at the current event
+   * instead of at the beginning. Only possible when can_clone() and nothing
+   * of the current event has been replayed yet; returns false (having
+   * written nothing) if the state can't be saved.
+   */
+  bool write_checkpoint();
+  /**
+   * Create a session positioned at the event of the persistent checkpoint
+   * with time |time| of the trace in 'dir'. Returns null if the checkpoint
+   * can't be restored, e.g. because a different rr build wrote it.
+   */
+  static shr_ptr create_from_checkpoint(const std::string& dir,
+                                        TraceFrame::Time time);
+  /**
+   * Check that the state of this session matches the persistent checkpoint
+   * at the current event, which must exist: the same tasks are live with the
+   * same registers, and their memory has the same checksums. Returns false
+   * on a register mismatch, asserts on a memory mismatch. Only call when
+   * nothing of the current event has been replayed yet.
+   */
+  bool matches_checkpoint();
+  /**
+   * Return the times of the persistent checkpoints of the trace in 'dir',
+   * in increasing order.
+   */
+  static std::vector<TraceFrame::Time> persistent_checkpoints(
+      const std::string& dir);
+
   struct StepConstraints {
     explicit StepConstraints(RunCommand command)
-        : command(command), stop_at_time(0), ticks_target(0) {}
+        : command(command),
+          stop_at_time(0),
+          ticks_target(0),
+          fast_forward_ticks_limit(0) {}
     RunCommand command;
     TraceFrame::Time stop_at_time;
     Ticks ticks_target;
@@ -223,6 +258,11 @@ public:
     // RUN_SINGLESTEP_FAST_FORWARD will always singlestep at least once
     // regardless.
     std::vector<const Registers*> stop_before_states;
+    // When the RunCommand is RUN_SINGLESTEP_FAST_FORWARD and this is nonzero,
+    // the step may also run through iterations of simple loops as long as
+    // the task's tick count stays below this. None of |stop_before_states|
+    // may be reachable with a lower tick count.
+    Ticks fast_forward_ticks_limit;
 
     bool is_singlestep() const {
       return command == RUN_SINGLESTEP ||
@@ -280,6 +320,12 @@ private:
     advance_to_next_trace_frame();
   }
 
+  /**
+   * Create a session at the start of the trace in 'dir', ignoring any
+   * events it lost in flight-recorder mode.
+   */
+  static shr_ptr create_at_start(const std::string& dir);
+
   ReplaySession(const ReplaySession& other)
       : Session(other),
         emu_fs(other.emu_fs->clone()),
@@ -301,6 +347,7 @@ private:
   Completion exit_task(Task* t);
   void check_ticks_consistency(Task* t, const Event& ev);
   void check_pending_sig(Task* t);
+  Ticks fast_forward_ticks_limit(const StepConstraints& constraints);
   void continue_or_step(Task* t, const StepConstraints& constraints,
                         TicksRequest tick_request,
                         ResumeRequest resume_how = RESUME_SYSCALL);
@@ -6,8 +6,10 @@
 
 #include <math.h>
 
+#include "Flags.h"
 #include "fast_forward.h"
 #include "log.h"
+#include "util.h"
 
 using namespace rr;
 using namespace std;
@@ -66,9 +68,16 @@ ReplayTimeline::ReplayTimeline(std::shared_ptr<ReplaySession> session,
     : session_flags(session_flags),
       current(std::move(session)),
       breakpoints_applied(false),
-      reverse_execution_barrier_event(0) {
+      reverse_execution_barrier_event(0),
+      memory_budget(Flags::get().checkpoint_memory_budget),
+      checkpoints_over_budget(0),
+      prewarm_current_progress(-1) {
   current->set_visible_execution(false);
   current->set_flags(session_flags);
+  if (!memory_budget) {
+    memory_budget =
+        (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 4;
+  }
 }
 
 ReplayTimeline::~ReplayTimeline() {
@@ -1086,6 +1095,9 @@ ReplayResult ReplayTimeline::reverse_singlestep(
                          << current_mark_key();
               constraints =
                   ReplaySession::StepConstraints(RUN_SINGLESTEP_FAST_FORWARD);
+              // Nothing between here and the ticks target needs to be
+              // seen, so tight loops can be run rather than singlestepped.
+              constraints.fast_forward_ticks_limit = ticks_target;
             }
           } else {
             if (seen_other_task_break) {
@@ -1477,6 +1489,54 @@ void ReplayTimeline::discard_past_reverse_exec_checkpoints(
     remove_explicit_checkpoint(m);
     reverse_exec_checkpoints.erase(m);
   }
+
+  enforce_checkpoint_memory_budget();
+}
+
+vector<ReplayTimeline::CheckpointMemoryCost>
+ReplayTimeline::reverse_exec_checkpoint_costs() {
+  vector<CheckpointMemoryCost> result;
+  for (auto& it : reverse_exec_checkpoints) {
+    uint64_t bytes = 0;
+    // Checkpoints may not be fully initialized, but every address space
+    // has a task already.
+    for (AddressSpace* vm : it.first.ptr->checkpoint->vms()) {
+      bytes += private_dirty_bytes((*vm->task_set().begin())->tid);
+    }
+    result.push_back({ it.first, it.second, bytes });
+  }
+  return result;
+}
+
+void ReplayTimeline::enforce_checkpoint_memory_budget() {
+  vector<CheckpointMemoryCost> costs = reverse_exec_checkpoint_costs();
+  uint64_t total = 0;
+  for (auto& c : costs) {
+    total += c.bytes;
+  }
+  while (total > memory_budget && !costs.empty()) {
+    // Without a checkpoint, reverse execution to before it has to start at
+    // the previous checkpoint instead, so that's the replay it saves.
+    size_t victim = 0;
+    double worst = -1;
+    for (size_t i = 0; i < costs.size(); ++i) {
+      Progress saved = costs[i].progress - (i ? costs[i - 1].progress : 0);
+      double bytes_per_progress =
+          double(costs[i].bytes) / max<Progress>(saved, 1);
+      if (bytes_per_progress > worst) {
+        worst = bytes_per_progress;
+        victim = i;
+      }
+    }
+    LOG(debug) << "Discarding reverse-exec checkpoint at "
+               << costs[victim].mark << " costing " << costs[victim].bytes
+               << " bytes";
+    total -= costs[victim].bytes;
+    remove_explicit_checkpoint(costs[victim].mark);
+    reverse_exec_checkpoints.erase(costs[victim].mark);
+    costs.erase(costs.begin() + victim);
+    ++checkpoints_over_budget;
+  }
 }
 
 ReplayTimeline::Mark ReplayTimeline::set_short_checkpoint() {
@@ -1496,3 +1556,87 @@ ReplayTimeline::Mark ReplayTimeline::set_short_checkpoint() {
   swap(m, reverse_exec_short_checkpoint);
   return reverse_exec_short_checkpoint;
 }
+
+bool ReplayTimeline::start_prewarming(Progress now) {
+  // Only the last low_overhead_inter_checkpoint_interval is allowed to keep
+  // checkpoints this dense; see discard_past_reverse_exec_checkpoints.
+  Progress window_start = now - low_overhead_inter_checkpoint_interval;
+  Progress end = now;
+  TraceFrame::Time end_time = current->trace_reader().time();
+  for (auto it = reverse_exec_checkpoints.rbegin();
+       it != reverse_exec_checkpoints.rend() && end > window_start; ++it) {
+    if (end <= prewarm_searched_down_to &&
+        end - it->second >=
+            2 * expecting_reverse_exec_inter_checkpoint_interval) {
+      LOG(debug) << "Prewarming reverse-exec checkpoints between " << it->first
+                 << " and event " << end_time;
+      prewarm_session = it->first.ptr->checkpoint->clone();
+      prewarm_searched_down_to = it->second;
+      prewarm_end_progress = end;
+      prewarm_end_time = end_time;
+      prewarm_last_checkpoint_progress = it->second;
+      return true;
+    }
+    end = it->second;
+    end_time = it->first.time();
+  }
+  return false;
+}
+
+/**
+ * Run prewarm steps for at most this many ticks, so that a long stretch of
+ * execution without events doesn't keep us from polling the debugger.
+ */
+static const Ticks prewarm_step_ticks = 1000000;
+
+bool ReplayTimeline::prewarm_reverse_exec_checkpoints() {
+  Progress now = estimate_progress();
+  if (now != prewarm_current_progress) {
+    if (prewarm_session) {
+      LOG(debug) << "Abandoning prewarming; current session has moved";
+    }
+    prewarm_session = nullptr;
+    prewarm_current_progress = now;
+    prewarm_searched_down_to = now;
+  }
+  if (!prewarm_session && !start_prewarming(now)) {
+    return false;
+  }
+
+  // Make the prewarm session current for a single step, so that mark() and
+  // add_explicit_checkpoint() apply to it.
+  unapply_breakpoints_and_watchpoints();
+  swap(current, prewarm_session);
+  shared_ptr<InternalMark> saved_current_at_or_after_mark;
+  swap(current_at_or_after_mark, saved_current_at_or_after_mark);
+
+  ReplaySession::StepConstraints constraints(RUN_CONTINUE);
+  constraints.stop_at_time = prewarm_end_time;
+  Task* t = current->current_task();
+  if (t) {
+    constraints.ticks_target = t->tick_count() + prewarm_step_ticks;
+  }
+  ReplayResult result = current->replay_step(constraints);
+  Progress progress = estimate_progress();
+  bool done = result.status != REPLAY_CONTINUE ||
+              current->trace_reader().time() >= prewarm_end_time ||
+              progress >= prewarm_end_progress -
+                              expecting_reverse_exec_inter_checkpoint_interval;
+  if (!done &&
+      progress >= prewarm_last_checkpoint_progress +
+                      expecting_reverse_exec_inter_checkpoint_interval &&
+      current->can_clone()) {
+    Mark m = add_explicit_checkpoint();
+    LOG(debug) << "Creating prewarmed reverse-exec checkpoint at " << m;
+    reverse_exec_checkpoints[m] = progress;
+    prewarm_last_checkpoint_progress = progress;
+  }
+
+  swap(current_at_or_after_mark, saved_current_at_or_after_mark);
+  swap(current, prewarm_session);
+  if (done) {
+    prewarm_session = nullptr;
+    enforce_checkpoint_memory_budget();
+  }
+  return true;
+}
@@ -28,7 +28,11 @@ private:
 public:
   ReplayTimeline(std::shared_ptr<ReplaySession> session,
                  const ReplaySession::Flags& session_flags);
-  ReplayTimeline() : breakpoints_applied(false) {}
+  ReplayTimeline()
+      : breakpoints_applied(false),
+        memory_budget(0),
+        checkpoints_over_budget(0),
+        prewarm_current_progress(-1) {}
   ~ReplayTimeline();
 
   bool is_running() const { return current != nullptr; }
@@ -242,6 +246,40 @@ public:
    */
   void apply_breakpoints_and_watchpoints();
 
+  /**
+   * Bytes of memory the reverse-exec checkpoints may pin. A forked
+   * checkpoint costs whatever pages have been dirtied privately since the
+   * fork, which grows as the session it was forked from moves on.
+   */
+  uint64_t checkpoint_memory_budget() const { return memory_budget; }
+  /**
+   * Number of reverse-exec checkpoints discarded to stay within the budget.
+   */
+  uint64_t checkpoints_discarded_over_budget() const {
+    return checkpoints_over_budget;
+  }
+
+  struct CheckpointMemoryCost {
+    Mark mark;
+    Progress progress;
+    uint64_t bytes;
+  };
+  /**
+   * Measure what each reverse-exec checkpoint costs now, in execution order.
+   */
+  std::vector<CheckpointMemoryCost> reverse_exec_checkpoint_costs();
+
+  /**
+   * Do a small amount of work towards filling the recent past with
+   * reverse-exec checkpoints at EXPECT_SHORT_REVERSE_EXECUTION density, by
+   * replaying a clone of an earlier checkpoint forward. The current session
+   * isn't touched. Call this repeatedly while waiting for the debugger;
+   * each call returns quickly so the work can be dropped as soon as a
+   * request arrives, and it's abandoned if the current session moves.
+   * Returns false when there's nothing left to do here.
+   */
+  bool prewarm_reverse_exec_checkpoints();
+
 private:
   /**
    * TraceFrame::Time + Ticks + ReplayStepKey does not uniquely identify
@@ -415,9 +453,22 @@ private:
    * useless).
    */
   void discard_future_reverse_exec_checkpoints();
+  /**
+   * Discard reverse-exec checkpoints until they fit in memory_budget,
+   * preferring the ones that cost the most memory per unit of reverse-exec
+   * replay they save.
+   */
+  void enforce_checkpoint_memory_budget();
 
   Mark set_short_checkpoint();
 
+  /**
+   * Find the latest gap between reverse-exec checkpoints behind |now| that
+   * prewarm_reverse_exec_checkpoints hasn't filled yet, and set up
+   * prewarm_session to fill it. Returns false if there isn't one.
+   */
+  bool start_prewarming(Progress now);
+
   /**
    * If result.break_status hit watchpoints or breakpoints, evaluate their
    * conditions and clear the break_status flags if the conditions don't hold.
@@ -466,6 +517,9 @@ private:
    */
   std::map<Mark, Progress> reverse_exec_checkpoints;
 
+  uint64_t memory_budget;
+  uint64_t checkpoints_over_budget;
+
   /**
    * When these are non-null, then when singlestepping from
    * no_break_interval_start to no_break_interval_end, none of the currently
@@ -479,6 +533,20 @@ private:
    * accelerate a sequence of reverse singlestep operations.
    */
   Mark reverse_exec_short_checkpoint;
+
+  /**
+   * State of prewarm_reverse_exec_checkpoints. prewarm_session is a clone
+   * of a reverse-exec checkpoint that we're replaying forward to
+   * prewarm_end_time or prewarm_end_progress, whichever comes first. Gaps
+   * ending after prewarm_searched_down_to have been dealt with. All of this
+   * is only valid while the current session is at prewarm_current_progress.
+   */
+  ReplaySession::shr_ptr prewarm_session;
+  Progress prewarm_current_progress;
+  Progress prewarm_searched_down_to;
+  Progress prewarm_end_progress;
+  TraceFrame::Time prewarm_end_time;
+  Progress prewarm_last_checkpoint_progress;
 };
 
 std::ostream& operator<<(std::ostream& s, const ReplayTimeline::Mark& o);
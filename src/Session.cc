@@ -160,87 +160,98 @@ AddressSpace* Session::find_address_space(const AddressSpaceUid& vmuid) const {
   return it->second;
 }
 
+/*static*/ void Session::detach_for_kill(Task* t) {
+  if (!t->is_stopped) {
+    // During recording we might be aborting the recording, in which case
+    // one or more tasks might not be stopped. We haven't got any really
+    // good options here so we'll just skip detaching and try killing
+    // it with SIGKILL below. rr will usually exit immediatley after this
+    // so the likelihood that we'll leak a zombie task isn't too bad.
+    return;
+  }
+
+  if (!t->stable_exit) {
+    /*
+     * Prepare to forcibly kill this task by detaching it first. To ensure
+     * the task doesn't continue executing, we first set its ip() to an
+     * invalid value. We need to do this for all tasks in the Session before
+     * kill() is guaranteed to work properly. SIGKILL on ptrace-attached tasks
+     * seems to not work very well, and after sending SIGKILL we can't seem to
+     * reliably detach.
+     */
+    LOG(debug) << "safely detaching from " << t->tid << " ...";
+    // Detaching from the process lets it continue. We don't want a replaying
+    // process to perform syscalls or do anything else observable before we
+    // get around to SIGKILLing it. So we move its ip() to an address
+    // which will cause it to do an exit() syscall if it runs at all.
+    // We used to set this to an invalid address, but that causes a SIGSEGV
+    // to be raised which can cause core dumps after we detach from ptrace.
+    // Making the process undumpable with PR_SET_DUMPABLE turned out not to
+    // be practical because that has a side effect of triggering various
+    // security measures blocking inspection of the process (PTRACE_ATTACH,
+    // access to /proc/<pid>/fd).
+    // Disabling dumps via setrlimit(RLIMIT_CORE, 0) doesn't stop dumps
+    // if /proc/sys/kernel/core_pattern is set to pipe the core to a process
+    // (e.g. to systemd-coredump).
+    // We also tried setting ip() to an address that does an infinite loop,
+    // but that leaves a runaway process if something happens to kill rr
+    // after detaching but before we get a chance to SIGKILL the tracee.
+    Registers r = t->regs();
+    r.set_ip(t->vm()->privileged_traced_syscall_ip());
+    r.set_syscallno(syscall_number_for_exit(r.arch()));
+    r.set_arg1(0);
+    t->set_regs(r);
+    long result;
+    do {
+      // We have observed this failing with an ESRCH when the thread clearly
+      // still exists and is ptraced. Retrying the PTRACE_DETACH seems to
+      // work around it.
+      result = t->fallible_ptrace(PTRACE_DETACH, nullptr, nullptr);
+      ASSERT(t, result >= 0 || errno == ESRCH);
+    } while (result < 0);
+  }
+}
+
+/*static*/ void Session::kill_detached(Task* t) {
+  if (!t->stable_exit && !t->unstable) {
+    /**
+     * Destroy the OS task backing this by sending it SIGKILL and
+     * ensuring it was delivered.  After |kill()|, the only
+     * meaningful thing that can be done with this task is to
+     * delete it.
+     */
+    LOG(debug) << "sending SIGKILL to " << t->tid << " ...";
+    // If we haven't already done a stable exit via syscall,
+    // kill the task and note that the entire task group is unstable.
+    // The task may already have exited due to the preparation above,
+    // so we might accidentally shoot down the wrong task :-(, but we
+    // have to do this because the task might be in a state where it's not
+    // going to run and exit by itself.
+    // Linux doesn't seem to give us a reliable way to detach and kill
+    // the tracee without races.
+    syscall(SYS_tgkill, t->real_tgid(), t->tid, SIGKILL);
+    t->task_group()->destabilize();
+  }
+
+  delete t;
+}
+
 void Session::kill_all_tasks() {
   for (auto& v : task_map) {
-    Task* t = v.second;
-
-    if (!t->is_stopped) {
-      // During recording we might be aborting the recording, in which case
-      // one or more tasks might not be stopped. We haven't got any really
-      // good options here so we'll just skip detaching and try killing
-      // it with SIGKILL below. rr will usually exit immediatley after this
-      // so the likelihood that we'll leak a zombie task isn't too bad.
-      continue;
-    }
-
-    if (!t->stable_exit) {
-      /*
-       * Prepare to forcibly kill this task by detaching it first. To ensure
-       * the task doesn't continue executing, we first set its ip() to an
-       * invalid value. We need to do this for all tasks in the Session before
-       * kill() is guaranteed to work properly. SIGKILL on ptrace-attached tasks
-       * seems to not work very well, and after sending SIGKILL we can't seem to
-       * reliably detach.
-       */
-      LOG(debug) << "safely detaching from " << t->tid << " ...";
-      // Detaching from the process lets it continue. We don't want a replaying
-      // process to perform syscalls or do anything else observable before we
-      // get around to SIGKILLing it. So we move its ip() to an address
-      // which will cause it to do an exit() syscall if it runs at all.
-      // We used to set this to an invalid address, but that causes a SIGSEGV
-      // to be raised which can cause core dumps after we detach from ptrace.
-      // Making the process undumpable with PR_SET_DUMPABLE turned out not to
-      // be practical because that has a side effect of triggering various
-      // security measures blocking inspection of the process (PTRACE_ATTACH,
-      // access to /proc/<pid>/fd).
-      // Disabling dumps via setrlimit(RLIMIT_CORE, 0) doesn't stop dumps
-      // if /proc/sys/kernel/core_pattern is set to pipe the core to a process
-      // (e.g. to systemd-coredump).
-      // We also tried setting ip() to an address that does an infinite loop,
-      // but that leaves a runaway process if something happens to kill rr
-      // after detaching but before we get a chance to SIGKILL the tracee.
-      Registers r = t->regs();
-      r.set_ip(t->vm()->privileged_traced_syscall_ip());
-      r.set_syscallno(syscall_number_for_exit(r.arch()));
-      r.set_arg1(0);
-      t->set_regs(r);
-      long result;
-      do {
-        // We have observed this failing with an ESRCH when the thread clearly
-        // still exists and is ptraced. Retrying the PTRACE_DETACH seems to
-        // work around it.
-        result = t->fallible_ptrace(PTRACE_DETACH, nullptr, nullptr);
-        ASSERT(t, result >= 0 || errno == ESRCH);
-      } while (result < 0);
-    }
+    detach_for_kill(v.second);
   }
 
   while (!task_map.empty()) {
-    Task* t = task_map.rbegin()->second;
-    if (!t->stable_exit && !t->unstable) {
-      /**
-       * Destroy the OS task backing this by sending it SIGKILL and
-       * ensuring it was delivered.  After |kill()|, the only
-       * meaningful thing that can be done with this task is to
-       * delete it.
-       */
-      LOG(debug) << "sending SIGKILL to " << t->tid << " ...";
-      // If we haven't already done a stable exit via syscall,
-      // kill the task and note that the entire task group is unstable.
-      // The task may already have exited due to the preparation above,
-      // so we might accidentally shoot down the wrong task :-(, but we
-      // have to do this because the task might be in a state where it's not
-      // going to run and exit by itself.
-      // Linux doesn't seem to give us a reliable way to detach and kill
-      // the tracee without races.
-      syscall(SYS_tgkill, t->real_tgid(), t->tid, SIGKILL);
-      t->task_group()->destabilize();
-    }
-
-    delete t;
+    kill_detached(task_map.rbegin()->second);
   }
 }
 
+void Session::kill_task(Task* t) {
+  assert(t->task_group()->task_set().size() == 1);
+  detach_for_kill(t);
+  kill_detached(t);
+}
+
 void Session::on_destroy(AddressSpace* vm) {
   assert(vm->task_set().size() == 0);
   assert(vm_map.count(vm->uid()) == 1);
@@ -342,8 +353,9 @@ void Session::finish_initializing() const {
   self->clone_completion = nullptr;
 }
 
-static void remap_shared_mmap(AutoRemoteSyscalls& remote, EmuFs& dest_emu_fs,
-                              const AddressSpace::Mapping& m_in_mem) {
+/*static*/ void Session::remap_shared_mmap(
+    AutoRemoteSyscalls& remote, EmuFs& dest_emu_fs,
+    const AddressSpace::Mapping& m_in_mem) {
   AddressSpace::Mapping m = m_in_mem;
 
   LOG(debug) << "    remapping shared region at " << m.map.start() << "-"
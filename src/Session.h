@@ -15,6 +15,7 @@
 #include "TraceStream.h"
 
 class AddressSpace;
+class AutoRemoteSyscalls;
 class DiversionSession;
 class EmuFs;
 class RecordSession;
@@ -170,6 +171,11 @@ public:
    * gone when this returns, or this won't return.
    */
   void kill_all_tasks();
+  /**
+   * Like kill_all_tasks(), but only for |t|, which must be the only task in
+   * its task group.
+   */
+  void kill_task(Task* t);
 
   /**
    * Call these functions from the objects' destructors in order
@@ -204,10 +210,39 @@ public:
 
   struct Statistics {
     Statistics()
-        : bytes_written(0), ticks_processed(0), syscalls_performed(0) {}
+        : bytes_written(0),
+          ticks_processed(0),
+          syscalls_performed(0),
+          register_fetches(0),
+          register_writebacks(0),
+          extra_register_fetches(0),
+          extra_register_writebacks(0),
+          loop_iterations_fast_forwarded(0),
+          singlesteps_avoided(0),
+          syscallbuf_flushes(0),
+          syscallbuf_resizes(0),
+          syscall_sites_patched(0),
+          syscall_sites_patched_from_cache(0) {}
     uint64_t bytes_written;
     Ticks ticks_processed;
     uint32_t syscalls_performed;
+    // ptrace round-trips to read or write task registers.
+    uint64_t register_fetches;
+    uint64_t register_writebacks;
+    uint64_t extra_register_fetches;
+    uint64_t extra_register_writebacks;
+    // Loop iterations run by fast_forward_through_instruction instead of
+    // being singlestepped, and the singlesteps that saved.
+    uint64_t loop_iterations_fast_forwarded;
+    uint64_t singlesteps_avoided;
+    // Syscallbuf flushes recorded, and how often a task's buffer was resized.
+    uint64_t syscallbuf_flushes;
+    uint64_t syscallbuf_resizes;
+    // Syscall instructions Monkeypatcher patched when they first trapped,
+    // and ones it patched ahead of time from PatchSiteCache, each of which
+    // saves a trap.
+    uint64_t syscall_sites_patched;
+    uint64_t syscall_sites_patched_from_cache;
   };
   void accumulate_bytes_written(uint64_t bytes_written) {
     statistics_.bytes_written += bytes_written;
@@ -216,6 +251,30 @@ public:
   void accumulate_ticks_processed(Ticks ticks) {
     statistics_.ticks_processed += ticks;
   }
+  void accumulate_register_fetch() { statistics_.register_fetches += 1; }
+  void accumulate_register_writeback() {
+    statistics_.register_writebacks += 1;
+  }
+  void accumulate_extra_register_fetch() {
+    statistics_.extra_register_fetches += 1;
+  }
+  void accumulate_extra_register_writeback() {
+    statistics_.extra_register_writebacks += 1;
+  }
+  void accumulate_loop_fast_forward(uint64_t iterations,
+                                    uint64_t singlesteps_avoided) {
+    statistics_.loop_iterations_fast_forwarded += iterations;
+    statistics_.singlesteps_avoided += singlesteps_avoided;
+  }
+  void accumulate_syscallbuf_flush() { statistics_.syscallbuf_flushes += 1; }
+  void accumulate_syscallbuf_resize() { statistics_.syscallbuf_resizes += 1; }
+  void accumulate_syscall_site_patched(bool from_cache) {
+    if (from_cache) {
+      statistics_.syscall_sites_patched_from_cache += 1;
+    } else {
+      statistics_.syscall_sites_patched += 1;
+    }
+  }
   Statistics statistics() { return statistics_; }
 
 protected:
@@ -231,6 +290,12 @@ protected:
   void check_for_watchpoint_changes(Task* t, BreakStatus& break_status);
 
   void copy_state_to(Session& dest, EmuFs& dest_emu_fs);
+  /**
+   * Replace the memory of the shared mapping |m| of |remote|'s task with a
+   * mapping of its file in |dest_emu_fs|.
+   */
+  static void remap_shared_mmap(AutoRemoteSyscalls& remote, EmuFs& dest_emu_fs,
+                                const AddressSpace::Mapping& m);
 
   struct CloneCompletion;
   // Call this before doing anything that requires access to the full set
@@ -238,6 +303,14 @@ protected:
   void finish_initializing() const;
   void assert_fully_initialized() const;
 
+  /**
+   * The two halves of killing a task; see kill_all_tasks(). Call
+   * detach_for_kill() for every task of a task group before calling
+   * kill_detached() for any of them.
+   */
+  static void detach_for_kill(Task* t);
+  static void kill_detached(Task* t);
+
   AddressSpaceMap vm_map;
   TaskMap task_map;
   TaskGroupMap task_group_map;
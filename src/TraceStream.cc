@@ -4,14 +4,20 @@
 
 #include "TraceStream.h"
 
+#include <dirent.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/wait.h>
 #include <sysexits.h>
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <sstream>
 
+#include "Flags.h"
 #include "log.h"
 #include "util.h"
 
@@ -26,26 +32,64 @@ using namespace std;
 // MUST increment this version number.  Otherwise users' old traces
 // will become unreplayable and they won't know why.
 //
-#define TRACE_VERSION 41
+#define TRACE_VERSION 45
+// The last trace version whose block headers carry no codec (all blocks
+// are zlib). We can still replay those.
+#define TRACE_VERSION_LEGACY_ZLIB 41
+// The last trace version whose raw-data headers have no source field (all
+// raw data is stored inline). We can still replay those.
+#define TRACE_VERSION_INLINE_RAW_DATA 42
+// The last trace version whose exec-info frames have no register encoding
+// byte (registers are always stored in full). We can still replay those.
+#define TRACE_VERSION_FULL_REGISTERS 43
+// The last trace version whose syscallbufs have a fixed size (1MB, with no
+// size field in rrcall_init_buffers_params). We can still replay those.
+#define TRACE_VERSION_FIXED_SYSCALLBUF 44
 
 struct SubstreamData {
   const char* name;
   size_t block_size;
   int threads;
+  // Preferred codec, used when rr was built with it and the user didn't
+  // override it. Small, latency-sensitive substreams favour speed; bulk
+  // data favours ratio.
+  CompressedWriter::Codec codec;
 };
 
 static const SubstreamData substreams[TraceStream::SUBSTREAM_COUNT] = {
-  { "events", 1024 * 1024, 1 },
-  { "data_header", 1024 * 1024, 1 },
-  { "data", 8 * 1024 * 1024, 3 },
-  { "mmaps", 64 * 1024, 1 },
-  { "tasks", 64 * 1024, 1 }
+  { "events", 1024 * 1024, 1, CompressedWriter::CODEC_LZ4 },
+  { "data_header", 1024 * 1024, 1, CompressedWriter::CODEC_LZ4 },
+  { "data", 8 * 1024 * 1024, 3, CompressedWriter::CODEC_ZSTD },
+  { "mmaps", 64 * 1024, 1, CompressedWriter::CODEC_ZLIB },
+  { "tasks", 64 * 1024, 1, CompressedWriter::CODEC_ZLIB }
 };
 
+// Frames between seek index entries. Seeking decompresses at most one
+// block per substream plus this many frames' worth of records.
+static const TraceFrame::Time SEEK_INDEX_INTERVAL = 1024;
+
+// Raw-data header source for data stored right after the previous record's
+// data in RAW_DATA, rather than referring to an earlier copy.
+static const uint64_t RAW_DATA_INLINE = UINT64_MAX;
+
 static const SubstreamData& substream(TraceStream::Substream s) {
   return substreams[s];
 }
 
+static CompressedWriter::Codec choose_codec(TraceStream::Substream s,
+                                            CompressedWriter::Codec override) {
+  if (override != CompressedWriter::CODEC_COUNT) {
+    return override;
+  }
+  CompressedWriter::Codec codec = substream(s).codec;
+  return CompressedWriter::codec_available(codec) ? codec
+                                                  : CompressedWriter::CODEC_ZLIB;
+}
+
+const char* TraceStream::substream_name(Substream s) {
+  return substream(s).name;
+}
+
 static TraceStream::Substream operator++(TraceStream::Substream& s) {
   s = (TraceStream::Substream)(s + 1);
   return s;
@@ -142,8 +186,56 @@ static void ensure_default_rr_trace_dir() {
   ensure_dir(default_rr_trace_dir(), S_IRWXU);
 }
 
-string TraceStream::path(Substream s) {
-  return trace_dir + "/" + substream(s).name;
+string TraceStream::path(Substream s, uint32_t segment) const {
+  return trace_dir + "/" + substream(s).name + segment_suffix(segment);
+}
+
+string TraceStream::checkpoint_dir(TraceFrame::Time time) const {
+  char name[32];
+  sprintf(name, "/%lld", (long long)time);
+  return checkpoints_dir() + name;
+}
+
+vector<TraceFrame::Time> TraceStream::checkpoint_times() const {
+  vector<TraceFrame::Time> result;
+  DIR* d = opendir(checkpoints_dir().c_str());
+  if (!d) {
+    return result;
+  }
+  while (struct dirent* ent = readdir(d)) {
+    // Skip checkpoints still being written, which have a suffix.
+    const char* name = ent->d_name;
+    if (!*name || strspn(name, "0123456789") != strlen(name)) {
+      continue;
+    }
+    result.push_back(strtoll(name, nullptr, 10));
+  }
+  closedir(d);
+  sort(result.begin(), result.end());
+  return result;
+}
+
+/*static*/ void TraceStream::remove_checkpoint_dir(const string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (d) {
+    while (struct dirent* ent = readdir(d)) {
+      string name = ent->d_name;
+      if (name != "." && name != "..") {
+        unlink((dir + "/" + name).c_str());
+      }
+    }
+    closedir(d);
+  }
+  rmdir(dir.c_str());
+}
+
+string TraceStream::segment_suffix(uint32_t segment) {
+  if (segment == 0) {
+    return string();
+  }
+  char buf[20];
+  sprintf(buf, ".%u", segment);
+  return buf;
 }
 
 bool TraceWriter::good() const {
@@ -172,8 +264,75 @@ struct BasicInfo {
   double monotonic_sec;
 };
 
+// Flags in the encoding byte that precedes the registers of exec-info
+// frames. A flag means the corresponding registers are stored as a delta
+// against the previous exec-info frame of the same task; see
+// write_xor_delta.
+enum RegisterEncoding { REGS_DELTA = 0x1, EXTRA_REGS_DELTA = 0x2 };
+
+/**
+ * Store |data| as its XOR with |base|, both |len| bytes. The XOR is split
+ * into 64-bit words and written in groups of 64 words: a mask of the
+ * nonzero words in the group, followed by those words. Registers that
+ * didn't change cost one bit.
+ */
+static void write_xor_delta(CompressedWriter& out, const uint8_t* base,
+                            const uint8_t* data, size_t len) {
+  uint64_t words[64];
+  for (size_t group = 0; group < len; group += sizeof(words)) {
+    uint64_t mask = 0;
+    int count = 0;
+    for (int i = 0; i < 64; ++i) {
+      size_t offset = group + i * sizeof(uint64_t);
+      if (offset >= len) {
+        break;
+      }
+      // Zero-pad the last word.
+      uint64_t b = 0, d = 0;
+      size_t size = min(sizeof(uint64_t), len - offset);
+      memcpy(&b, base + offset, size);
+      memcpy(&d, data + offset, size);
+      if (b != d) {
+        mask |= uint64_t(1) << i;
+        words[count++] = b ^ d;
+      }
+    }
+    out << mask;
+    out.write(words, count * sizeof(uint64_t));
+  }
+}
+
+/**
+ * Inverse of write_xor_delta. |data| holds the base on entry.
+ */
+static void read_xor_delta(CompressedReader& in, uint8_t* data, size_t len) {
+  for (size_t group = 0; group < len; group += 64 * sizeof(uint64_t)) {
+    uint64_t mask;
+    in >> mask;
+    for (int i = 0; mask; ++i, mask >>= 1) {
+      if (!(mask & 1)) {
+        continue;
+      }
+      uint64_t word;
+      in >> word;
+      size_t offset = group + i * sizeof(uint64_t);
+      if (offset >= len) {
+        FATAL() << "Corrupt register delta in trace";
+      }
+      uint64_t d = 0;
+      size_t size = min(sizeof(uint64_t), len - offset);
+      memcpy(&d, data + offset, size);
+      d ^= word;
+      memcpy(data + offset, &d, size);
+    }
+  }
+}
+
 void TraceWriter::write_frame(const TraceFrame& frame) {
   auto& events = writer(EVENTS);
+  if (!segments.empty() && segments.back().start_monotonic < 0) {
+    segments.back().start_monotonic = frame.monotonic_time();
+  }
 
   BasicInfo basic_info = { frame.time(), frame.tid(), frame.event().encode(),
                            frame.ticks(), frame.monotonic_time() };
@@ -185,13 +344,32 @@ void TraceWriter::write_frame(const TraceFrame& frame) {
   // TODO: only store exec info for non-async-sig events when
   // debugging assertions are enabled.
   if (frame.event().has_exec_info() == HAS_EXEC_INFO) {
-    events << frame.regs() << frame.extra_perf_values();
+    const ExtraRegisters& extra_regs = frame.extra_regs();
+    uint8_t encoding = 0;
+    auto base = register_delta_bases.find(frame.tid());
+    if (delta_encode_registers && base != register_delta_bases.end()) {
+      encoding |= REGS_DELTA;
+      if (extra_regs.format() == base->second.extra_regs.format() &&
+          extra_regs.data_size() == base->second.extra_regs.data_size()) {
+        encoding |= EXTRA_REGS_DELTA;
+      }
+    }
+    events << encoding;
+    if (encoding & REGS_DELTA) {
+      write_xor_delta(events,
+                      reinterpret_cast<const uint8_t*>(&base->second.regs),
+                      reinterpret_cast<const uint8_t*>(&frame.regs()),
+                      sizeof(Registers));
+    } else {
+      events << frame.regs();
+    }
+    events << frame.extra_perf_values();
     if (!events.good()) {
       FATAL() << "Tried to save registers to the trace, but failed";
     }
 
-    int extra_reg_bytes = frame.extra_regs().data_size();
-    char extra_reg_format = (char)frame.extra_regs().format();
+    int extra_reg_bytes = extra_regs.data_size();
+    char extra_reg_format = (char)extra_regs.format();
     events << extra_reg_format << extra_reg_bytes;
     if (!events.good()) {
       FATAL() << "Tried to save "
@@ -199,22 +377,411 @@ void TraceWriter::write_frame(const TraceFrame& frame) {
               << " bytes to the trace, but failed";
     }
     if (extra_reg_bytes > 0) {
-      events.write((const char*)frame.extra_regs().data_bytes(),
-                   extra_reg_bytes);
+      if (encoding & EXTRA_REGS_DELTA) {
+        write_xor_delta(events, base->second.extra_regs.data_bytes(),
+                        extra_regs.data_bytes(), extra_reg_bytes);
+      } else {
+        events.write((const char*)extra_regs.data_bytes(), extra_reg_bytes);
+      }
       if (!events.good()) {
         FATAL() << "Tried to save " << extra_reg_bytes
                 << " bytes to the trace, but failed";
       }
     }
+
+    if (delta_encode_registers) {
+      RegisterDeltaBase& new_base = register_delta_bases[frame.tid()];
+      new_base.regs = frame.regs();
+      new_base.extra_regs = extra_regs;
+    }
   }
   if (frame.event().is_signal_event()) {
     events << frame.event().Signal().signal_data();
   }
 
   tick_time();
+  if (global_time % SEEK_INDEX_INTERVAL == 0) {
+    if (segment_full(frame)) {
+      start_segment(frame);
+    } else {
+      add_seek_index_entry();
+    }
+  }
+}
+
+void TraceWriter::add_seek_index_entry() {
+  // A reader that seeks here won't have seen earlier frames, so deltas
+  // mustn't refer to them.
+  register_delta_bases.clear();
+
+  SeekIndexPositions entry;
+  // The next frame written (and the raw data and mmaps tagged with it)
+  // will have time |global_time|.
+  entry.time = global_time;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    entry.positions[s] = writer(s).position();
+  }
+  seek_index_positions.push_back(entry);
+}
+
+// Flight-recorder mode keeps about this many segments, so that discarding
+// the oldest one still leaves most of the requested window.
+static const int FLIGHT_RECORDER_SEGMENTS = 4;
+
+void TraceWriter::set_flight_recorder(uint64_t max_bytes, double keep_secs) {
+  assert(segments.empty());
+  max_trace_bytes = max_bytes;
+  keep_last_secs = keep_secs;
+  Segment first = { segment, global_time, 0, -1, 0, vector<string>() };
+  segments.push_back(first);
+  write_segments_file();
+}
+
+bool TraceWriter::segment_full(const TraceFrame& frame) {
+  if (segments.empty()) {
+    return false;
+  }
+  const Segment& current = segments.back();
+  if (segments.size() == 1) {
+    return first_segment_ended;
+  }
+  if (max_trace_bytes > 0 &&
+      current_segment_bytes() >= max_trace_bytes / FLIGHT_RECORDER_SEGMENTS) {
+    return true;
+  }
+  return keep_last_secs > 0 &&
+         frame.monotonic_time() - current.start_monotonic >=
+             keep_last_secs / FLIGHT_RECORDER_SEGMENTS;
+}
+
+void TraceWriter::close_substreams() {
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    CompressedWriter& w = writer(s);
+    if (!w.is_open()) {
+      continue;
+    }
+    w.close();
+    if (w.producer_stall_count() > 0) {
+      LOG(info) << "Writing " << substream(s).name << " stalled "
+                << w.producer_stall_count() << " times for "
+                << w.producer_stall_seconds() << "s";
+    }
+
+    CompressionStats& stats = compression_stats[s];
+    stats.codec = choose_codec(s, codec);
+    stats.producer_stalls += w.producer_stall_count();
+    stats.producer_stall_seconds += w.producer_stall_seconds();
+    for (int i = 0; i <= CompressedWriter::MAX_LEVEL; ++i) {
+      const CompressedWriter::LevelStats& level = w.level_stats()[i];
+      stats.levels[i].blocks += level.blocks;
+      stats.levels[i].uncompressed_bytes += level.uncompressed_bytes;
+      stats.levels[i].compress_seconds += level.compress_seconds;
+    }
+  }
+}
+
+void TraceWriter::write_compression_stats() {
+  ofstream out(compression_stats_path(), ios::binary);
+  out.write(reinterpret_cast<const char*>(compression_stats),
+            sizeof(compression_stats));
+  if (!out.good()) {
+    LOG(warn) << "Failed to write " << compression_stats_path();
+  }
+}
+
+void TraceWriter::set_adaptive_compression(bool enable) {
+  adaptive_compression = enable;
+  for (auto& w : writers) {
+    w->set_adaptive_level(enable);
+  }
+}
+
+void TraceWriter::start_segment(const TraceFrame& frame) {
+  uint64_t uncompressed = 0;
+  for (auto& w : writers) {
+    uncompressed += w->position();
+  }
+  close_substreams();
+  if (write_seek_index_on_close && !seek_index_positions.empty()) {
+    write_seek_index();
+  }
+  segments.back().bytes = segment_bytes(segment);
+  if (uncompressed > 0) {
+    compression_ratio = double(segments.back().bytes) / uncompressed;
+  }
+
+  if (segments.size() > 1) {
+    // Save a checkpoint in the segment we just closed, before it might be
+    // needed to replay what's left after discarding the one before. Don't
+    // make the tracee wait for a helper that's still replaying an earlier
+    // segment: this segment just goes without a checkpoint, and the next
+    // helper replays through it.
+    if (checkpoint_helper_running()) {
+      LOG(debug) << "Checkpoint helper still running; no checkpoint for "
+                    "trace segment "
+                 << segments.back().index;
+    } else {
+      start_checkpoint_helper(segments.back().start_time, global_time - 1);
+    }
+  }
+
+  ++segment;
+  Segment next = { segment, global_time, task_events_written,
+                   frame.monotonic_time(), 0, vector<string>() };
+  segments.push_back(next);
+  open_substreams();
+  // Readers start reading at segment boundaries, and the segments before
+  // may be gone, so nothing may refer back to them.
+  register_delta_bases.clear();
+  forget_raw_data();
+
+  drop_old_segments(frame.monotonic_time());
+  write_segments_file();
+}
+
+void TraceWriter::drop_old_segments(double now) {
+  uint64_t total = current_segment_bytes();
+  for (size_t i = 0; i + 1 < segments.size(); ++i) {
+    total += segments[i].bytes;
+  }
+  // Segment 0 is kept, and the oldest segment after it is only discarded
+  // once a closed segment after it has a checkpoint for replay to start
+  // from. Without one (because a helper failed, or is still running) the
+  // trace keeps growing rather than become unreplayable.
+  while (segments.size() > 3) {
+    const Segment& oldest = segments[1];
+    bool too_big = max_trace_bytes > 0 && total > max_trace_bytes;
+    bool too_old = keep_last_secs > 0 &&
+                   segments[2].start_monotonic <= now - keep_last_secs;
+    if (!too_big && !too_old) {
+      break;
+    }
+    if (!has_checkpoint_between(segments[2].start_time,
+                                segments.back().start_time)) {
+      LOG(debug) << "No checkpoint after trace segment " << oldest.index
+                 << " yet; keeping it";
+      break;
+    }
+    LOG(debug) << "Discarding trace segment " << oldest.index << " (events "
+               << oldest.start_time << " to " << segments[2].start_time - 1
+               << ")";
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      unlink(path(s, oldest.index).c_str());
+    }
+    unlink(seek_index_path(oldest.index).c_str());
+    for (auto& f : oldest.files) {
+      unlink(f.c_str());
+    }
+    for (TraceFrame::Time time : checkpoint_times()) {
+      if (time < segments[2].start_time) {
+        remove_checkpoint_dir(checkpoint_dir(time));
+      }
+    }
+    total -= oldest.bytes;
+    segments.erase(segments.begin() + 1);
+  }
+}
+
+/**
+ * The global options the checkpoint helper's replay needs to match ours.
+ */
+static vector<string> replay_global_options() {
+  const Flags& flags = Flags::get();
+  vector<string> result;
+  if (!flags.forced_uarch.empty()) {
+    result.push_back("--microarch=" + flags.forced_uarch);
+  }
+  if (flags.checksum == Flags::CHECKSUM_SYSCALL) {
+    result.push_back("--checksum=on-syscalls");
+  } else if (flags.checksum == Flags::CHECKSUM_ALL) {
+    result.push_back("--checksum=on-all-events");
+  } else if (flags.checksum != Flags::CHECKSUM_NONE) {
+    result.push_back("--checksum=" + to_string(flags.checksum));
+  }
+  if (flags.incremental_checksums) {
+    result.push_back("--incremental-checksums");
+  }
+  if (flags.force_things) {
+    result.push_back("--force-things");
+  }
+  if (flags.check_cached_mmaps) {
+    result.push_back("--check-cached-mmaps");
+  }
+  if (flags.suppress_environment_warnings) {
+    result.push_back("--suppress-environment-warnings");
+  }
+  if (flags.fatal_errors_and_warnings) {
+    result.push_back("--fatal-errors");
+  }
+  if (flags.read_ahead_blocks > 0) {
+    result.push_back("--read-ahead=" + to_string(flags.read_ahead_blocks));
+  }
+  return result;
+}
+
+void TraceWriter::start_checkpoint_helper(TraceFrame::Time first,
+                                          TraceFrame::Time last) {
+  char range[64];
+  sprintf(range, "--range=%lld-%lld", (long long)first, (long long)last);
+  // Tests can substitute a helper that fails.
+  const char* exe = getenv("_RR_CHECKPOINT_HELPER");
+  if (!exe) {
+    exe = "/proc/self/exe";
+  }
+  // Build the arguments now; the forked child mustn't allocate.
+  vector<string> args = replay_global_options();
+  args.insert(args.begin(), "rr");
+  args.push_back("checkpoint");
+  args.push_back("create");
+  args.push_back(range);
+  args.push_back(trace_dir);
+  vector<char*> argv;
+  for (auto& arg : args) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC)) {
+    FATAL() << "Can't create pipe";
+  }
+  // Fork twice so that the helper isn't our child. Otherwise the
+  // scheduler's waitpid(-1) could reap it, and its pid be reused by a
+  // tracee we'd then mistake for it.
+  pid_t child = fork();
+  if (child == 0) {
+    if (fork() == 0) {
+      int null_fd = open("/dev/null", O_RDWR);
+      dup2(null_fd, STDIN_FILENO);
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+      // Keep the write end open in the helper.
+      fcntl(fds[1], F_SETFD, 0);
+      execv(exe, argv.data());
+      _exit(1);
+    }
+    _exit(0);
+  }
+  ::close(fds[1]);
+  checkpoint_helper = ScopedFd(fds[0]);
+  if (child < 0 || waitpid(child, nullptr, 0) != child) {
+    FATAL() << "Can't start checkpoint helper";
+  }
+  LOG(debug) << "Saving a checkpoint between events " << first << " and "
+             << last;
+}
+
+bool TraceWriter::checkpoint_helper_running() {
+  if (!checkpoint_helper.is_open()) {
+    return false;
+  }
+  struct pollfd pfd = { checkpoint_helper, POLLIN, 0 };
+  if (poll(&pfd, 1, 0) == 0) {
+    return true;
+  }
+  // The helper has exited and closed its end of the pipe.
+  checkpoint_helper.close();
+  return false;
+}
+
+void TraceWriter::wait_for_checkpoint_helper() {
+  if (!checkpoint_helper.is_open()) {
+    return;
+  }
+  char ch;
+  while (read(checkpoint_helper, &ch, 1) < 0 && errno == EINTR) {
+  }
+  checkpoint_helper.close();
+}
+
+bool TraceWriter::has_checkpoint_between(TraceFrame::Time begin,
+                                         TraceFrame::Time end) {
+  for (TraceFrame::Time time : checkpoint_times()) {
+    if (time >= begin && time < end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t TraceWriter::current_segment_bytes() const {
+  uint64_t uncompressed = 0;
+  for (auto& w : writers) {
+    uncompressed += w->position();
+  }
+  return uint64_t(uncompressed * compression_ratio);
+}
+
+void TraceWriter::write_segments_file() {
+  // Replace the file atomically so it always describes segments that exist.
+  string tmp_path = segments_path() + ".tmp";
+  {
+    ofstream out(tmp_path);
+    for (auto& seg : segments) {
+      out << seg.index << " " << seg.start_time << " " << seg.task_events
+          << "\n";
+    }
+    if (!out.good()) {
+      FATAL() << "Unable to write " << tmp_path;
+    }
+  }
+  if (rename(tmp_path.c_str(), segments_path().c_str())) {
+    FATAL() << "Unable to replace " << segments_path();
+  }
+}
+
+uint64_t TraceWriter::segment_bytes(uint32_t index) const {
+  uint64_t total = 0;
+  struct stat st;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    if (!stat(path(s, index).c_str(), &st)) {
+      total += st.st_size;
+    }
+  }
+  if (!stat(seek_index_path(index).c_str(), &st)) {
+    total += st.st_size;
+  }
+  return total;
+}
+
+void TraceWriter::write_seek_index() {
+  vector<SeekIndexEntry> entries;
+  for (auto& p : seek_index_positions) {
+    SeekIndexEntry entry;
+    entry.time = p.time;
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      writer(s).block_position(p.positions[s],
+                               &entry.positions[s].block_offset,
+                               &entry.positions[s].intra_block_offset);
+    }
+    entries.push_back(entry);
+  }
+  seek_index_positions.clear();
+
+  ofstream out(seek_index_path(), ios::binary);
+  out.write(reinterpret_cast<const char*>(entries.data()),
+            entries.size() * sizeof(SeekIndexEntry));
+  if (!out.good()) {
+    LOG(warn) << "Failed to write " << seek_index_path()
+              << "; seeking in this trace will be slow";
+  }
 }
 
 TraceFrame TraceReader::read_frame() {
+  return read_frame(&register_delta_bases);
+}
+
+TraceFrame TraceReader::read_frame(RegisterDeltaBases* bases) {
+  if (reader(EVENTS).at_end() &&
+      reader_segments[EVENTS] + 1 < segments.size()) {
+    open_segment(reader_segments[EVENTS] + 1, false);
+    // There may be a gap where segments were discarded.
+    global_time = segments[reader_segments[EVENTS]].start_time - 1;
+    if (bases) {
+      bases->clear();
+    }
+  }
+
   // Read the common event info first, to see if we also have
   // exec info to read.
   auto& events = reader(EVENTS);
@@ -224,15 +791,45 @@ TraceFrame TraceReader::read_frame() {
                    Event(basic_info.ev), basic_info.ticks_,
                    basic_info.monotonic_sec);
   if (frame.event().has_exec_info() == HAS_EXEC_INFO) {
-    events >> frame.recorded_regs >> frame.extra_perf;
+    uint8_t encoding = 0;
+    if (registers_have_encoding) {
+      events >> encoding;
+    }
+    const RegisterDeltaBase* base = nullptr;
+    if (encoding) {
+      const RegisterDeltaBases& b = bases ? *bases : register_delta_bases;
+      auto it = b.find(frame.tid());
+      if (it == b.end()) {
+        FATAL() << "Register delta for tid " << frame.tid()
+                << " without an earlier frame to apply it to";
+      }
+      base = &it->second;
+    }
+    if (encoding & REGS_DELTA) {
+      frame.recorded_regs = base->regs;
+      read_xor_delta(events, reinterpret_cast<uint8_t*>(&frame.recorded_regs),
+                     sizeof(Registers));
+    } else {
+      events >> frame.recorded_regs;
+    }
+    events >> frame.extra_perf;
 
     int extra_reg_bytes;
     char extra_reg_format;
     events >> extra_reg_format >> extra_reg_bytes;
     if (extra_reg_bytes > 0) {
       vector<uint8_t> data;
-      data.resize(extra_reg_bytes);
-      events.read((char*)data.data(), extra_reg_bytes);
+      if (encoding & EXTRA_REGS_DELTA) {
+        if (base->extra_regs.data_size() != extra_reg_bytes) {
+          FATAL() << "Corrupt register delta in trace";
+        }
+        data.assign(base->extra_regs.data_bytes(),
+                    base->extra_regs.data_bytes() + extra_reg_bytes);
+        read_xor_delta(events, data.data(), extra_reg_bytes);
+      } else {
+        data.resize(extra_reg_bytes);
+        events.read((char*)data.data(), extra_reg_bytes);
+      }
       frame.recorded_extra_regs.set_arch(frame.event().arch());
       frame.recorded_extra_regs.set_to_raw_data(
           (ExtraRegisters::Format)extra_reg_format, data);
@@ -240,6 +837,12 @@ TraceFrame TraceReader::read_frame() {
       assert(extra_reg_format == ExtraRegisters::NONE);
       frame.recorded_extra_regs = ExtraRegisters(frame.event().arch());
     }
+
+    if (bases) {
+      RegisterDeltaBase& new_base = (*bases)[frame.tid()];
+      new_base.regs = frame.recorded_regs;
+      new_base.extra_regs = frame.recorded_extra_regs;
+    }
   }
   if (frame.event().is_signal_event()) {
     uint64_t signal_data;
@@ -254,6 +857,7 @@ TraceFrame TraceReader::read_frame() {
 
 void TraceWriter::write_task_event(const TraceTaskEvent& event) {
   auto& tasks = writer(TASKS);
+  ++task_events_written;
   tasks << event.type() << event.tid();
   switch (event.type()) {
     case TraceTaskEvent::CLONE:
@@ -274,9 +878,17 @@ void TraceWriter::write_task_event(const TraceTaskEvent& event) {
 }
 
 TraceTaskEvent TraceReader::read_task_event() {
+  while (reader(TASKS).at_end() &&
+         reader_segments[TASKS] + 1 < segments.size()) {
+    open_substream(TASKS, reader_segments[TASKS] + 1);
+    task_events_read_ = segments[reader_segments[TASKS]].task_events;
+  }
   auto& tasks = reader(TASKS);
   TraceTaskEvent r;
   tasks >> r.type_ >> r.tid_;
+  if (r.type() != TraceTaskEvent::NONE) {
+    ++task_events_read_;
+  }
   switch (r.type()) {
     case TraceTaskEvent::CLONE:
       tasks >> r.parent_tid_ >> r.clone_flags_;
@@ -311,6 +923,9 @@ string TraceWriter::try_hardlink_file(const string& file_name) {
     // maybe tried to link across filesystems?
     return file_name;
   }
+  if (!segments.empty()) {
+    segments.back().files.push_back(link_path);
+  }
   return link_path;
 }
 
@@ -348,7 +963,104 @@ TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
                                              : DONT_RECORD_IN_TRACE;
 }
 
-KernelMapping TraceReader::read_mapped_region(MappedData* data, bool* found) {
+/**
+ * Copy the contents, permissions and modification time of |src| to the new
+ * file |dst|.
+ */
+static bool copy_file(const string& src, const string& dst, mode_t mode,
+                      time_t mtime) {
+  ScopedFd in(src.c_str(), O_RDONLY);
+  if (!in.is_open()) {
+    return false;
+  }
+  ScopedFd out(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL, mode & 07777);
+  // Don't let the umask change the permissions.
+  if (!out.is_open() || fchmod(out, mode & 07777)) {
+    return false;
+  }
+  char buf[64 * 1024];
+  while (true) {
+    ssize_t nread = read(in, buf, sizeof(buf));
+    if (nread < 0) {
+      return false;
+    }
+    if (nread == 0) {
+      break;
+    }
+    if (write(out, buf, nread) != nread) {
+      return false;
+    }
+  }
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1].tv_sec = mtime;
+  times[1].tv_nsec = 0;
+  return futimens(out, times) == 0;
+}
+
+void TraceWriter::write_mapped_region_copy(const KernelMapping& km,
+                                           const MappedData& data) {
+  auto& mmaps = writer(MMAPS);
+  string backing_file_name;
+  if (data.source == SOURCE_FILE) {
+    // Hardlinks of the same file share one copy.
+    struct stat st;
+    pair<dev_t, ino_t> id(0, 0);
+    if (stat(data.file_name.c_str(), &st) == 0) {
+      id = make_pair(st.st_dev, st.st_ino);
+    }
+    auto it = copied_files.find(id);
+    if (id.second != 0 && it != copied_files.end()) {
+      backing_file_name = it->second;
+    } else {
+      size_t last_slash = km.fsname().rfind('/');
+      string basename = (last_slash != km.fsname().npos)
+                            ? km.fsname().substr(last_slash + 1)
+                            : km.fsname();
+      char count_str[20];
+      sprintf(count_str, "%d", mmap_count);
+      // Relative, so the trace can be moved.
+      backing_file_name = string("mmap_") + count_str + "_pack_" + basename;
+      string path = dir() + "/" + backing_file_name;
+      // Always copy: a hardlink would share the file with the original
+      // trace or the filesystem, which could still modify it.
+      if (!copy_file(data.file_name, path, data.file_mode, data.file_mtime)) {
+        LOG(warn) << "Failed to copy " << data.file_name
+                  << " into the trace; replay will depend on it";
+        unlink(path.c_str());
+        backing_file_name = data.file_name;
+      }
+      if (id.second != 0) {
+        copied_files[id] = backing_file_name;
+      }
+    }
+  }
+  mmaps << global_time << data.source << km.start() << km.end() << km.fsname()
+        << km.device() << km.inode() << km.prot() << km.flags()
+        << km.file_offset_bytes() << backing_file_name << data.file_mode
+        << data.file_uid << data.file_gid << (int64_t)data.file_size_bytes
+        << data.file_mtime;
+  ++mmap_count;
+}
+
+/**
+ * Return true if |name|, relative to the trace directory, is a file that
+ * write_mapped_region_copy copied into the trace.
+ */
+static bool is_packed_copy(const string& name) {
+  static const char prefix[] = "mmap_";
+  static const char infix[] = "_pack_";
+  if (name.compare(0, sizeof(prefix) - 1, prefix)) {
+    return false;
+  }
+  size_t digits = strspn(name.c_str() + sizeof(prefix) - 1, "0123456789");
+  return digits > 0 && !name.compare(sizeof(prefix) - 1 + digits,
+                                     sizeof(infix) - 1, infix);
+}
+
+KernelMapping TraceReader::read_mapped_region(MappedData* data, bool* found,
+                                              ValidateSourceFile validate) {
   if (found) {
     *found = false;
   }
@@ -379,18 +1091,27 @@ KernelMapping TraceReader::read_mapped_region(MappedData* data, bool* found) {
       device >> inode >> prot >> flags >> file_offset_bytes >>
       backing_file_name >> mode >> uid >> gid >> file_size >> mtime;
   assert(time == global_time);
+  // A copy owned by the trace (see write_mapped_region_copy) can't
+  // preserve the inode or owner of the original file. Hardlinks made while
+  // recording can, so they're validated like any other file.
+  bool owned_copy = false;
   if (data->source == SOURCE_FILE) {
     if (backing_file_name[0] != '/') {
+      owned_copy = is_packed_copy(backing_file_name);
       backing_file_name = dir() + "/" + backing_file_name;
     }
+  }
+  if (data->source == SOURCE_FILE && validate == VALIDATE) {
     struct stat backing_stat;
     if (stat(backing_file_name.c_str(), &backing_stat)) {
       FATAL() << "Failed to stat " << backing_file_name
               << ": replay is impossible";
     }
-    if (backing_stat.st_ino != inode || backing_stat.st_mode != mode ||
-        backing_stat.st_uid != uid || backing_stat.st_gid != gid ||
-        backing_stat.st_size != file_size || backing_stat.st_mtime != mtime) {
+    if ((!owned_copy &&
+         (backing_stat.st_ino != inode || backing_stat.st_uid != uid ||
+          backing_stat.st_gid != gid)) ||
+        backing_stat.st_mode != mode || backing_stat.st_size != file_size ||
+        backing_stat.st_mtime != mtime) {
       LOG(error)
           << "Metadata of " << original_file_name
           << " changed: replay divergence likely, but continuing anyway ...";
@@ -399,6 +1120,10 @@ KernelMapping TraceReader::read_mapped_region(MappedData* data, bool* found) {
   data->file_name = backing_file_name;
   data->file_data_offset_bytes = file_offset_bytes;
   data->file_size_bytes = file_size;
+  data->file_mode = mode;
+  data->file_uid = uid;
+  data->file_gid = gid;
+  data->file_mtime = mtime;
   if (found) {
     *found = true;
   }
@@ -426,23 +1151,167 @@ static istream& operator>>(istream& in, vector<string>& vs) {
   return in;
 }
 
+static inline uint64_t rotate_left(uint64_t v, int bits) {
+  return (v << bits) | (v >> (64 - bits));
+}
+
+static inline uint64_t finalize_hash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+ * Two independent 64-bit multiply-rotate hashes over 8-byte words. Fast
+ * enough to run over every large raw-data record; not collision resistant
+ * against deliberately crafted input.
+ */
+static void hash_raw_data(const uint8_t* data, size_t len, uint64_t hash[2]) {
+  uint64_t h0 = 0xcbf29ce484222325ULL ^ len;
+  uint64_t h1 = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+    // Zero-pad the last word.
+    uint64_t word = 0;
+    memcpy(&word, data + i, min(sizeof(word), len - i));
+    h0 = rotate_left((h0 ^ word) * 0x100000001b3ULL, 29);
+    h1 = rotate_left(h1 + word * 0xc2b2ae3d27d4eb4fULL, 31) *
+         0x87c37b91114253d5ULL;
+  }
+  hash[0] = finalize_hash(h0);
+  hash[1] = finalize_hash(h1);
+}
+
 void TraceWriter::write_raw(const void* d, size_t len, remote_ptr<void> addr) {
   auto& data = writer(RAW_DATA);
   auto& data_header = writer(RAW_DATA_HEADER);
-  data_header << global_time << addr.as_int() << len;
+  if (raw_data_dedup_threshold > 0 && len >= raw_data_dedup_threshold) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(d);
+    RawDataKey key;
+    hash_raw_data(bytes, len, key.hash);
+    key.size = len;
+    auto it = raw_data_copies.find(key);
+    if (it != raw_data_copies.end()) {
+      RawDataCopy& copy = it->second;
+      raw_data_lru.splice(raw_data_lru.begin(), raw_data_lru,
+                          copy.lru_position);
+      if (!memcmp(copy.data.data(), bytes, len)) {
+        data_header << global_time << addr.as_int() << len << copy.position;
+        return;
+      }
+      // A hash collision. Store this one inline and keep the old copy.
+    } else {
+      remember_raw_data(key, bytes, data.position());
+    }
+  }
+  data_header << global_time << addr.as_int() << len << RAW_DATA_INLINE;
   data.write(d, len);
 }
 
+// Bytes of raw data write_raw keeps to compare new records against.
+static const size_t RAW_DATA_DEDUP_MEMORY = 64 * 1024 * 1024;
+
+void TraceWriter::remember_raw_data(const RawDataKey& key,
+                                    const uint8_t* bytes, uint64_t position) {
+  if (key.size > RAW_DATA_DEDUP_MEMORY) {
+    return;
+  }
+  raw_data_lru.push_front(key);
+  RawDataCopy& copy = raw_data_copies[key];
+  copy.position = position;
+  copy.data.assign(bytes, bytes + key.size);
+  copy.lru_position = raw_data_lru.begin();
+  raw_data_copies_bytes += key.size;
+  while (raw_data_copies_bytes > RAW_DATA_DEDUP_MEMORY) {
+    auto oldest = raw_data_copies.find(raw_data_lru.back());
+    raw_data_copies_bytes -= oldest->second.data.size();
+    raw_data_copies.erase(oldest);
+    raw_data_lru.pop_back();
+  }
+}
+
+void TraceWriter::forget_raw_data() {
+  raw_data_copies.clear();
+  raw_data_lru.clear();
+  raw_data_copies_bytes = 0;
+}
+
+size_t TraceWriter::write_raw_from(remote_ptr<void> addr, size_t len,
+                                   const RawDataSource& source) {
+  if (raw_data_dedup_threshold > 0 && len >= raw_data_dedup_threshold) {
+    // We have to see the data before we know whether to store it.
+    vector<uint8_t> buf(len);
+    size_t nread = max<ssize_t>(0, source(addr, len, buf.data()));
+    write_raw(buf.data(), nread, addr);
+    return nread;
+  }
+
+  auto& data = writer(RAW_DATA);
+  size_t recorded = 0;
+  while (recorded < len) {
+    size_t amount = len - recorded;
+    uint8_t* buf = data.reserve(&amount);
+    if (!buf) {
+      break;
+    }
+    ssize_t nread = source(addr + recorded, amount, buf);
+    if (nread <= 0) {
+      break;
+    }
+    data.commit(nread);
+    recorded += nread;
+    if ((size_t)nread < amount) {
+      break;
+    }
+  }
+  writer(RAW_DATA_HEADER) << global_time << addr.as_int() << recorded
+                          << RAW_DATA_INLINE;
+  return recorded;
+}
+
+void TraceReader::read_raw_data_header(CompressedReader& data_header,
+                                       TraceFrame::Time* time,
+                                       remote_ptr<void>* addr,
+                                       size_t* num_bytes,
+                                       uint64_t* source) const {
+  data_header >> *time >> *addr >> *num_bytes;
+  *source = RAW_DATA_INLINE;
+  if (raw_data_has_source) {
+    data_header >> *source;
+  }
+}
+
+void TraceReader::read_deduplicated_raw_data(uint64_t source,
+                                             vector<uint8_t>& data) {
+  if (!raw_data_source_reader) {
+    raw_data_source_reader =
+        unique_ptr<CompressedReader>(new CompressedReader(path(RAW_DATA)));
+    // References point all over the stream; read-ahead would mostly
+    // decompress blocks we never look at.
+    raw_data_source_reader->disable_read_ahead();
+  }
+  if (!raw_data_source_reader->seek_uncompressed(source) ||
+      !raw_data_source_reader->read(data.data(), data.size())) {
+    FATAL() << "Raw data reference to " << source << " in " << dir()
+            << " is out of range";
+  }
+}
+
 TraceReader::RawData TraceReader::read_raw_data() {
   auto& data = reader(RAW_DATA);
   auto& data_header = reader(RAW_DATA_HEADER);
   TraceFrame::Time time;
   RawData d;
   size_t num_bytes;
-  data_header >> time >> d.addr >> num_bytes;
+  uint64_t source;
+  read_raw_data_header(data_header, &time, &d.addr, &num_bytes, &source);
   assert(time == global_time);
   d.data.resize(num_bytes);
-  data.read((char*)d.data.data(), num_bytes);
+  if (source == RAW_DATA_INLINE) {
+    data.read((char*)d.data.data(), num_bytes);
+  } else {
+    read_deduplicated_raw_data(source, d.data);
+  }
   return d;
 }
 
@@ -464,9 +1333,12 @@ bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
 }
 
 void TraceWriter::close() {
-  for (auto& w : writers) {
-    w->close();
+  wait_for_checkpoint_helper();
+  close_substreams();
+  if (write_seek_index_on_close && !seek_index_positions.empty()) {
+    write_seek_index();
   }
+  write_compression_stats();
 }
 
 static string make_trace_dir(const string& exe_path) {
@@ -492,21 +1364,67 @@ static string make_trace_dir(const string& exe_path) {
 }
 
 TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
-                         const string& cwd, int bind_to_cpu)
+                         const string& cwd, int bind_to_cpu,
+                         CompressedWriter::Codec codec)
     : TraceStream(make_trace_dir(argv[0]),
                   // Somewhat arbitrarily start the
                   // global time from 1.
                   1),
-      mmap_count(0) {
+      mmap_count(0),
+      raw_data_dedup_threshold(0),
+      raw_data_copies_bytes(0),
+      delta_encode_registers(false),
+      write_seek_index_on_close(true),
+      adaptive_compression(true),
+      max_trace_bytes(0),
+      keep_last_secs(0),
+      compression_ratio(1),
+      task_events_written(0),
+      first_segment_ended(false) {
   this->argv = argv;
   this->envp = envp;
   this->cwd = cwd;
   this->bind_to_cpu = bind_to_cpu;
 
-  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
-    writers[s] = unique_ptr<CompressedWriter>(new CompressedWriter(
-        path(s), substream(s).block_size, substream(s).threads));
+  create_files(codec, 0);
+
+  if (!probably_not_interactive(STDOUT_FILENO)) {
+    printf("rr: Saving the execution of `%s' to trace directory `%s'.\n",
+           argv[0].c_str(), trace_dir.c_str());
   }
+}
+
+TraceWriter::TraceWriter(const string& dir, const TraceStream& other,
+                         CompressedWriter::Codec codec, int num_threads)
+    : TraceStream(dir, 1),
+      mmap_count(0),
+      raw_data_dedup_threshold(0),
+      raw_data_copies_bytes(0),
+      delta_encode_registers(false),
+      write_seek_index_on_close(true),
+      adaptive_compression(true),
+      max_trace_bytes(0),
+      keep_last_secs(0),
+      compression_ratio(1),
+      task_events_written(0),
+      first_segment_ended(false) {
+  argv = other.initial_argv();
+  envp = other.initial_envp();
+  cwd = other.initial_cwd();
+  bind_to_cpu = other.bound_to_cpu();
+
+  if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG)) {
+    FATAL() << "Unable to create trace directory `" << dir << "'";
+  }
+  create_files(codec, num_threads);
+}
+
+void TraceWriter::create_files(CompressedWriter::Codec codec,
+                               int num_threads) {
+  this->codec = codec;
+  compression_threads = num_threads;
+  memset(compression_stats, 0, sizeof(compression_stats));
+  open_substreams();
 
   string ver_path = version_path();
   fstream version(ver_path.c_str(), fstream::out);
@@ -515,11 +1433,6 @@ TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
   }
   version << TRACE_VERSION << endl;
 
-  if (!probably_not_interactive(STDOUT_FILENO)) {
-    printf("rr: Saving the execution of `%s' to trace directory `%s'.\n",
-           argv[0].c_str(), trace_dir.c_str());
-  }
-
   ofstream out(args_env_path());
   out << cwd << '\0';
   out << argv;
@@ -528,6 +1441,16 @@ TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
   assert(out.good());
 }
 
+void TraceWriter::open_substreams() {
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    writers[s] = unique_ptr<CompressedWriter>(new CompressedWriter(
+        path(s), substream(s).block_size,
+        compression_threads > 0 ? compression_threads : substream(s).threads,
+        choose_codec(s, codec)));
+    writers[s]->set_adaptive_level(adaptive_compression);
+  }
+}
+
 void TraceWriter::make_latest_trace() {
   string link_name = latest_trace_symlink();
   // Try to update the symlink to |this|.  We only try attempt
@@ -544,28 +1467,53 @@ void TraceWriter::make_latest_trace() {
 }
 
 TraceFrame TraceReader::peek_frame() {
+  if (reader(EVENTS).at_end() && !at_end()) {
+    // The next frame is in the next segment.
+    TraceReader copy(*this);
+    return copy.read_frame();
+  }
   auto& events = reader(EVENTS);
   events.save_state();
   auto saved_time = global_time;
   TraceFrame frame;
   if (!at_end()) {
-    frame = read_frame();
+    // Don't remember the frame's registers as the base for the next delta.
+    frame = read_frame(nullptr);
   }
   events.restore_state();
   global_time = saved_time;
   return frame;
 }
 
+static bool frame_matches(const TraceFrame& frame, pid_t pid, EventType type,
+                          SyscallState state) {
+  return frame.tid() == pid && frame.event().type() == type &&
+         (!frame.event().is_syscall_event() ||
+          frame.event().Syscall().state == state);
+}
+
 TraceFrame TraceReader::peek_to(pid_t pid, EventType type, SyscallState state) {
-  auto& events = reader(EVENTS);
   TraceFrame frame;
+  if (segments.size() > 1) {
+    // The frame may be in a later segment, which we can't restore_state()
+    // across.
+    TraceReader copy(*this);
+    while (copy.good() && !copy.at_end()) {
+      frame = copy.read_frame();
+      if (frame_matches(frame, pid, type, state)) {
+        return frame;
+      }
+    }
+    FATAL() << "Unable to find requested frame in stream";
+    return frame;
+  }
+  auto& events = reader(EVENTS);
   events.save_state();
   auto saved_time = global_time;
+  RegisterDeltaBases bases = register_delta_bases;
   while (good() && !at_end()) {
-    frame = read_frame();
-    if (frame.tid() == pid && frame.event().type() == type &&
-        (!frame.event().is_syscall_event() ||
-         frame.event().Syscall().state == state)) {
+    frame = read_frame(&bases);
+    if (frame_matches(frame, pid, type, state)) {
       events.restore_state();
       global_time = saved_time;
       return frame;
@@ -577,24 +1525,158 @@ TraceFrame TraceReader::peek_to(pid_t pid, EventType type, SyscallState state) {
 }
 
 void TraceReader::rewind() {
-  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
-    reader(s).rewind();
-  }
-  global_time = 0;
+  open_segment(0, true);
+  global_time = segments[0].start_time - 1;
+  task_events_read_ = 0;
   assert(good());
 }
 
-TraceReader::TraceReader(const string& dir)
-    : TraceStream(dir.empty() ? latest_trace_symlink() : dir,
-                  // Initialize the global time at 0, so
-                  // that when we tick it when reading
-                  // the first trace, it matches the
-                  // initial global time at recording, 1.
-                  0) {
+void TraceReader::skip_task_events(uint64_t count) {
+  // Start in the last segment that began before those events, since
+  // earlier segments may be gone.
+  size_t i = 0;
+  while (i + 1 < segments.size() && segments[i + 1].task_events <= count) {
+    ++i;
+  }
+  open_substream(TASKS, i);
+  task_events_read_ = segments[i].task_events;
+  while (task_events_read_ < count) {
+    if (read_task_event().type() == TraceTaskEvent::NONE) {
+      break;
+    }
+  }
+}
+
+void TraceReader::open_segment(size_t i, bool reopen_all) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
-    readers[s] = unique_ptr<CompressedReader>(new CompressedReader(path(s)));
+    if (reader_segments[s] == i && reopen_all) {
+      reader(s).rewind();
+    } else if (reader_segments[s] < i || reopen_all) {
+      open_substream(s, i);
+    }
+  }
+  if (segment != segments[i].index) {
+    segment = segments[i].index;
+    seek_index = nullptr;
+  }
+  // The writer didn't delta-encode across segment boundaries.
+  register_delta_bases.clear();
+}
+
+void TraceReader::open_substream(Substream s, size_t i) {
+  readers[s] = unique_ptr<CompressedReader>(new CompressedReader(
+      path(s, segments[i].index), legacy_zlib_format));
+  reader_segments[s] = i;
+  if (s == RAW_DATA) {
+    raw_data_source_reader = nullptr;
+  }
+}
+
+void TraceReader::load_seek_index() {
+  if (seek_index) {
+    return;
+  }
+  seek_index = make_shared<vector<SeekIndexEntry> >();
+  ifstream in(seek_index_path(), ios::binary);
+  SeekIndexEntry entry;
+  while (in.read(reinterpret_cast<char*>(&entry), sizeof(entry))) {
+    seek_index->push_back(entry);
+  }
+}
+
+void TraceReader::skip_frame() {
+  TraceFrame frame = read_frame();
+  auto& data_header = reader(RAW_DATA_HEADER);
+  while (!data_header.at_end()) {
+    TraceFrame::Time time;
+    data_header.save_state();
+    data_header >> time;
+    data_header.restore_state();
+    if (time > frame.time()) {
+      break;
+    }
+    remote_ptr<void> addr;
+    size_t num_bytes;
+    uint64_t source;
+    read_raw_data_header(data_header, &time, &addr, &num_bytes, &source);
+    // Deduplicated data needn't be looked at.
+    if (source == RAW_DATA_INLINE) {
+      reader(RAW_DATA).skip(num_bytes);
+    }
+  }
+  while (true) {
+    MappedData data;
+    bool found;
+    read_mapped_region(&data, &found, DONT_VALIDATE);
+    if (!found) {
+      break;
+    }
   }
+}
+
+bool TraceReader::seek_to_time(TraceFrame::Time time) {
+  if (time <= global_time) {
+    rewind();
+  }
+
+  // Start at the segment containing |time|.
+  size_t i = reader_segments[EVENTS];
+  while (i + 1 < segments.size() && segments[i + 1].start_time <= time) {
+    ++i;
+  }
+  if (i > reader_segments[EVENTS]) {
+    open_segment(i, true);
+    global_time = segments[i].start_time - 1;
+  }
+
+  load_seek_index();
+  // Find the last entry at or before |time|.
+  auto it = upper_bound(
+      seek_index->begin(), seek_index->end(), time,
+      [](TraceFrame::Time t, const SeekIndexEntry& e) { return t < e.time; });
+  if (it != seek_index->begin()) {
+    --it;
+    if (it->time - 1 > global_time) {
+      for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+        if (!reader(s).seek(it->positions[s].block_offset,
+                            it->positions[s].intra_block_offset)) {
+          FATAL() << "Seek index of " << dir() << " is corrupt";
+        }
+      }
+      global_time = it->time - 1;
+      // The writer didn't delta-encode across this point.
+      register_delta_bases.clear();
+    }
+  }
+
+  while (global_time + 1 < time) {
+    if (at_end()) {
+      return false;
+    }
+    skip_frame();
+  }
+  return !at_end();
+}
 
+bool TraceReader::seek_index_position(TraceFrame::Time time, Substream s,
+                                      uint64_t* position) {
+  load_seek_index();
+  auto it = lower_bound(
+      seek_index->begin(), seek_index->end(), time,
+      [](const SeekIndexEntry& e, TraceFrame::Time t) { return e.time < t; });
+  if (it == seek_index->end() || it->time != time) {
+    return false;
+  }
+  return reader(s).uncompressed_position(it->positions[s].block_offset,
+                                         it->positions[s].intra_block_offset,
+                                         position);
+}
+
+TraceReader::TraceReader(const string& dir)
+    : TraceStream(dir.empty() ? latest_trace_symlink() : dir,
+                  // Set below, once we know where the trace starts.
+                  0),
+      task_events_read_(0) {
   string path = version_path();
   fstream vfile(path.c_str(), fstream::in);
   if (!vfile.good()) {
@@ -613,7 +1695,8 @@ TraceReader::TraceReader(const string& dir)
   }
   int version = 0;
   vfile >> version;
-  if (vfile.fail() || TRACE_VERSION != version) {
+  if (vfile.fail() || version < TRACE_VERSION_LEGACY_ZLIB ||
+      version > TRACE_VERSION) {
     fprintf(stderr, "\n"
                     "rr: error: Recorded trace `%s' has an incompatible "
                     "version %d; expected\n"
@@ -627,6 +1710,31 @@ TraceReader::TraceReader(const string& dir)
     exit(EX_DATAERR);
   }
 
+  legacy_zlib_format = version == TRACE_VERSION_LEGACY_ZLIB;
+  raw_data_has_source = version > TRACE_VERSION_INLINE_RAW_DATA;
+  registers_have_encoding = version > TRACE_VERSION_FULL_REGISTERS;
+  syscallbuf_resizable_ = version > TRACE_VERSION_FIXED_SYSCALLBUF;
+
+  ifstream segments_in(segments_path());
+  Segment seg;
+  while (segments_in >> seg.index >> seg.start_time >> seg.task_events) {
+    segments.push_back(seg);
+  }
+  if (segments.empty()) {
+    // Initialize the global time at 0, so that when we tick it when
+    // reading the first trace, it matches the initial global time at
+    // recording, 1.
+    seg.index = 0;
+    seg.start_time = 1;
+    seg.task_events = 0;
+    segments.push_back(seg);
+  }
+  segment = segments[0].index;
+  global_time = segments[0].start_time - 1;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    open_substream(s, 0);
+  }
+
   ifstream in(args_env_path());
   assert(in.good());
   char buf[PATH_MAX];
@@ -653,20 +1761,70 @@ TraceReader::TraceReader(const TraceReader& other)
   envp = other.envp;
   cwd = other.cwd;
   bind_to_cpu = other.bind_to_cpu;
+  seek_index = other.seek_index;
+  segment = other.segment;
+  segments = other.segments;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    reader_segments[s] = other.reader_segments[s];
+  }
+  legacy_zlib_format = other.legacy_zlib_format;
+  raw_data_has_source = other.raw_data_has_source;
+  registers_have_encoding = other.registers_have_encoding;
+  syscallbuf_resizable_ = other.syscallbuf_resizable_;
+  register_delta_bases = other.register_delta_bases;
+  task_events_read_ = other.task_events_read_;
 }
 
 uint64_t TraceReader::uncompressed_bytes() const {
   uint64_t total = 0;
-  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
-    total += reader(s).uncompressed_bytes();
+  for (auto& seg : segments) {
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      total += CompressedReader(path(s, seg.index), legacy_zlib_format)
+                   .uncompressed_bytes();
+    }
   }
   return total;
 }
 
 uint64_t TraceReader::compressed_bytes() const {
   uint64_t total = 0;
-  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
-    total += reader(s).compressed_bytes();
+  for (auto& seg : segments) {
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      total += CompressedReader(path(s, seg.index), legacy_zlib_format)
+                   .compressed_bytes();
+    }
+  }
+  return total;
+}
+
+bool TraceReader::read_compression_stats(
+    CompressionStats stats[SUBSTREAM_COUNT]) const {
+  ifstream in(compression_stats_path(), ios::binary);
+  return bool(in.read(reinterpret_cast<char*>(stats),
+                      SUBSTREAM_COUNT * sizeof(CompressionStats)));
+}
+
+uint64_t TraceReader::deduplicated_bytes() const {
+  if (!raw_data_has_source) {
+    return 0;
+  }
+  uint64_t total = 0;
+  for (auto& seg : segments) {
+    CompressedReader data_header(path(RAW_DATA_HEADER, seg.index),
+                                 legacy_zlib_format);
+    while (!data_header.at_end()) {
+      TraceFrame::Time time;
+      remote_ptr<void> addr;
+      size_t num_bytes;
+      uint64_t source;
+      read_raw_data_header(data_header, &time, &addr, &num_bytes, &source);
+      if (!data_header.good()) {
+        break;
+      }
+      if (source != RAW_DATA_INLINE) {
+        total += num_bytes;
+      }
+    }
   }
   return total;
 }
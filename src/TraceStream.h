@@ -5,6 +5,9 @@
 
 #include <unistd.h>
 
+#include <functional>
+#include <list>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
@@ -14,6 +17,7 @@
 #include "CompressedWriter.h"
 #include "Event.h"
 #include "remote_ptr.h"
+#include "ScopedFd.h"
 #include "TraceFrame.h"
 #include "TraceTaskEvent.h"
 
@@ -51,8 +55,60 @@ public:
     SUBSTREAM_COUNT
   };
 
+  enum MappedDataSource { SOURCE_TRACE, SOURCE_FILE, SOURCE_ZERO };
+  /**
+   * Where to obtain data for the mapped region.
+   */
+  struct MappedData {
+    MappedDataSource source;
+    /** Name of file to map the data from. */
+    string file_name;
+    /** Data offset within the file. */
+    uint64_t file_data_offset_bytes;
+    /** Original size of mapped file. */
+    uint64_t file_size_bytes;
+    /** Original metadata of the mapped file. */
+    uint32_t file_mode;
+    uint32_t file_uid;
+    uint32_t file_gid;
+    int64_t file_mtime;
+  };
+
+  /**
+   * How writing one substream went during recording: how often the
+   * recorder had to wait for the compression threads, and which levels the
+   * writer chose in response. See CompressedWriter::choose_level.
+   */
+  struct CompressionStats {
+    // A CompressedWriter::Codec. 64 bits wide so the layout is the same
+    // for 32- and 64-bit builds of rr.
+    uint64_t codec;
+    uint64_t producer_stalls;
+    double producer_stall_seconds;
+    CompressedWriter::LevelStats levels[CompressedWriter::MAX_LEVEL + 1];
+  };
+
+  static const char* substream_name(Substream s);
+
   /** Return the directory storing this trace's files. */
   const string& dir() const { return trace_dir; }
+  /**
+   * Return the path of the "checkpoints" directory, which holds the
+   * persistent replay checkpoints made by `rr checkpoint`, one
+   * subdirectory per event. See ReplaySession::write_checkpoint.
+   */
+  string checkpoints_dir() const { return trace_dir + "/checkpoints"; }
+  /** Return the directory of the checkpoint at |time|. */
+  string checkpoint_dir(TraceFrame::Time time) const;
+  /**
+   * Return the times of the trace's persistent checkpoints, in increasing
+   * order.
+   */
+  std::vector<TraceFrame::Time> checkpoint_times() const;
+  /**
+   * Delete the checkpoint (or partially written checkpoint) in |dir|.
+   */
+  static void remove_checkpoint_dir(const string& dir);
 
   const string& initial_exe() const { return argv[0]; }
   const std::vector<string>& initial_argv() const { return argv; }
@@ -68,12 +124,18 @@ public:
 
 protected:
   TraceStream(const string& trace_dir, TraceFrame::Time initial_time)
-      : trace_dir(trace_dir), global_time(initial_time) {}
+      : trace_dir(trace_dir), global_time(initial_time), segment(0) {}
 
   /**
-   * Return the path of the file for the given substream.
+   * Return the path of the file for the given substream in the current
+   * segment.
+   */
+  string path(Substream s) const { return path(s, segment); }
+  /**
+   * Return the path of the file for the given substream in segment
+   * |segment|. See TraceWriter::set_flight_recorder.
    */
-  string path(Substream s);
+  string path(Substream s, uint32_t segment) const;
 
   /**
    * Return the path of the "args_env" file, into which the
@@ -86,6 +148,62 @@ protected:
    * trace.
    */
   string version_path() const { return trace_dir + "/version"; }
+  /**
+   * Return the path of the "seek_index" file, which maps trace times to
+   * positions in each substream. See SeekIndexEntry.
+   */
+  string seek_index_path() const { return seek_index_path(segment); }
+  string seek_index_path(uint32_t segment) const {
+    return trace_dir + "/seek_index" + segment_suffix(segment);
+  }
+  /**
+   * Return the path of the "segments" file, which lists the segments of a
+   * trace recorded in flight-recorder mode that haven't been discarded,
+   * one "<index> <start time> <task events before it>" line each. Other
+   * traces have a single segment 0 and no such file.
+   */
+  string segments_path() const { return trace_dir + "/segments"; }
+  /**
+   * Return the path of the "compression_stats" file, which holds a
+   * CompressionStats for each substream, covering the whole recording.
+   */
+  string compression_stats_path() const {
+    return trace_dir + "/compression_stats";
+  }
+  /**
+   * Suffix of the file names of segment |segment|'s files. Segment 0 has
+   * the same file names as an unsegmented trace.
+   */
+  static string segment_suffix(uint32_t segment);
+
+  /**
+   * Where one substream was positioned; see
+   * CompressedWriter::block_position.
+   */
+  struct SubstreamPosition {
+    uint64_t block_offset;
+    uint64_t intra_block_offset;
+  };
+  /**
+   * An entry of the seek index. Records the position of every substream
+   * just before the records for frame 'time' were written, i.e. where a
+   * reader that has read everything up to and including frame 'time - 1'
+   * would be.
+   */
+  struct SeekIndexEntry {
+    TraceFrame::Time time;
+    SubstreamPosition positions[SUBSTREAM_COUNT];
+  };
+
+  /**
+   * The registers of the last exec-info frame of a task, against which its
+   * next frame's registers may be delta-encoded.
+   */
+  struct RegisterDeltaBase {
+    Registers regs;
+    ExtraRegisters extra_regs;
+  };
+  typedef std::map<pid_t, RegisterDeltaBase> RegisterDeltaBases;
 
   /**
    * Increment the global time and return the incremented value.
@@ -105,6 +223,8 @@ protected:
   // Arbitrary notion of trace time, ticked on the recording of
   // each event (trace frame).
   TraceFrame::Time global_time;
+  // Segment being written, or whose frames are being read.
+  uint32_t segment;
 };
 
 class TraceWriter : public TraceStream {
@@ -128,6 +248,14 @@ public:
                                     const struct stat& stat,
                                     MappingOrigin origin = SYSCALL_MAPPING);
 
+  /**
+   * Write a mapped-region record read from another trace. If the data comes
+   * from a file, the file is copied into the trace directory (once per
+   * file), so this trace doesn't depend on it.
+   */
+  void write_mapped_region_copy(const KernelMapping& map,
+                                const MappedData& data);
+
   /**
    * Write a raw-data record to the trace.
    * 'addr' is the address in the tracee where the data came from/will be
@@ -135,6 +263,47 @@ public:
    */
   void write_raw(const void* data, size_t len, remote_ptr<void> addr);
 
+  /**
+   * Reads up to |len| bytes of tracee memory at |addr| into |buf| and
+   * returns the number of bytes read, or a negative value on error.
+   */
+  typedef std::function<ssize_t(remote_ptr<void> addr, size_t len, void* buf)>
+      RawDataSource;
+  /**
+   * Write a raw-data record for up to |len| bytes at |addr|, having
+   * |source| read them straight into the trace's compression buffer rather
+   * than into an intermediate copy. Stops at the first short read. Returns
+   * the number of bytes recorded.
+   */
+  size_t write_raw_from(remote_ptr<void> addr, size_t len,
+                        const RawDataSource& source);
+
+  /**
+   * Store raw-data records of at least |min_bytes| bytes whose contents
+   * were already recorded as references to the earlier copy. Zero (the
+   * default) disables deduplication.
+   */
+  void set_raw_data_dedup_threshold(size_t min_bytes) {
+    raw_data_dedup_threshold = min_bytes;
+  }
+
+  /**
+   * Store the registers and extra registers of exec-info frames as a delta
+   * against the previous exec-info frame of the same task. This makes the
+   * events substream much smaller, at a small cost when reading frames.
+   */
+  void set_delta_encode_registers(bool enable) {
+    delta_encode_registers = enable;
+  }
+
+  /**
+   * Let the compression level of each substream follow how well its
+   * compression threads keep up (the default). When disabled, every block
+   * is compressed at its codec's default level, which suits rewriting a
+   * trace offline.
+   */
+  void set_adaptive_compression(bool enable);
+
   /**
    * Write a task event (clone or exec record) to the trace.
    */
@@ -158,10 +327,21 @@ public:
    * current working directory |cwd| and bound to cpu |bind_to_cpu|. This
    * data is recored in the trace.
    * The trace name is determined by the global rr args and environment.
+   * If |codec| is not CODEC_COUNT, every substream is compressed with it
+   * instead of the substream's default codec.
    */
   TraceWriter(const std::vector<std::string>& argv,
               const std::vector<std::string>& envp, const string& cwd,
-              int bind_to_cpu);
+              int bind_to_cpu,
+              CompressedWriter::Codec codec = CompressedWriter::CODEC_COUNT);
+
+  /**
+   * Create a trace in the new directory |dir| with the same initial exe,
+   * args, environment, cwd and CPU as |other|, for rewriting |other|.
+   * Every substream is compressed with |codec| by |num_threads| threads.
+   */
+  TraceWriter(const string& dir, const TraceStream& other,
+              CompressedWriter::Codec codec, int num_threads);
 
   /**
    * We got far enough into recording that we should set this as the latest
@@ -169,8 +349,130 @@ public:
    */
   void make_latest_trace();
 
+  /**
+   * Keep only the most recent part of the trace ("flight recorder" mode).
+   * The trace is split into segments, each starting at a seek index entry.
+   * Once the segments take more than |max_bytes| bytes on disk, or the
+   * oldest segment ended more than |keep_secs| seconds before the latest
+   * event, the oldest segments are deleted. A zero limit is ignored.
+   * Call before writing any frames.
+   *
+   * Segment 0 is never deleted; see end_first_segment(). Replay of a trace
+   * that has lost segments gets through segment 0 and then restores the
+   * first checkpoint after the gap. These checkpoints are written by an
+   * `rr checkpoint create' process that we start whenever a segment is
+   * closed (unless the previous one is still running), to replay the
+   * segment and save a checkpoint near its start. Segments are only deleted
+   * while a later closed segment has a checkpoint, so the trace can exceed
+   * the limits when checkpoints can't be saved.
+   */
+  void set_flight_recorder(uint64_t max_bytes, double keep_secs);
+  /**
+   * In flight-recorder mode, end segment 0 at the next seek index entry.
+   * Call once the initial exec is done, so that segment 0 holds little
+   * more than what replay needs to get through it.
+   */
+  void end_first_segment() { first_segment_ended = true; }
+
+  /**
+   * Don't write a seek index when closing, because its TASKS positions
+   * wouldn't be right. Used when rewriting a trace whose task events can't
+   * be interleaved with its frames as they were originally.
+   */
+  void discard_seek_index() { write_seek_index_on_close = false; }
+
+  /**
+   * Number of uncompressed bytes written to substream |s| so far.
+   */
+  uint64_t substream_position(Substream s) const {
+    return writer(s).position();
+  }
+
 private:
+  /**
+   * Open the substreams and write the version and args_env files. A
+   * |num_threads| of zero uses each substream's default.
+   */
+  void create_files(CompressedWriter::Codec codec, int num_threads);
+  void open_substreams();
   std::string try_hardlink_file(const std::string& file_name);
+  /**
+   * Remember the current position of every substream for the seek index.
+   */
+  void add_seek_index_entry();
+  void write_seek_index();
+  /**
+   * Close all substream writers, reporting any that fell behind, and add
+   * their statistics to |compression_stats|.
+   */
+  void close_substreams();
+  void write_compression_stats();
+
+  /**
+   * Close the current segment and continue in a new one, then delete
+   * segments we no longer need to keep.
+   */
+  void start_segment(const TraceFrame& frame);
+  bool segment_full(const TraceFrame& frame);
+  void drop_old_segments(double now);
+  void write_segments_file();
+  /**
+   * Start a background `rr checkpoint create' that saves a checkpoint at
+   * the first event from |first| to |last| where it can. It resumes from
+   * the checkpoint the previous one saved, so only one may run at a time.
+   */
+  void start_checkpoint_helper(TraceFrame::Time first, TraceFrame::Time last);
+  /**
+   * Return true if the last helper started hasn't exited yet, without
+   * waiting for it.
+   */
+  bool checkpoint_helper_running();
+  void wait_for_checkpoint_helper();
+  /**
+   * Return true if there's a checkpoint at or after |begin| and before
+   * |end|.
+   */
+  bool has_checkpoint_between(TraceFrame::Time begin, TraceFrame::Time end);
+  /** Bytes the files of segment |index| take on disk. */
+  uint64_t segment_bytes(uint32_t index) const;
+  /**
+   * Estimate of the bytes the current segment will take on disk. Most of
+   * it is still being buffered or compressed, so we scale what has been
+   * written by compression_ratio.
+   */
+  uint64_t current_segment_bytes() const;
+
+  struct SeekIndexPositions {
+    TraceFrame::Time time;
+    uint64_t positions[SUBSTREAM_COUNT];
+  };
+
+  /**
+   * Identifies the contents of a raw-data record. The hash isn't
+   * cryptographic, so it only finds candidates: write_raw compares the
+   * bytes before referring to an earlier copy.
+   */
+  struct RawDataKey {
+    uint64_t hash[2];
+    size_t size;
+    bool operator<(const RawDataKey& other) const {
+      if (size != other.size) {
+        return size < other.size;
+      }
+      if (hash[0] != other.hash[0]) {
+        return hash[0] < other.hash[0];
+      }
+      return hash[1] < other.hash[1];
+    }
+  };
+
+  /**
+   * Keep a copy of the raw-data record with |key| and |bytes|, stored at
+   * RAW_DATA position |position|, for write_raw to compare against.
+   */
+  void remember_raw_data(const RawDataKey& key, const uint8_t* bytes,
+                         uint64_t position);
+  void forget_raw_data();
 
   CompressedWriter& writer(Substream s) { return *writers[s]; }
   const CompressedWriter& writer(Substream s) const { return *writers[s]; }
@@ -182,6 +484,66 @@ private:
    */
   std::set<std::pair<dev_t, ino_t> > files_assumed_immutable;
   uint32_t mmap_count;
+  /**
+   * Uncompressed substream positions for the seek index. They're translated
+   * to block offsets in close(), once all blocks have been written.
+   */
+  std::vector<SeekIndexPositions> seek_index_positions;
+  size_t raw_data_dedup_threshold;
+  struct RawDataCopy {
+    // Uncompressed RAW_DATA position of the stored copy.
+    uint64_t position;
+    std::vector<uint8_t> data;
+    std::list<RawDataKey>::iterator lru_position;
+  };
+  /**
+   * Recently stored raw-data records eligible for deduplication, kept to
+   * compare new records against. At most RAW_DATA_DEDUP_MEMORY bytes of
+   * them are kept; the least recently used are forgotten first.
+   */
+  std::map<RawDataKey, RawDataCopy> raw_data_copies;
+  // Keys of raw_data_copies, most recently used first.
+  std::list<RawDataKey> raw_data_lru;
+  size_t raw_data_copies_bytes;
+  bool delta_encode_registers;
+  RegisterDeltaBases register_delta_bases;
+  /**
+   * Files copied into the trace directory by write_mapped_region_copy, by
+   * the device and inode of the source file.
+   */
+  std::map<std::pair<dev_t, ino_t>, string> copied_files;
+  bool write_seek_index_on_close;
+  CompressedWriter::Codec codec;
+  int compression_threads;
+  bool adaptive_compression;
+  CompressionStats compression_stats[SUBSTREAM_COUNT];
+
+  struct Segment {
+    uint32_t index;
+    TraceFrame::Time start_time;
+    // Number of task events written before the segment started.
+    uint64_t task_events;
+    // Monotonic time of the segment's first frame, or -1 before that's
+    // been written.
+    double start_monotonic;
+    // Size of the segment's files once it has been closed.
+    uint64_t bytes;
+    // Mapped files hardlinked into the trace by this segment's records.
+    std::vector<string> files;
+  };
+  // Segments not yet deleted, oldest first. Empty unless in flight-recorder
+  // mode.
+  std::vector<Segment> segments;
+  uint64_t max_trace_bytes;
+  double keep_last_secs;
+  // Compressed size over uncompressed size of the last closed segment.
+  double compression_ratio;
+  uint64_t task_events_written;
+  bool first_segment_ended;
+  // Read end of a pipe whose write end the running checkpoint helper
+  // holds, so we see EOF once it has exited. The helper isn't our child;
+  // see start_checkpoint_helper().
+  ScopedFd checkpoint_helper;
 };
 
 class TraceReader : public TraceStream {
@@ -204,26 +566,15 @@ public:
    */
   TraceFrame read_frame();
 
-  enum MappedDataSource { SOURCE_TRACE, SOURCE_FILE, SOURCE_ZERO };
-  /**
-   * Where to obtain data for the mapped region.
-   */
-  struct MappedData {
-    MappedDataSource source;
-    /** Name of file to map the data from. */
-    string file_name;
-    /** Data offset within the file. */
-    uint64_t file_data_offset_bytes;
-    /** Original size of mapped file. */
-    uint64_t file_size_bytes;
-  };
   /**
    * Read the next mapped region descriptor and return it.
    * Also returns where to get the mapped data in 'data'.
    * If |found| is non-null, set *found to indicate whether a descriptor
    * was found for the current event.
    */
-  KernelMapping read_mapped_region(MappedData* data, bool* found = nullptr);
+  enum ValidateSourceFile { VALIDATE, DONT_VALIDATE };
+  KernelMapping read_mapped_region(MappedData* data, bool* found = nullptr,
+                                   ValidateSourceFile validate = VALIDATE);
 
   /**
    * Peek at the next mapping. Returns an empty region if there isn't one for
@@ -236,6 +587,16 @@ public:
    * Returns a record of type NONE at the end of the trace.
    */
   TraceTaskEvent read_task_event();
+  /**
+   * Number of task events read since the start of the trace, including
+   * those of discarded segments. Not meaningful after seek_to_time().
+   */
+  uint64_t task_events_read() const { return task_events_read_; }
+  /**
+   * Position the task event substream just after the first |count| task
+   * events of the trace, independently of the other substreams.
+   */
+  void skip_task_events(uint64_t count);
 
   /**
    * Read the next raw data record and return it.
@@ -258,7 +619,33 @@ public:
   /**
    * Return true if we're at the end of the trace file.
    */
-  bool at_end() const { return reader(EVENTS).at_end(); }
+  bool at_end() const {
+    return reader(EVENTS).at_end() &&
+           reader_segments[EVENTS] + 1 >= segments.size();
+  }
+
+  /**
+   * If the trace was recorded in flight-recorder mode and lost segments
+   * after segment 0, return the time of the first frame after them.
+   * Otherwise return 0. Replay can't get past the gap; it has to restore a
+   * checkpoint after it instead.
+   */
+  TraceFrame::Time first_time_after_gap() const {
+    return segments.size() > 1 && segments[1].index > 1
+               ? segments[1].start_time
+               : 0;
+  }
+  /**
+   * Number of segments of the trace. See TraceWriter::set_flight_recorder.
+   */
+  size_t segment_count() const { return segments.size(); }
+
+  /**
+   * False for traces recorded before syscallbufs could be resized. Their
+   * tracees pass the old rrcall_init_buffers_params layout, without the
+   * |syscallbuf_size| field, and expect a SYSCALLBUF_BUFFER_SIZE buffer.
+   */
+  bool syscallbuf_resizable() const { return syscallbuf_resizable_; }
 
   /**
    * Return the next trace frame, without mutating any stream
@@ -279,8 +666,42 @@ public:
    */
   void rewind();
 
+  /**
+   * Position all substreams so that the next read_frame() returns the
+   * frame at |time|, using the seek index to avoid decompressing the data
+   * in between where possible. Raw data and mmap records of skipped frames
+   * are skipped too. Task events are repositioned only by the index, to
+   * where they were when frame |time| was recorded. Returns false if the
+   * trace ends before |time|.
+   */
+  bool seek_to_time(TraceFrame::Time time);
+
+  /**
+   * Returns true if the trace has a non-empty seek index.
+   */
+  bool has_seek_index() {
+    load_seek_index();
+    return !seek_index->empty();
+  }
+  /**
+   * If the seek index has an entry for |time|, set *position to the
+   * uncompressed position of substream |s| at that entry and return true.
+   */
+  bool seek_index_position(TraceFrame::Time time, Substream s,
+                           uint64_t* position);
+
   uint64_t uncompressed_bytes() const;
   uint64_t compressed_bytes() const;
+  /**
+   * Number of raw-data bytes stored as references to an earlier copy
+   * instead of being stored again.
+   */
+  uint64_t deduplicated_bytes() const;
+  /**
+   * Fill |stats| with the CompressionStats of every substream. Returns
+   * false for traces recorded without them.
+   */
+  bool read_compression_stats(CompressionStats stats[SUBSTREAM_COUNT]) const;
 
   /**
    * Open the trace in 'dir'. When 'dir' is the empty string, open the
@@ -299,7 +720,70 @@ private:
   CompressedReader& reader(Substream s) { return *readers[s]; }
   const CompressedReader& reader(Substream s) const { return *readers[s]; }
 
+  /**
+   * Load the seek index if we haven't tried already. Traces recorded
+   * without one (or whose recording was cut short) just have an empty
+   * index.
+   */
+  void load_seek_index();
+  /**
+   * Read the next frame, decoding register deltas against |bases|, which
+   * is updated with the frame's registers. If |bases| is null, decode
+   * against our own bases without updating them.
+   */
+  TraceFrame read_frame(RegisterDeltaBases* bases);
+  /**
+   * Consume the next frame and all its raw data and mmap records.
+   */
+  void skip_frame();
+  /**
+   * Read the next raw-data header. |source| is set to the RAW_DATA position
+   * of the data for deduplicated records.
+   */
+  void read_raw_data_header(CompressedReader& data_header,
+                            TraceFrame::Time* time, remote_ptr<void>* addr,
+                            size_t* num_bytes, uint64_t* source) const;
+  /**
+   * Fill |data| from the earlier copy at RAW_DATA position |source|.
+   */
+  void read_deduplicated_raw_data(uint64_t source, std::vector<uint8_t>& data);
+  /**
+   * Continue reading in segments[i]. Substreams already reading segment i or
+   * later are left alone unless |reopen_all|, in which case every substream
+   * starts at the beginning of segment i.
+   */
+  void open_segment(size_t i, bool reopen_all);
+  void open_substream(Substream s, size_t i);
+
+  struct Segment {
+    uint32_t index;
+    TraceFrame::Time start_time;
+    uint64_t task_events;
+  };
+
   std::unique_ptr<CompressedReader> readers[SUBSTREAM_COUNT];
+  // The segments of the trace, and which one each substream is reading.
+  // Substreams move on to the next segment together when the frames of a
+  // segment are exhausted, except TASKS, which moves on as soon as its
+  // segment's task events are exhausted.
+  std::vector<Segment> segments;
+  size_t reader_segments[SUBSTREAM_COUNT];
+  bool legacy_zlib_format;
+  /**
+   * Second RAW_DATA reader for resolving references to earlier data.
+   * Created on first use.
+   */
+  std::unique_ptr<CompressedReader> raw_data_source_reader;
+  // False for traces recorded before raw data could be deduplicated;
+  // their raw-data headers have no source field.
+  bool raw_data_has_source;
+  // False for traces recorded before registers could be delta-encoded;
+  // their exec-info frames have no encoding byte.
+  bool registers_have_encoding;
+  bool syscallbuf_resizable_;
+  RegisterDeltaBases register_delta_bases;
+  std::shared_ptr<std::vector<SeekIndexEntry> > seek_index;
+  uint64_t task_events_read_;
 };
 
 #endif /* RR_TRACE_H_ */
@@ -5,6 +5,7 @@
 #include "fast_forward.h"
 
 #include "log.h"
+#include "Session.h"
 
 using namespace rr;
 using namespace std;
@@ -150,8 +151,14 @@ static bool is_x86ish(Task* t) {
   return t->arch() == x86 || t->arch() == x86_64;
 }
 
+static bool fast_forward_through_loop(Task* t, ResumeRequest how,
+                                      remote_code_ptr prev_ip,
+                                      const vector<const Registers*>& states,
+                                      Ticks ticks_limit);
+
 bool fast_forward_through_instruction(Task* t, ResumeRequest how,
-                                      const vector<const Registers*>& states) {
+                                      const vector<const Registers*>& states,
+                                      Ticks ticks_limit) {
   assert(how == RESUME_SINGLESTEP || how == RESUME_SYSEMU_SINGLESTEP);
 
   remote_code_ptr ip = t->ip();
@@ -163,6 +170,9 @@ bool fast_forward_through_instruction(Task* t, ResumeRequest how,
   }
 
   if (t->ip() != ip) {
+    if (ticks_limit > 0 && is_x86ish(t)) {
+      return fast_forward_through_loop(t, how, ip, states, ticks_limit);
+    }
     return false;
   }
   if (t->vm()->get_breakpoint_type_at_addr(ip) != BKPT_NONE) {
@@ -474,3 +484,315 @@ bool maybe_at_or_after_x86_string_instruction(Task* t) {
   return is_string_instruction_at(t, t->ip()) ||
          is_string_instruction_before(t, t->ip());
 }
+
+enum LoopInstruction {
+  // Falls through, or jumps to a fixed target without retiring a tick.
+  LOOP_INSN_STRAIGHT_LINE,
+  LOOP_INSN_CONDITIONAL_BRANCH,
+  // Anything whose successor we can't predict or that we shouldn't run
+  // without singlestepping: indirect branches, calls, returns, syscalls,
+  // REP-prefixed string instructions, ...
+  LOOP_INSN_UNSUPPORTED
+};
+
+/**
+ * Classify the instruction at |ip| for fast_forward_through_loop. For a
+ * conditional branch, also returns its target and the address of the
+ * instruction after it.
+ * This can be conservative: anything unusual is LOOP_INSN_UNSUPPORTED.
+ */
+static LoopInstruction classify_loop_instruction(Task* t, remote_code_ptr ip,
+                                                 remote_code_ptr* target,
+                                                 remote_code_ptr* next) {
+  InstructionBuf code = read_instruction(t, ip);
+  bool found_operand_prefix = false;
+  bool found_rep_prefix = false;
+  int i = 0;
+  for (; i < code.code_buf_len; ++i) {
+    uint8_t byte = code.code_buf[i];
+    if (byte == 0x66) {
+      found_operand_prefix = true;
+    } else if (is_rep_prefix(byte)) {
+      found_rep_prefix = true;
+    } else if (!is_ignorable_prefix(t, byte)) {
+      break;
+    }
+  }
+  // Make sure we have the opcode and a 32-bit immediate.
+  if (i + 6 > code.code_buf_len) {
+    return LOOP_INSN_UNSUPPORTED;
+  }
+  uint8_t opcode = code.code_buf[i];
+
+  if (opcode >= 0x70 && opcode <= 0x7F) {
+    // Jcc rel8
+    if (found_operand_prefix) {
+      return LOOP_INSN_UNSUPPORTED;
+    }
+    *next = ip + i + 2;
+    *target = *next + (int8_t)code.code_buf[i + 1];
+    return LOOP_INSN_CONDITIONAL_BRANCH;
+  }
+  if (opcode == 0x0F) {
+    uint8_t opcode2 = code.code_buf[i + 1];
+    if (opcode2 >= 0x80 && opcode2 <= 0x8F) {
+      // Jcc rel32. With an operand-size prefix the displacement is 16 bits;
+      // nobody does that.
+      if (found_operand_prefix) {
+        return LOOP_INSN_UNSUPPORTED;
+      }
+      int32_t rel;
+      memcpy(&rel, code.code_buf + i + 2, sizeof(rel));
+      *next = ip + i + 6;
+      *target = *next + rel;
+      return LOOP_INSN_CONDITIONAL_BRANCH;
+    }
+    switch (opcode2) {
+      case 0x00: // system instructions
+      case 0x01:
+      case 0x05: // SYSCALL
+      case 0x07: // SYSRET
+      case 0x0B: // UD2
+      case 0x31: // RDTSC
+      case 0x34: // SYSENTER
+      case 0x35: // SYSEXIT
+      case 0xA2: // CPUID
+        return LOOP_INSN_UNSUPPORTED;
+      default:
+        return LOOP_INSN_STRAIGHT_LINE;
+    }
+  }
+  if (found_rep_prefix && is_string_instruction(opcode)) {
+    return LOOP_INSN_UNSUPPORTED;
+  }
+  switch (opcode) {
+    case 0x9A: // far CALL
+    case 0xC2: // RET
+    case 0xC3:
+    case 0xCA:
+    case 0xCB:
+    case 0xCC: // INT3, INT, INTO, IRET
+    case 0xCD:
+    case 0xCE:
+    case 0xCF:
+    case 0xE0: // LOOPNE, LOOPE, LOOP, JCXZ
+    case 0xE1:
+    case 0xE2:
+    case 0xE3:
+    case 0xE4: // IN, OUT
+    case 0xE5:
+    case 0xE6:
+    case 0xE7:
+    case 0xE8: // CALL
+    case 0xEA: // far JMP
+    case 0xEC: // IN, OUT
+    case 0xED:
+    case 0xEE:
+    case 0xEF:
+    case 0xF1: // INT1
+    case 0xF4: // HLT
+    case 0xFF: // indirect CALL/JMP, among others
+      return LOOP_INSN_UNSUPPORTED;
+    default:
+      return LOOP_INSN_STRAIGHT_LINE;
+  }
+}
+
+static bool matches_any_state(Task* t, const vector<const Registers*>& states) {
+  for (auto& state : states) {
+    if (state->matches(t->regs())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Singlestep once with |how|. Returns false if we must stop because of
+ * something the caller needs to see: a signal, a watchpoint, reaching
+ * one of |states| or a breakpoint at the new IP.
+ */
+static bool loop_singlestep(Task* t, ResumeRequest how,
+                            const vector<const Registers*>& states) {
+  t->resume_execution(how, RESUME_WAIT, RESUME_UNLIMITED_TICKS);
+  return t->pending_sig() == SIGTRAP &&
+         !t->vm()->notify_watchpoint_fired(t->debug_status()) &&
+         !matches_any_state(t, states) &&
+         t->vm()->get_breakpoint_type_at_addr(t->ip()) == BKPT_NONE;
+}
+
+/** Upper bound on the instructions we singlestep looking for a loop. */
+static const int MAX_LOOP_SEARCH_STEPS = 64;
+
+/**
+ * Called after a singlestep of |t| has left the IP it started at. If |t|
+ * is about to run a tight loop whose body has no control flow except the
+ * conditional branch back to its head (and direct jumps), every iteration
+ * retires exactly one tick and takes the same path. Singlestep until we
+ * reach the head of such a loop and through one iteration to learn its
+ * body, then run further iterations at full speed with the ticks counter
+ * programmed to interrupt us before t->tick_count() reaches |ticks_limit|
+ * and an internal breakpoint at the loop exit, and the last few iterations
+ * with internal breakpoints at the loop head and exit.
+ *
+ * Stops early, like fast_forward_through_instruction, when anything the
+ * caller must see happens. Returns true if we executed anything beyond
+ * the initial singlestep.
+ */
+static bool fast_forward_through_loop(Task* t, ResumeRequest how,
+                                      remote_code_ptr prev_ip,
+                                      const vector<const Registers*>& states,
+                                      Ticks ticks_limit) {
+  if (t->vm()->notify_watchpoint_fired(t->debug_status()) ||
+      matches_any_state(t, states) ||
+      t->vm()->get_breakpoint_type_at_addr(t->ip()) != BKPT_NONE) {
+    return false;
+  }
+
+  bool did_execute = false;
+  bool in_loop = false;
+  remote_code_ptr head;
+  remote_code_ptr exit;
+  remote_code_ptr branch_ip;
+  Ticks head_ticks = 0;
+  vector<remote_code_ptr> body;
+
+  remote_code_ptr target;
+  remote_code_ptr next;
+  LoopInstruction insn = classify_loop_instruction(t, prev_ip, &target, &next);
+  for (int steps = 0; steps <= MAX_LOOP_SEARCH_STEPS; ++steps) {
+    if (!in_loop && insn == LOOP_INSN_CONDITIONAL_BRANCH &&
+        t->ip() == target && target < prev_ip) {
+      // We just took a backward branch. Learn one iteration of the loop.
+      in_loop = true;
+      head = target;
+      exit = next;
+      branch_ip = prev_ip;
+      head_ticks = t->tick_count();
+    } else if (in_loop && (t->ip() < head || branch_ip < t->ip())) {
+      // Left the loop.
+      return did_execute;
+    }
+
+    prev_ip = t->ip();
+    if (in_loop && prev_ip == head && !body.empty()) {
+      break;
+    }
+    // Each step retires at most one tick.
+    if (steps == MAX_LOOP_SEARCH_STEPS ||
+        t->tick_count() + 1 >= ticks_limit) {
+      return did_execute;
+    }
+    insn = classify_loop_instruction(t, prev_ip, &target, &next);
+    if (insn == LOOP_INSN_UNSUPPORTED ||
+        (in_loop && insn == LOOP_INSN_CONDITIONAL_BRANCH &&
+         prev_ip != branch_ip)) {
+      return did_execute;
+    }
+    if (in_loop) {
+      body.push_back(prev_ip);
+    }
+    did_execute = true;
+    if (!loop_singlestep(t, how, states)) {
+      return did_execute;
+    }
+  }
+  // Only the branch back to the head may retire a tick, or later
+  // iterations could take other paths.
+  if (t->tick_count() != head_ticks + 1) {
+    return did_execute;
+  }
+  Ticks start_ticks = t->tick_count();
+  // Set when we stop for something the caller must diagnose from the real
+  // debug status.
+  bool interrupted = false;
+  int stops = 0;
+
+  // Every iteration retires exactly one tick, so the ticks counter counts
+  // iterations. If we're far enough from |ticks_limit|, run the loop at
+  // full speed with the counter programmed to interrupt us early enough
+  // that even with skid, stepping to the end of the interrupted iteration
+  // leaves us below |ticks_limit|.
+  Ticks ticks_period =
+      ticks_limit - 2 - start_ticks - PerfCounters::SKID_SIZE;
+  if (ticks_period > 0 && t->vm()->add_breakpoint(exit, BKPT_INTERNAL)) {
+    ++stops;
+    t->resume_execution(RESUME_CONT, RESUME_WAIT, (TicksRequest)ticks_period);
+    t->vm()->remove_breakpoint(exit, BKPT_INTERNAL);
+    if (t->pending_sig() == PerfCounters::TIME_SLICE_SIGNAL) {
+      // We're somewhere in the loop. Singlestep at least once, so the
+      // caller sees a singlestep stop, and on to the end of the iteration.
+      // That takes at most one more tick.
+      do {
+        ++stops;
+        if (!loop_singlestep(t, how, states)) {
+          interrupted = true;
+          break;
+        }
+      } while (t->ip() != head && t->ip() != exit);
+    } else if (t->pending_sig() == SIGTRAP &&
+               !t->vm()->notify_watchpoint_fired(t->debug_status()) &&
+               t->ip() == exit.increment_by_bkpt_insn_length(t->arch())) {
+      t->move_ip_before_breakpoint();
+    } else {
+      interrupted = true;
+    }
+  }
+
+  // The counter can't stop us precisely within its skid of |ticks_limit|,
+  // so run the iterations left there one at a time, with internal
+  // breakpoints at the loop head and exit. That costs two stops per
+  // iteration, so it only pays off for longer bodies.
+  if (!interrupted && t->ip() == head && body.size() > 2 &&
+      t->vm()->add_breakpoint(head, BKPT_INTERNAL)) {
+    if (t->vm()->add_breakpoint(exit, BKPT_INTERNAL)) {
+      uint64_t max_iterations = ticks_limit - 1 - t->tick_count();
+      uint64_t iterations_run = 0;
+      while (t->ip() == head && iterations_run < max_iterations) {
+        // Step off the head's breakpoint.
+        t->vm()->remove_breakpoint(head, BKPT_INTERNAL);
+        bool step_ok = loop_singlestep(t, RESUME_SINGLESTEP, states);
+        t->vm()->add_breakpoint(head, BKPT_INTERNAL);
+        stops += 2;
+        if (!step_ok || t->ip() == head) {
+          interrupted = true;
+          break;
+        }
+        t->resume_execution(RESUME_CONT, RESUME_WAIT, RESUME_UNLIMITED_TICKS);
+        if (t->pending_sig() != SIGTRAP ||
+            t->vm()->notify_watchpoint_fired(t->debug_status())) {
+          interrupted = true;
+          break;
+        }
+        if (t->ip() == head.increment_by_bkpt_insn_length(t->arch()) ||
+            t->ip() == exit.increment_by_bkpt_insn_length(t->arch())) {
+          t->move_ip_before_breakpoint();
+        }
+        ++iterations_run;
+        if (matches_any_state(t, states)) {
+          break;
+        }
+      }
+      t->vm()->remove_breakpoint(exit, BKPT_INTERNAL);
+    }
+    t->vm()->remove_breakpoint(head, BKPT_INTERNAL);
+  }
+
+  uint64_t iterations = t->tick_count() - start_ticks;
+  if (iterations > 0) {
+    // Singlestepping would have stopped at every instruction of every
+    // iteration.
+    uint64_t steps = iterations * body.size();
+    LOG(debug) << "loop fast-forward: " << iterations
+               << " iterations of loop at " << head << " (" << body.size()
+               << " instructions) in " << stops << " stops; ip()=="
+               << t->ip();
+    t->session().accumulate_loop_fast_forward(
+        iterations, steps > (uint64_t)stops ? steps - stops : 0);
+  }
+  if (!interrupted) {
+    // Fake singlestep status for trap diagnosis
+    t->set_debug_status(DS_SINGLESTEP);
+  }
+  return true;
+}
@@ -26,13 +26,19 @@ class Registers;
  *
  * Spurious returns after any singlestep are also allowed.
  *
- * This will not add more than one tick to t->tick_count().
+ * Unless |ticks_limit| is nonzero, this will not add more than one tick to
+ * t->tick_count(). If it is nonzero, we may also run through whole
+ * iterations of a simple counted loop (see fast_forward_through_loop in
+ * fast_forward.cc), as long as t->tick_count() stays below |ticks_limit|.
+ * Callers must pick |ticks_limit| so that none of |states| can be reached
+ * with a lower tick count.
  *
  * Returns true if we did a fast-forward, false if we just did one regular
  * singlestep.
  */
-bool fast_forward_through_instruction(
-    Task* t, ResumeRequest how, const std::vector<const Registers*>& states);
+bool fast_forward_through_instruction(Task* t, ResumeRequest how,
+                                      const std::vector<const Registers*>& states,
+                                      Ticks ticks_limit);
 
 /**
  * Return true if the instruction at t->ip(), or the instruction immediately
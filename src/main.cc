@@ -119,6 +119,13 @@ void print_usage(FILE* out) {
       "                             at all events (`on-all-events'), or \n"
       "                             starting from a global timepoint "
       "FROM_TIME\n"
+      "  -I, --incremental-checksums\n"
+      "                             with --checksum, only re-read pages "
+      "written\n"
+      "                             since the last checksum (using soft-dirty\n"
+      "                             page tracking) and store a checksum per\n"
+      "                             page, so replay can report the exact page\n"
+      "                             that diverged\n"
       "  -D, --dump-on=<SYSCALL_NUM|-SIGNAL_NUM>\n"
       "                             dump memory at SYSCALL or SIGNAL to the\n"
       "                             file "
@@ -139,6 +146,9 @@ void print_usage(FILE* out) {
       "                             which the write occurs and PID is the pid\n"
       "                             of the process it occurs in.\n"
       "  -N, --version              print the version number and exit\n"
+      "  -R, --read-ahead=<NUM>     when reading a trace, decompress up to NUM\n"
+      "                             blocks of each trace file ahead of the\n"
+      "                             reader on background threads\n"
       "  -S, --suppress-environment-warnings\n"
       "                             suppress warnings about issues in the\n"
       "                             environment that rr has no control over\n"
@@ -161,6 +171,7 @@ bool parse_global_option(std::vector<std::string>& args) {
   static const OptionSpec options[] = {
     { 'C', "checksum", HAS_PARAMETER },
     { 'K', "check-cached-mmaps", NO_PARAMETER },
+    { 'I', "incremental-checksums", NO_PARAMETER },
     { 'U', "cpu-unbound", NO_PARAMETER },
     { 'T', "dump-at", HAS_PARAMETER },
     { 'D', "dump-on", HAS_PARAMETER },
@@ -170,7 +181,8 @@ bool parse_global_option(std::vector<std::string>& args) {
     { 'S', "suppress-environment-warnings", NO_PARAMETER },
     { 'E', "fatal-errors", NO_PARAMETER },
     { 'V', "verbose", NO_PARAMETER },
-    { 'N', "version", NO_PARAMETER }
+    { 'N', "version", NO_PARAMETER },
+    { 'R', "read-ahead", HAS_PARAMETER }
   };
 
   ParsedOption opt;
@@ -204,6 +216,9 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'F':
       flags.force_things = true;
       break;
+    case 'I':
+      flags.incremental_checksums = true;
+      break;
     case 'K':
       flags.check_cached_mmaps = true;
       break;
@@ -222,6 +237,12 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'N':
       show_version = true;
       break;
+    case 'R':
+      if (!opt.verify_valid_int(0, 64)) {
+        return false;
+      }
+      flags.read_ahead_blocks = opt.int_value;
+      break;
     default:
       assert(0 && "Invalid flag");
   }
@@ -67,6 +67,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -143,6 +144,9 @@ static __thread int thread_inited TLS_STORAGE_MODEL;
  * syscallbuf_hdr|, so |buffer| is also a pointer to the buffer
  * header. */
 static __thread uint8_t* buffer TLS_STORAGE_MODEL;
+/* Number of usable bytes at |buffer|, counting the header. rr writes this
+ * directly; see |rrcall_init_buffers_params|. */
+static __thread uint32_t buffer_size TLS_STORAGE_MODEL;
 /* This is used to support the buffering of "may-block" system calls.
  * The problem that needs to be addressed can be introduced with a
  * simple example; assume that we're buffering the "read" and "write"
@@ -206,10 +210,9 @@ static uint8_t* buffer_last(void) {
 }
 
 /**
- * Return a pointer to the byte just after the very end of the mapped
- * region.
+ * Return a pointer to the byte just after the usable part of the buffer.
  */
-static uint8_t* buffer_end(void) { return buffer + SYSCALLBUF_BUFFER_SIZE; }
+static uint8_t* buffer_end(void) { return buffer + buffer_size; }
 
 /**
  * Same as libc memcpy(), but usable within syscallbuf transaction
@@ -560,6 +563,7 @@ static void init_thread(void) {
       open_desched_event_counter(1, privileged_traced_gettid());
 
   args.desched_counter_fd = desched_counter_fd;
+  args.syscallbuf_size = &buffer_size;
 
   /* Trap to rr: let the magic begin!
    *
@@ -1179,6 +1183,45 @@ static long sys_creat(const struct syscall_info* call) {
   return sys_open(&open_call);
 }
 
+/**
+ * Also handles epoll_pwait() without a signal mask; glibc implements
+ * epoll_wait() that way on some architectures.
+ */
+static long sys_epoll_wait(const struct syscall_info* call) {
+  const int syscallno = call->no;
+  int epfd = call->args[0];
+  struct epoll_event* events = (struct epoll_event*)call->args[1];
+  int max_events = call->args[2];
+  int timeout = call->args[3];
+
+  void* ptr;
+  struct epoll_event* events2 = NULL;
+  long ret;
+
+  if (syscallno == SYS_epoll_pwait && call->args[4]) {
+    /* See sys_ppoll. */
+    return traced_raw_syscall(call);
+  }
+
+  ptr = prep_syscall_for_fd(epfd);
+  if (events && max_events > 0) {
+    events2 = ptr;
+    ptr += max_events * sizeof(*events2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall4(syscallno, epfd, events2, max_events, timeout);
+
+  if (events2 && ret >= 0) {
+    /* Only the ready events are written and recorded. */
+    local_memcpy(events, events2, ret * sizeof(*events));
+    ptr = events2 + ret;
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static int sys_fcntl64_no_outparams(const struct syscall_info* call) {
   const int syscallno = RR_FCNTL_SYSCALL;
   int fd = call->args[0];
@@ -1258,6 +1301,55 @@ static int sys_fcntl64_xlk64(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_faccessat(const struct syscall_info* call) {
+  const int syscallno = SYS_faccessat;
+  int dirfd = call->args[0];
+  const char* pathname = (const char*)call->args[1];
+  int mode = call->args[2];
+
+  void* ptr = prep_syscall();
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall3(syscallno, dirfd, pathname, mode);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+#if defined(SYS_fstatat64)
+static long sys_fstatat64(const struct syscall_info* call)
+#else
+static long sys_newfstatat(const struct syscall_info* call)
+#endif
+{
+  const int syscallno = call->no;
+  int dirfd = call->args[0];
+  const char* pathname = (const char*)call->args[1];
+  struct stat64* buf = (struct stat64*)call->args[2];
+  int flags = call->args[3];
+
+  /* Not arming the desched event, like sys_xstat64. */
+  void* ptr = prep_syscall();
+  struct stat64* buf2 = NULL;
+  long ret;
+
+  if (buf) {
+    buf2 = ptr;
+    ptr += sizeof(*buf2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall4(syscallno, dirfd, pathname, buf2, flags);
+  if (buf2 && ret >= 0) {
+    local_memcpy(buf, buf2, sizeof(*buf));
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 #if defined(SYS_fcntl64)
 static long sys_fcntl64(const struct syscall_info* call)
 #else
@@ -1603,6 +1695,128 @@ static long sys_poll(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_ppoll(const struct syscall_info* call) {
+  const int syscallno = SYS_ppoll;
+  struct pollfd* fds = (struct pollfd*)call->args[0];
+  unsigned int nfds = call->args[1];
+  struct timespec* tmo = (struct timespec*)call->args[2];
+
+  void* ptr;
+  struct pollfd* fds2 = NULL;
+  struct timespec* tmo2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (call->args[3]) {
+    /* A signal unblocked by the temporary mask has to be delivered before
+     * the kernel restores the old mask, which rr can't arrange for a
+     * buffered syscall. Let rr trace syscalls that change the mask. */
+    return traced_raw_syscall(call);
+  }
+
+  ptr = prep_syscall();
+  if (fds && nfds > 0) {
+    fds2 = ptr;
+    ptr += nfds * sizeof(*fds2);
+  }
+  if (tmo) {
+    tmo2 = ptr;
+    ptr += sizeof(*tmo2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  if (fds2) {
+    memcpy_input_parameter(fds2, fds, nfds * sizeof(*fds2));
+  }
+  if (tmo2) {
+    memcpy_input_parameter(tmo2, tmo, sizeof(*tmo2));
+  }
+
+  ret = untraced_syscall4(syscallno, fds2, nfds, tmo2, NULL);
+
+  /* See sys_poll for why we don't copy on error. */
+  if (ret >= 0) {
+    if (fds2) {
+      local_memcpy(fds, fds2, nfds * sizeof(*fds));
+    }
+    if (tmo2) {
+      local_memcpy(tmo, tmo2, sizeof(*tmo));
+    }
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pread64(const struct syscall_info* call) {
+  const int syscallno = SYS_pread64;
+  int fd = call->args[0];
+  void* buf = (void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  void* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf && count > 0) {
+    buf2 = ptr;
+    ptr += count;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  /* On x86 the offset is split across two arguments. */
+  ret = untraced_syscall5(syscallno, fd, buf2, count, call->args[3],
+                          call->args[4]);
+  ptr = copy_output_buffer(ret, ptr, buf, buf2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pwrite64(const struct syscall_info* call) {
+  const int syscallno = SYS_pwrite64;
+  int fd = call->args[0];
+  const void* buf = (const void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall5(syscallno, fd, buf, count, call->args[3],
+                          call->args[4]);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pwritev(const struct syscall_info* call) {
+  const int syscallno = SYS_pwritev;
+  int fd = call->args[0];
+  const struct iovec* iov = (const struct iovec*)call->args[1];
+  unsigned long iovcnt = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall5(syscallno, fd, iov, iovcnt, call->args[3],
+                          call->args[4]);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_read(const struct syscall_info* call) {
   const int syscallno = SYS_read;
   int fd = call->args[0];
@@ -1653,6 +1867,125 @@ static long sys_readlink(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_readlinkat(const struct syscall_info* call) {
+  const int syscallno = SYS_readlinkat;
+  int dirfd = call->args[0];
+  const char* path = (const char*)call->args[1];
+  char* buf = (char*)call->args[2];
+  int bufsiz = call->args[3];
+
+  void* ptr = prep_syscall();
+  char* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf && bufsiz > 0) {
+    buf2 = ptr;
+    ptr += bufsiz;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall4(syscallno, dirfd, path, buf2, bufsiz);
+  ptr = copy_output_buffer(ret, ptr, buf, buf2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+/**
+ * Generic helper for getdents() and getdents64(), which differ only in the
+ * format of the entries.
+ */
+static long sys_xgetdents(const struct syscall_info* call) {
+  const int syscallno = call->no;
+  int fd = call->args[0];
+  void* dirp = (void*)call->args[1];
+  unsigned int count = call->args[2];
+
+  /* Like stat(), listing a directory doesn't block for long enough to be
+   * worth arming the desched event. */
+  void* ptr = prep_syscall_for_fd(fd);
+  void* dirp2 = NULL;
+  long ret;
+
+  if (dirp && count > 0) {
+    dirp2 = ptr;
+    ptr += count;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall3(syscallno, fd, dirp2, count);
+  ptr = copy_output_buffer(ret, ptr, dirp, dirp2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+/**
+ * Generic helper for readv() and preadv(). The kernel fills the buffers
+ * in iovec order, so the buffered data is laid out contiguously after our
+ * copy of the iovec array.
+ */
+static long sys_xreadv(const struct syscall_info* call) {
+  const int syscallno = call->no;
+  int fd = call->args[0];
+  const struct iovec* iov = (const struct iovec*)call->args[1];
+  int iovcnt = call->args[2];
+  long pos_l = syscallno == SYS_preadv ? call->args[3] : 0;
+  long pos_h = syscallno == SYS_preadv ? call->args[4] : 0;
+
+  void* ptr = prep_syscall_for_fd(fd);
+  long ret;
+  struct iovec* iov2;
+  void* ptr_base = ptr;
+  void* ptr_overwritten_end;
+  void* ptr_bytes_start;
+  void* ptr_end;
+  int i;
+
+  if (iovcnt < 0 || iovcnt > IOV_MAX) {
+    return traced_raw_syscall(call);
+  }
+
+  /* Compute final buffer size up front, like sys_recvmsg. */
+  ptr += sizeof(struct iovec) * iovcnt;
+  for (i = 0; i < iovcnt; ++i) {
+    ptr += iov[i].iov_len;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  /* The kernel doesn't write to the iovec array, and the values we write
+   * here during replay match those we wrote during recording. */
+  iov2 = ptr = ptr_base;
+  ptr += sizeof(struct iovec) * iovcnt;
+  ptr_overwritten_end = ptr;
+  ptr_bytes_start = ptr;
+  for (i = 0; i < iovcnt; ++i) {
+    iov2[i].iov_base = ptr;
+    iov2[i].iov_len = iov[i].iov_len;
+    ptr += iov[i].iov_len;
+  }
+
+  ret = untraced_syscall5(syscallno, fd, iov2, iovcnt, pos_l, pos_h);
+
+  if (ret >= 0) {
+    size_t bytes = ret;
+    ptr_end = ptr_bytes_start + bytes;
+    for (i = 0; i < iovcnt && bytes > 0; ++i) {
+      size_t copy_bytes = bytes < iov[i].iov_len ? bytes : iov[i].iov_len;
+      local_memcpy(iov[i].iov_base, iov2[i].iov_base, copy_bytes);
+      bytes -= copy_bytes;
+    }
+  } else {
+    /* Don't let the next record overlap the iovecs we wrote. */
+    ptr_end = ptr_overwritten_end;
+  }
+  return commit_raw_syscall(syscallno, ptr_end, ret);
+}
+
 #if defined(SYS_socketcall)
 static long sys_socketcall_recv(const struct syscall_info* call) {
   const int syscallno = SYS_socketcall;
@@ -1896,6 +2229,41 @@ static long sys_socketpair(const struct syscall_info* call) {
 }
 #endif
 
+#if defined(SYS_statx)
+/* struct statx has the same 256-byte layout on all architectures. Not all
+ * the headers we build against define it. */
+#define RR_STATX_BUF_SIZE 256
+
+static long sys_statx(const struct syscall_info* call) {
+  const int syscallno = SYS_statx;
+  int dirfd = call->args[0];
+  const char* pathname = (const char*)call->args[1];
+  int flags = call->args[2];
+  unsigned int mask = call->args[3];
+  void* buf = (void*)call->args[4];
+
+  /* Not arming the desched event, like sys_xstat64. */
+  void* ptr = prep_syscall();
+  void* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf) {
+    buf2 = ptr;
+    ptr += RR_STATX_BUF_SIZE;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall5(syscallno, dirfd, pathname, flags, mask, buf2);
+  if (buf2 && ret >= 0) {
+    local_memcpy(buf, buf2, RR_STATX_BUF_SIZE);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 static long sys_time(const struct syscall_info* call) {
   const int syscallno = SYS_time;
   time_t* tp = (time_t*)call->args[0];
@@ -1916,6 +2284,80 @@ static long sys_time(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+/**
+ * Generic helper for select() and pselect6(). The kernel only touches the
+ * first |nfds| bits of each fd set, rounded up to a whole long, so that's
+ * all we reserve and copy.
+ */
+static long sys_xselect(const struct syscall_info* call) {
+  const int syscallno = call->no;
+  int nfds = call->args[0];
+  fd_set* sets[3] = { (fd_set*)call->args[1], (fd_set*)call->args[2],
+                      (fd_set*)call->args[3] };
+  void* tmo = (void*)call->args[4];
+  size_t tmo_size = syscallno == SYS_pselect6 ? sizeof(struct timespec)
+                                              : sizeof(struct timeval);
+  size_t set_size;
+
+  void* ptr;
+  fd_set* sets2[3] = { NULL, NULL, NULL };
+  void* tmo2 = NULL;
+  long ret;
+  int i;
+
+  if (syscallno == SYS_pselect6) {
+    /* pselect6() takes a pointer to a { sigset pointer, size } pair. */
+    void** sigmask_data = (void**)call->args[5];
+    if (sigmask_data && sigmask_data[0]) {
+      /* See sys_ppoll. */
+      return traced_raw_syscall(call);
+    }
+  }
+  if (nfds < 0) {
+    return traced_raw_syscall(call);
+  }
+  set_size = (nfds + 8 * sizeof(long) - 1) / (8 * sizeof(long)) * sizeof(long);
+
+  ptr = prep_syscall();
+  for (i = 0; i < 3; ++i) {
+    if (sets[i]) {
+      sets2[i] = ptr;
+      ptr += set_size;
+    }
+  }
+  if (tmo) {
+    tmo2 = ptr;
+    ptr += tmo_size;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  for (i = 0; i < 3; ++i) {
+    if (sets2[i]) {
+      memcpy_input_parameter(sets2[i], sets[i], set_size);
+    }
+  }
+  if (tmo2) {
+    memcpy_input_parameter(tmo2, tmo, tmo_size);
+  }
+
+  ret = untraced_syscall6(syscallno, nfds, sets2[0], sets2[1], sets2[2], tmo2,
+                          syscallno == SYS_pselect6 ? call->args[5] : 0);
+
+  /* See sys_poll for why we don't copy on error. */
+  if (ret >= 0) {
+    for (i = 0; i < 3; ++i) {
+      if (sets2[i]) {
+        local_memcpy(sets[i], sets2[i], set_size);
+      }
+    }
+    if (tmo2) {
+      local_memcpy(tmo, tmo2, tmo_size);
+    }
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_xstat64(const struct syscall_info* call) {
   const int syscallno = call->no;
   /* NB: this arg may be a string or an fd, but for the purposes
@@ -2046,10 +2488,17 @@ static long syscall_hook_internal(const struct syscall_info* call) {
     CASE(clock_gettime);
     CASE(close);
     CASE(creat);
+    CASE(epoll_wait);
+    CASE(faccessat);
 #if defined(SYS_fcntl64)
     CASE(fcntl64);
 #else
     CASE(fcntl);
+#endif
+#if defined(SYS_fstatat64)
+    CASE(fstatat64);
+#else
+    CASE(newfstatat);
 #endif
     CASE(futex);
     CASE(getpid);
@@ -2065,8 +2514,13 @@ static long syscall_hook_internal(const struct syscall_info* call) {
     CASE(madvise);
     CASE(open);
     CASE(poll);
+    CASE(ppoll);
+    CASE(pread64);
+    CASE(pwrite64);
+    CASE(pwritev);
     CASE(read);
     CASE(readlink);
+    CASE(readlinkat);
 #if defined(SYS_recvfrom)
     CASE(recvfrom);
 #endif
@@ -2081,11 +2535,19 @@ static long syscall_hook_internal(const struct syscall_info* call) {
 #endif
 #if defined(SYS_socketpair)
     CASE(socketpair);
+#endif
+#if defined(SYS_statx)
+    CASE(statx);
 #endif
     CASE(time);
     CASE(write);
     CASE(writev);
 #undef CASE
+    case SYS_epoll_pwait:
+      return sys_epoll_wait(call);
+    case SYS_getdents:
+    case SYS_getdents64:
+      return sys_xgetdents(call);
 #if defined(SYS_fstat64)
     case SYS_fstat64:
 #else
@@ -2102,6 +2564,16 @@ static long syscall_hook_internal(const struct syscall_info* call) {
     case SYS_stat:
 #endif
       return sys_xstat64(call);
+    case SYS_preadv:
+    case SYS_readv:
+      return sys_xreadv(call);
+#if defined(SYS__newselect)
+    case SYS__newselect:
+#else
+    case SYS_select:
+#endif
+    case SYS_pselect6:
+      return sys_xselect(call);
     default:
       return traced_raw_syscall(call);
   }
@@ -32,8 +32,15 @@
  * so we can't use it. */
 #define SYSCALLBUF_DESCHED_SIGNAL SIGPWR
 
-/* This size counts the header along with record data. */
+/* These sizes count the header along with record data. Each thread's
+ * buffer starts out SYSCALLBUF_BUFFER_SIZE bytes long. rr grows the
+ * buffers of threads that keep filling them and shrinks the buffers of
+ * threads that barely use them, within these bounds. The whole
+ * SYSCALLBUF_MAX_BUFFER_SIZE bytes are mapped up front so the buffer never
+ * moves; only the pages a thread actually uses take up memory. */
 #define SYSCALLBUF_BUFFER_SIZE (1 << 20)
+#define SYSCALLBUF_MIN_BUFFER_SIZE (1 << 16)
+#define SYSCALLBUF_MAX_BUFFER_SIZE (1 << 23)
 
 /* Set this env var to enable syscall buffering. */
 #define SYSCALLBUF_ENABLED_ENV_VAR "_RR_USE_SYSCALLBUF"
@@ -162,9 +169,25 @@ struct rrcall_init_buffers_params {
    */
   int padding;
 
+  /* Address of the thread's copy of the usable size of its syscallbuf.
+   * rr stores the initial size there and updates it whenever it resizes
+   * the buffer, which it only does while the buffer is empty. */
+  PTR(uint32_t) syscallbuf_size;
+
   /* "Out" params. */
-  /* Returned pointer to and size of the shared syscallbuf
-   * segment. */
+  /* Returned pointer to the shared syscallbuf segment. */
+  PTR(void) syscallbuf_ptr;
+};
+
+/**
+ * The layout of |rrcall_init_buffers_params| used by tracees recorded
+ * before syscallbufs could be resized. We still see it when replaying
+ * their traces.
+ */
+TEMPLATE_ARCH
+struct rrcall_init_buffers_params_fixed_size {
+  int desched_counter_fd;
+  int padding;
   PTR(void) syscallbuf_ptr;
 };
 
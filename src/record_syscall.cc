@@ -2228,7 +2228,9 @@ static Switchable rec_prepare_syscall_arch(Task* t,
     }
 
     case Arch::write:
-    case Arch::writev: {
+    case Arch::writev:
+    case Arch::pwrite64:
+    case Arch::pwritev: {
       int fd = (int)t->regs().arg1_signed();
       return t->fd_table()->will_write(t, fd);
     }
@@ -2559,7 +2561,10 @@ static Switchable rec_prepare_syscall_arch(Task* t,
 
     /* int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int
      * timeout); */
+    /* int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+     *                 int timeout, const sigset_t *sigmask); */
     case Arch::epoll_wait:
+    case Arch::epoll_pwait:
       syscall_state.reg_parameter(2, sizeof(typename Arch::epoll_event) *
                                          t->regs().arg3_signed());
       return ALLOW_SWITCH;
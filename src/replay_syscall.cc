@@ -91,6 +91,9 @@ static string maybe_dump_written_string(Task* t) {
  * Proceeds until the next system call, which is being executed.
  */
 static void __ptrace_cont(Task* t, int expect_syscallno) {
+  // The kernel's writes to tracee memory while it executes the syscall
+  // would fail on pages write-protected for software watchpoints.
+  t->vm()->lift_software_watch_pages(true);
   do {
     uintptr_t saved_r11 = t->arch() == x86_64 ? t->regs().r11() : 0;
     t->resume_execution(RESUME_SYSCALL, RESUME_WAIT, RESUME_NO_TICKS);
@@ -103,6 +106,9 @@ static void __ptrace_cont(Task* t, int expect_syscallno) {
       t->set_regs(r);
     }
   } while (ReplaySession::is_ignored_signal(t->stop_sig()));
+  // Protect them again before the task next runs user code. (After an
+  // execve this is a new address space, which has nothing lifted.)
+  t->vm()->lift_software_watch_pages(false);
 
   ASSERT(t, !t->pending_sig()) << "Expected no pending signal, but got "
                                << t->pending_sig();
@@ -853,11 +859,30 @@ static void process_mmap(Task* t, const TraceFrame& trace_frame,
     // Finally, we finish by emulating the return value.
     remote.regs().set_syscall_result(trace_frame.regs().syscall_result());
   }
-  // Monkeypatcher can emit data records that need to be applied now
+  // Monkeypatcher can emit mappings and data records that need to be
+  // applied now
+  process_patch_mappings(t);
   t->apply_all_data_records_from_trace();
   t->validate_regs();
 }
 
+void process_patch_mappings(Task* t) {
+  while (true) {
+    TraceReader::MappedData data;
+    bool found;
+    KernelMapping km = t->trace_reader().read_mapped_region(&data, &found);
+    if (!found) {
+      break;
+    }
+    AutoRemoteSyscalls remote(t);
+    ASSERT(t, km.flags() & MAP_ANONYMOUS);
+    remote.infallible_mmap_syscall(km.start(), km.size(), km.prot(),
+                                   km.flags() | MAP_FIXED, -1, 0);
+    t->vm()->map(km.start(), km.size(), km.prot(), km.flags(), 0, string(),
+                 KernelMapping::NO_DEVICE, KernelMapping::NO_INODE, &km);
+  }
+}
+
 void process_grow_map(Task* t) {
   AutoRemoteSyscalls remote(t);
   TraceReader::MappedData data;
@@ -950,7 +975,9 @@ static void rep_after_enter_syscall_arch(Task* t, int syscallno) {
       break;
 
     case Arch::write:
-    case Arch::writev: {
+    case Arch::writev:
+    case Arch::pwrite64:
+    case Arch::pwritev: {
       int fd = (int)t->regs().arg1_signed();
       t->fd_table()->will_write(t, fd);
       break;
@@ -1258,6 +1285,8 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
 
     case Arch::write:
     case Arch::writev:
+    case Arch::pwrite64:
+    case Arch::pwritev:
       if (state == SYSCALL_EXIT) {
         /* write*() can be desched'd, but don't use scratch,
          * so we might have saved 0 bytes of scratch after a
@@ -1285,6 +1314,7 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
     case SYS_rrcall_init_preload:
       if (state == SYSCALL_EXIT) {
         t->at_preload_init();
+        process_patch_mappings(t);
       }
       return;
 
@@ -26,4 +26,12 @@ void rep_process_syscall(Task* t, ReplayTraceStep* step);
  */
 void process_grow_map(Task* t);
 
+/**
+ * Replay the anonymous mappings Monkeypatcher recorded for the current
+ * event, if any. Besides EV_PATCH_SYSCALL events, patching syscall sites
+ * known from PatchSiteCache can create them during an mmap or the
+ * preload library's initialization.
+ */
+void process_patch_mappings(Task* t);
+
 #endif /* RR_REP_PROCESS_EVENT_H_ */
@@ -0,0 +1,102 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/*
+ * Measure the round-trip time of an epoll-driven echo loop, the inner loop
+ * of an event-driven server, so the cost of recording it can be compared
+ * with running it natively. Each round does an epoll_wait(), a read() and a
+ * write() on both sides of a socketpair.
+ *
+ * Build and run with
+ *
+ *   cc -O2 -o epoll-echo-benchmark epoll-echo-benchmark.c
+ *   ./epoll-echo-benchmark [ROUNDS]
+ *   rr record -n ./epoll-echo-benchmark [ROUNDS]
+ *   rr record ./epoll-echo-benchmark [ROUNDS]
+ *
+ * `rr record -n' disables the syscallbuf, so every syscall stops rr; plain
+ * `rr record' buffers all three syscalls. The recording slowdown is the
+ * ratio of the time per round to the native one.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int watch(int fd) {
+  struct epoll_event ev;
+  int epfd = epoll_create1(0);
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("epoll");
+    exit(1);
+  }
+  return epfd;
+}
+
+/* Wait for |fd| to become readable, then read one byte from it. Returns 0
+ * at end of file. */
+static int wait_and_read(int epfd, int fd, char* ch) {
+  struct epoll_event ev;
+  if (epoll_wait(epfd, &ev, 1, -1) != 1) {
+    perror("epoll_wait");
+    exit(1);
+  }
+  return read(fd, ch, 1) == 1;
+}
+
+int main(int argc, char** argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+  if (rounds <= 0) {
+    fprintf(stderr, "Usage: %s [ROUNDS]\n", argv[0]);
+    return 1;
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    perror("socketpair");
+    return 1;
+  }
+  pid_t child = fork();
+  if (!child) {
+    char ch;
+    int epfd = watch(fds[1]);
+    close(fds[0]);
+    while (wait_and_read(epfd, fds[1], &ch)) {
+      if (write(fds[1], &ch, 1) != 1) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  close(fds[1]);
+
+  int epfd = watch(fds[0]);
+  double start = now();
+  for (int i = 0; i < rounds; ++i) {
+    char ch = i;
+    if (write(fds[0], &ch, 1) != 1 || !wait_and_read(epfd, fds[0], &ch)) {
+      perror("echo");
+      return 1;
+    }
+  }
+  double seconds = now() - start;
+
+  close(fds[0]);
+  waitpid(child, NULL, 0);
+  printf("%d rounds in %.3fs: %.0f ns per round\n", rounds, seconds,
+         seconds * 1e9 / rounds);
+  return 0;
+}
@@ -0,0 +1,138 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+/*
+ * Measure what it costs rr to restart the ticks counter of a stopped
+ * tracee, which it does on every resume: opening and configuring a new
+ * perf event the way rr used to, versus reprogramming an open one with
+ * ioctls. Also times the read() rr uses to collect the count.
+ *
+ * Build and run with
+ *
+ *   cc -O2 -o perf-counter-benchmark perf-counter-benchmark.c
+ *   ./perf-counter-benchmark [ITERATIONS]
+ *
+ * A counter's mmap()ed user page can't stand in for read() here: rdpmc
+ * only reads counters scheduled on the current thread, and rr's counters
+ * monitor other tasks.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void init_attr(struct perf_event_attr* attr) {
+  memset(attr, 0, sizeof(*attr));
+  attr->type = PERF_TYPE_HARDWARE;
+  attr->size = sizeof(*attr);
+  attr->config = PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+  attr->sample_period = 0xffffffff;
+  attr->exclude_kernel = 1;
+  attr->exclude_guest = 1;
+}
+
+static int open_counter(pid_t tid) {
+  struct perf_event_attr attr;
+  init_attr(&attr);
+  int fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+  if (fd < 0) {
+    perror("perf_event_open");
+    exit(1);
+  }
+  return fd;
+}
+
+/* What PerfCounters::reset() did on every resume before it kept its
+ * counters open. */
+static void reopen_cycle(pid_t tid) {
+  int fd = open_counter(tid);
+  struct f_owner_ex own = { F_OWNER_TID, tid };
+  if (fcntl(fd, F_SETOWN_EX, &own) || fcntl(fd, F_SETFL, O_ASYNC) ||
+      fcntl(fd, F_SETSIG, SIGSTKFLT) || ioctl(fd, PERF_EVENT_IOC_ENABLE, 0)) {
+    perror("configuring counter");
+    exit(1);
+  }
+  close(fd);
+}
+
+static void reprogram_cycle(int fd) {
+  uint64_t period = 0xffffffff;
+  if (ioctl(fd, PERF_EVENT_IOC_PERIOD, &period) ||
+      ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) ||
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) ||
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP)) {
+    perror("reprogramming counter");
+    exit(1);
+  }
+}
+
+static void report(const char* what, double seconds, int iterations) {
+  printf("%-24s %8.0f ns\n", what, seconds * 1e9 / iterations);
+}
+
+int main(int argc, char** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+    return 1;
+  }
+
+  /* A child blocked in read() stands in for a stopped tracee. */
+  int pipe_fds[2];
+  if (pipe(pipe_fds)) {
+    perror("pipe");
+    return 1;
+  }
+  pid_t child = fork();
+  if (!child) {
+    char ch;
+    close(pipe_fds[1]);
+    read(pipe_fds[0], &ch, 1);
+    return 0;
+  }
+  close(pipe_fds[0]);
+
+  int fd = open_counter(child);
+  double start = now();
+  for (int i = 0; i < iterations; ++i) {
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+      perror("read");
+      return 1;
+    }
+  }
+  report("read()", now() - start, iterations);
+
+  start = now();
+  for (int i = 0; i < iterations; ++i) {
+    reopen_cycle(child);
+  }
+  report("reopen per resume", now() - start, iterations);
+
+  start = now();
+  for (int i = 0; i < iterations; ++i) {
+    reprogram_cycle(fd);
+  }
+  report("reprogram per resume", now() - start, iterations);
+
+  close(fd);
+  close(pipe_fds[1]);
+  waitpid(child, NULL, 0);
+  return 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Measure replay throughput of a recorded trace under different rr
+# options. Each option set is replayed with `rr replay -a' RUNS times and
+# the best wall-clock time is reported along with events/sec.
+#
+# Usage: replay-benchmark.sh [-n RUNS] <trace-dir> ["<rr options>"]...
+#
+# With no option sets, compares synchronous decompression against
+# --read-ahead=4. For example
+#
+#   replay-benchmark.sh ~/.local/share/rr/latest-trace "" "--read-ahead=2"
+
+function fatal { why=$1;
+    echo "[FATAL]" $why >&2
+    exit 1
+}
+
+runs=3
+if [[ "$1" == "-n" ]]; then
+    runs=$2
+    shift 2
+fi
+trace=$1
+shift
+if [[ ! -d "$trace" ]]; then
+    fatal "Usage: replay-benchmark.sh [-n RUNS] <trace-dir> [\"<rr options>\"]..."
+fi
+
+option_sets=("$@")
+if [[ ${#option_sets[@]} == 0 ]]; then
+    option_sets=("" "--read-ahead=4")
+fi
+
+events=$(rr dump -r "$trace" | wc -l)
+echo "Trace $trace has $events events"
+
+for options in "${option_sets[@]}"; do
+    best=
+    for i in $(seq 1 $runs); do
+        start=$(date +%s.%N)
+        rr $options replay -a "$trace" > /dev/null 2>&1 ||
+            fatal "replay with options '$options' failed"
+        end=$(date +%s.%N)
+        secs=$(echo "$end - $start" | bc)
+        if [[ -z "$best" || $(echo "$secs < $best" | bc) == 1 ]]; then
+            best=$secs
+        fi
+    done
+    rate=$(echo "$events / $best" | bc)
+    printf "%-30s %8.3fs %10d events/sec\n" "'$options'" $best $rate
+done
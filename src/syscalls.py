@@ -932,8 +932,10 @@ rt_sigsuspend = IrregularEmulatedSyscall(x86=179, x64=130)
 #
 # pread, pwrite - read from or write to a file descriptor at a given
 # offset
+#
+# Note: pwrite64 is irregular, like write, so FileMonitors see its writes.
 pread64 = IrregularEmulatedSyscall(x86=180, x64=17)
-pwrite64 = EmulatedSyscall(x86=181, x64=18)
+pwrite64 = IrregularEmulatedSyscall(x86=181, x64=18)
 
 chown = EmulatedSyscall(x86=182, x64=92)
 
@@ -1471,7 +1473,11 @@ tee = UnsupportedSyscall(x86=315, x64=276)
 vmsplice = UnsupportedSyscall(x86=316, x64=278)
 move_pages = UnsupportedSyscall(x86=317, x64=279)
 getcpu = EmulatedSyscall(x86=318, x64=309, arg1="unsigned int", arg2="unsigned int")
-epoll_pwait = UnsupportedSyscall(x86=319, x64=281)
+#  int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+#                  int timeout, const sigset_t *sigmask);
+#
+# epoll_pwait() is to epoll_wait() as ppoll() is to poll().
+epoll_pwait = IrregularEmulatedSyscall(x86=319, x64=281)
 
 #  int utimensat(int dirfd, const char *pathname, const struct timespec
 #times[2], int flags);
@@ -1557,7 +1563,7 @@ pipe2 = EmulatedSyscall(x86=331, x64=293, arg1="int[2]")
 inotify_init1 = EmulatedSyscall(x86=332, x64=294)
 
 preadv = IrregularEmulatedSyscall(x86=333, x64=295)
-pwritev = EmulatedSyscall(x86=334, x64=296)
+pwritev = IrregularEmulatedSyscall(x86=334, x64=296)
 
 #  int rt_sigqueueinfo(pid_t tgid, int sig, siginfo_t *uinfo);
 #  int rt_tgsigqueueinfo(pid_t tgid, pid_t tid, int sig,
@@ -1633,6 +1639,13 @@ seccomp = IrregularEmulatedSyscall(x86=354, x64=317)
 getrandom = IrregularEmulatedSyscall(x86=355, x64=318)
 memfd_create = EmulatedSyscall(x86=356, x64=319)
 
+#  int statx(int dirfd, const char *pathname, int flags, unsigned int mask,
+#            struct statx *statxbuf);
+#
+# This function returns information about a file, storing it in the
+# buffer pointed to by statxbuf.
+statx = EmulatedSyscall(x86=383, x64=332, arg5="struct Arch::statx")
+
 # restart_syscall is a little special.
 restart_syscall = RestartSyscall(x86=0, x64=219)
 
@@ -17,6 +17,7 @@
 #include <sys/personality.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/user.h>
 
@@ -28,6 +29,8 @@
 #include "preload/preload_interface.h"
 
 #include "AutoRemoteSyscalls.h"
+#include "CompressedReader.h"
+#include "CompressedWriter.h"
 #include "CPUIDBugDetector.h"
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
@@ -222,7 +225,8 @@ TaskGroup::~TaskGroup() {
 
 Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
            int _priority, SupportedArch a)
-    : unstable(false),
+    : remote_syscalls_depth(0),
+      unstable(false),
       stable_exit(false),
       priority(_priority),
       in_round_robin_queue(false),
@@ -235,6 +239,10 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
       scratch_size(),
       flushed_syscallbuf(false),
       delay_syscallbuf_reset(false),
+      syscallbuf_flushes(0),
+      syscallbuf_full_flushes(0),
+      syscallbuf_full_flush_run(0),
+      syscallbuf_sparse_flush_run(0),
       // This will be initialized when the syscall buffer is.
       desched_fd_child(-1),
       seccomp_bpf_enabled(false),
@@ -245,15 +253,19 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
       own_namespace_rec_tid(0),
       syscallbuf_hdr(),
       num_syscallbuf_bytes(),
+      syscallbuf_size(0),
+      syscallbuf_size_child(),
       stopping_breakpoint_table_entry_size(0),
       serial(serial),
       blocked_sigs(),
       prname("???"),
       ticks(0),
       registers(a),
+      registers_dirty(false),
       is_stopped(false),
       extra_registers(a),
       extra_registers_known(false),
+      extra_registers_dirty(false),
       robust_futex_list(),
       robust_futex_list_len(),
       session_(&session),
@@ -289,6 +301,13 @@ Task::~Task() {
     log_pending_events();
   }
 
+  if (session().is_recording() && syscallbuf_flushes) {
+    LOG(info) << "task " << tid << " flushed its syscallbuf "
+              << syscallbuf_flushes << " times, " << syscallbuf_full_flushes
+              << " of them at least half full; final size "
+              << syscallbuf_size << " bytes";
+  }
+
   session().on_destroy(this);
   tg->erase_task(this);
   as->erase_task(this);
@@ -664,6 +683,32 @@ TraceWriter& Task::trace_writer() { return record_session().trace_writer(); }
 RecordSession& Task::record_session() const { return *session().as_record(); }
 ReplaySession& Task::replay_session() const { return *session().as_replay(); }
 
+template <typename Arch>
+void Task::init_fixed_size_buffers_arch(AutoRemoteSyscalls& remote,
+                                        remote_ptr<void> map_hint) {
+  // Replaying a trace recorded before syscallbufs could be resized: the
+  // tracee passes the old params layout and its buffer is
+  // SYSCALLBUF_BUFFER_SIZE bytes for good. Leaving |syscallbuf_size_child|
+  // null keeps us from ever resizing it.
+  remote_ptr<rrcall_init_buffers_params_fixed_size<Arch> > child_args =
+      remote.regs().arg1();
+  auto args = read_mem(child_args);
+
+  if (as->syscallbuf_enabled()) {
+    init_syscall_buffer(remote, map_hint, SYSCALLBUF_BUFFER_SIZE);
+    args.syscallbuf_ptr = syscallbuf_child;
+    syscallbuf_size = SYSCALLBUF_BUFFER_SIZE;
+    desched_fd_child = args.desched_counter_fd;
+    // Prevent the child from closing this fd
+    fds->add_monitor(desched_fd_child, new PreserveFileMonitor());
+  } else {
+    args.syscallbuf_ptr = remote_ptr<void>(nullptr);
+  }
+
+  write_mem(child_args, args);
+  remote.regs().set_syscall_result(syscallbuf_child);
+}
+
 template <typename Arch>
 void Task::init_buffers_arch(remote_ptr<void> map_hint) {
   // NB: the tracee can't be interrupted with a signal while
@@ -671,14 +716,22 @@ void Task::init_buffers_arch(remote_ptr<void> map_hint) {
   // signals.
   AutoRemoteSyscalls remote(this);
 
+  if (session().is_replaying() && !trace_reader().syscallbuf_resizable()) {
+    init_fixed_size_buffers_arch<Arch>(remote, map_hint);
+    return;
+  }
+
   // Arguments to the rrcall.
   remote_ptr<rrcall_init_buffers_params<Arch> > child_args =
       remote.regs().arg1();
   auto args = read_mem(child_args);
 
   if (as->syscallbuf_enabled()) {
-    init_syscall_buffer(remote, map_hint);
+    init_syscall_buffer(remote, map_hint, SYSCALLBUF_MAX_BUFFER_SIZE);
     args.syscallbuf_ptr = syscallbuf_child;
+    syscallbuf_size_child = args.syscallbuf_size.rptr();
+    syscallbuf_size = SYSCALLBUF_BUFFER_SIZE;
+    write_mem(syscallbuf_size_child, syscallbuf_size);
     desched_fd_child = args.desched_counter_fd;
     // Prevent the child from closing this fd
     fds->add_monitor(desched_fd_child, new PreserveFileMonitor());
@@ -943,7 +996,8 @@ void Task::on_syscall_exit_arch(int syscallno, const Registers& regs) {
       }
       return;
 
-    case Arch::write: {
+    case Arch::write:
+    case Arch::pwrite64: {
       int fd = (int)regs.arg1_signed();
       vector<FileMonitor::Range> ranges;
       ssize_t amount = regs.syscall_result_signed();
@@ -954,7 +1008,8 @@ void Task::on_syscall_exit_arch(int syscallno, const Registers& regs) {
       return;
     }
 
-    case Arch::writev: {
+    case Arch::writev:
+    case Arch::pwritev: {
       int fd = (int)regs.arg1_signed();
       vector<FileMonitor::Range> ranges;
       auto iovecs =
@@ -1072,6 +1127,7 @@ void Task::post_exec(const Registers* replay_regs,
   // Read registers now that the architecture is known.
   struct user_regs_struct ptrace_regs;
   ptrace_if_alive(PTRACE_GETREGS, nullptr, &ptrace_regs);
+  session().accumulate_register_fetch();
   registers.set_from_ptrace(ptrace_regs);
   // Change syscall number to execve *for the new arch*. If we don't do this,
   // and the arch changes, then the syscall number for execve in the old arch/
@@ -1090,6 +1146,7 @@ void Task::post_exec(const Registers* replay_regs,
   // the clone.
   set_robust_list(nullptr, 0);
   syscallbuf_child = nullptr;
+  syscallbuf_size_child = nullptr;
   syscallbuf_fds_disabled_child = nullptr;
 
   sighandlers = sighandlers->clone();
@@ -1151,10 +1208,64 @@ void Task::maybe_reset_syscallbuf() {
     flushed_syscallbuf = false;
     LOG(debug) << "Syscallbuf reset";
     reset_syscallbuf();
+    maybe_resize_syscallbuf();
     record_event(Event(EV_SYSCALLBUF_RESET, NO_EXEC_INFO, arch()));
   }
 }
 
+/* Grow a syscallbuf once this many flushes in a row have found it at least
+ * half full, and shrink it once this many in a row have found it less than
+ * 1/16 full. Shrinking is deliberately slow: a mostly idle thread costs
+ * little, but a buffer that's too small costs a trip through rr every time
+ * it fills. */
+static const uint32_t SYSCALLBUF_GROW_FLUSH_RUN = 4;
+static const uint32_t SYSCALLBUF_SHRINK_FLUSH_RUN = 64;
+
+void Task::maybe_resize_syscallbuf() {
+  // The size can only change while the buffer is empty and the tracee isn't
+  // in the middle of buffering a syscall.
+  if (!is_stopped || syscallbuf_size_child.is_null() ||
+      syscallbuf_hdr->locked) {
+    return;
+  }
+
+  uint32_t size = syscallbuf_size;
+  if (syscallbuf_full_flush_run >= SYSCALLBUF_GROW_FLUSH_RUN &&
+      size < SYSCALLBUF_MAX_BUFFER_SIZE) {
+    size *= 2;
+  } else if (syscallbuf_sparse_flush_run >= SYSCALLBUF_SHRINK_FLUSH_RUN &&
+             size > SYSCALLBUF_MIN_BUFFER_SIZE) {
+    size /= 2;
+  } else {
+    return;
+  }
+  syscallbuf_full_flush_run = 0;
+  syscallbuf_sparse_flush_run = 0;
+
+  LOG(debug) << "Resizing syscallbuf from " << syscallbuf_size << " to "
+             << size << " bytes";
+  set_syscallbuf_size(size);
+  session().accumulate_syscallbuf_resize();
+  // Replay picks the new size up from the reset event.
+  record_local(syscallbuf_size_child, sizeof(size), &size);
+}
+
+void Task::set_syscallbuf_size(uint32_t size) {
+  ASSERT(this,
+         size <= num_syscallbuf_bytes && !syscallbuf_size_child.is_null());
+  if (size < syscallbuf_size) {
+    // Hand the pages we no longer use back to the system. They're shared
+    // with the tracee's mapping, which won't touch them again until the
+    // buffer grows, at which point they come back zeroed.
+    if (madvise((uint8_t*)syscallbuf_hdr + size, syscallbuf_size - size,
+                MADV_REMOVE)) {
+      LOG(warn) << "Failed to release syscallbuf pages: " << errno_name(errno);
+    }
+  }
+  syscallbuf_size = size;
+  write_mem(syscallbuf_size_child, size);
+}
+
 void Task::record_event(const Event& ev, FlushSyscallbuf flush) {
   if (flush == FLUSH_SYSCALLBUF) {
     maybe_flush_syscallbuf();
@@ -1211,6 +1322,13 @@ void Task::record_local(remote_ptr<void> addr, ssize_t num_bytes,
   trace_writer().write_raw(data, num_bytes, addr);
 }
 
+size_t Task::record_remote_directly(remote_ptr<void> addr, ssize_t num_bytes) {
+  return trace_writer().write_raw_from(
+      addr, num_bytes, [this](remote_ptr<void> p, size_t len, void* buf) {
+        return read_bytes_fallible(p, len, buf);
+      });
+}
+
 void Task::record_remote(remote_ptr<void> addr, ssize_t num_bytes) {
   maybe_flush_syscallbuf();
 
@@ -1223,8 +1341,10 @@ void Task::record_remote(remote_ptr<void> addr, ssize_t num_bytes) {
     return;
   }
 
-  auto buf = read_mem(addr.cast<uint8_t>(), num_bytes);
-  trace_writer().write_raw(buf.data(), num_bytes, addr);
+  size_t nread = record_remote_directly(addr, num_bytes);
+  ASSERT(this, nread == (size_t)num_bytes)
+      << "Should have read " << num_bytes << " bytes from " << addr
+      << ", but only read " << nread;
 }
 
 void Task::record_remote_fallible(remote_ptr<void> addr, ssize_t num_bytes) {
@@ -1234,13 +1354,11 @@ void Task::record_remote_fallible(remote_ptr<void> addr, ssize_t num_bytes) {
   ASSERT(this, !addr || addr != scratch_ptr);
   ASSERT(this, num_bytes >= 0);
 
-  vector<uint8_t> buf;
-  if (!addr.is_null()) {
-    buf.resize(num_bytes);
-    ssize_t nread = read_bytes_fallible(addr, num_bytes, buf.data());
-    buf.resize(max<ssize_t>(0, nread));
+  if (addr.is_null()) {
+    trace_writer().write_raw(nullptr, 0, addr);
+    return;
   }
-  trace_writer().write_raw(buf.data(), buf.size(), addr);
+  record_remote_directly(addr, num_bytes);
 }
 
 void Task::record_remote_even_if_null(remote_ptr<void> addr,
@@ -1257,8 +1375,10 @@ void Task::record_remote_even_if_null(remote_ptr<void> addr,
     return;
   }
 
-  auto buf = read_mem(addr.cast<uint8_t>(), num_bytes);
-  trace_writer().write_raw(buf.data(), num_bytes, addr);
+  size_t nread = record_remote_directly(addr, num_bytes);
+  ASSERT(this, nread == (size_t)num_bytes)
+      << "Should have read " << num_bytes << " bytes from " << addr
+      << ", but only read " << nread;
 }
 
 string Task::read_c_str(remote_ptr<char> child_addr) {
@@ -1345,6 +1465,7 @@ const ExtraRegisters& Task::extra_regs() {
 #endif
     }
 
+    session().accumulate_extra_register_fetch();
     extra_registers_known = true;
   }
   return extra_registers;
@@ -1494,6 +1615,64 @@ void Task::remote_memcpy(remote_ptr<void> dst, remote_ptr<void> src,
 
 void Task::resume_execution(ResumeRequest how, WaitRequest wait_how,
                             TicksRequest tick_period, int sig) {
+  Ticks ticks_at_resume = tick_count();
+  while (true) {
+    // Within a remote-syscall sequence, leave the page protection alone
+    // until the outermost AutoRemoteSyscalls has finished.
+    if (!remote_syscalls_depth && as->software_watch_pages_need_update()) {
+      as->update_software_watch_pages(this);
+    }
+    resume_execution_once(how, wait_how, tick_period, sig);
+    if (RESUME_WAIT != wait_how ||
+        handle_software_watchpoint_fault(how) != SOFTWARE_WATCHPOINT_SPURIOUS) {
+      return;
+    }
+    // A write to a watched page that didn't change any watched value.
+    // Carry on as if nothing happened.
+    if (tick_period > 0) {
+      tick_period = (TicksRequest)max<Ticks>(
+          1, tick_period - (tick_count() - ticks_at_resume));
+    }
+    sig = 0;
+  }
+}
+
+Task::SoftwareWatchpointFault Task::handle_software_watchpoint_fault(
+    ResumeRequest how) {
+  if (!is_stopped || SIGSEGV != pending_sig()) {
+    return NOT_SOFTWARE_WATCHPOINT;
+  }
+  const siginfo_t& si = get_siginfo();
+  remote_ptr<void> addr(reinterpret_cast<uintptr_t>(si.si_addr));
+  if (SEGV_ACCERR != si.si_code || !as->is_software_watch_page(addr)) {
+    return NOT_SOFTWARE_WATCHPOINT;
+  }
+
+  LOG(debug) << "Write to software-watched page at " << addr;
+  as->begin_software_watch_write(this, addr);
+  // Complete the faulting write with the page writable. This can fault
+  // again if the write spans two watched pages.
+  resume_execution(RESUME_SINGLESTEP, RESUME_WAIT, RESUME_UNLIMITED_TICKS);
+  as->end_software_watch_write(addr);
+  if (!is_stopped || SIGTRAP != pending_sig()) {
+    // Something else happened, e.g. the task exited. Let our caller see it.
+    return NOT_SOFTWARE_WATCHPOINT;
+  }
+  if (how == RESUME_SINGLESTEP || how == RESUME_SYSEMU_SINGLESTEP) {
+    // Our singlestep completes the caller's; compute_trap_reasons will
+    // check the watchpoints.
+    return SOFTWARE_WATCHPOINT_TRIGGERED;
+  }
+  if (!as->notify_watchpoint_fired(0)) {
+    return SOFTWARE_WATCHPOINT_SPURIOUS;
+  }
+  // Report a watchpoint trap rather than a singlestep.
+  set_debug_status(0);
+  return SOFTWARE_WATCHPOINT_TRIGGERED;
+}
+
+void Task::resume_execution_once(ResumeRequest how, WaitRequest wait_how,
+                                 TicksRequest tick_period, int sig) {
   // Treat a RESUME_NO_TICKS tick_period as a very large but finite number.
   // Always resetting here, and always to a nonzero number, improves
   // consistency between recording and replay and hopefully
@@ -1530,12 +1709,15 @@ ssize_t Task::set_data_from_trace() {
 }
 
 void Task::apply_all_data_records_from_trace() {
+  vector<TraceReader::RawData> records;
   TraceReader::RawData buf;
   while (trace_reader().read_raw_data_for_frame(current_trace_frame(), buf)) {
     if (!buf.addr.is_null() && buf.data.size() > 0) {
-      write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
+      records.push_back(move(buf));
+      buf = TraceReader::RawData();
     }
   }
+  write_data_records(records);
 }
 
 void Task::set_return_value_from_trace() {
@@ -1551,14 +1733,28 @@ void Task::set_return_value_from_trace() {
 void Task::set_regs(const Registers& regs) {
   ASSERT(this, is_stopped);
   registers = regs;
-  auto ptrace_regs = registers.get_ptrace();
-  ptrace_if_alive(PTRACE_SETREGS, nullptr, &ptrace_regs);
+  registers_dirty = true;
 }
 
 void Task::set_extra_regs(const ExtraRegisters& regs) {
   ASSERT(this, !regs.empty()) << "Trying to set empty ExtraRegisters";
   extra_registers = regs;
   extra_registers_known = true;
+  extra_registers_dirty = true;
+}
+
+void Task::flush_registers() {
+  if (registers_dirty) {
+    auto ptrace_regs = registers.get_ptrace();
+    ptrace_if_alive(PTRACE_SETREGS, nullptr, &ptrace_regs);
+    session().accumulate_register_writeback();
+    registers_dirty = false;
+  }
+  if (!extra_registers_dirty) {
+    return;
+  }
+  extra_registers_dirty = false;
+  session().accumulate_extra_register_writeback();
 
   init_xsave();
 
@@ -2113,11 +2309,15 @@ void Task::did_waitpid(int status, siginfo_t* override_siginfo) {
   session().accumulate_ticks_processed(more_ticks);
 
   LOG(debug) << "  (refreshing register cache)";
+  // Normally we flushed them when resuming, but we may be reaping a stop we
+  // didn't resume from.
+  flush_registers();
   intptr_t original_syscallno = registers.original_syscallno();
   // Skip reading registers immediately after a PTRACE_EVENT_EXEC, since
   // we may not know the correct architecture.
   if (ptrace_event() != PTRACE_EVENT_EXEC) {
     struct user_regs_struct ptrace_regs;
+    session().accumulate_register_fetch();
     if (ptrace_if_alive(PTRACE_GETREGS, nullptr, &ptrace_regs)) {
       registers.set_from_ptrace(ptrace_regs);
     } else {
@@ -2479,9 +2679,10 @@ Task* Task::clone(int flags, remote_ptr<void> stack, remote_ptr<void> tls,
   return t;
 }
 
-Task* Task::os_fork_into(Session* session) {
+Task* Task::os_fork_into(Session* session, pid_t new_rec_tid,
+                         uint32_t new_serial) {
   AutoRemoteSyscalls remote(this);
-  Task* child = os_clone(this, session, remote, rec_tid, serial,
+  Task* child = os_clone(this, session, remote, new_rec_tid, new_serial,
                          // Most likely, we'll be setting up a
                          // CLEARTID futex.  That's not done
                          // here, but rather later in
@@ -2551,6 +2752,8 @@ Task::CapturedState Task::capture_state() {
   state.robust_futex_list_len = robust_futex_list_len;
   state.thread_areas = thread_areas_;
   state.num_syscallbuf_bytes = num_syscallbuf_bytes;
+  state.syscallbuf_size = syscallbuf_size;
+  state.syscallbuf_size_child = syscallbuf_size_child;
   state.desched_fd_child = desched_fd_child;
   state.syscallbuf_child = syscallbuf_child;
   if (syscallbuf_hdr) {
@@ -2559,7 +2762,7 @@ Task::CapturedState Task::capture_state() {
       // There may be an incomplete syscall record after num_rec_bytes that
       // we need to capture here. We don't know how big that record is,
       // so just record the entire buffer. This should not be common.
-      data_size = num_syscallbuf_bytes;
+      data_size = syscallbuf_size;
     }
     state.syscallbuf_hdr.resize(data_size);
     memcpy(state.syscallbuf_hdr.data(), syscallbuf_hdr,
@@ -2607,13 +2810,16 @@ void Task::copy_state(const CapturedState& state) {
     if (!state.syscallbuf_child.is_null()) {
       // All these fields are preserved by the fork.
       num_syscallbuf_bytes = state.num_syscallbuf_bytes;
+      syscallbuf_size = state.syscallbuf_size;
+      syscallbuf_size_child = state.syscallbuf_size_child;
       desched_fd_child = state.desched_fd_child;
 
       // The syscallbuf is mapped as a shared
       // segment between rr and the tracee.  So we
       // have to unmap it, create a copy, and then
       // re-map the copy in rr and the tracee.
-      init_syscall_buffer(remote, state.syscallbuf_child);
+      init_syscall_buffer(remote, state.syscallbuf_child,
+                          state.num_syscallbuf_bytes);
       ASSERT(this, state.syscallbuf_child == syscallbuf_child);
       // Ensure the copied syscallbuf has the same contents
       // as the old one, for consistency checking.
@@ -2641,12 +2847,94 @@ void Task::copy_state(const CapturedState& state) {
   ticks = state.ticks;
 }
 
+/*static*/ void Task::write_captured_state(CompressedWriter& out,
+                                          const CapturedState& state) {
+  out << state.rec_tid << state.serial << state.regs;
+  out << state.extra_regs.format_ << state.extra_regs.arch_
+      << state.extra_regs.data_;
+  out << state.prname << state.robust_futex_list << state.robust_futex_list_len
+      << state.thread_areas << state.num_syscallbuf_bytes
+      << state.syscallbuf_size << state.syscallbuf_size_child
+      << state.desched_fd_child << state.syscallbuf_child
+      << state.syscallbuf_hdr << state.syscallbuf_fds_disabled_child
+      << state.scratch_ptr << state.scratch_size << state.wait_status
+      << state.blocked_sigs;
+  // Events are plain data, apart from the syscallbuf record pointers of
+  // desched events, which the caller must not persist.
+  out << state.pending_events.size();
+  for (auto& ev : state.pending_events) {
+    out.write(&ev, sizeof(ev));
+  }
+  out << state.ticks << state.tid_futex << state.top_of_stack;
+}
+
+/*static*/ Task::CapturedState Task::read_captured_state(CompressedReader& in) {
+  CapturedState state;
+  in >> state.rec_tid >> state.serial >> state.regs;
+  in >> state.extra_regs.format_ >> state.extra_regs.arch_ >>
+      state.extra_regs.data_;
+  in >> state.prname >> state.robust_futex_list >>
+      state.robust_futex_list_len >> state.thread_areas >>
+      state.num_syscallbuf_bytes >> state.syscallbuf_size >>
+      state.syscallbuf_size_child >> state.desched_fd_child >>
+      state.syscallbuf_child >> state.syscallbuf_hdr >>
+      state.syscallbuf_fds_disabled_child >> state.scratch_ptr >>
+      state.scratch_size >> state.wait_status >> state.blocked_sigs;
+  size_t num_events;
+  in >> num_events;
+  for (size_t i = 0; i < num_events; ++i) {
+    Event ev;
+    in.read(&ev, sizeof(ev));
+    state.pending_events.push_back(ev);
+  }
+  in >> state.ticks >> state.tid_futex >> state.top_of_stack;
+  return state;
+}
+
+void Task::write_sighandlers(CompressedWriter& out) const {
+  for (auto& h : sighandlers->handlers) {
+    out << h.k_sa_handler << h.sa << h.resethand << h.takes_siginfo;
+  }
+}
+
+void Task::read_sighandlers(CompressedReader& in) {
+  for (auto& h : sighandlers->handlers) {
+    in >> h.k_sa_handler >> h.sa >> h.resethand >> h.takes_siginfo;
+  }
+}
+
 void Task::destroy_local_buffers() {
   desched_fd.close();
   munmap(syscallbuf_hdr, num_syscallbuf_bytes);
 }
 
+/**
+ * Return true if |request| lets the tracee run again, or lets go of it.
+ */
+static bool ptrace_request_releases_tracee(int request) {
+  switch (request) {
+    case PTRACE_CONT:
+    case PTRACE_SYSCALL:
+    case PTRACE_SINGLESTEP:
+    case PTRACE_SYSEMU:
+    case PTRACE_SYSEMU_SINGLESTEP:
+    case PTRACE_DETACH:
+    case PTRACE_KILL:
+      return true;
+    default:
+      return false;
+  }
+}
+
 long Task::fallible_ptrace(int request, remote_ptr<void> addr, void* data) {
+  if (ptrace_request_releases_tracee(request)) {
+    // Registers changed with set_regs() must reach the kernel before the
+    // tracee runs again. Callers check errno after this, so don't let the
+    // writeback disturb it.
+    int saved_errno = errno;
+    flush_registers();
+    errno = saved_errno;
+  }
   return ptrace(__ptrace_request(request), tid, addr, data);
 }
 
@@ -2682,7 +2970,7 @@ void Task::open_mem_fd_if_needed() {
 }
 
 void Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
-                               remote_ptr<void> map_hint) {
+                               remote_ptr<void> map_hint, size_t size) {
   static int nonce = 0;
   // Create the segment we'll share with the tracee.
   char path[PATH_MAX];
@@ -2707,12 +2995,14 @@ void Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
   unlink(path);
 
   ScopedFd shmem_fd = remote.retrieve_fd(child_shmem_fd);
-  resize_shmem_segment(shmem_fd, SYSCALLBUF_BUFFER_SIZE);
+  // Resizable buffers get room for the largest size up front so they never
+  // have to move. Only the pages the tracee actually touches take up memory.
+  resize_shmem_segment(shmem_fd, size);
   LOG(debug) << "created shmem segment " << path;
 
   // Map the segment in ours and the tracee's address spaces.
   void* map_addr;
-  num_syscallbuf_bytes = SYSCALLBUF_BUFFER_SIZE;
+  num_syscallbuf_bytes = size;
   int prot = PROT_READ | PROT_WRITE;
   int flags = MAP_SHARED;
   if ((void*)-1 == (map_addr = mmap(nullptr, num_syscallbuf_bytes, prot, flags,
@@ -2790,6 +3080,21 @@ void Task::maybe_flush_syscallbuf() {
   record_current_event();
   pop_event(EV_SYSCALLBUF_FLUSH);
 
+  ++syscallbuf_flushes;
+  session().accumulate_syscallbuf_flush();
+  uint32_t used = sizeof(hdr) + hdr.num_rec_bytes;
+  if (syscallbuf_size && used * 2 >= syscallbuf_size) {
+    ++syscallbuf_full_flushes;
+    ++syscallbuf_full_flush_run;
+    syscallbuf_sparse_flush_run = 0;
+  } else if (used * 16 <= syscallbuf_size) {
+    ++syscallbuf_sparse_flush_run;
+    syscallbuf_full_flush_run = 0;
+  } else {
+    syscallbuf_full_flush_run = 0;
+    syscallbuf_sparse_flush_run = 0;
+  }
+
   flushed_syscallbuf = true;
   flushed_num_rec_bytes = hdr.num_rec_bytes;
 
@@ -2856,6 +3161,57 @@ ssize_t Task::write_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size,
   return nwritten;
 }
 
+/**
+ * Cleared when process_vm_writev() turns out not to be usable at all, e.g.
+ * because a seccomp policy forbids it.
+ */
+static bool process_vm_writev_works = true;
+
+void Task::write_data_records(const vector<TraceReader::RawData>& records) {
+  // Once a record can't be written this way, the rest of the frame is
+  // likely to hit the same protected pages, so don't keep retrying.
+  bool batching = process_vm_writev_works;
+  size_t i = 0;
+  while (i < records.size()) {
+    size_t batch = min<size_t>(records.size() - i, IOV_MAX);
+    size_t written = 0;
+    if (batching && batch > 1) {
+      vector<struct iovec> local(batch);
+      vector<struct iovec> remote(batch);
+      for (size_t j = 0; j < batch; ++j) {
+        const TraceReader::RawData& r = records[i + j];
+        local[j].iov_base = const_cast<uint8_t*>(r.data.data());
+        local[j].iov_len = r.data.size();
+        remote[j].iov_base = (void*)r.addr.as_int();
+        remote[j].iov_len = r.data.size();
+      }
+      ssize_t nwritten =
+          process_vm_writev(tid, local.data(), batch, remote.data(), batch, 0);
+      if (nwritten < 0 && (errno == ENOSYS || errno == EPERM)) {
+        LOG(debug) << "process_vm_writev unavailable; writing records singly";
+        process_vm_writev_works = false;
+      }
+      // The kernel stops at the first record it can't write completely.
+      size_t remaining = max<ssize_t>(nwritten, 0);
+      while (written < batch && remaining >= records[i + written].data.size()) {
+        const TraceReader::RawData& r = records[i + written];
+        vm()->notify_written(r.addr, r.data.size());
+        remaining -= r.data.size();
+        ++written;
+      }
+      i += written;
+    }
+    if (written < batch) {
+      // process_vm_writev() respects page protections and /proc/<pid>/mem
+      // doesn't, so this can succeed where that failed.
+      batching = false;
+      const TraceReader::RawData& r = records[i];
+      write_bytes_helper(r.addr, r.data.size(), r.data.data());
+      ++i;
+    }
+  }
+}
+
 ssize_t Task::read_bytes_fallible(remote_ptr<void> addr, ssize_t buf_size,
                                   void* buf) {
   ASSERT(this, buf_size >= 0) << "Invalid buf_size " << buf_size;
@@ -23,6 +23,8 @@
 #include "util.h"
 
 class AutoRemoteSyscalls;
+class CompressedReader;
+class CompressedWriter;
 class RecordSession;
 class ReplaySession;
 class ScopedFd;
@@ -1075,6 +1077,13 @@ public:
    */
   void reset_syscallbuf();
 
+  /**
+   * Set the usable size of the syscallbuf, counting the header, and tell
+   * the tracee. Only call this while the buffer is empty. Shrinking the
+   * buffer releases the memory beyond the new size.
+   */
+  void set_syscallbuf_size(uint32_t size);
+
   /**
    * Return the virtual memory mapping (address space) of this
    * task.
@@ -1215,6 +1224,11 @@ public:
    */
   std::string syscall_name(int syscallno) const;
 
+  /* The number of AutoRemoteSyscalls currently operating on this task.
+   * Software watchpoint page protection is only brought up to date when
+   * this is zero, since doing that needs remote syscalls of its own. */
+  int remote_syscalls_depth;
+
   /* State only used during recording. */
 
   std::unique_ptr<Registers> registers_at_start_of_uninterrupted_timeslice;
@@ -1312,6 +1326,14 @@ public:
    * record buffer from being reset when it normally would be.
    * Currently, the desched'd syscall code uses this. */
   bool delay_syscallbuf_reset;
+  /* Recording only: the number of times we've flushed the syscallbuf, how
+   * many of those flushes found it at least half full, and how many flushes
+   * in a row found it at least half full or nearly empty. The last two
+   * drive maybe_resize_syscallbuf(). */
+  uint64_t syscallbuf_flushes;
+  uint64_t syscallbuf_full_flushes;
+  uint32_t syscallbuf_full_flush_run;
+  uint32_t syscallbuf_sparse_flush_run;
 
   /* The child's desched counter event fd number, and our local
    * dup. */
@@ -1347,7 +1369,13 @@ public:
 
   /* Points at rr's mapping of the (shared) syscall buffer. */
   struct syscallbuf_hdr* syscallbuf_hdr;
+  /* Size of the mapping. This is SYSCALLBUF_MAX_BUFFER_SIZE, except when
+   * replaying traces from before syscallbufs could be resized. */
   size_t num_syscallbuf_bytes;
+  /* The part of the mapping the tracee may use, counting the header. */
+  uint32_t syscallbuf_size;
+  /* Points at the tracee's copy of |syscallbuf_size|. */
+  remote_ptr<uint32_t> syscallbuf_size_child;
   /* Points at the tracee's mapping of the buffer. */
   remote_ptr<struct syscallbuf_hdr> syscallbuf_child;
   remote_ptr<char> syscallbuf_fds_disabled_child;
@@ -1366,6 +1394,8 @@ public:
     size_t robust_futex_list_len;
     std::vector<struct user_desc> thread_areas;
     size_t num_syscallbuf_bytes;
+    uint32_t syscallbuf_size;
+    remote_ptr<uint32_t> syscallbuf_size_child;
     int desched_fd_child;
     remote_ptr<struct syscallbuf_hdr> syscallbuf_child;
     std::vector<uint8_t> syscallbuf_hdr;
@@ -1380,6 +1410,20 @@ public:
     remote_ptr<void> top_of_stack;
   };
 
+  /**
+   * Save |state| in a persistent checkpoint, and read it back. See
+   * ReplaySession::write_checkpoint.
+   */
+  static void write_captured_state(CompressedWriter& out,
+                                   const CapturedState& state);
+  static CapturedState read_captured_state(CompressedReader& in);
+  /**
+   * Save this task's signal dispositions in a persistent checkpoint, and
+   * replace them with ones read back.
+   */
+  void write_sighandlers(CompressedWriter& out) const;
+  void read_sighandlers(CompressedReader& in);
+
 private:
   Task(Session& session, pid_t tid, pid_t rec_tid, uint32_t serial,
        int priority, SupportedArch a);
@@ -1392,6 +1436,26 @@ private:
 
   /** Helper function for init_buffers. */
   template <typename Arch> void init_buffers_arch(remote_ptr<void> map_hint);
+  template <typename Arch>
+  void init_fixed_size_buffers_arch(AutoRemoteSyscalls& remote,
+                                    remote_ptr<void> map_hint);
+
+  /** Resume once, without handling software watchpoint faults. */
+  void resume_execution_once(ResumeRequest how, WaitRequest wait_how,
+                             TicksRequest tick_period, int sig);
+  enum SoftwareWatchpointFault {
+    NOT_SOFTWARE_WATCHPOINT,
+    // The task is stopped with a SIGTRAP reporting the write.
+    SOFTWARE_WATCHPOINT_TRIGGERED,
+    // The write didn't change any watched value; resume the task.
+    SOFTWARE_WATCHPOINT_SPURIOUS
+  };
+  /**
+   * If this is stopped by a write to a page write-protected for a software
+   * watchpoint (see AddressSpace::is_software_watch_page), complete the
+   * write and check the watchpoints. |how| is how we were resumed.
+   */
+  SoftwareWatchpointFault handle_software_watchpoint_fault(ResumeRequest how);
 
   /**
    * Return a new Task cloned from |p|.  |flags| are a set of
@@ -1432,7 +1496,8 @@ private:
 
   /**
    * Make the ptrace |request| with |addr| and |data|, return
-   * the ptrace return value.
+   * the ptrace return value. Dirty registers are written back first if
+   * |request| resumes, detaches or kills the tracee.
    */
   long fallible_ptrace(int request, remote_ptr<void> addr, void* data);
 
@@ -1456,6 +1521,18 @@ private:
    */
   ssize_t read_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size, void* buf);
 
+  /**
+   * Record as much as we can of the bytes in this range, reading them
+   * straight into the trace buffer. Returns the number of bytes recorded.
+   */
+  size_t record_remote_directly(remote_ptr<void> addr, ssize_t num_bytes);
+
+  /**
+   * Write back registers that set_regs() and set_extra_regs() have changed.
+   * fallible_ptrace() does this before any request that lets the tracee go.
+   */
+  void flush_registers();
+
   /**
    * Write tracee memory using PTRACE_POKEDATA calls. Slow, only use
    * as fallback. Returns number of bytes actually written.
@@ -1463,6 +1540,12 @@ private:
   ssize_t write_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size,
                              const void* buf);
 
+  /**
+   * Write each of |records| to its address, in order, as
+   * write_bytes_helper() would, but with as few syscalls as possible.
+   */
+  void write_data_records(const std::vector<TraceReader::RawData>& records);
+
   /**
    * Try writing 'buf' to 'addr' by replacing pages in the tracee
    * address-space using a temporary file. This may work around PaX issues.
@@ -1477,8 +1560,18 @@ private:
    * there are no expectations.
    * Initializes syscallbuf_child.
    */
+  /**
+   * Called when the syscallbuf has just been reset during recording. Grow
+   * the buffer if it keeps filling up, or shrink it if it's barely used,
+   * and record the new size for replay.
+   */
+  void maybe_resize_syscallbuf();
+
+  /**
+   * Map a |size|-byte syscallbuf shared between rr and the tracee.
+   */
   void init_syscall_buffer(AutoRemoteSyscalls& remote,
-                           remote_ptr<void> map_hint);
+                           remote_ptr<void> map_hint, size_t size);
 
   /**
    * True if this has blocked delivery of the desched signal.
@@ -1500,7 +1593,14 @@ private:
    * created.  |task_leader| will perform the actual OS calls to
    * create the new child.
    */
-  Task* os_fork_into(Session* session);
+  Task* os_fork_into(Session* session) {
+    return os_fork_into(session, rec_tid, serial);
+  }
+  /**
+   * Like os_fork_into(), but the returned task takes the identity
+   * |new_rec_tid|/|new_serial| instead of ours.
+   */
+  Task* os_fork_into(Session* session, pid_t new_rec_tid, uint32_t new_serial);
   static Task* os_clone_into(const CapturedState& state, Task* task_leader,
                              AutoRemoteSyscalls& remote);
 
@@ -1549,6 +1649,9 @@ private:
   Ticks ticks;
   // When |is_stopped|, these are our child registers.
   Registers registers;
+  // When |registers_dirty|, |registers| has changes the kernel hasn't seen
+  // yet. They're written back when the task resumes.
+  bool registers_dirty;
   // True when there was a breakpoint set at the location where we resumed
   // execution
   remote_code_ptr address_of_last_execution_resume;
@@ -1558,6 +1661,8 @@ private:
   // When |extra_registers_known|, we have saved our extra registers.
   ExtraRegisters extra_registers;
   bool extra_registers_known;
+  // Like |registers_dirty|, for |extra_registers|.
+  bool extra_registers_dirty;
   // Futex list passed to |set_robust_list()|.  We could keep a
   // strong type for this list head and read it if we wanted to,
   // but for now we only need to remember its address / size at
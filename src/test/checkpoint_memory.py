@@ -0,0 +1,14 @@
+from rrutil import *
+import re
+
+send_gdb('b main')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('info checkpoint-memory')
+expect_gdb(re.compile(r'(\d+) reverse-exec checkpoints use (\d+) KB of a (\d+) KB budget'))
+if int(last_match().group(3)) != 64 * 1024:
+    failed('ERROR: --checkpoint-memory not applied')
+
+ok()
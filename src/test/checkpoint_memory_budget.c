@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define ROUNDS 6
+#define DIRTY_SIZE (8 * 1024 * 1024)
+/* Enough ticks between rounds for replay to make a reverse-exec checkpoint
+ * in each of them. */
+#define SPIN_ITERATIONS 150000000
+
+static void breakpoint(void) {}
+
+int main(void) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  char* p = mmap(NULL, DIRTY_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  volatile int spin;
+  size_t i;
+  int round;
+
+  test_assert(p != MAP_FAILED);
+  for (round = 0; round < ROUNDS; ++round) {
+    /* Every page we write here becomes private to every checkpoint forked
+     * before it. */
+    for (i = 0; i < DIRTY_SIZE; i += page_size) {
+      p[i] = round + 1;
+    }
+    for (spin = 0; spin < SPIN_ITERATIONS; ++spin) {
+    }
+  }
+
+  breakpoint();
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
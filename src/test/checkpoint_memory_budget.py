@@ -0,0 +1,21 @@
+from rrutil import *
+import re
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+# Each checkpoint made on the way here pins the pages the test dirtied
+# after it, far more than the 1 MB budget.
+send_gdb('info checkpoint-memory')
+expect_gdb(re.compile(r'(\d+) KB budget; (\d+) discarded to stay within it'))
+if int(last_match().group(1)) != 1024:
+    failed('ERROR: --checkpoint-memory not applied')
+if int(last_match().group(2)) == 0:
+    failed('ERROR: No checkpoints discarded over budget')
+
+send_gdb('c')
+expect_gdb('EXIT-SUCCESS')
+
+ok()
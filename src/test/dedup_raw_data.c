@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Bigger than the syscall buffer, so every read is recorded by rr itself. */
+#define BUF_SIZE (2 * 1024 * 1024)
+#define NUM_READS 20
+
+int main(void) {
+  static const char file_name[] = "dedup_raw_data.tmp";
+  char* buf = malloc(BUF_SIZE);
+  int fd;
+  int i;
+
+  test_assert(buf != NULL);
+  for (i = 0; i < BUF_SIZE; ++i) {
+    buf[i] = (char)(i * 7);
+  }
+  fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  test_assert(unlink(file_name) == 0);
+  test_assert(write(fd, buf, BUF_SIZE) == BUF_SIZE);
+
+  for (i = 0; i < NUM_READS; ++i) {
+    memset(buf, 0, BUF_SIZE);
+    test_assert(pread(fd, buf, BUF_SIZE, 0) == BUF_SIZE);
+    test_assert(buf[BUF_SIZE - 1] == (char)((BUF_SIZE - 1) * 7));
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
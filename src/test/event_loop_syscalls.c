@@ -0,0 +1,105 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_ROUNDS 100
+
+static int sockfds[2];
+static int epfd;
+
+/* Wait for sockfds[0] to become readable with each syscall in turn. */
+static void wait_readable(int round) {
+  struct epoll_event ev;
+  struct pollfd pfd;
+  struct timespec ts = { 10, 0 };
+  struct timeval tv = { 10, 0 };
+  sigset_t mask;
+  fd_set rfds;
+
+  switch (round % 6) {
+    case 0:
+      test_assert(1 == epoll_wait(epfd, &ev, 1, -1));
+      test_assert(ev.events == EPOLLIN && ev.data.u32 == 42);
+      break;
+    case 1:
+      test_assert(1 == epoll_pwait(epfd, &ev, 1, -1, NULL));
+      test_assert(ev.events == EPOLLIN && ev.data.u32 == 42);
+      break;
+    case 2:
+      sigemptyset(&mask);
+      test_assert(1 == epoll_pwait(epfd, &ev, 1, -1, &mask));
+      test_assert(ev.events == EPOLLIN && ev.data.u32 == 42);
+      break;
+    case 3:
+      pfd.fd = sockfds[0];
+      pfd.events = POLLIN;
+      test_assert(1 == ppoll(&pfd, 1, &ts, NULL));
+      test_assert(pfd.revents == POLLIN);
+      break;
+    case 4:
+      FD_ZERO(&rfds);
+      FD_SET(sockfds[0], &rfds);
+      test_assert(1 == select(sockfds[0] + 1, &rfds, NULL, NULL, &tv));
+      test_assert(FD_ISSET(sockfds[0], &rfds));
+      break;
+    case 5:
+      FD_ZERO(&rfds);
+      FD_SET(sockfds[0], &rfds);
+      test_assert(1 == pselect(sockfds[0] + 1, &rfds, NULL, NULL, &ts, NULL));
+      test_assert(FD_ISSET(sockfds[0], &rfds));
+      break;
+  }
+}
+
+int main(void) {
+  struct epoll_event ev;
+  struct pollfd pfd;
+  struct timespec ts = { 0, 0 };
+  struct timeval tv = { 0, 0 };
+  fd_set rfds;
+  pid_t child;
+  int status;
+  int i;
+  char ch;
+
+  test_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockfds));
+  epfd = epoll_create(1);
+  test_assert(epfd >= 0);
+  ev.events = EPOLLIN;
+  ev.data.u32 = 42;
+  test_assert(0 == epoll_ctl(epfd, EPOLL_CTL_ADD, sockfds[0], &ev));
+
+  /* Nothing is ready yet. */
+  test_assert(0 == epoll_wait(epfd, &ev, 1, 0));
+  pfd.fd = sockfds[0];
+  pfd.events = POLLIN;
+  test_assert(0 == ppoll(&pfd, 1, &ts, NULL));
+  FD_ZERO(&rfds);
+  FD_SET(sockfds[0], &rfds);
+  test_assert(0 == select(sockfds[0] + 1, &rfds, NULL, NULL, &tv));
+  test_assert(!FD_ISSET(sockfds[0], &rfds));
+
+  /* An echo loop: the child answers each byte we send it. */
+  child = fork();
+  if (!child) {
+    close(sockfds[0]);
+    while (1 == read(sockfds[1], &ch, 1)) {
+      test_assert(1 == write(sockfds[1], &ch, 1));
+    }
+    return 0;
+  }
+  close(sockfds[1]);
+  for (i = 0; i < NUM_ROUNDS; ++i) {
+    ch = i;
+    test_assert(1 == write(sockfds[0], &ch, 1));
+    wait_readable(i);
+    test_assert(1 == read(sockfds[0], &ch, 1));
+    test_assert(ch == (char)i);
+  }
+  close(sockfds[0]);
+  test_assert(child == waitpid(child, &status, 0));
+  test_assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,16 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Enough unbuffered syscalls to fill several trace segments. */
+#define NUM_ITERATIONS 100000
+
+int main(void) {
+  int i;
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    test_assert(getsid(0) > 0);
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
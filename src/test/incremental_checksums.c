@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* sched_yield() is never buffered, so each call is a checksum point. */
+static void checksum_point(void) { sched_yield(); }
+
+int main(void) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  char* p;
+  char* q;
+
+  p = mmap(NULL, 4 * page_size, PROT_READ | PROT_WRITE,
+           MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  test_assert(p != MAP_FAILED);
+  memset(p, 1, 4 * page_size);
+  checksum_point();
+
+  /* This madvise is buffered, so rr doesn't see it. Reading the page
+   * afterwards maps the zero page, which isn't soft-dirty. */
+  test_assert(0 == madvise(p, page_size, MADV_DONTNEED));
+  test_assert(p[0] == 0);
+  checksum_point();
+
+  /* Unmap a page and map a fresh one in its place. */
+  test_assert(0 == munmap(p + page_size, page_size));
+  q = mmap(p + page_size, page_size, PROT_READ | PROT_WRITE,
+           MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0);
+  test_assert(q == p + page_size);
+  test_assert(q[0] == 0);
+  checksum_point();
+
+  /* Move the last two pages somewhere else. */
+  q = mremap(p + 2 * page_size, 2 * page_size, 4 * page_size,
+             MREMAP_MAYMOVE);
+  test_assert(q != MAP_FAILED);
+  test_assert(q[0] == 1 && q[page_size] == 1 && q[2 * page_size] == 0);
+  checksum_point();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
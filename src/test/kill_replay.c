@@ -0,0 +1,20 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static void breakpoint(void) {}
+
+int main(void) {
+  int fd;
+
+  breakpoint();
+
+  /* If a killed replay lets this task carry on, this creates the file for
+     real. */
+  fd = open("kill_replay_marker", O_CREAT | O_WRONLY, 0600);
+  test_assert(fd >= 0);
+  test_assert(0 == close(fd));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
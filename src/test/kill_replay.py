@@ -0,0 +1,11 @@
+from rrutil import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1, breakpoint')
+
+# Quitting here tears down the replay session with the task stopped at
+# the breakpoint, after rr has rewritten its registers.
+ok()
@@ -0,0 +1,85 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define ITERATIONS 100
+
+static char dir_name[] = "/tmp/rr-metadata-XXXXXX";
+static char file_name[PATH_MAX];
+static char link_name[PATH_MAX];
+
+/* What a build tool does before deciding whether to rebuild something. */
+static void scan(int dirfd) {
+  struct stat st;
+  char buf[PATH_MAX];
+  DIR* dir;
+  struct dirent* ent;
+  int found = 0;
+
+  test_assert(0 == fstatat(dirfd, "file", &st, 0));
+  test_assert(S_ISREG(st.st_mode) && st.st_size == 5);
+  test_assert(0 == fstatat(dirfd, "link", &st, AT_SYMLINK_NOFOLLOW));
+  test_assert(S_ISLNK(st.st_mode));
+  test_assert(-1 == fstatat(dirfd, "missing", &st, 0) && errno == ENOENT);
+
+#ifdef STATX_BASIC_STATS
+  {
+    struct statx stx;
+    test_assert(0 == statx(dirfd, "file", 0, STATX_BASIC_STATS, &stx));
+    test_assert(S_ISREG(stx.stx_mode) && stx.stx_size == 5);
+  }
+#endif
+
+  test_assert(0 == faccessat(dirfd, "file", R_OK | W_OK, 0));
+  test_assert(-1 == faccessat(dirfd, "missing", F_OK, 0) && errno == ENOENT);
+
+  memset(buf, 0, sizeof(buf));
+  test_assert(4 == readlinkat(dirfd, "link", buf, sizeof(buf)));
+  test_assert(0 == strcmp(buf, "file"));
+
+  dir = opendir(dir_name);
+  test_assert(dir != NULL);
+  while ((ent = readdir(dir))) {
+    if (!strcmp(ent->d_name, "file") || !strcmp(ent->d_name, "link")) {
+      ++found;
+    }
+  }
+  test_assert(found == 2);
+  closedir(dir);
+}
+
+int main(void) {
+  char buf[4096];
+  int dirfd;
+  int fd;
+  int i;
+  long nread;
+
+  test_assert(mkdtemp(dir_name) != NULL);
+  snprintf(file_name, sizeof(file_name), "%s/file", dir_name);
+  snprintf(link_name, sizeof(link_name), "%s/link", dir_name);
+  fd = open(file_name, O_CREAT | O_WRONLY, 0600);
+  test_assert(fd >= 0);
+  test_assert(5 == write(fd, "hello", 5));
+  test_assert(0 == close(fd));
+  test_assert(0 == symlink("file", link_name));
+
+  dirfd = open(dir_name, O_RDONLY | O_DIRECTORY);
+  test_assert(dirfd >= 0);
+  for (i = 0; i < ITERATIONS; ++i) {
+    scan(dirfd);
+  }
+
+  /* The legacy getdents format, which glibc doesn't use. */
+  nread = syscall(SYS_getdents, dirfd, buf, sizeof(buf));
+  test_assert(nread > 0);
+  test_assert(0 == syscall(SYS_getdents, dirfd, buf, sizeof(buf)));
+
+  test_assert(0 == close(dirfd));
+  test_assert(0 == unlink(link_name));
+  test_assert(0 == unlink(file_name));
+  test_assert(0 == rmdir(dir_name));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
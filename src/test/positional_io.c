@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define ITERATIONS 1000
+#define RECORD_SIZE 64
+#define NUM_RECORDS 16
+
+static char expected[NUM_RECORDS][RECORD_SIZE];
+
+static void fill(char* buf, int record, int iteration) {
+  int i;
+  for (i = 0; i < RECORD_SIZE; ++i) {
+    buf[i] = (char)(record * 31 + iteration * 7 + i);
+  }
+}
+
+int main(void) {
+  char name[] = "/tmp/rr-positional-io-XXXXXX";
+  int fd = mkstemp(name);
+  char buf[RECORD_SIZE];
+  char half1[RECORD_SIZE / 2];
+  char half2[RECORD_SIZE / 2];
+  struct iovec iovs[2];
+  int i;
+
+  test_assert(fd >= 0);
+  test_assert(0 == unlink(name));
+
+  iovs[0].iov_base = half1;
+  iovs[0].iov_len = sizeof(half1);
+  iovs[1].iov_base = half2;
+  iovs[1].iov_len = sizeof(half2);
+
+  /* A little database: update records in place and read them back. */
+  for (i = 0; i < ITERATIONS; ++i) {
+    int record = (i * 7) % NUM_RECORDS;
+    off_t offset = record * RECORD_SIZE;
+
+    fill(expected[record], record, i);
+    if (i % 2) {
+      test_assert(RECORD_SIZE ==
+                  pwrite(fd, expected[record], RECORD_SIZE, offset));
+    } else {
+      memcpy(half1, expected[record], sizeof(half1));
+      memcpy(half2, expected[record] + sizeof(half1), sizeof(half2));
+      test_assert(RECORD_SIZE == pwritev(fd, iovs, 2, offset));
+    }
+
+    memset(buf, 0, sizeof(buf));
+    test_assert(RECORD_SIZE == pread(fd, buf, sizeof(buf), offset));
+    test_assert(0 == memcmp(buf, expected[record], RECORD_SIZE));
+
+    memset(half1, 0, sizeof(half1));
+    memset(half2, 0, sizeof(half2));
+    if (i % 2) {
+      test_assert(offset == lseek(fd, offset, SEEK_SET));
+      test_assert(RECORD_SIZE == readv(fd, iovs, 2));
+    } else {
+      test_assert(RECORD_SIZE == preadv(fd, iovs, 2, offset));
+    }
+    test_assert(0 == memcmp(half1, expected[record], sizeof(half1)));
+    test_assert(0 == memcmp(half2, expected[record] + sizeof(half1),
+                            sizeof(half2)));
+  }
+
+  /* Short read at end of file: only the first iovec is filled. */
+  memset(half1, 'x', sizeof(half1));
+  memset(half2, 'y', sizeof(half2));
+  test_assert(sizeof(half1) ==
+              preadv(fd, iovs, 2,
+                     NUM_RECORDS * RECORD_SIZE - (off_t)sizeof(half1)));
+  test_assert(0 == memcmp(half1, expected[NUM_RECORDS - 1] + sizeof(half1),
+                          sizeof(half1)));
+  test_assert(half2[0] == 'y');
+
+  test_assert(0 == pread(fd, buf, sizeof(buf), NUM_RECORDS * RECORD_SIZE));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
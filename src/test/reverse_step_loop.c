@@ -0,0 +1,23 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_ITERATIONS 1000
+
+static int sum;
+
+static void after_loop(void) { atomic_printf("sum=%d\n", sum); }
+
+int main(void) {
+  int i;
+
+  /* A tight counted loop. Reverse-stepping into it makes rr run forward
+     through many iterations to find the previous instruction. */
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    sum += i;
+  }
+  after_loop();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
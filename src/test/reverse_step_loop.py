@@ -0,0 +1,38 @@
+from rrutil import *
+import re
+
+send_gdb('break after_loop')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+# Back out to the call of after_loop, then into the loop's final
+# comparison. Finding the instruction before the call means running
+# forward through the loop.
+send_gdb('reverse-finish')
+expect_gdb('main')
+send_gdb('reverse-stepi')
+send_gdb('p i')
+expect_gdb('= 1000')
+send_gdb('p sum')
+expect_gdb('= 499500')
+
+send_gdb('info loop-fast-forward')
+expect_gdb(re.compile(r'(\d+) loop iterations fast-forwarded, (\d+) singlesteps avoided'))
+if int(last_match().group(1)) == 0 or int(last_match().group(2)) == 0:
+    failed('ERROR: Loop was not fast-forwarded')
+
+# Reverse into the loop's last iteration.
+send_gdb('break 17')
+expect_gdb('Breakpoint 2')
+send_gdb('reverse-continue')
+expect_gdb('Breakpoint 2')
+send_gdb('p i')
+expect_gdb('= 999')
+
+send_gdb('delete 1')
+send_gdb('delete 2')
+send_gdb('c')
+expect_gdb('EXIT-SUCCESS')
+
+ok()
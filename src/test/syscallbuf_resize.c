@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define BIG_READ (64 * 1024)
+
+static char buf[BIG_READ];
+
+/* Large buffered reads fill the syscallbuf quickly, so rr grows it. */
+static void fill_buffer(int fd, int count) {
+  int i;
+  for (i = 0; i < count; ++i) {
+    buf[0] = 1;
+    test_assert(BIG_READ == read(fd, buf, sizeof(buf)));
+    test_assert(buf[0] == 0);
+  }
+}
+
+int main(void) {
+  struct utsname uts;
+  int fd = open("/dev/zero", O_RDONLY);
+  int i;
+
+  test_assert(fd >= 0);
+  fill_buffer(fd, 256);
+
+  /* Each unbuffered uname() flushes a nearly empty syscallbuf, so rr
+   * shrinks it again. */
+  for (i = 0; i < 1000; ++i) {
+    test_assert(1 == read(fd, buf, 1));
+    test_assert(0 == uname(&uts));
+  }
+
+  fill_buffer(fd, 256);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,24 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_VARS 5
+
+/* One more watched variable than there are debug registers. */
+static int vars[NUM_VARS];
+/* Shares a page with |vars| but isn't watched. */
+static int other;
+
+int main(void) {
+  int i;
+
+  for (i = 0; i < NUM_VARS; ++i) {
+    other = i + 100;
+    vars[i] = i + 1;
+  }
+
+  atomic_printf("vars[%d]=%d other=%d\n", NUM_VARS - 1, vars[NUM_VARS - 1],
+                other);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,24 @@
+from rrutil import *
+
+send_gdb('break atomic_printf')
+expect_gdb('Breakpoint 1')
+for i in range(5):
+    send_gdb('watch vars[%d]' % i)
+    expect_gdb('Hardware watchpoint %d' % (i + 2))
+
+for i in range(5):
+    send_gdb('c')
+    expect_gdb('Hardware watchpoint %d' % (i + 2))
+    expect_gdb('Old value = 0')
+    expect_gdb('New value = %d' % (i + 1))
+
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+for i in reversed(range(5)):
+    send_gdb('reverse-cont')
+    expect_gdb('Hardware watchpoint %d' % (i + 2))
+    expect_gdb('Old value = %d' % (i + 1))
+    expect_gdb('New value = 0')
+
+ok()
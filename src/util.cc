@@ -8,6 +8,7 @@
 #include "util.h"
 
 #include <algorithm>
+#include <sstream>
 
 #include <assert.h>
 #include <elf.h>
@@ -58,6 +59,30 @@ bool probably_not_interactive(int fd) {
   return !isatty(fd);
 }
 
+uint64_t private_dirty_bytes(pid_t tid) {
+  // smaps_rollup is much cheaper, but needs Linux 4.14.
+  char path[PATH_MAX];
+  sprintf(path, "/proc/%d/smaps_rollup", tid);
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    sprintf(path, "/proc/%d/smaps", tid);
+    f = fopen(path, "r");
+    if (!f) {
+      return 0;
+    }
+  }
+  uint64_t total = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long long kb;
+    if (sscanf(line, "Private_Dirty: %llu kB", &kb) == 1) {
+      total += kb * 1024;
+    }
+  }
+  fclose(f);
+  return total;
+}
+
 int clone_flags_to_task_flags(int flags_arg) {
   int flags = CLONE_SHARE_NOTHING;
   // See task.h for description of the flags.
@@ -171,7 +196,8 @@ void dump_process_memory(Task* t, TraceFrame::Time global_time,
 
 static void notify_checksum_error(Task* t, TraceFrame::Time global_time,
                                   unsigned checksum, unsigned rec_checksum,
-                                  const string& raw_map_line) {
+                                  const string& raw_map_line,
+                                  const string& divergent_pages) {
   char cur_dump[PATH_MAX];
   char rec_dump[PATH_MAX];
 
@@ -187,12 +213,12 @@ static void notify_checksum_error(Task* t, TraceFrame::Time global_time,
   format_dump_filename(t, global_time, "rec", rec_dump, sizeof(rec_dump));
 
   const Event& ev = t->current_trace_frame().event();
-  ASSERT(t, checksum == rec_checksum)
+  ASSERT(t, checksum == rec_checksum && divergent_pages.empty())
       << "Divergence in contents of memory segment after '" << ev << "':\n"
                                                                      "\n"
       << raw_map_line << "    (recorded checksum:" << HEX(rec_checksum)
       << "; replaying checksum:" << HEX(checksum) << ")\n"
-                                                     "\n"
+      << divergent_pages << "\n"
       << "Dumped current memory contents to " << cur_dump
       << ". If you've created a memory dump for\n"
       << "the '" << ev << "' event (line " << t->trace_time()
@@ -240,20 +266,243 @@ static bool checksum_segment_filter(const AddressSpace::Mapping& m) {
   return may_diverge;
 }
 
+/* Bits of a /proc/<pid>/pagemap entry. See
+ * Documentation/vm/pagemap.txt. */
+static const uint64_t PAGEMAP_SOFT_DIRTY = 1ULL << 55;
+static const uint64_t PAGEMAP_EXCLUSIVE = 1ULL << 56;
+static const uint64_t PAGEMAP_FILE_OR_SHARED_ANON = 1ULL << 61;
+static const uint64_t PAGEMAP_SWAPPED = 1ULL << 62;
+static const uint64_t PAGEMAP_PRESENT = 1ULL << 63;
+
+/**
+ * Clear the soft-dirty bits of all of |tid|'s pages, so the next write to
+ * each page sets its bit again.
+ */
+static bool clear_soft_dirty_bits(pid_t tid) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path) - 1, "/proc/%d/clear_refs", tid);
+  ScopedFd fd(path, O_WRONLY);
+  return fd.is_open() && write(fd, "4", 1) == 1;
+}
+
+/**
+ * Kernels built without CONFIG_MEM_SOFT_DIRTY accept clear_refs requests
+ * but never report a page as soft-dirty, so try it on a page of our own.
+ */
+static bool soft_dirty_bits_work() {
+  static int works = -1;
+  if (works >= 0) {
+    return works;
+  }
+  works = 0;
+  ScopedFd pagemap("/proc/self/pagemap", O_RDONLY);
+  volatile uint8_t* p = (volatile uint8_t*)mmap(
+      nullptr, page_size(), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pagemap.is_open() && p != MAP_FAILED) {
+    off64_t offset = uintptr_t(p) / page_size() * sizeof(uint64_t);
+    uint64_t clean_entry;
+    uint64_t dirty_entry;
+    p[0] = 1;
+    if (clear_soft_dirty_bits(getpid()) &&
+        pread64(pagemap, &clean_entry, sizeof(clean_entry), offset) ==
+            sizeof(clean_entry)) {
+      p[0] = 2;
+      if (pread64(pagemap, &dirty_entry, sizeof(dirty_entry), offset) ==
+          sizeof(dirty_entry)) {
+        works = !(clean_entry & PAGEMAP_SOFT_DIRTY) &&
+                (dirty_entry & PAGEMAP_SOFT_DIRTY);
+      }
+    }
+  }
+  if (p != MAP_FAILED) {
+    munmap((void*)p, page_size());
+  }
+  if (!works) {
+    LOG(warn) << "Soft-dirty page tracking doesn't work here; incremental "
+                 "checksums will read every page";
+  }
+  return works;
+}
+
+static uint32_t sum_words(const uint8_t* data, size_t len) {
+  const uint32_t* words = (const uint32_t*)data;
+  uint32_t sum = 0;
+  for (size_t i = 0; i < len / sizeof(*words); ++i) {
+    sum += words[i];
+  }
+  return sum;
+}
+
+/**
+ * Compute the checksum of each page of |m|. They add up to the checksum
+ * of the whole mapping, except that unreadable pages count as zero.
+ * If |pagemap| is open, reuse the checksums in t->vm()->page_checksums()
+ * for private anonymous pages that aren't soft-dirty. Record the checksums
+ * in |new_page_checksums|.
+ */
+static vector<uint32_t> page_checksums(
+    Task* t, const KernelMapping& m, ScopedFd& pagemap,
+    map<remote_ptr<void>, uint32_t>& new_page_checksums) {
+  size_t num_pages = m.size() / page_size();
+  vector<uint32_t> result(num_pages);
+  vector<bool> need_read(num_pages, true);
+  auto& old_page_checksums = t->vm()->page_checksums();
+
+  if (pagemap.is_open() && !(m.flags() & MAP_SHARED)) {
+    vector<uint64_t> entries(num_pages);
+    ssize_t entries_size = entries.size() * sizeof(uint64_t);
+    if (pread64(pagemap, entries.data(), entries_size,
+                m.start().as_int() / page_size() * sizeof(uint64_t)) ==
+        entries_size) {
+      for (size_t i = 0; i < num_pages; ++i) {
+        uint64_t e = entries[i];
+        // Pages still backed by the file (or swapped out of shared memory)
+        // can change without this process writing to them.
+        if (!(e & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) ||
+            (e & (PAGEMAP_SOFT_DIRTY | PAGEMAP_FILE_OR_SHARED_ANON))) {
+          continue;
+        }
+        auto it = old_page_checksums.find(m.start() + i * page_size());
+        if (it == old_page_checksums.end()) {
+          continue;
+        }
+        // A buffered madvise(MADV_DONTNEED) discards pages without rr
+        // hearing about it, and the shared zero page that a read then maps
+        // isn't soft-dirty. That page is never mapped exclusively, so
+        // re-read any page that isn't, unless its old sum was already zero.
+        if ((e & PAGEMAP_PRESENT) && !(e & PAGEMAP_EXCLUSIVE) && it->second) {
+          continue;
+        }
+        result[i] = it->second;
+        need_read[i] = false;
+      }
+    }
+  }
+
+  // Read runs of pages that need it with one read each.
+  vector<uint8_t> buf;
+  size_t pages_read = 0;
+  for (size_t i = 0; i < num_pages;) {
+    if (!need_read[i]) {
+      ++i;
+      continue;
+    }
+    size_t end = i;
+    while (end < num_pages && need_read[end]) {
+      ++end;
+    }
+    buf.resize((end - i) * page_size());
+    ssize_t nread =
+        t->read_bytes_fallible(m.start() + i * page_size(), buf.size(),
+                               buf.data());
+    nread = max(ssize_t(0), nread);
+    for (size_t j = i; j < end; ++j) {
+      size_t offset = (j - i) * page_size();
+      result[j] = sum_words(
+          buf.data() + offset,
+          min<ssize_t>(max<ssize_t>(nread - offset, 0), page_size()));
+    }
+    pages_read += end - i;
+    i = end;
+  }
+  LOG(debug) << "Read " << pages_read << " of " << num_pages
+             << " pages to checksum " << m;
+
+  for (size_t i = 0; i < num_pages; ++i) {
+    new_page_checksums[m.start() + i * page_size()] = result[i];
+  }
+  return result;
+}
+
+/**
+ * Page checksums are stored on the line after their mapping's checksum,
+ * starting with this.
+ */
+static const char PAGE_CHECKSUMS_PREFIX[] = "[pages]";
+
+static void write_page_checksums(FILE* f, const vector<uint32_t>& sums) {
+  fputs(PAGE_CHECKSUMS_PREFIX, f);
+  for (auto sum : sums) {
+    fprintf(f, " %x", sum);
+  }
+  fputc('\n', f);
+}
+
+/**
+ * If the next line of |f| holds page checksums, read them into |sums| and
+ * return true.
+ */
+static bool read_page_checksums(FILE* f, vector<uint32_t>* sums) {
+  int ch = fgetc(f);
+  ungetc(ch, f);
+  if (ch != PAGE_CHECKSUMS_PREFIX[0]) {
+    return false;
+  }
+  char* line = nullptr;
+  size_t line_size = 0;
+  if (getline(&line, &line_size, f) < 0) {
+    free(line);
+    return false;
+  }
+  char* p = line + sizeof(PAGE_CHECKSUMS_PREFIX) - 1;
+  while (true) {
+    char* end;
+    unsigned long sum = strtoul(p, &end, 16);
+    if (end == p) {
+      break;
+    }
+    sums->push_back(sum);
+    p = end;
+  }
+  free(line);
+  return true;
+}
+
+static string describe_divergent_pages(const KernelMapping& m,
+                                       const vector<uint32_t>& sums,
+                                       const vector<uint32_t>& rec_sums) {
+  if (sums.size() != rec_sums.size()) {
+    return "";
+  }
+  stringstream out;
+  size_t count = 0;
+  for (size_t i = 0; i < sums.size(); ++i) {
+    if (sums[i] != rec_sums[i]) {
+      if (count < 16) {
+        out << "    page " << m.start() + i * page_size()
+            << " (recorded checksum:" << HEX(rec_sums[i])
+            << "; replaying checksum:" << HEX(sums[i]) << ")\n";
+      }
+      ++count;
+    }
+  }
+  if (count > 16) {
+    out << "    ... and " << count - 16 << " more pages\n";
+  }
+  return out.str();
+}
+
 /**
  * Either create and store checksums for each segment mapped in |t|'s
  * address space, or validate an existing computed checksum.  Behavior
  * is selected by |mode|.
+ *
+ * With Flags::incremental_checksums we also store per-page checksums, and
+ * only read the pages that have been written since the last checksum
+ * point. Validation checks page checksums whenever they were stored, so it
+ * can say which pages diverged.
  */
 static void iterate_checksums(Task* t, ChecksumMode mode,
-                              TraceFrame::Time global_time) {
+                              TraceFrame::Time global_time,
+                              const string& dir) {
   struct checksum_iterator_data c;
   memset(&c, 0, sizeof(c));
   char filename[PATH_MAX];
   const char* fmode = (STORE_CHECKSUMS == mode) ? "w" : "r";
 
   c.mode = mode;
-  snprintf(filename, sizeof(filename) - 1, "%s/%d_%d", t->trace_dir().c_str(),
+  snprintf(filename, sizeof(filename) - 1, "%s/%d_%d", dir.c_str(),
            global_time, t->rec_tid);
   c.checksums_file = fopen64(filename, fmode);
   c.global_time = global_time;
@@ -261,52 +510,28 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
     FATAL() << "Failed to open checksum file " << filename;
   }
 
+  bool incremental = Flags::get().incremental_checksums;
+  ScopedFd pagemap;
+  if (incremental && soft_dirty_bits_work()) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path) - 1, "/proc/%d/pagemap", t->tid);
+    pagemap = ScopedFd(path, O_RDONLY);
+  }
+  map<remote_ptr<void>, uint32_t> new_page_checksums;
+
   const AddressSpace& as = *(t->vm());
   for (auto m : as.maps()) {
-    vector<uint8_t> mem;
-    ssize_t valid_mem_len = 0;
-
-    if (checksum_segment_filter(m)) {
-      mem.resize(m.map.size());
-      valid_mem_len =
-          t->read_bytes_fallible(m.map.start(), m.map.size(), mem.data());
-      valid_mem_len = max(ssize_t(0), valid_mem_len);
-    }
-
-    unsigned* buf = (unsigned*)mem.data();
-    unsigned checksum = 0;
-    int i;
-
-    if (m.map.fsname().find(SYSCALLBUF_SHMEM_PATH_PREFIX) == 0) {
-      /* The syscallbuf consists of a region that's written
-      * deterministically wrt the trace events, and a
-      * region that's written nondeterministically in the
-      * same way as trace scratch buffers.  The
-      * deterministic region comprises committed syscallbuf
-      * records, and possibly the one pending record
-      * metadata.  The nondeterministic region starts at
-      * the "extra data" for the possibly one pending
-      * record.
-      *
-      * So here, we set things up so that we only checksum
-      * the deterministic region. */
-      auto child_hdr = m.map.start().cast<struct syscallbuf_hdr>();
-      auto hdr = t->read_mem(child_hdr);
-      valid_mem_len = !buf ? 0 : sizeof(hdr) + hdr.num_rec_bytes +
-                                     sizeof(struct syscallbuf_record);
-    }
-
-    ASSERT(t, buf || valid_mem_len == 0);
-    for (i = 0; i < ssize_t(valid_mem_len / sizeof(*buf)); ++i) {
-      checksum += buf[i];
-    }
-
     string raw_map_line = m.map.str();
+    bool is_syscallbuf =
+        m.map.fsname().find(SYSCALLBUF_SHMEM_PATH_PREFIX) == 0;
+    unsigned rec_checksum = 0;
+    vector<uint32_t> rec_page_sums;
+    bool by_page;
+
     if (STORE_CHECKSUMS == c.mode) {
-      fprintf(c.checksums_file, "(%x) %s\n", checksum, raw_map_line.c_str());
+      by_page = incremental && !is_syscallbuf && checksum_segment_filter(m);
     } else {
       char line[1024];
-      unsigned rec_checksum;
       unsigned long rec_start;
       unsigned long rec_end;
       int nparsed;
@@ -317,6 +542,7 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
       remote_ptr<void> rec_start_addr = rec_start;
       remote_ptr<void> rec_end_addr = rec_end;
       ASSERT(t, 3 == nparsed) << "Only parsed " << nparsed << " items";
+      by_page = read_page_checksums(c.checksums_file, &rec_page_sums);
 
       ASSERT(t, rec_start_addr == m.map.start() && rec_end_addr == m.map.end())
           << "Segment " << rec_start_addr << "-" << rec_end_addr
@@ -332,10 +558,70 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
                    << rec_start_addr << dec;
         continue;
       }
-      if (checksum != rec_checksum) {
-        notify_checksum_error(t, c.global_time, checksum, rec_checksum,
-                              raw_map_line.c_str());
+    }
+
+    unsigned checksum = 0;
+    vector<uint32_t> page_sums;
+    if (by_page) {
+      page_sums = page_checksums(t, m.map, pagemap, new_page_checksums);
+      for (auto sum : page_sums) {
+        checksum += sum;
+      }
+    } else {
+      vector<uint8_t> mem;
+      ssize_t valid_mem_len = 0;
+
+      if (checksum_segment_filter(m)) {
+        mem.resize(m.map.size());
+        valid_mem_len =
+            t->read_bytes_fallible(m.map.start(), m.map.size(), mem.data());
+        valid_mem_len = max(ssize_t(0), valid_mem_len);
+      }
+
+      if (is_syscallbuf) {
+        /* The syscallbuf consists of a region that's written
+        * deterministically wrt the trace events, and a
+        * region that's written nondeterministically in the
+        * same way as trace scratch buffers.  The
+        * deterministic region comprises committed syscallbuf
+        * records, and possibly the one pending record
+        * metadata.  The nondeterministic region starts at
+        * the "extra data" for the possibly one pending
+        * record.
+        *
+        * So here, we set things up so that we only checksum
+        * the deterministic region. */
+        auto child_hdr = m.map.start().cast<struct syscallbuf_hdr>();
+        auto hdr = t->read_mem(child_hdr);
+        valid_mem_len = mem.empty() ? 0 : sizeof(hdr) + hdr.num_rec_bytes +
+                                              sizeof(struct syscallbuf_record);
       }
+
+      ASSERT(t, !mem.empty() || valid_mem_len == 0);
+      checksum = sum_words(mem.data(), valid_mem_len);
+    }
+
+    if (STORE_CHECKSUMS == c.mode) {
+      fprintf(c.checksums_file, "(%x) %s\n", checksum, raw_map_line.c_str());
+      if (by_page) {
+        write_page_checksums(c.checksums_file, page_sums);
+      }
+    } else if (checksum != rec_checksum ||
+               (by_page && page_sums != rec_page_sums)) {
+      notify_checksum_error(
+          t, c.global_time, checksum, rec_checksum, raw_map_line,
+          by_page ? describe_divergent_pages(m.map, page_sums, rec_page_sums)
+                  : string());
+    }
+  }
+
+  if (pagemap.is_open()) {
+    // The page checksums are only good for next time if every write from
+    // now on sets a soft-dirty bit.
+    if (clear_soft_dirty_bits(t->tid)) {
+      t->vm()->page_checksums() = move(new_page_checksums);
+    } else {
+      t->vm()->page_checksums().clear();
     }
   }
 
@@ -370,11 +656,21 @@ bool should_checksum(const TraceFrame& f) {
 }
 
 void checksum_process_memory(Task* t, TraceFrame::Time global_time) {
-  iterate_checksums(t, STORE_CHECKSUMS, global_time);
+  iterate_checksums(t, STORE_CHECKSUMS, global_time, t->trace_dir());
 }
 
 void validate_process_memory(Task* t, TraceFrame::Time global_time) {
-  iterate_checksums(t, VALIDATE_CHECKSUMS, global_time);
+  iterate_checksums(t, VALIDATE_CHECKSUMS, global_time, t->trace_dir());
+}
+
+void checksum_process_memory(Task* t, TraceFrame::Time global_time,
+                             const string& dir) {
+  iterate_checksums(t, STORE_CHECKSUMS, global_time, dir);
+}
+
+void validate_process_memory(Task* t, TraceFrame::Time global_time,
+                             const string& dir) {
+  iterate_checksums(t, VALIDATE_CHECKSUMS, global_time, dir);
 }
 
 signal_action default_action(int sig) {
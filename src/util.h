@@ -136,6 +136,14 @@ void checksum_process_memory(Task* t, TraceFrame::Time global_time);
  * during recording.
  */
 void validate_process_memory(Task* t, TraceFrame::Time global_time);
+/**
+ * Like checksum_process_memory() and validate_process_memory(), but keep
+ * the checksums in |dir| instead of the trace directory.
+ */
+void checksum_process_memory(Task* t, TraceFrame::Time global_time,
+                             const std::string& dir);
+void validate_process_memory(Task* t, TraceFrame::Time global_time,
+                             const std::string& dir);
 
 /**
  * Return nonzero if the rr session is probably not interactive (that
@@ -144,6 +152,13 @@ void validate_process_memory(Task* t, TraceFrame::Time global_time);
  */
 bool probably_not_interactive(int fd = STDERR_FILENO);
 
+/**
+ * Return the number of bytes of private dirty memory of process |tid|, i.e.
+ * roughly how much memory would be freed if it exited. Returns 0 if that
+ * can't be determined.
+ */
+uint64_t private_dirty_bytes(pid_t tid);
+
 /**
  * Convert the flags passed to the clone() syscall, |flags_arg|, into
  * the format understood by Task::clone().